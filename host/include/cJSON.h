@@ -0,0 +1,50 @@
+#ifndef HOST_CJSON_H
+#define HOST_CJSON_H
+
+/* The part of cJSON's API the firmware uses, implemented by host/src/cjson.c. The types and struct
+   are cJSON's own, so code written against one compiles against the other. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define cJSON_Invalid (0)
+#define cJSON_False (1 << 0)
+#define cJSON_True (1 << 1)
+#define cJSON_NULL (1 << 2)
+#define cJSON_Number (1 << 3)
+#define cJSON_String (1 << 4)
+#define cJSON_Array (1 << 5)
+#define cJSON_Object (1 << 6)
+
+typedef int cJSON_bool;
+
+typedef struct cJSON {
+  struct cJSON *next;
+  struct cJSON *prev;
+  struct cJSON *child;
+  int type;
+  char *valuestring;
+  int valueint;
+  double valuedouble;
+  char *string;
+} cJSON;
+
+cJSON *cJSON_Parse(const char *value);
+void cJSON_Delete(cJSON *item);
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string); // Case insensitive, as cJSON's
+cJSON_bool cJSON_IsBool(const cJSON *item);
+cJSON_bool cJSON_IsTrue(const cJSON *item);
+cJSON_bool cJSON_IsNumber(const cJSON *item);
+cJSON_bool cJSON_IsString(const cJSON *item);
+cJSON_bool cJSON_IsObject(const cJSON *item);
+cJSON *cJSON_CreateObject(void);
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *string);
+char *cJSON_PrintUnformatted(const cJSON *item);
+void cJSON_free(void *object);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
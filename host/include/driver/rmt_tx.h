@@ -0,0 +1,63 @@
+#ifndef HOST_DRIVER_RMT_TX_H
+#define HOST_DRIVER_RMT_TX_H
+
+#include "driver/rmt_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  int gpio_num;
+  rmt_clock_source_t clk_src;
+  uint32_t resolution_hz;
+  size_t mem_block_symbols;
+  size_t trans_queue_depth;
+  int intr_priority;
+  struct {
+    uint32_t invert_out : 1;
+    uint32_t with_dma : 1;
+    uint32_t io_loop_back : 1;
+    uint32_t io_od_mode : 1;
+    uint32_t allow_pd : 1;
+  } flags;
+} rmt_tx_channel_config_t;
+
+typedef struct {
+  int loop_count;
+  struct {
+    uint32_t eot_level : 1;
+    uint32_t queue_nonblocking : 1;
+  } flags;
+} rmt_transmit_config_t;
+
+typedef struct {
+} rmt_copy_encoder_config_t;
+
+typedef struct {
+  rmt_symbol_word_t bit0;
+  rmt_symbol_word_t bit1;
+  struct {
+    uint32_t msb_first : 1;
+  } flags;
+} rmt_bytes_encoder_config_t;
+
+/* On the host the RMT channels on a pin drive a model of the 1-Wire bus with a DS18B20 on it
+   (host/src/onewire-bus.cpp): the symbols sent are decoded into bus slots, and what's received is
+   the waveform the sensor would leave on the line. */
+esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *ret_chan);
+esp_err_t rmt_transmit(rmt_channel_handle_t tx_channel, rmt_encoder_handle_t encoder, const void *payload,
+                       size_t payload_bytes, const rmt_transmit_config_t *config);
+esp_err_t rmt_tx_wait_all_done(rmt_channel_handle_t tx_channel, int timeout_ms);
+esp_err_t rmt_new_copy_encoder(const rmt_copy_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder);
+esp_err_t rmt_new_bytes_encoder(const rmt_bytes_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder);
+esp_err_t rmt_del_encoder(rmt_encoder_handle_t encoder);
+esp_err_t rmt_del_channel(rmt_channel_handle_t channel);
+esp_err_t rmt_enable(rmt_channel_handle_t channel);
+esp_err_t rmt_disable(rmt_channel_handle_t channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
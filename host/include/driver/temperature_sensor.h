@@ -0,0 +1,39 @@
+#ifndef HOST_DRIVER_TEMPERATURE_SENSOR_H
+#define HOST_DRIVER_TEMPERATURE_SENSOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct temperature_sensor_obj_t *temperature_sensor_handle_t;
+
+typedef struct {
+  int range_min;
+  int range_max;
+  int clk_src;
+} temperature_sensor_config_t;
+
+#define TEMPERATURE_SENSOR_CONFIG_DEFAULT(min, max) { \
+    .range_min = min,                                 \
+    .range_max = max,                                 \
+    .clk_src = 0,                                     \
+}
+
+// The die runs a little above the room temperature of the host's model
+esp_err_t temperature_sensor_install(const temperature_sensor_config_t *tsens_config,
+                                     temperature_sensor_handle_t *ret_tsens);
+esp_err_t temperature_sensor_uninstall(temperature_sensor_handle_t tsens);
+esp_err_t temperature_sensor_enable(temperature_sensor_handle_t tsens);
+esp_err_t temperature_sensor_disable(temperature_sensor_handle_t tsens);
+esp_err_t temperature_sensor_get_celsius(temperature_sensor_handle_t tsens, float *out_celsius);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+/* RTC memory is a section of its own, so the host runtime can keep it over a deep sleep (which
+   re-runs the program, as a wake reboots the chip). RTC_NOINIT_ATTR is also kept over esp_restart().
+   See host/src/system.cpp. */
+#define RTC_DATA_ATTR __attribute__((section("rtc_data")))
+#define RTC_NOINIT_ATTR __attribute__((section("rtc_noinit")))
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HOST_ESP_DEBUG_HELPERS_H
+#define HOST_ESP_DEBUG_HELPERS_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t esp_backtrace_print(int depth);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
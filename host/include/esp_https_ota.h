@@ -0,0 +1,22 @@
+#ifndef HOST_ESP_HTTPS_OTA_H
+#define HOST_ESP_HTTPS_OTA_H
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "esp_system.h" // Which IDF's reaches through its own includes, and update.cpp relies on
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  const esp_http_client_config_t *http_config;
+} esp_https_ota_config_t;
+
+esp_err_t esp_https_ota(const esp_https_ota_config_t *ota_config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef HOST_ESP_NETIF_IP_ADDR_H
+#define HOST_ESP_NETIF_IP_ADDR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint32_t addr;  // Network byte order
+} esp_ip4_addr_t;
+
+#define esp_netif_ip4_makeu32(a, b, c, d) \
+  (((uint32_t)((a) & 0xff) << 24) | ((uint32_t)((b) & 0xff) << 16) | ((uint32_t)((c) & 0xff) << 8) | (uint32_t)((d) & 0xff))
+#define ESP_IP4TOADDR(a, b, c, d) __builtin_bswap32(esp_netif_ip4_makeu32(a, b, c, d))
+
+#define esp_ip4_addr_get_byte(ipaddr, idx) (((const uint8_t *)(&(ipaddr)->addr))[idx])
+#define esp_ip4_addr1(ipaddr) esp_ip4_addr_get_byte(ipaddr, 0)
+#define esp_ip4_addr2(ipaddr) esp_ip4_addr_get_byte(ipaddr, 1)
+#define esp_ip4_addr3(ipaddr) esp_ip4_addr_get_byte(ipaddr, 2)
+#define esp_ip4_addr4(ipaddr) esp_ip4_addr_get_byte(ipaddr, 3)
+#define IP2STR(ipaddr) esp_ip4_addr1(ipaddr), esp_ip4_addr2(ipaddr), esp_ip4_addr3(ipaddr), esp_ip4_addr4(ipaddr)
+#define IPSTR "%d.%d.%d.%d"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int64_t esp_timer_get_time(void); // Microseconds since this boot (or wake)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+/* FreeRTOS on POSIX threads, for running the firmware on a Linux host (see host/src/freertos.cpp).
+   Only the parts the firmware uses. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "portmacro.h"
+#include "sdkconfig.h"
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define configMAX_TASK_NAME_LEN 16
+#define configTASK_NOTIFICATION_ARRAY_ENTRIES 2
+#define configMAX_PRIORITIES 25
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * (uint64_t)configTICK_RATE_HZ) / 1000U))
+
+typedef void (*TaskFunction_t)(void *);
+
+// Big enough for the host's own state, which the static variants keep here
+typedef struct {
+  void *reserved[24];
+} StaticTask_t;
+typedef struct {
+  void *reserved[24];
+} StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct {
+  void *reserved[24];
+} StaticEventGroup_t;
+
+#endif
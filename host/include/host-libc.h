@@ -0,0 +1,25 @@
+#ifndef HOST_LIBC_H
+#define HOST_LIBC_H
+
+/* What newlib has (and so the firmware uses) that glibc doesn't: the fixed width types, which
+   newlib's string.h and stdlib.h declare, and strlcpy() before glibc 2.38. Included ahead of every
+   source file by CMakeLists.txt. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size);
+#define HOST_NEEDS_STRLCPY 1
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
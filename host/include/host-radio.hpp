@@ -0,0 +1,14 @@
+#ifndef HOST_RADIO_H
+#define HOST_RADIO_H
+
+#include "host.h"
+#include "udp-transport.hpp"
+
+// The simulated ESP-NOW radio, as the command line sets it up (see net/device-radio.hpp)
+class DeviceRadio : public UdpTransport {
+public:
+  DeviceRadio()
+      : UdpTransport(hostOptions.mac, hostOptions.rssi, hostOptions.loss, hostOptions.port, hostOptions.medium) {}
+};
+
+#endif
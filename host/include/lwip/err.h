@@ -0,0 +1,9 @@
+#ifndef HOST_LWIP_ERR_H
+#define HOST_LWIP_ERR_H
+
+// The host's own sockets stand in for lwIP
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HOST_LWIP_INET_H
+#define HOST_LWIP_INET_H
+
+#include <arpa/inet.h>
+#include <stdio.h>
+
+// lwIP's reentrant inet_ntoa, on an address in network byte order
+static inline char *inet_ntoa_r(uint32_t addr, char *buf, int buflen) {
+  const uint8_t *b = (const uint8_t *)&addr;
+  snprintf(buf, buflen, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+  return buf;
+}
+
+#endif
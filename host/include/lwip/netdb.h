@@ -0,0 +1,9 @@
+#ifndef HOST_LWIP_NETDB_H
+#define HOST_LWIP_NETDB_H
+
+// The host's own sockets stand in for lwIP
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HOST_LWIP_SOCKETS_H
+#define HOST_LWIP_SOCKETS_H
+
+// The host's own sockets stand in for lwIP
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>     // Which lwIP's arch headers include
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define IPADDR_ANY ((uint32_t)0x00000000UL)
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef HOST_MBEDTLS_ECDH_H
+#define HOST_MBEDTLS_ECDH_H
+
+#include <stddef.h>
+
+// See sha256.h
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MBEDTLS_ECP_PF_UNCOMPRESSED 0
+
+typedef enum {
+  MBEDTLS_ECP_DP_NONE = 0,
+  MBEDTLS_ECP_DP_CURVE25519 = 9,
+} mbedtls_ecp_group_id;
+
+typedef struct {
+  unsigned char opaque[64];
+} mbedtls_mpi;
+
+typedef struct {
+  unsigned char opaque[128];
+} mbedtls_ecp_point;
+
+typedef struct {
+  unsigned char opaque[1024];
+} mbedtls_ecp_group;
+
+void mbedtls_mpi_init(mbedtls_mpi *X);
+void mbedtls_mpi_free(mbedtls_mpi *X);
+int mbedtls_mpi_read_binary_le(mbedtls_mpi *X, const unsigned char *buf, size_t buflen);
+int mbedtls_mpi_write_binary_le(const mbedtls_mpi *X, unsigned char *buf, size_t buflen);
+
+void mbedtls_ecp_group_init(mbedtls_ecp_group *grp);
+void mbedtls_ecp_group_free(mbedtls_ecp_group *grp);
+int mbedtls_ecp_group_load(mbedtls_ecp_group *grp, mbedtls_ecp_group_id id);
+void mbedtls_ecp_point_init(mbedtls_ecp_point *pt);
+void mbedtls_ecp_point_free(mbedtls_ecp_point *pt);
+int mbedtls_ecp_point_read_binary(const mbedtls_ecp_group *grp, mbedtls_ecp_point *P, const unsigned char *buf,
+                                  size_t ilen);
+int mbedtls_ecp_point_write_binary(const mbedtls_ecp_group *grp, const mbedtls_ecp_point *P, int format,
+                                   size_t *olen, unsigned char *buf, size_t buflen);
+int mbedtls_ecp_gen_keypair(mbedtls_ecp_group *grp, mbedtls_mpi *d, mbedtls_ecp_point *Q,
+                            int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+int mbedtls_ecdh_compute_shared(mbedtls_ecp_group *grp, mbedtls_mpi *z, const mbedtls_ecp_point *Q,
+                                const mbedtls_mpi *d, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef HOST_MBEDTLS_SHA256_H
+#define HOST_MBEDTLS_SHA256_H
+
+#include <stddef.h>
+
+/* The host links the system's libmbedcrypto (2.28), whose headers aren't installed. Only what the
+   firmware calls is declared, with the contexts oversized and opaque. The firmware is written
+   against IDF's mbedtls 3, where these return int: that's the _ret variants in 2.28. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  unsigned char opaque[256];
+} mbedtls_sha256_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224) __asm__("mbedtls_sha256_starts_ret");
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+    __asm__("mbedtls_sha256_update_ret");
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32]) __asm__("mbedtls_sha256_finish_ret");
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
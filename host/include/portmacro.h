@@ -0,0 +1,57 @@
+#ifndef HOST_PORTMACRO_H
+#define HOST_PORTMACRO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_attr.h" // As IDF's port, which the firmware relies on for RTC_DATA_ATTR
+#include "esp_bit_defs.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// As the RISC-V port: stacks are measured in bytes
+typedef uint8_t StackType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / CONFIG_FREERTOS_HZ)
+#define portNUM_PROCESSORS 1
+
+/* The chip has one core, where a critical section stops everything else. Here the tasks are threads,
+   so every critical section (and spinlock) takes the same recursive lock. It's never held across a
+   blocking call. */
+typedef struct {
+  uint32_t owner;
+  uint32_t count;
+} spinlock_t;
+typedef spinlock_t portMUX_TYPE;
+
+#define SPINLOCK_INITIALIZER {0, 0}
+#define SPINLOCK_WAIT_FOREVER (-1)
+#define portMUX_INITIALIZER_UNLOCKED SPINLOCK_INITIALIZER
+#define portMUX_INITIALIZE(mux) spinlock_initialize(mux)
+
+void spinlock_initialize(spinlock_t *lock);
+bool spinlock_acquire(spinlock_t *lock, int32_t timeout);
+void spinlock_release(spinlock_t *lock);
+
+#define taskENTER_CRITICAL(mux) spinlock_acquire(mux, SPINLOCK_WAIT_FOREVER)
+#define taskEXIT_CRITICAL(mux) spinlock_release(mux)
+#define portENTER_CRITICAL(mux) taskENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL(mux) taskEXIT_CRITICAL(mux)
+#define taskENTER_CRITICAL_ISR(mux) taskENTER_CRITICAL(mux)
+#define taskEXIT_CRITICAL_ISR(mux) taskEXIT_CRITICAL(mux)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
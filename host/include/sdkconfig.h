@@ -0,0 +1,10 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+// The few settings the firmware reads, as in ../../sdkconfig (other than the target)
+#define CONFIG_IDF_TARGET "linux"
+#define CONFIG_FREERTOS_HZ 500
+#define CONFIG_LOG_MAXIMUM_LEVEL 5
+#define CONFIG_ESP_HTTPS_OTA_ALLOW_HTTP 1
+
+#endif
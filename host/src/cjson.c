@@ -0,0 +1,326 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cJSON.h"
+
+/* Just enough of cJSON for the firmware: parsing a document (as the portal's POSTs are), looking up
+   members, and printing a flat object of strings. */
+
+static cJSON *newItem(int type) {
+  cJSON *item = calloc(1, sizeof(cJSON));
+  if (item)
+    item->type = type;
+  return item;
+}
+
+void cJSON_Delete(cJSON *item) {
+  while (item) {
+    cJSON *next = item->next;
+    cJSON_Delete(item->child);
+    free(item->valuestring);
+    free(item->string);
+    free(item);
+    item = next;
+  }
+}
+
+static const char *skip(const char *p) {
+  while (p && *p && isspace((unsigned char)*p))
+    p++;
+  return p;
+}
+
+static int hex4(const char *p, unsigned *out) {
+  *out = 0;
+  for (int i = 0; i < 4; i++) {
+    const char c = p[i];
+    *out <<= 4;
+    if (c >= '0' && c <= '9')
+      *out |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      *out |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      *out |= c - 'A' + 10;
+    else
+      return 0;
+  }
+  return 1;
+}
+
+static char *utf8(char *o, unsigned cp) {
+  if (cp < 0x80) {
+    *o++ = cp;
+  } else if (cp < 0x800) {
+    *o++ = 0xC0 | (cp >> 6);
+    *o++ = 0x80 | (cp & 0x3F);
+  } else if (cp < 0x10000) {
+    *o++ = 0xE0 | (cp >> 12);
+    *o++ = 0x80 | ((cp >> 6) & 0x3F);
+    *o++ = 0x80 | (cp & 0x3F);
+  } else {
+    *o++ = 0xF0 | (cp >> 18);
+    *o++ = 0x80 | ((cp >> 12) & 0x3F);
+    *o++ = 0x80 | ((cp >> 6) & 0x3F);
+    *o++ = 0x80 | (cp & 0x3F);
+  }
+  return o;
+}
+
+// A string, from just after its opening quote. The escapes never make it longer.
+static const char *parseString(const char *p, char **out) {
+  const char *end = p;
+  while (*end && *end != '"') {
+    if (*end == '\\' && end[1])
+      end++;
+    end++;
+  }
+  if (*end != '"')
+    return NULL;
+  char *s = malloc(end - p + 1), *o = s;
+  while (p < end) {
+    if (*p != '\\') {
+      *o++ = *p++;
+      continue;
+    }
+    p++;
+    switch (*p++) {
+    case 'b': *o++ = '\b'; break;
+    case 'f': *o++ = '\f'; break;
+    case 'n': *o++ = '\n'; break;
+    case 'r': *o++ = '\r'; break;
+    case 't': *o++ = '\t'; break;
+    case '"': *o++ = '"'; break;
+    case '\\': *o++ = '\\'; break;
+    case '/': *o++ = '/'; break;
+    case 'u': {
+      unsigned cp, low;
+      if (end - p < 4 || !hex4(p, &cp)) {
+        free(s);
+        return NULL;
+      }
+      p += 4;
+      if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u' && hex4(p + 2, &low)
+          && low >= 0xDC00 && low < 0xE000) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        p += 6;
+      }
+      o = utf8(o, cp);
+      break;
+    }
+    default:
+      free(s);
+      return NULL;
+    }
+  }
+  *o = 0;
+  *out = s;
+  return end + 1;
+}
+
+static const char *parseValue(cJSON *item, const char *p, int depth);
+
+static const char *parseMembers(cJSON *item, const char *p, int depth, int object) {
+  const char close = object ? '}' : ']';
+  item->type = object ? cJSON_Object : cJSON_Array;
+  p = skip(p);
+  if (*p == close)
+    return p + 1;
+  cJSON *last = NULL;
+  while (1) {
+    cJSON *child = newItem(cJSON_Invalid);
+    if (!child)
+      return NULL;
+    if (last) {
+      last->next = child;
+      child->prev = last;
+    } else {
+      item->child = child;
+    }
+    last = child;
+    p = skip(p);
+    if (object) {
+      if (*p != '"' || !(p = parseString(p + 1, &child->string)))
+        return NULL;
+      p = skip(p);
+      if (*p++ != ':')
+        return NULL;
+    }
+    if (!(p = parseValue(child, skip(p), depth + 1)))
+      return NULL;
+    p = skip(p);
+    if (*p == close)
+      return p + 1;
+    if (*p++ != ',')
+      return NULL;
+  }
+}
+
+static const char *parseValue(cJSON *item, const char *p, int depth) {
+  if (depth > 100)
+    return NULL;
+  if (!strncmp(p, "null", 4)) {
+    item->type = cJSON_NULL;
+    return p + 4;
+  }
+  if (!strncmp(p, "false", 5)) {
+    item->type = cJSON_False;
+    return p + 5;
+  }
+  if (!strncmp(p, "true", 4)) {
+    item->type = cJSON_True;
+    item->valueint = 1;
+    return p + 4;
+  }
+  if (*p == '"') {
+    item->type = cJSON_String;
+    return parseString(p + 1, &item->valuestring);
+  }
+  if (*p == '-' || isdigit((unsigned char)*p)) {
+    char *end;
+    item->type = cJSON_Number;
+    item->valuedouble = strtod(p, &end);
+    item->valueint = item->valuedouble >= 2147483647.0 ? 2147483647
+                     : item->valuedouble <= -2147483648.0 ? -2147483647 - 1 : (int)item->valuedouble;
+    return end;
+  }
+  if (*p == '{' || *p == '[')
+    return parseMembers(item, p + 1, depth, *p == '{');
+  return NULL;
+}
+
+cJSON *cJSON_Parse(const char *value) {
+  if (!value)
+    return NULL;
+  cJSON *item = newItem(cJSON_Invalid);
+  if (!item)
+    return NULL;
+  const char *end = parseValue(item, skip(value), 0);
+  if (!end) {
+    cJSON_Delete(item);
+    return NULL;
+  }
+  return item;
+}
+
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string) {
+  if (!object || !string)
+    return NULL;
+  for (cJSON *c = object->child; c; c = c->next) {
+    if (c->string && !strcasecmp(c->string, string))
+      return c;
+  }
+  return NULL;
+}
+
+cJSON_bool cJSON_IsBool(const cJSON *item) {
+  return item && (item->type & (cJSON_True | cJSON_False));
+}
+
+cJSON_bool cJSON_IsTrue(const cJSON *item) {
+  return item && (item->type & cJSON_True);
+}
+
+cJSON_bool cJSON_IsNumber(const cJSON *item) {
+  return item && (item->type & cJSON_Number);
+}
+
+cJSON_bool cJSON_IsString(const cJSON *item) {
+  return item && (item->type & cJSON_String);
+}
+
+cJSON_bool cJSON_IsObject(const cJSON *item) {
+  return item && (item->type & cJSON_Object);
+}
+
+cJSON *cJSON_CreateObject() {
+  return newItem(cJSON_Object);
+}
+
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *string) {
+  if (!object || !name || !string)
+    return NULL;
+  cJSON *item = newItem(cJSON_String);
+  if (!item)
+    return NULL;
+  item->string = strdup(name);
+  item->valuestring = strdup(string);
+  if (!object->child) {
+    object->child = item;
+  } else {
+    cJSON *last = object->child;
+    while (last->next)
+      last = last->next;
+    last->next = item;
+    item->prev = last;
+  }
+  return item;
+}
+
+// Quoted and escaped
+static void printString(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    const unsigned char c = *s;
+    switch (c) {
+    case '"': fputs("\\\"", f); break;
+    case '\\': fputs("\\\\", f); break;
+    case '\b': fputs("\\b", f); break;
+    case '\f': fputs("\\f", f); break;
+    case '\n': fputs("\\n", f); break;
+    case '\r': fputs("\\r", f); break;
+    case '\t': fputs("\\t", f); break;
+    default:
+      if (c < 0x20)
+        fprintf(f, "\\u%04x", c);
+      else
+        fputc(c, f);
+    }
+  }
+  fputc('"', f);
+}
+
+static void print(FILE *f, const cJSON *item) {
+  switch (item->type & 0xFF) {
+  case cJSON_NULL: fputs("null", f); break;
+  case cJSON_False: fputs("false", f); break;
+  case cJSON_True: fputs("true", f); break;
+  case cJSON_Number: fprintf(f, "%.17g", item->valuedouble); break;
+  case cJSON_String: printString(f, item->valuestring); break;
+  case cJSON_Array:
+  case cJSON_Object: {
+    const int object = item->type & cJSON_Object;
+    fputc(object ? '{' : '[', f);
+    for (const cJSON *c = item->child; c; c = c->next) {
+      if (object) {
+        printString(f, c->string);
+        fputc(':', f);
+      }
+      print(f, c);
+      if (c->next)
+        fputc(',', f);
+    }
+    fputc(object ? '}' : ']', f);
+    break;
+  }
+  }
+}
+
+char *cJSON_PrintUnformatted(const cJSON *item) {
+  if (!item)
+    return NULL;
+  char *out = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&out, &len);
+  if (!f)
+    return NULL;
+  print(f, item);
+  fclose(f);
+  return out;
+}
+
+void cJSON_free(void *object) {
+  free(object);
+}
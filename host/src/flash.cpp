@@ -0,0 +1,744 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "esp_app_desc.h"
+#include "esp_app_format.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "host.h"
+#include "mbedtls/sha256.h"
+#include "nvs_flash.h"
+
+/* The flash chip, kept in flash.bin in the state directory, and what IDF keeps in it.
+
+   The partitions are those of partitions.csv. The app partitions hold images in the chip's format,
+   and otadata holds the bootloader's two entries, as IDF's bootloader reads and writes them (with
+   rollback enabled, as sdkconfig has it). The image this program was built as is written to app0
+   when flash.bin is created, or with --flash; an image received over the air replaces it as it
+   would on the chip, though it's still this program that runs. NVS is the host's own encoding of
+   the keys, rewritten on each change.
+*/
+
+#define FLASH_SIZE (4 * 1024 * 1024)
+#define SECTOR 4096
+#define MAX_SEGMENTS 16
+#define CHECKSUM_SEED 0xEF
+#define OTA_HANDLES 2
+#define NVS_MAGIC 0x53564E48 // "HNVS"
+#define NVS_KEY_MAX 15
+#define NVS_HANDLES 16
+#define NVS_BLOB 1
+#define NVS_STR 2
+
+static esp_partition_t partitions[] = {
+  {NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x5000, SECTOR, "nvs", false, false},
+  {NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, 0xE000, 0x2000, SECTOR, "otadata", false, false},
+  {NULL, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000, 0x1E0000, SECTOR, "app0", false, false},
+  {NULL, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x1F0000, 0x1E0000, SECTOR, "app1", false, false},
+  {NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, 0x3D0000, 0xB000, SECTOR, "fs", false, false},
+  {NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, 0x3DB000, 0x4000, SECTOR, "zb_storage", false, false},
+  {NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, 0x3DF000, 0x1000, SECTOR, "zb_fct", false, false},
+  {NULL, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, 0x3E0000, 0x20000, SECTOR, "coredump", false, false},
+};
+
+static const esp_partition_t *const nvsPartition = &partitions[0];
+static const esp_partition_t *const otadata = &partitions[1];
+static const esp_partition_t *const apps[2] = {&partitions[2], &partitions[3]};
+
+static uint8_t *flash;
+static pthread_mutex_t flashLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Partitions
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label) {
+  for (const auto &p : partitions) {
+    if (p.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p.subtype == subtype)
+        && (!label || !strcmp(label, p.label)))
+      return &p;
+  }
+  return NULL;
+}
+
+static bool inside(const esp_partition_t *partition, size_t offset, size_t size) {
+  return partition && offset <= partition->size && size <= partition->size - offset;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size) {
+  if (!partition || !dst)
+    return ESP_ERR_INVALID_ARG;
+  if (!inside(partition, offset, size))
+    return ESP_ERR_INVALID_SIZE;
+  memcpy(dst, flash + partition->address + offset, size);
+  return ESP_OK;
+}
+
+// As NOR flash, a write can only clear bits
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size) {
+  if (!partition || !src)
+    return ESP_ERR_INVALID_ARG;
+  if (!inside(partition, offset, size))
+    return ESP_ERR_INVALID_SIZE;
+  uint8_t *to = flash + partition->address + offset;
+  const uint8_t *from = (const uint8_t *)src;
+  pthread_mutex_lock(&flashLock);
+  for (size_t i = 0; i < size; i++)
+    to[i] &= from[i];
+  pthread_mutex_unlock(&flashLock);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+  if (!partition)
+    return ESP_ERR_INVALID_ARG;
+  if (!inside(partition, offset, size))
+    return ESP_ERR_INVALID_SIZE;
+  if (offset % SECTOR || size % SECTOR)
+    return ESP_ERR_INVALID_ARG;
+  memset(flash + partition->address + offset, 0xFF, size);
+  return ESP_OK;
+}
+
+// Images
+
+static void sha256(const uint8_t *data, size_t len, uint8_t *out) {
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  mbedtls_sha256_update(&ctx, data, len);
+  mbedtls_sha256_finish(&ctx, out);
+  mbedtls_sha256_free(&ctx);
+}
+
+// The length of the valid image in a partition (not counting an appended hash), or 0
+static size_t imageLength(const esp_partition_t *partition, bool *hashAppended = NULL) {
+  const uint8_t *image = flash + partition->address;
+  esp_image_header_t header;
+  memcpy(&header, image, sizeof(header));
+  if (header.magic != ESP_IMAGE_HEADER_MAGIC || header.segment_count == 0 || header.segment_count > MAX_SEGMENTS)
+    return 0;
+  size_t pos = sizeof(header);
+  uint8_t checksum = CHECKSUM_SEED;
+  for (int i = 0; i < header.segment_count; i++) {
+    esp_image_segment_header_t segment;
+    if (!inside(partition, pos, sizeof(segment)))
+      return 0;
+    memcpy(&segment, image + pos, sizeof(segment));
+    pos += sizeof(segment);
+    if (!inside(partition, pos, segment.data_len))
+      return 0;
+    for (uint32_t j = 0; j < segment.data_len; j++)
+      checksum ^= image[pos + j];
+    pos += segment.data_len;
+  }
+  // The checksum is the last byte of a 16 byte block
+  pos = (pos + 16) & ~15;
+  if (!inside(partition, pos, header.hash_appended ? 32 : 0) || image[pos - 1] != checksum)
+    return 0;
+  if (header.hash_appended) {
+    uint8_t digest[32];
+    sha256(image, pos, digest);
+    if (memcmp(digest, image + pos, sizeof(digest)))
+      return 0;
+  }
+  if (hashAppended)
+    *hashAppended = header.hash_appended;
+  return pos;
+}
+
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *out) {
+  if (!partition || !out)
+    return ESP_ERR_INVALID_ARG;
+  if (partition->type != ESP_PARTITION_TYPE_APP) {
+    sha256(flash + partition->address, partition->size, out);
+    return ESP_OK;
+  }
+  const size_t len = imageLength(partition);
+  if (!len)
+    return ESP_ERR_INVALID_STATE;
+  sha256(flash + partition->address, len, out);
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition, esp_app_desc_t *app_desc) {
+  if (!partition || !app_desc || partition->type != ESP_PARTITION_TYPE_APP)
+    return ESP_ERR_INVALID_ARG;
+  const uint8_t *image = flash + partition->address;
+  memcpy(app_desc, image + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(*app_desc));
+  if (image[0] != ESP_IMAGE_HEADER_MAGIC || app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD)
+    return ESP_ERR_NOT_FOUND;
+  return ESP_OK;
+}
+
+// This program, as an image: just the app description, in a segment of its own
+static void writeHostImage(const esp_partition_t *partition) {
+  std::vector<uint8_t> image(sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)
+                             + sizeof(esp_app_desc_t));
+  esp_image_header_t header = {};
+  header.magic = ESP_IMAGE_HEADER_MAGIC;
+  header.segment_count = 1;
+  header.chip_id = 13; // ESP32-C6
+  header.hash_appended = 1;
+  const esp_image_segment_header_t segment = {0x42000020, sizeof(esp_app_desc_t)};
+  esp_app_desc_t desc = {};
+  desc.magic_word = ESP_APP_DESC_MAGIC_WORD;
+  strncpy(desc.version, HOST_APP_VERSION, sizeof(desc.version) - 1);
+  strncpy(desc.project_name, "trv-1", sizeof(desc.project_name) - 1);
+  strncpy(desc.time, __TIME__, sizeof(desc.time) - 1);
+  strncpy(desc.date, __DATE__, sizeof(desc.date) - 1);
+  strncpy(desc.idf_ver, "host", sizeof(desc.idf_ver) - 1);
+  desc.mmu_page_size = 16; // log2(64KB)
+
+  FILE *f = fopen("/proc/self/exe", "rb");
+  if (f) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      mbedtls_sha256_update(&ctx, buf, n);
+    mbedtls_sha256_finish(&ctx, desc.app_elf_sha256);
+    mbedtls_sha256_free(&ctx);
+    fclose(f);
+  }
+
+  memcpy(image.data(), &header, sizeof(header));
+  memcpy(image.data() + sizeof(header), &segment, sizeof(segment));
+  memcpy(image.data() + sizeof(header) + sizeof(segment), &desc, sizeof(desc));
+  uint8_t checksum = CHECKSUM_SEED;
+  for (size_t i = sizeof(header) + sizeof(segment); i < image.size(); i++)
+    checksum ^= image[i];
+  image.resize((image.size() + 16) & ~15, 0);
+  image.back() = checksum;
+  image.resize(image.size() + 32);
+  sha256(image.data(), image.size() - 32, image.data() + image.size() - 32);
+
+  esp_partition_erase_range(partition, 0, partition->size);
+  esp_partition_write(partition, 0, image.data(), image.size());
+}
+
+// The bootloader's entries in otadata, one per sector. The highest sequence number is the one that
+// boots, in app partition (seq - 1) % 2.
+
+typedef struct {
+  uint32_t ota_seq;
+  uint8_t seq_label[20];
+  uint32_t ota_state;
+  uint32_t crc;
+} ota_select_entry_t;
+
+static const esp_partition_t *running;
+static esp_app_desc_t runningDesc;
+
+static uint32_t entryCrc(const ota_select_entry_t &e) {
+  return esp_rom_crc32_le(UINT32_MAX, (const uint8_t *)&e.ota_seq, sizeof(e.ota_seq));
+}
+
+static bool readEntry(int sector, ota_select_entry_t &e) {
+  esp_partition_read(otadata, sector * SECTOR, &e, sizeof(e));
+  return e.ota_seq != UINT32_MAX && e.crc == entryCrc(e);
+}
+
+static void writeEntry(int sector, ota_select_entry_t e) {
+  e.crc = entryCrc(e);
+  esp_partition_erase_range(otadata, sector * SECTOR, SECTOR);
+  esp_partition_write(otadata, sector * SECTOR, &e, sizeof(e));
+}
+
+static int appIndex(const esp_partition_t *partition) {
+  return partition == apps[0] ? 0 : partition == apps[1] ? 1 : -1;
+}
+
+// The sector holding the entry for a partition (the newer, if both are), or -1
+static int entryFor(const esp_partition_t *partition, ota_select_entry_t &e) {
+  int found = -1;
+  ota_select_entry_t candidate;
+  for (int s = 0; s < 2; s++) {
+    if (readEntry(s, candidate) && (int)((candidate.ota_seq - 1) % 2) == appIndex(partition)
+        && (found < 0 || candidate.ota_seq > e.ota_seq)) {
+      e = candidate;
+      found = s;
+    }
+  }
+  return found;
+}
+
+// The sector with the newest entry, or -1
+static int newestEntry(ota_select_entry_t &e) {
+  int found = -1;
+  ota_select_entry_t candidate;
+  for (int s = 0; s < 2; s++) {
+    if (readEntry(s, candidate) && (found < 0 || candidate.ota_seq > e.ota_seq)) {
+      e = candidate;
+      found = s;
+    }
+  }
+  return found;
+}
+
+static void setState(const esp_partition_t *partition, esp_ota_img_states_t state) {
+  ota_select_entry_t e;
+  const int sector = entryFor(partition, e);
+  if (sector >= 0) {
+    e.ota_state = state;
+    writeEntry(sector, e);
+  }
+}
+
+static const esp_partition_t *chooseApp() {
+  ota_select_entry_t entries[2];
+  int order[2], n = 0;
+  for (int s = 0; s < 2; s++) {
+    if (readEntry(s, entries[s]))
+      order[n++] = s;
+  }
+  if (n == 2 && entries[order[1]].ota_seq > entries[order[0]].ota_seq)
+    std::swap(order[0], order[1]);
+  for (int i = 0; i < n; i++) {
+    ota_select_entry_t &e = entries[order[i]];
+    const esp_partition_t *app = apps[(e.ota_seq - 1) % 2];
+    if (e.ota_state == ESP_OTA_IMG_INVALID || e.ota_state == ESP_OTA_IMG_ABORTED)
+      continue;
+    if (e.ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
+      // It didn't confirm itself on the last boot
+      printf("host: bootloader: %s was never marked valid, rolling back\n", app->label);
+      e.ota_state = ESP_OTA_IMG_ABORTED;
+      writeEntry(order[i], e);
+      continue;
+    }
+    if (!imageLength(app))
+      continue;
+    if (e.ota_state == ESP_OTA_IMG_NEW) {
+      e.ota_state = ESP_OTA_IMG_PENDING_VERIFY;
+      writeEntry(order[i], e);
+    }
+    return app;
+  }
+  // With no usable entry, the first app partition with an image boots
+  for (const auto *app : apps) {
+    if (imageLength(app))
+      return app;
+  }
+  return NULL;
+}
+
+void flashBoot() {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/flash.bin", hostOptions.dir);
+  const int fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "host: can't open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  const bool created = st.st_size != FLASH_SIZE;
+  if (created && ftruncate(fd, FLASH_SIZE) != 0) {
+    fprintf(stderr, "host: can't size %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  flash = (uint8_t *)mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (flash == MAP_FAILED) {
+    fprintf(stderr, "host: can't map %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  if (created)
+    memset(flash, 0xFF, FLASH_SIZE);
+  if (created || (hostOptions.flash && hostWorld.reset == ESP_RST_POWERON)) {
+    // As `idf.py flash`, which also erases otadata
+    writeHostImage(apps[0]);
+    esp_partition_erase_range(otadata, 0, otadata->size);
+  }
+
+  running = chooseApp();
+  if (!running) {
+    fprintf(stderr, "host: bootloader: no app to boot\n");
+    exit(1);
+  }
+  esp_ota_get_partition_description(running, &runningDesc);
+}
+
+const esp_app_desc_t *esp_app_get_description() {
+  return &runningDesc;
+}
+
+int esp_app_get_elf_sha256(char *dst, size_t size) {
+  if (!dst || !size)
+    return 0;
+  size_t n = 0;
+  for (; n < sizeof(runningDesc.app_elf_sha256) * 2 && n + 1 < size; n++)
+    dst[n] = "0123456789abcdef"[(runningDesc.app_elf_sha256[n / 2] >> (n % 2 ? 0 : 4)) & 15];
+  dst[n] = 0;
+  return n + 1;
+}
+
+// OTA
+
+static struct {
+  const esp_partition_t *partition;
+  size_t written;
+  size_t erased;          // Up to
+  bool sequential;        // Erase as the writes reach each sector
+} otaHandles[OTA_HANDLES];
+
+const esp_partition_t *esp_ota_get_running_partition() {
+  return running;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition() {
+  ota_select_entry_t e;
+  return newestEntry(e) >= 0 ? apps[(e.ota_seq - 1) % 2] : apps[0];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+  const int i = appIndex(start_from ? start_from : running);
+  return i < 0 ? apps[0] : apps[1 - i];
+}
+
+static esp_err_t startOta(const esp_partition_t *partition, size_t image_size, size_t offset,
+                          esp_ota_handle_t *handle) {
+  if (!partition || !handle || appIndex(partition) < 0)
+    return ESP_ERR_INVALID_ARG;
+  if (partition == running)
+    return ESP_ERR_OTA_PARTITION_CONFLICT;
+  const bool sequential = image_size == OTA_WITH_SEQUENTIAL_WRITES;
+  if (!sequential && image_size != OTA_SIZE_UNKNOWN && image_size > partition->size)
+    return ESP_ERR_INVALID_SIZE;
+  for (int i = 0; i < OTA_HANDLES; i++) {
+    if (!otaHandles[i].partition) {
+      size_t erased = (offset + SECTOR - 1) & ~(SECTOR - 1);
+      if (!sequential) {
+        const size_t end = image_size == OTA_SIZE_UNKNOWN ? partition->size : (image_size + SECTOR - 1) & ~(SECTOR - 1);
+        if (end > erased)
+          esp_partition_erase_range(partition, erased, end - erased);
+        erased = end;
+      }
+      otaHandles[i] = {partition, offset, erased, sequential};
+      *handle = i + 1;
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *handle) {
+  return startOta(partition, image_size, 0, handle);
+}
+
+esp_err_t esp_ota_resume(const esp_partition_t *partition, size_t image_size, size_t offset,
+                         esp_ota_handle_t *handle) {
+  if (partition && offset > partition->size)
+    return ESP_ERR_INVALID_SIZE;
+  return startOta(partition, image_size, offset, handle);
+}
+
+#define HANDLE(h) (h >= 1 && h <= OTA_HANDLES && otaHandles[h - 1].partition ? &otaHandles[h - 1] : NULL)
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size) {
+  auto *h = HANDLE(handle);
+  if (!h)
+    return ESP_ERR_INVALID_ARG;
+  if (h->written == 0 && size && ((const uint8_t *)data)[0] != ESP_IMAGE_HEADER_MAGIC)
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  if (!inside(h->partition, h->written, size))
+    return ESP_ERR_INVALID_SIZE;
+  if (h->sequential) {
+    while (h->erased < h->written + size) {
+      esp_partition_erase_range(h->partition, h->erased, SECTOR);
+      h->erased += SECTOR;
+    }
+  }
+  esp_err_t err = esp_partition_write(h->partition, h->written, data, size);
+  if (err == ESP_OK)
+    h->written += size;
+  return err;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+  auto *h = HANDLE(handle);
+  if (!h)
+    return ESP_ERR_NOT_FOUND;
+  const bool valid = imageLength(h->partition) != 0;
+  h->partition = NULL;
+  return valid ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+  auto *h = HANDLE(handle);
+  if (!h)
+    return ESP_ERR_NOT_FOUND;
+  h->partition = NULL;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+  const int index = appIndex(partition);
+  if (index < 0)
+    return ESP_ERR_INVALID_ARG;
+  if (!imageLength(partition))
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  ota_select_entry_t e = {};
+  const int newest = newestEntry(e);
+  uint32_t seq = newest < 0 ? 1 : e.ota_seq + 1;
+  while ((int)((seq - 1) % 2) != index)
+    seq++;
+  ota_select_entry_t next = {};
+  memset(next.seq_label, 0xFF, sizeof(next.seq_label));
+  next.ota_seq = seq;
+  next.ota_state = ESP_OTA_IMG_NEW;
+  writeEntry(newest < 0 ? 0 : 1 - newest, next);
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state) {
+  if (!partition || !ota_state || appIndex(partition) < 0)
+    return ESP_ERR_INVALID_ARG;
+  ota_select_entry_t e;
+  if (entryFor(partition, e) < 0)
+    return ESP_ERR_NOT_FOUND;
+  *ota_state = (esp_ota_img_states_t)e.ota_state;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback() {
+  esp_ota_img_states_t state;
+  if (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY)
+    setState(running, ESP_OTA_IMG_VALID);
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot() {
+  const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+  if (!imageLength(previous))
+    return ESP_ERR_OTA_ROLLBACK_FAILED;
+  setState(running, ESP_OTA_IMG_INVALID);
+  esp_restart();
+}
+
+/* NVS. The keys are kept in memory, and the whole store is written to the partition whenever one
+   changes: [magic][length][crc] then for each key [type][namespace\0][key\0][length][value]. */
+
+struct nvs_value_t {
+  uint8_t type;
+  std::vector<uint8_t> data;
+};
+
+static std::map<std::string, std::map<std::string, nvs_value_t>> nvsStore;
+static bool nvsReady;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  bool open;
+  bool readOnly;
+  std::string ns;
+} nvsHandles[NVS_HANDLES];
+
+static void put(std::vector<uint8_t> &out, const void *p, size_t n) {
+  out.insert(out.end(), (const uint8_t *)p, (const uint8_t *)p + n);
+}
+
+static esp_err_t nvsSave() {
+  std::vector<uint8_t> body;
+  for (const auto &[ns, keys] : nvsStore) {
+    for (const auto &[key, value] : keys) {
+      const uint32_t len = value.data.size();
+      put(body, &value.type, 1);
+      put(body, ns.c_str(), ns.size() + 1);
+      put(body, key.c_str(), key.size() + 1);
+      put(body, &len, sizeof(len));
+      put(body, value.data.data(), len);
+    }
+  }
+  const uint32_t header[3] = {NVS_MAGIC, (uint32_t)body.size(), esp_rom_crc32_le(0, body.data(), body.size())};
+  if (sizeof(header) + body.size() > nvsPartition->size)
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+  std::vector<uint8_t> all;
+  put(all, header, sizeof(header));
+  put(all, body.data(), body.size());
+  esp_partition_erase_range(nvsPartition, 0, nvsPartition->size);
+  return esp_partition_write(nvsPartition, 0, all.data(), all.size());
+}
+
+static bool nvsLoad() {
+  uint32_t header[3];
+  esp_partition_read(nvsPartition, 0, header, sizeof(header));
+  nvsStore.clear();
+  if (header[0] == UINT32_MAX)
+    return true; // Erased
+  if (header[0] != NVS_MAGIC || header[1] > nvsPartition->size - sizeof(header))
+    return false;
+  const uint8_t *p = flash + nvsPartition->address + sizeof(header);
+  const uint8_t *end = p + header[1];
+  if (esp_rom_crc32_le(0, p, header[1]) != header[2])
+    return false;
+  while (p < end) {
+    nvs_value_t value;
+    value.type = *p++;
+    const std::string ns((const char *)p);
+    p += ns.size() + 1;
+    const std::string key((const char *)p);
+    p += key.size() + 1;
+    uint32_t len;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    value.data.assign(p, p + len);
+    p += len;
+    nvsStore[ns][key] = value;
+  }
+  return true;
+}
+
+esp_err_t nvs_flash_init() {
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_OK;
+  if (!nvsReady) {
+    nvsReady = nvsLoad();
+    if (!nvsReady)
+      err = ESP_ERR_NVS_NO_FREE_PAGES; // As IDF, for a partition it can't make sense of
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+esp_err_t nvs_flash_erase() {
+  pthread_mutex_lock(&lock);
+  nvsReady = false;
+  nvsStore.clear();
+  for (auto &h : nvsHandles)
+    h.open = false;
+  pthread_mutex_unlock(&lock);
+  return esp_partition_erase_range(nvsPartition, 0, nvsPartition->size);
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle) {
+  if (!nvsReady)
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+  if (!name || strlen(name) > NVS_KEY_MAX)
+    return ESP_ERR_NVS_INVALID_NAME;
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+  if (mode == NVS_READONLY && !nvsStore.count(name)) {
+    err = ESP_ERR_NVS_NOT_FOUND;
+  } else {
+    for (int i = 0; i < NVS_HANDLES; i++) {
+      if (!nvsHandles[i].open) {
+        nvsHandles[i].open = true;
+        nvsHandles[i].readOnly = mode == NVS_READONLY;
+        nvsHandles[i].ns = name;
+        *handle = i + 1;
+        err = ESP_OK;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+#define NVS_HANDLE(h) (h >= 1 && h <= NVS_HANDLES && nvsHandles[h - 1].open ? &nvsHandles[h - 1] : NULL)
+
+void nvs_close(nvs_handle_t handle) {
+  pthread_mutex_lock(&lock);
+  if (auto *h = NVS_HANDLE(handle))
+    h->open = false;
+  pthread_mutex_unlock(&lock);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  return NVS_HANDLE(handle) ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+static esp_err_t nvsGet(nvs_handle_t handle, const char *key, uint8_t type, void *out, size_t *length) {
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_ERR_NVS_INVALID_HANDLE;
+  if (auto *h = NVS_HANDLE(handle)) {
+    err = ESP_ERR_NVS_NOT_FOUND;
+    auto &keys = nvsStore[h->ns];
+    auto it = keys.find(key);
+    if (it != keys.end() && it->second.type == type) {
+      const size_t size = it->second.data.size();
+      err = ESP_OK;
+      if (!out)
+        *length = size;
+      else if (*length < size)
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+      else {
+        memcpy(out, it->second.data.data(), size);
+        *length = size;
+      }
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+static esp_err_t nvsSet(nvs_handle_t handle, const char *key, uint8_t type, const void *value, size_t length) {
+  if (!key || strlen(key) > NVS_KEY_MAX)
+    return ESP_ERR_NVS_INVALID_NAME;
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_ERR_NVS_INVALID_HANDLE;
+  if (auto *h = NVS_HANDLE(handle)) {
+    err = ESP_ERR_NVS_READ_ONLY;
+    if (!h->readOnly) {
+      auto &slot = nvsStore[h->ns][key];
+      slot.type = type;
+      slot.data.assign((const uint8_t *)value, (const uint8_t *)value + length);
+      err = nvsSave();
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out, size_t *length) {
+  return nvsGet(handle, key, NVS_BLOB, out, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+  return nvsSet(handle, key, NVS_BLOB, value, length);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out, size_t *length) {
+  return nvsGet(handle, key, NVS_STR, out, length);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+  return nvsSet(handle, key, NVS_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_ERR_NVS_INVALID_HANDLE;
+  if (auto *h = NVS_HANDLE(handle)) {
+    err = h->readOnly ? ESP_ERR_NVS_READ_ONLY : nvsStore[h->ns].erase(key) ? nvsSave() : ESP_ERR_NVS_NOT_FOUND;
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_ERR_NVS_INVALID_HANDLE;
+  if (auto *h = NVS_HANDLE(handle)) {
+    err = ESP_ERR_NVS_READ_ONLY;
+    if (!h->readOnly) {
+      nvsStore[h->ns].clear();
+      err = nvsSave();
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
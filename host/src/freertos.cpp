@@ -0,0 +1,479 @@
+/* FreeRTOS on POSIX threads: each task is a thread, and there's one kernel lock, with a condition
+   variable that's broadcast whenever anything a task might be blocked on changes. That's slow next
+   to a real scheduler, but the firmware has a handful of tasks, and it keeps every primitive simple.
+
+   Priorities are recorded but don't preempt: the threads run in parallel, which is harsher than the
+   chip's single core (anything that relies on a higher priority task not being interrupted shows up
+   here first).
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <new>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "host.h"
+
+#define STACK_FILL 0xa5
+#define MIN_TASK_STACK (64 * 1024) // The host's frames are bigger than the RISC-V's
+
+static const char *TAG = "freertos";
+
+struct host_task {
+  pthread_t thread;
+  char name[configMAX_TASK_NAME_LEN];
+  TaskFunction_t fn;
+  void *arg;
+  UBaseType_t priority;
+  uint32_t notify[configTASK_NOTIFICATION_ARRAY_ENTRIES];
+  uint8_t *stack;          // NULL for the main thread
+  size_t stackSize;
+  bool ownStack;           // Allocated here, rather than given to xTaskCreateStatic()
+  bool ownTcb;
+  bool deleted;            // Asked to stop, at the next blocking call
+  bool exited;             // Its thread has finished, and can be joined
+  bool awaited;            // By vTaskDelete(), so not to be freed yet
+  host_task *nextExited;
+};
+
+struct host_queue {
+  uint8_t *storage;
+  UBaseType_t length;
+  UBaseType_t itemSize;    // 0 for a semaphore
+  UBaseType_t count;
+  UBaseType_t head;
+  bool ownStorage;
+  bool ownQueue;
+};
+
+struct host_event_group {
+  EventBits_t bits;
+  bool own;
+};
+
+static_assert(sizeof(host_task) <= sizeof(StaticTask_t), "StaticTask_t is too small");
+static_assert(sizeof(host_queue) <= sizeof(StaticQueue_t), "StaticQueue_t is too small");
+static_assert(sizeof(host_event_group) <= sizeof(StaticEventGroup_t), "StaticEventGroup_t is too small");
+
+static pthread_mutex_t kernel = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;
+static pthread_once_t initialised = PTHREAD_ONCE_INIT;
+static pthread_mutex_t critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static host_task *exitedTasks = NULL; // To be joined, and their stacks freed
+static thread_local host_task *self = NULL;
+
+static void init() {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&changed, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void lockKernel() {
+  pthread_once(&initialised, init);
+  pthread_mutex_lock(&kernel);
+}
+
+static void unlockKernel(bool wake) {
+  if (wake)
+    pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&kernel);
+}
+
+static host_task *current() {
+  if (!self) {
+    // The main thread (running app_main), or one the host started itself
+    static host_task main = {};
+    main.thread = pthread_self();
+    strcpy(main.name, "main");
+    main.priority = 1;
+    self = &main;
+  }
+  return self;
+}
+
+// With the kernel lock held: a task that's been deleted stops here
+static void checkDeleted() {
+  host_task *t = current();
+  if (t->deleted) {
+    t->exited = true;
+    t->nextExited = exitedTasks;
+    exitedTasks = t;
+    unlockKernel(true);
+    pthread_exit(NULL);
+  }
+}
+
+// With the kernel lock held, waits for `ready` or the ticks to run out. False if they did.
+template <typename F>
+static bool block(TickType_t ticks, F ready) {
+  checkDeleted();
+  if (ready())
+    return true;
+  if (ticks == 0)
+    return false;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  const uint64_t ns = hostRealUs((int64_t)ticks * portTICK_PERIOD_MS * 1000) * 1000ULL;
+  deadline.tv_sec += ns / 1000000000ULL;
+  deadline.tv_nsec += ns % 1000000000ULL;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (true) {
+    const int rc = ticks == portMAX_DELAY ? pthread_cond_wait(&changed, &kernel)
+                                          : pthread_cond_timedwait(&changed, &kernel, &deadline);
+    checkDeleted();
+    if (ready())
+      return true;
+    if (rc == ETIMEDOUT)
+      return false;
+  }
+}
+
+// With the kernel lock held: joins the threads that have finished, and frees what they had
+static void reap() {
+  for (host_task **p = &exitedTasks; *p;) {
+    host_task *t = *p;
+    if (t->awaited) {
+      p = &t->nextExited;
+      continue;
+    }
+    *p = t->nextExited;
+    pthread_join(t->thread, NULL);
+    if (t->ownStack)
+      munmap(t->stack, t->stackSize);
+    if (t->ownTcb)
+      delete t;
+  }
+}
+
+static void *runTask(void *p) {
+  self = (host_task *)p;
+  self->fn(self->arg);
+  // Tasks don't return (they delete themselves), but as FreeRTOS would, treat it as vTaskDelete(NULL)
+  ESP_LOGE(TAG, "Task %s returned", self->name);
+  vTaskDelete(NULL);
+  return NULL;
+}
+
+static host_task *startTask(host_task *t, TaskFunction_t fn, const char *name, void *arg, UBaseType_t priority) {
+  t->fn = fn;
+  t->arg = arg;
+  t->priority = priority;
+  strncpy(t->name, name ? name : "", sizeof(t->name) - 1);
+  memset(t->stack, STACK_FILL, t->stackSize);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, t->stack, t->stackSize);
+  lockKernel();
+  reap();
+  const int rc = pthread_create(&t->thread, &attr, runTask, t);
+  unlockKernel(false);
+  pthread_attr_destroy(&attr);
+  if (rc) {
+    ESP_LOGE(TAG, "Unable to start task %s: %s", t->name, strerror(rc));
+    return NULL;
+  }
+  return t;
+}
+
+extern "C" {
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core) {
+  host_task *t = new (std::nothrow) host_task();
+  if (!t)
+    return pdFAIL;
+  t->stackSize = stackDepth > MIN_TASK_STACK ? stackDepth : MIN_TASK_STACK;
+  t->stack = (uint8_t *)mmap(NULL, t->stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (t->stack == MAP_FAILED) {
+    delete t;
+    return pdFAIL;
+  }
+  t->ownStack = true;
+  t->ownTcb = true;
+  if (!startTask(t, fn, name, arg, priority)) {
+    munmap(t->stack, t->stackSize);
+    delete t;
+    return pdFAIL;
+  }
+  if (created)
+    *created = t;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *arg, UBaseType_t priority,
+                       TaskHandle_t *created) {
+  return xTaskCreatePinnedToCore(fn, name, stackDepth, arg, priority, created, 0);
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *arg,
+                               UBaseType_t priority, StackType_t *stack, StaticTask_t *tcb) {
+  host_task *t = new (tcb) host_task();
+  t->stack = stack;
+  t->stackSize = stackDepth;
+  return startTask(t, fn, name, arg, priority);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  host_task *t = task ? task : current();
+  lockKernel();
+  t->deleted = true;
+  if (t == current())
+    checkDeleted(); // Doesn't return
+  // Wait until it gets to a blocking call, so its queues etc. can be deleted once we return
+  t->awaited = true;
+  pthread_cond_broadcast(&changed);
+  while (!t->exited)
+    pthread_cond_wait(&changed, &kernel);
+  t->awaited = false;
+  unlockKernel(false);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  lockKernel();
+  block(ticks, [] { return false; });
+  unlockKernel(false);
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return (TickType_t)(esp_timer_get_time() / (1000 * portTICK_PERIOD_MS));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  return current();
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority) {
+  (task ? task : current())->priority = priority;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+  return (task ? task : current())->priority;
+}
+
+char *pcTaskGetName(TaskHandle_t task) {
+  return (task ? task : current())->name;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  const host_task *t = task ? task : current();
+  if (!t->stack)
+    return 0;
+  // The stack grows down, so what's never been touched is still filled at the bottom
+  size_t untouched = 0;
+  while (untouched < t->stackSize && t->stack[untouched] == STACK_FILL)
+    untouched++;
+  return untouched;
+}
+
+uint32_t ulTaskNotifyTakeIndexed(UBaseType_t index, BaseType_t clearOnExit, TickType_t ticks) {
+  host_task *t = current();
+  lockKernel();
+  block(ticks, [t, index] { return t->notify[index] != 0; });
+  const uint32_t value = t->notify[index];
+  if (value)
+    t->notify[index] = clearOnExit ? 0 : value - 1;
+  unlockKernel(false);
+  return value;
+}
+
+BaseType_t xTaskNotifyGiveIndexed(TaskHandle_t task, UBaseType_t index) {
+  lockKernel();
+  task->notify[index]++;
+  unlockKernel(true);
+  return pdPASS;
+}
+
+static host_queue *initQueue(host_queue *q, UBaseType_t length, UBaseType_t itemSize, uint8_t *storage) {
+  q->length = length;
+  q->itemSize = itemSize;
+  q->storage = storage;
+  return q;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  host_queue *q = new (std::nothrow) host_queue();
+  if (!q)
+    return NULL;
+  q->ownQueue = true;
+  uint8_t *storage = NULL;
+  if (itemSize) {
+    storage = (uint8_t *)malloc(length * itemSize);
+    if (!storage) {
+      delete q;
+      return NULL;
+    }
+    q->ownStorage = true;
+  }
+  return initQueue(q, length, itemSize, storage);
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t itemSize, uint8_t *storage, StaticQueue_t *buffer) {
+  return initQueue(new (buffer) host_queue(), length, itemSize, storage);
+}
+
+static BaseType_t send(QueueHandle_t q, const void *item, TickType_t ticks, bool front) {
+  lockKernel();
+  if (!block(ticks, [q] { return q->count < q->length; })) {
+    unlockKernel(false);
+    return pdFAIL;
+  }
+  if (q->itemSize) {
+    UBaseType_t slot;
+    if (front) {
+      q->head = (q->head + q->length - 1) % q->length;
+      slot = q->head;
+    } else {
+      slot = (q->head + q->count) % q->length;
+    }
+    memcpy(q->storage + slot * q->itemSize, item, q->itemSize);
+  }
+  q->count++;
+  unlockKernel(true);
+  return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+  return send(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks) {
+  return send(queue, item, ticks, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks) {
+  lockKernel();
+  if (!block(ticks, [q] { return q->count > 0; })) {
+    unlockKernel(false);
+    return pdFAIL;
+  }
+  if (q->itemSize) {
+    memcpy(item, q->storage + q->head * q->itemSize, q->itemSize);
+    q->head = (q->head + 1) % q->length;
+  }
+  q->count--;
+  unlockKernel(true);
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  lockKernel();
+  const UBaseType_t count = q->count;
+  unlockKernel(false);
+  return count;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+  if (q->ownStorage)
+    free(q->storage);
+  if (q->ownQueue)
+    delete q;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  SemaphoreHandle_t sem = xQueueCreate(1, 0);
+  if (sem)
+    sem->count = 1;
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer) {
+  SemaphoreHandle_t sem = xQueueCreateStatic(1, 0, NULL, buffer);
+  sem->count = 1;
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+  return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer) {
+  return xQueueCreateStatic(1, 0, NULL, buffer);
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  host_event_group *g = new (std::nothrow) host_event_group();
+  if (g)
+    g->own = true;
+  return g;
+}
+
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t *buffer) {
+  return new (buffer) host_event_group();
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits) {
+  lockKernel();
+  g->bits |= bits;
+  const EventBits_t now = g->bits;
+  unlockKernel(true);
+  return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits) {
+  lockKernel();
+  const EventBits_t before = g->bits;
+  g->bits &= ~bits;
+  unlockKernel(false);
+  return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g) {
+  lockKernel();
+  const EventBits_t bits = g->bits;
+  unlockKernel(false);
+  return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clearOnExit,
+                                BaseType_t waitForAll, TickType_t ticks) {
+  lockKernel();
+  const bool met = block(ticks, [g, bits, waitForAll] {
+    return waitForAll ? (g->bits & bits) == bits : (g->bits & bits) != 0;
+  });
+  const EventBits_t value = g->bits;
+  if (met && clearOnExit)
+    g->bits &= ~bits;
+  unlockKernel(false);
+  return value;
+}
+
+void vEventGroupDelete(EventGroupHandle_t g) {
+  if (g->own)
+    delete g;
+}
+
+void spinlock_initialize(spinlock_t *lock) {
+  lock->owner = 0;
+  lock->count = 0;
+}
+
+bool spinlock_acquire(spinlock_t *lock, int32_t timeout) {
+  pthread_mutex_lock(&critical);
+  lock->count++;
+  return true;
+}
+
+void spinlock_release(spinlock_t *lock) {
+  lock->count--;
+  pthread_mutex_unlock(&critical);
+}
+
+} // extern "C"
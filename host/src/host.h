@@ -0,0 +1,60 @@
+#ifndef HOST_H
+#define HOST_H
+
+/* What the host's stand-ins for ESP-IDF share: the command line, and the simulated world the
+   firmware's pins are wired to. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_sleep.h"
+#include "esp_system.h"
+
+typedef struct {
+  const char *dir;          // Where flash.bin (and the RTC memory, over a sleep) is kept
+  uint8_t mac[6];
+  int8_t rssi;              // How strongly the other radios hear this one
+  uint8_t loss;             // Percentage of the frames heard that are lost
+  uint16_t port;            // Of the simulated ESP-NOW medium
+  uint16_t medium;          // Frames are sent to a relay on this port (tools/fleet-host.py), if not 0
+  float sleepScale;         // Sleeps are this fraction of the time asked for
+  float slowdown;           // The chip's clock runs this many times slower than real time
+  int wakes;                // Exit, rather than sleep, after this many boots (0 for never)
+  bool flash;               // Write this program's image to app0 at power on, as `idf.py flash`
+} host_options_t;
+
+extern host_options_t hostOptions;
+
+// Kept over every reset, as the world outside the chip is
+#define HOST_WORLD_ATTR __attribute__((section("host_world")))
+
+typedef struct {
+  bool started;             // The rest has been set from the command line
+  esp_reset_reason_t reset;
+  esp_sleep_wakeup_cause_t wakeCause;
+  uint32_t boots;
+  double simSecs;           // Since power on, counting the whole of each sleep
+  float valve;              // Physical position, 0 (closed) to 100
+  float room;               // °C
+  float batteryMv;          // Resting
+  bool charging;
+  bool wiringReversed;      // The motor opens the valve when MOTOR != this
+  bool touchAtBoot;         // Held for the first part of the boot (a touch wake, or --touch)
+} host_world_t;
+
+extern host_world_t hostWorld;
+
+// Deep sleep and restart, and the RTC memory that's kept over them (system.cpp)
+void hostBoot(int argc, char **argv);
+int64_t hostRealUs(int64_t us);     // A time on the chip's clock, in real time (see --slowdown)
+// The model of what's outside the chip (plant.cpp). SIGUSR1 touches the pad.
+void plantStart(void);
+void plantAdvance(double secs);     // Over a sleep, with the motor off
+float plantRoom(void);
+int64_t plantMotorUs(void);        // The motor has run this boot
+bool plantTouched(void);
+bool plantWaitForTouch(int64_t us); // Sleeps until a touch, or for `us` (forever if < 0)
+// The flash, with the partitions of ../../partitions.csv, and the bootloader's choice of app (flash.cpp)
+void flashBoot(void);
+
+#endif
@@ -0,0 +1,130 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host.h"
+
+/* The firmware, run as a Linux process: a TRV with its valve, battery and room simulated (plant.cpp)
+   and its radio on the simulated ESP-NOW medium (main/net/udp-transport.hpp). A reset or a wake from
+   deep sleep restarts the process, keeping what the chip would (system.cpp), and the flash is kept
+   in a file (flash.cpp), so a TRV's state lasts as long as its --dir.
+
+   Run tools/now-hub.py on the same --port for a hub to pair with.
+*/
+
+extern "C" void app_main(void);
+
+host_options_t hostOptions = {
+  .dir = ".",
+  .mac = {0x02, 0x00, 0x00, 0x00, 0x01, 0x01},
+  .rssi = -60,
+  .loss = 0,
+  .port = 5557,
+  .medium = 0,
+  .sleepScale = 1,
+  .slowdown = 1,
+  .wakes = 0,
+  .flash = false,
+};
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --dir DIR            where flash.bin and the RTC memory are kept (.)\n"
+          "  --mac MAC            of the radio (02:00:00:00:01:01)\n"
+          "  --rssi DBM           how strongly the others hear this TRV (-60)\n"
+          "  --loss PERCENT       of the frames it hears that are lost (0)\n"
+          "  --port PORT          of the simulated ESP-NOW medium (5557)\n"
+          "  --medium PORT        send to a relay on this port, which passes on what survives (0: none)\n"
+          "  --sleep-scale F      sleep for this fraction of the time asked for (1)\n"
+          "  --slowdown F         run the chip's clock F times slower than real time (1)\n"
+          "  --wakes N            exit, rather than sleep, after N boots\n"
+          "  --flash              write this program to app0 at power on, as `idf.py flash`\n"
+          "At power on:\n"
+          "  --room C             the room's temperature (18)\n"
+          "  --battery MV         the battery's voltage (4000)\n"
+          "  --charging           on the charger\n"
+          "  --valve PERCENT      how open the valve is (0)\n"
+          "  --forward-wiring     the motor opens the valve when MOTOR is high\n"
+          "  --touch              the pad is held as it powers on\n"
+          "SIGUSR1 touches the pad.\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  enum { DIR = 256, MAC, RSSI, LOSS, PORT, MEDIUM, SLEEP_SCALE, SLOWDOWN, WAKES, FLASH, ROOM, BATTERY, CHARGING, VALVE, FORWARD, TOUCH };
+  static const struct option options[] = {
+    {"dir", required_argument, NULL, DIR},
+    {"mac", required_argument, NULL, MAC},
+    {"rssi", required_argument, NULL, RSSI},
+    {"loss", required_argument, NULL, LOSS},
+    {"port", required_argument, NULL, PORT},
+    {"medium", required_argument, NULL, MEDIUM},
+    {"sleep-scale", required_argument, NULL, SLEEP_SCALE},
+    {"slowdown", required_argument, NULL, SLOWDOWN},
+    {"wakes", required_argument, NULL, WAKES},
+    {"flash", no_argument, NULL, FLASH},
+    {"room", required_argument, NULL, ROOM},
+    {"battery", required_argument, NULL, BATTERY},
+    {"charging", no_argument, NULL, CHARGING},
+    {"valve", required_argument, NULL, VALVE},
+    {"forward-wiring", no_argument, NULL, FORWARD},
+    {"touch", no_argument, NULL, TOUCH},
+    {NULL, 0, NULL, 0},
+  };
+  host_world_t world = {};
+  world.room = 18;
+  world.batteryMv = 4000;
+  world.wiringReversed = true; // As the default motor config (trv-state.cpp) has it
+
+  // getopt_long() may reorder argv, and a reset runs the program again with the original
+  char **bootArgv = (char **)calloc(argc + 1, sizeof(char *));
+  memcpy(bootArgv, argv, argc * sizeof(char *));
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case DIR: hostOptions.dir = optarg; break;
+    case MAC:
+      if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &hostOptions.mac[0], &hostOptions.mac[1],
+                 &hostOptions.mac[2], &hostOptions.mac[3], &hostOptions.mac[4], &hostOptions.mac[5]) != 6)
+        usage(argv[0]);
+      break;
+    case RSSI: hostOptions.rssi = atoi(optarg); break;
+    case LOSS: hostOptions.loss = atoi(optarg); break;
+    case PORT: hostOptions.port = atoi(optarg); break;
+    case MEDIUM: hostOptions.medium = atoi(optarg); break;
+    case SLEEP_SCALE: hostOptions.sleepScale = atof(optarg); break;
+    case SLOWDOWN: hostOptions.slowdown = atof(optarg); break;
+    case WAKES: hostOptions.wakes = atoi(optarg); break;
+    case FLASH: hostOptions.flash = true; break;
+    case ROOM: world.room = atof(optarg); break;
+    case BATTERY: world.batteryMv = atof(optarg); break;
+    case CHARGING: world.charging = true; break;
+    case VALVE: world.valve = atof(optarg); break;
+    case FORWARD: world.wiringReversed = false; break;
+    case TOUCH: world.touchAtBoot = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || hostOptions.slowdown <= 0)
+    usage(argv[0]);
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  hostBoot(argc, bootArgv);
+  if (!hostWorld.started) {
+    world.started = true;
+    world.reset = hostWorld.reset;
+    world.boots = hostWorld.boots;
+    hostWorld = world;
+  }
+  flashBoot();
+  plantStart();
+  app_main();
+  vTaskDelete(NULL); // As IDF's main task, leaving the others running
+  return 0;
+}
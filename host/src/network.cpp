@@ -0,0 +1,419 @@
+#include <pthread.h>
+#include <string.h>
+
+#include <vector>
+
+#include "esp_event.h"
+#include "esp_http_client.h"
+#include "esp_http_server.h"
+#include "esp_https_ota.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+
+/* What's behind Wi-Fi on the chip, as the host has it: the event loop, and interfaces that never
+   carry anything (see esp_wifi.h). */
+
+#define WIFI_REASON_NO_AP_FOUND 201
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+// Events
+
+struct handler_t {
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void *arg;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<handler_t *> handlers;
+static bool loopCreated;
+
+esp_err_t esp_event_loop_create_default() {
+  pthread_mutex_lock(&lock);
+  const bool created = loopCreated;
+  loopCreated = true;
+  pthread_mutex_unlock(&lock);
+  return created ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id,
+                                              esp_event_handler_t event_handler, void *event_handler_arg,
+                                              esp_event_handler_instance_t *instance) {
+  if (!event_handler)
+    return ESP_ERR_INVALID_ARG;
+  auto *h = new handler_t{event_base, event_id, event_handler, event_handler_arg};
+  pthread_mutex_lock(&lock);
+  handlers.push_back(h);
+  pthread_mutex_unlock(&lock);
+  if (instance)
+    *instance = h;
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_unregister(esp_event_base_t event_base, int32_t event_id,
+                                                esp_event_handler_instance_t instance) {
+  pthread_mutex_lock(&lock);
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  for (auto it = handlers.begin(); it != handlers.end(); ++it) {
+    if (*it == instance && (*it)->base == event_base && (*it)->id == event_id) {
+      delete *it;
+      handlers.erase(it);
+      err = ESP_OK;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base, int32_t event_id,
+                                     esp_event_handler_t event_handler, void *event_handler_arg) {
+  return esp_event_handler_instance_register(event_base, event_id, event_handler, event_handler_arg, NULL);
+}
+
+esp_err_t esp_event_handler_unregister(esp_event_base_t event_base, int32_t event_id,
+                                       esp_event_handler_t event_handler) {
+  pthread_mutex_lock(&lock);
+  for (auto it = handlers.begin(); it != handlers.end(); ++it) {
+    if ((*it)->handler == event_handler && (*it)->base == event_base && (*it)->id == event_id) {
+      delete *it;
+      handlers.erase(it);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data,
+                         size_t event_data_size, uint32_t ticks_to_wait) {
+  pthread_mutex_lock(&lock);
+  if (!loopCreated) {
+    pthread_mutex_unlock(&lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  std::vector<handler_t> matching;
+  for (const auto *h : handlers) {
+    if (h->base == event_base && (h->id == ESP_EVENT_ANY_ID || h->id == event_id))
+      matching.push_back(*h);
+  }
+  pthread_mutex_unlock(&lock);
+  // The data is copied, as the loop's queue would
+  std::vector<uint8_t> data((const uint8_t *)event_data, (const uint8_t *)event_data + event_data_size);
+  for (const auto &h : matching)
+    h.handler(h.arg, event_base, event_id, event_data ? data.data() : NULL);
+  return ESP_OK;
+}
+
+// Wi-Fi
+
+static bool wifiInited;
+static wifi_mode_t wifiMode = WIFI_MODE_NULL;
+static bool wifiStarted;
+static uint8_t channel = 1;
+static wifi_config_t configs[2];
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+  wifiInited = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_deinit() {
+  if (wifiStarted)
+    return ESP_ERR_INVALID_STATE;
+  wifiInited = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+  if (!wifiInited)
+    return ESP_ERR_INVALID_STATE;
+  wifiMode = mode;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf) {
+  if (!wifiInited)
+    return ESP_ERR_INVALID_STATE;
+  if (!conf || (interface != WIFI_IF_STA && interface != WIFI_IF_AP))
+    return ESP_ERR_INVALID_ARG;
+  configs[interface] = *conf;
+  if (interface == WIFI_IF_AP && conf->ap.channel)
+    channel = conf->ap.channel;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage) {
+  return wifiInited ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_wifi_set_country(const wifi_country_t *country) {
+  return wifiInited ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second) {
+  if (!wifiInited)
+    return ESP_ERR_INVALID_STATE;
+  if (primary < 1 || primary > 13)
+    return ESP_ERR_INVALID_ARG;
+  channel = primary;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second) {
+  if (!wifiInited)
+    return ESP_ERR_INVALID_STATE;
+  *primary = channel;
+  *second = WIFI_SECOND_CHAN_NONE;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_start() {
+  if (!wifiInited)
+    return ESP_ERR_INVALID_STATE;
+  wifiStarted = true;
+  if (wifiMode == WIFI_MODE_STA || wifiMode == WIFI_MODE_APSTA)
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, 0);
+  if (wifiMode == WIFI_MODE_AP || wifiMode == WIFI_MODE_APSTA)
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_AP_START, NULL, 0, 0);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop() {
+  if (!wifiInited)
+    return ESP_ERR_INVALID_STATE;
+  if (wifiStarted) {
+    wifiStarted = false;
+    if (wifiMode == WIFI_MODE_STA || wifiMode == WIFI_MODE_APSTA)
+      esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_STOP, NULL, 0, 0);
+    if (wifiMode == WIFI_MODE_AP || wifiMode == WIFI_MODE_APSTA)
+      esp_event_post(WIFI_EVENT, WIFI_EVENT_AP_STOP, NULL, 0, 0);
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect() {
+  if (!wifiStarted || (wifiMode != WIFI_MODE_STA && wifiMode != WIFI_MODE_APSTA))
+    return ESP_ERR_INVALID_STATE;
+  wifi_event_sta_disconnected_t event = {};
+  const auto &sta = configs[WIFI_IF_STA].sta;
+  event.ssid_len = strnlen((const char *)sta.ssid, sizeof(sta.ssid));
+  memcpy(event.ssid, sta.ssid, event.ssid_len);
+  event.reason = WIFI_REASON_NO_AP_FOUND;
+  esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event, sizeof(event), 0);
+  return ESP_OK;
+}
+
+// Interfaces
+
+struct esp_netif_obj {
+  const char *key;
+  esp_netif_ip_info_t ip;
+};
+
+static esp_netif_t *netifs[2];
+
+esp_err_t esp_netif_init() {
+  return ESP_OK;
+}
+
+static esp_netif_t *createNetif(int i, const char *key, esp_netif_ip_info_t ip) {
+  if (netifs[i])
+    return NULL; // As IDF, which refuses a second interface with the same key
+  netifs[i] = new esp_netif_obj{key, ip};
+  return netifs[i];
+}
+
+esp_netif_t *esp_netif_create_default_wifi_ap() {
+  return createNetif(1, "WIFI_AP_DEF", {ESP_IP4TOADDR(192, 168, 4, 1), ESP_IP4TOADDR(255, 255, 255, 0),
+                                        ESP_IP4TOADDR(192, 168, 4, 1)});
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta() {
+  return createNetif(0, "WIFI_STA_DEF", {});
+}
+
+void esp_netif_destroy(esp_netif_t *esp_netif) {
+  for (auto &n : netifs) {
+    if (n && n == esp_netif) {
+      delete n;
+      n = NULL;
+    }
+  }
+}
+
+void esp_netif_destroy_default_wifi(void *esp_netif) {
+  esp_netif_destroy((esp_netif_t *)esp_netif);
+}
+
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *if_key) {
+  for (auto *n : netifs) {
+    if (n && !strcmp(n->key, if_key))
+      return n;
+  }
+  return NULL;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info) {
+  if (!esp_netif || !ip_info)
+    return ESP_ERR_INVALID_ARG;
+  *ip_info = esp_netif->ip;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_set_hostname(esp_netif_t *esp_netif, const char *hostname) {
+  return esp_netif ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_netif_dhcps_start(esp_netif_t *esp_netif) {
+  return esp_netif ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_netif_dhcps_stop(esp_netif_t *esp_netif) {
+  return esp_netif ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_netif_dhcps_option(esp_netif_t *esp_netif, esp_netif_dhcp_option_mode_t opt_op,
+                                 esp_netif_dhcp_option_id_t opt_id, void *opt_val, uint32_t opt_len) {
+  return esp_netif ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// HTTP client, and OTA over it
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config) {
+  return NULL;
+}
+
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client) {
+  return ESP_FAIL;
+}
+
+int esp_http_client_read_response(esp_http_client_handle_t client, char *buffer, int len) {
+  return ESP_FAIL;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+  return -1;
+}
+
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client) {
+  return -1;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_http_client_set_redirection(esp_http_client_handle_t client) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_https_ota(const esp_https_ota_config_t *ota_config) {
+  return ESP_FAIL;
+}
+
+// HTTP server
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_register_err_handler(httpd_handle_t handle, httpd_err_code_t error,
+                                     httpd_err_handler_func_t handler_fn) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+// As IDF's: a trailing '*' matches any rest, and a '?' before it makes the last character optional
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto) {
+  const size_t tpl_len = strlen(uri_template);
+  size_t exact_match_chars = tpl_len;
+  const char *asterisk = strrchr(uri_template, '*');
+  const char *question = strrchr(uri_template, '?');
+  const bool asterisk_end = asterisk && asterisk + 1 == uri_template + tpl_len;
+  const bool question_end = question && (question + 1 == uri_template + tpl_len || (asterisk_end && question + 2 == uri_template + tpl_len));
+  if (asterisk_end)
+    exact_match_chars--;
+  if (question_end) {
+    exact_match_chars--;
+    // The character before '?' is optional
+    if (exact_match_chars > 0)
+      exact_match_chars--;
+  }
+  if (match_upto < exact_match_chars || strncmp(uri_template, uri_to_match, exact_match_chars))
+    return false;
+  if (question_end) {
+    const char optional = uri_template[exact_match_chars];
+    if (match_upto > exact_match_chars && uri_to_match[exact_match_chars] == optional)
+      exact_match_chars++;
+    else if (!asterisk_end && match_upto != exact_match_chars)
+      return false;
+  }
+  return asterisk_end || match_upto == exact_match_chars;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+  return HTTPD_SOCK_ERR_INVALID;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size) {
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+  return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value) {
+  return ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,320 @@
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "driver/rmt_rx.h"
+#include "driver/rmt_tx.h"
+#include "esp_timer.h"
+#include "host.h"
+
+/* The RMT channels DallasOneWire drives its 1-Wire bus with, and the DS18B20 on the end of it.
+
+   The transmit channel's symbols are decoded into bus slots by their low time, as a slave sees them:
+   a reset pulse, a write-0, or a write-1 (which is also how the master starts a read slot). What the
+   receive channel records is the bus itself (the TX pin is looped back to it), so a slot the sensor
+   holds low to send a 0 comes back with a long low time, and a reset comes back with its presence
+   pulse. The receive-done callback runs at the end of the transmit that completes the waveform, as
+   the RMT interrupt would.
+
+   The sensor understands SKIP ROM and the scratchpad and conversion commands DallasOneWire uses. A
+   conversion takes as long as the real one for the configured resolution, and reads the room
+   temperature of the host's model.
+*/
+
+#define SLOT_0_MIN_US 15              // A longer low time than this is a write-0
+#define RESET_MIN_US 400
+#define PRESENCE_WAIT_US 30           // After the reset pulse, until the sensor pulls the bus low
+#define PRESENCE_US 120
+#define READ_0_LOW_US 60              // A 0 bit, as the sensor holds the bus low for it
+#define READ_0_HIGH_US 10
+
+#define OW_SKIP_ROM 0xCC
+#define DS18B20_CONVERT_T 0x44
+#define DS18B20_WRITE_SCRATCHPAD 0x4E
+#define DS18B20_READ_SCRATCHPAD 0xBE
+#define DS18B20_COPY_SCRATCHPAD 0x48
+#define DS18B20_RECALL_EE 0xB8
+#define DS18B20_READ_POWER_SUPPLY 0xB4
+
+struct rmt_channel_t {
+  bool rx;
+  int gpio;
+  bool enabled;
+  // Receive channels only
+  rmt_rx_done_callback_t done;
+  void *ctx;
+  rmt_symbol_word_t *buffer;
+  size_t capacity;        // In symbols
+  size_t received;
+  bool armed;
+};
+
+struct rmt_encoder_t {
+  bool bytes;             // Otherwise a copy encoder
+  rmt_symbol_word_t bit0, bit1;
+  bool msbFirst;
+};
+
+enum sensor_state_t {
+  SENSOR_IDLE,            // Until a reset
+  SENSOR_ROM_COMMAND,
+  SENSOR_FUNCTION_COMMAND,
+  SENSOR_WRITING,         // The master is writing the scratchpad
+  SENSOR_READING,         // The master reads: the scratchpad, or whether the conversion is done
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static rmt_channel_t *receiver;
+
+static struct {
+  sensor_state_t state;
+  uint8_t in;             // The byte being written by the master
+  int inBits;
+  uint8_t scratchpad[9];
+  int written;            // Scratchpad bytes written
+  const uint8_t *out;     // Bytes being read by the master
+  int outBits;            // Left to send
+  int outPos;
+  int64_t convertedAt;    // When the conversion finishes
+  bool converting;
+} sensor = {
+  .state = SENSOR_IDLE,
+  // As at power on: 85°C, TH 75, TL 70, 12 bits
+  .scratchpad = {0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10, 0x00},
+};
+
+static uint8_t crc8(const uint8_t *data, int len) {
+  uint8_t crc = 0;
+  while (len--) {
+    uint8_t b = *data++;
+    for (int i = 0; i < 8; i++) {
+      const bool mix = (crc ^ b) & 1;
+      crc >>= 1;
+      if (mix)
+        crc ^= 0x8C;
+      b >>= 1;
+    }
+  }
+  return crc;
+}
+
+static void finishConversion() {
+  if (!sensor.converting || esp_timer_get_time() < sensor.convertedAt)
+    return;
+  sensor.converting = false;
+  // The resolution's unused low bits read as 0
+  const int res = (sensor.scratchpad[4] >> 5) & 3;
+  int16_t t = (int16_t)lroundf(plantRoom() * 16);
+  t &= ~((1 << (3 - res)) - 1);
+  sensor.scratchpad[0] = (uint8_t)t;
+  sensor.scratchpad[1] = (uint8_t)(t >> 8);
+  sensor.scratchpad[8] = crc8(sensor.scratchpad, 8);
+}
+
+static void command(uint8_t cmd) {
+  if (sensor.state == SENSOR_ROM_COMMAND) {
+    // There's only one sensor on the bus, so ROM searches aren't answered
+    sensor.state = cmd == OW_SKIP_ROM ? SENSOR_FUNCTION_COMMAND : SENSOR_IDLE;
+    return;
+  }
+  if (sensor.state == SENSOR_WRITING) {
+    sensor.scratchpad[2 + sensor.written++] = cmd;
+    if (sensor.written == 3) {
+      sensor.scratchpad[8] = crc8(sensor.scratchpad, 8);
+      sensor.state = SENSOR_IDLE;
+    }
+    return;
+  }
+  switch (cmd) {
+  case DS18B20_CONVERT_T:
+    sensor.converting = true;
+    sensor.convertedAt = esp_timer_get_time() + (93750 << ((sensor.scratchpad[4] >> 5) & 3));
+    sensor.outBits = 0;
+    sensor.state = SENSOR_READING;
+    break;
+  case DS18B20_WRITE_SCRATCHPAD:
+    sensor.written = 0;
+    sensor.state = SENSOR_WRITING;
+    break;
+  case DS18B20_READ_SCRATCHPAD:
+    finishConversion();
+    sensor.out = sensor.scratchpad;
+    sensor.outBits = 8 * sizeof(sensor.scratchpad);
+    sensor.outPos = 0;
+    sensor.state = SENSOR_READING;
+    break;
+  default: // Copying to, and recalling from, the EEPROM are instant
+    sensor.outBits = 0;
+    sensor.state = SENSOR_READING;
+    break;
+  }
+}
+
+// The bit the sensor puts on the bus in a read slot
+static bool readBit() {
+  if (sensor.converting) {
+    finishConversion();
+    return !sensor.converting;
+  }
+  if (sensor.outBits <= 0)
+    return true; // The bus is released
+  const bool bit = sensor.out[sensor.outPos / 8] & (1 << (sensor.outPos % 8));
+  sensor.outPos++;
+  sensor.outBits--;
+  return bit;
+}
+
+static void record(uint32_t low, uint32_t high) {
+  if (!receiver || !receiver->armed || receiver->received >= receiver->capacity)
+    return;
+  rmt_symbol_word_t &s = receiver->buffer[receiver->received++];
+  s.level0 = 1;
+  s.duration0 = low;
+  s.level1 = 0;
+  s.duration1 = high;
+}
+
+// A symbol from the master, as a slot on the bus
+static void slot(const rmt_symbol_word_t &s) {
+  const uint32_t low = s.level0 ? s.duration0 : s.duration1;
+  if (low >= RESET_MIN_US) {
+    sensor.state = SENSOR_ROM_COMMAND;
+    sensor.inBits = 0;
+    record(low, PRESENCE_WAIT_US);
+    record(PRESENCE_US, 0);
+    return;
+  }
+  const bool one = low < SLOT_0_MIN_US;
+  if (sensor.state == SENSOR_READING && one && !readBit()) {
+    record(READ_0_LOW_US, READ_0_HIGH_US);
+    return;
+  }
+  record(low, s.duration1);
+  if (sensor.state == SENSOR_ROM_COMMAND || sensor.state == SENSOR_FUNCTION_COMMAND
+      || sensor.state == SENSOR_WRITING) {
+    sensor.in = (uint8_t)((sensor.in >> 1) | (one ? 0x80 : 0));
+    if (++sensor.inBits == 8) {
+      sensor.inBits = 0;
+      command(sensor.in);
+    }
+  }
+}
+
+esp_err_t rmt_new_rx_channel(const rmt_rx_channel_config_t *config, rmt_channel_handle_t *ret_chan) {
+  pthread_mutex_lock(&lock);
+  const bool busy = receiver != NULL;
+  if (!busy)
+    receiver = *ret_chan = new rmt_channel_t{.rx = true, .gpio = config->gpio_num};
+  pthread_mutex_unlock(&lock);
+  return busy ? ESP_ERR_NOT_FOUND : ESP_OK; // As when the chip's channels are all in use
+}
+
+esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *ret_chan) {
+  *ret_chan = new rmt_channel_t{.rx = false, .gpio = config->gpio_num};
+  return ESP_OK;
+}
+
+esp_err_t rmt_rx_register_event_callbacks(rmt_channel_handle_t rx_channel, const rmt_rx_event_callbacks_t *cbs,
+                                          void *user_data) {
+  if (!rx_channel || !rx_channel->rx || rx_channel->enabled)
+    return ESP_ERR_INVALID_STATE;
+  rx_channel->done = cbs->on_recv_done;
+  rx_channel->ctx = user_data;
+  return ESP_OK;
+}
+
+esp_err_t rmt_enable(rmt_channel_handle_t channel) {
+  if (!channel || channel->enabled)
+    return ESP_ERR_INVALID_STATE;
+  channel->enabled = true;
+  return ESP_OK;
+}
+
+esp_err_t rmt_disable(rmt_channel_handle_t channel) {
+  if (!channel || !channel->enabled)
+    return ESP_ERR_INVALID_STATE;
+  channel->enabled = false;
+  channel->armed = false;
+  return ESP_OK;
+}
+
+esp_err_t rmt_del_channel(rmt_channel_handle_t channel) {
+  if (!channel || channel->enabled)
+    return ESP_ERR_INVALID_STATE;
+  pthread_mutex_lock(&lock);
+  if (channel == receiver)
+    receiver = NULL;
+  pthread_mutex_unlock(&lock);
+  delete channel;
+  return ESP_OK;
+}
+
+esp_err_t rmt_receive(rmt_channel_handle_t rx_channel, void *buffer, size_t buffer_size,
+                      const rmt_receive_config_t *config) {
+  if (!rx_channel || !rx_channel->rx || !rx_channel->enabled)
+    return ESP_ERR_INVALID_STATE;
+  pthread_mutex_lock(&lock);
+  rx_channel->buffer = (rmt_symbol_word_t *)buffer;
+  rx_channel->capacity = buffer_size / sizeof(rmt_symbol_word_t);
+  rx_channel->received = 0;
+  rx_channel->armed = true;
+  pthread_mutex_unlock(&lock);
+  return ESP_OK;
+}
+
+esp_err_t rmt_new_copy_encoder(const rmt_copy_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder) {
+  *ret_encoder = new rmt_encoder_t{.bytes = false};
+  return ESP_OK;
+}
+
+esp_err_t rmt_new_bytes_encoder(const rmt_bytes_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder) {
+  *ret_encoder = new rmt_encoder_t{.bytes = true, .bit0 = config->bit0, .bit1 = config->bit1,
+                                   .msbFirst = config->flags.msb_first != 0};
+  return ESP_OK;
+}
+
+esp_err_t rmt_del_encoder(rmt_encoder_handle_t encoder) {
+  delete encoder;
+  return ESP_OK;
+}
+
+esp_err_t rmt_transmit(rmt_channel_handle_t tx_channel, rmt_encoder_handle_t encoder, const void *payload,
+                       size_t payload_bytes, const rmt_transmit_config_t *config) {
+  if (!tx_channel || tx_channel->rx || !tx_channel->enabled || !encoder)
+    return ESP_ERR_INVALID_STATE;
+  pthread_mutex_lock(&lock);
+  const bool looped = receiver && receiver->gpio == tx_channel->gpio;
+  if (encoder->bytes) {
+    const uint8_t *bytes = (const uint8_t *)payload;
+    for (size_t i = 0; i < payload_bytes * 8; i++) {
+      const int bit = encoder->msbFirst ? 7 - i % 8 : i % 8;
+      const bool one = bytes[i / 8] & (1 << bit);
+      if (looped)
+        slot(one ? encoder->bit1 : encoder->bit0);
+    }
+  } else if (looped) {
+    const rmt_symbol_word_t *symbols = (const rmt_symbol_word_t *)payload;
+    for (size_t i = 0; i < payload_bytes / sizeof(rmt_symbol_word_t); i++)
+      slot(symbols[i]);
+  }
+
+  // The bus idles high at the end, which ends the reception
+  rmt_channel_t *done = looped && receiver->armed ? receiver : NULL;
+  rmt_rx_done_event_data_t event = {};
+  if (done) {
+    done->armed = false;
+    if (done->received)
+      done->buffer[done->received - 1].duration1 = 0;
+    event.received_symbols = done->buffer;
+    event.num_symbols = done->received;
+    event.flags.is_last = 1;
+  }
+  pthread_mutex_unlock(&lock);
+  if (done && done->done)
+    done->done(done, &event, done->ctx);
+  return ESP_OK;
+}
+
+esp_err_t rmt_tx_wait_all_done(rmt_channel_handle_t tx_channel, int timeout_ms) {
+  return tx_channel && tx_channel->enabled ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
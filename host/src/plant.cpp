@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "driver/gpio.h"
+#include "driver/temperature_sensor.h"
+#include "esp_adc/adc_oneshot.h"
+#include "esp_timer.h"
+#include "host.h"
+#include "pins.h"
+
+/* What the TRV's pins are wired to: a valve driven by the motor, the battery it runs from (sagging
+   across the shunt as the motor draws current), the touch pad, and the room the valve heats.
+
+   The motor draws an in-rush current as it starts, less while it runs, and stalls at either end of
+   the valve's travel. MotorController finds the end stops from that, through the battery's ADC
+   readings, so the figures here are the ones it's tuned for (see the comment in MotorController.cpp).
+*/
+
+#define VALVE_SECS 10.0f          // End to end
+#define INRUSH_US 150000
+#define INRUSH_MV 250             // Across the shunt, as the motor starts
+#define RUNNING_MV 120
+#define STALLED_MV 240
+#define NOISE_MV 3
+#define ADC_FULL_SCALE_MV 3300    // At ADC_ATTEN_DB_12
+#define ADC_MAX 4095
+#define TOUCHED_RAW 3000
+#define UNTOUCHED_RAW 100
+#define TOUCH_HOLD_US 2000000     // A touch (or the one that woke us) is held this long
+#define DIE_ABOVE_ROOM 10.0f
+
+// The room: heat lost to outside, and gained from the radiator in proportion to the valve opening
+#define OUTSIDE_C 8.0f
+#define FLOW_C 60.0f
+#define LOSS_PER_SEC (1.0f / (3 * 3600))
+#define HEAT_PER_SEC (0.44f * LOSS_PER_SEC)
+#define ROOM_STEP_SECS 60.0
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool output[GPIO_NUM_MAX];
+static uint32_t level[GPIO_NUM_MAX];
+static int motorDir = 0;          // Of the valve: 1 opening, -1 closing
+static int64_t motorStart = 0;
+static int64_t lastUpdate = 0;
+static int64_t motorUs = 0;       // This boot
+static unsigned int noiseSeed = 1;
+static volatile int64_t lastTouch = -1;
+static int touchPipe[2] = {-1, -1};
+
+static void stepRoom(double secs) {
+  auto &w = hostWorld;
+  w.room += secs * ((w.valve / 100) * HEAT_PER_SEC * (FLOW_C - w.room) - LOSS_PER_SEC * (w.room - OUTSIDE_C));
+  w.simSecs += secs;
+}
+
+// Brings the model up to now. Must be called with the lock held.
+static int64_t update() {
+  const int64_t now = esp_timer_get_time();
+  const double secs = (now - lastUpdate) / 1e6;
+  if (motorDir)
+    motorUs += now - lastUpdate;
+  lastUpdate = now;
+  if (motorDir) {
+    hostWorld.valve += motorDir * secs * 100 / VALVE_SECS;
+    if (hostWorld.valve < 0)
+      hostWorld.valve = 0;
+    if (hostWorld.valve > 100)
+      hostWorld.valve = 100;
+  }
+  stepRoom(secs);
+  return now;
+}
+
+static int valveDir() {
+  if (!output[NSLEEP] || !level[NSLEEP])
+    return 0;
+  return (level[MOTOR] != 0) != hostWorld.wiringReversed ? 1 : -1;
+}
+
+static void motorChanged(int64_t now) {
+  const int dir = valveDir();
+  if (dir != motorDir) {
+    motorDir = dir;
+    motorStart = now;
+  }
+}
+
+// Across the shunt, so the battery reads this much lower
+static int shuntMv(int64_t now) {
+  if (!motorDir)
+    return 0;
+  int mv = RUNNING_MV;
+  if (now - motorStart < INRUSH_US)
+    mv = INRUSH_MV;
+  else if ((motorDir > 0 && hostWorld.valve >= 100) || (motorDir < 0 && hostWorld.valve <= 0))
+    mv = STALLED_MV;
+  return mv + rand_r(&noiseSeed) % (2 * NOISE_MV + 1) - NOISE_MV;
+}
+
+static void touched(int) {
+  const int saved = errno;
+  lastTouch = esp_timer_get_time();
+  if (write(touchPipe[1], "t", 1) < 0) {
+    // The pipe is full of touches already
+  }
+  errno = saved;
+}
+
+void plantStart() {
+  noiseSeed = (unsigned int)hostWorld.boots;
+  if (pipe2(touchPipe, O_NONBLOCK) != 0)
+    abort();
+  struct sigaction sa = {};
+  sa.sa_handler = touched;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  pthread_mutex_lock(&lock);
+  lastUpdate = esp_timer_get_time();
+  pthread_mutex_unlock(&lock);
+}
+
+void plantAdvance(double secs) {
+  pthread_mutex_lock(&lock);
+  update();
+  for (; secs > 0; secs -= ROOM_STEP_SECS)
+    stepRoom(secs < ROOM_STEP_SECS ? secs : ROOM_STEP_SECS);
+  pthread_mutex_unlock(&lock);
+}
+
+float plantRoom() {
+  pthread_mutex_lock(&lock);
+  update();
+  const float room = hostWorld.room;
+  pthread_mutex_unlock(&lock);
+  return room;
+}
+
+int64_t plantMotorUs() {
+  pthread_mutex_lock(&lock);
+  update();
+  const int64_t us = motorUs;
+  pthread_mutex_unlock(&lock);
+  return us;
+}
+
+bool plantTouched() {
+  const int64_t now = esp_timer_get_time();
+  const int64_t touch = lastTouch;
+  return (hostWorld.touchAtBoot && now < TOUCH_HOLD_US) || (touch >= 0 && now - touch < TOUCH_HOLD_US);
+}
+
+bool plantWaitForTouch(int64_t us) {
+  char drain[16];
+  while (read(touchPipe[0], drain, sizeof(drain)) > 0) {
+  }
+  const int64_t until = esp_timer_get_time() + us;
+  while (true) {
+    struct pollfd fd = {.fd = touchPipe[0], .events = POLLIN, .revents = 0};
+    const int64_t left = hostRealUs(until - esp_timer_get_time());
+    if (us >= 0 && left <= 0)
+      return false;
+    struct timespec timeout = {.tv_sec = (time_t)(left / 1000000), .tv_nsec = (long)(left % 1000000) * 1000};
+    const int r = ppoll(&fd, 1, us < 0 ? NULL : &timeout, NULL);
+    if (r >= 0 || errno != EINTR) // The signal interrupts it, and then the pipe is ready
+      return r > 0;
+  }
+}
+
+// GPIO
+
+esp_err_t gpio_config(const gpio_config_t *config) {
+  pthread_mutex_lock(&lock);
+  const int64_t now = update();
+  for (int pin = 0; pin < GPIO_NUM_MAX; pin++) {
+    if (config->pin_bit_mask & (1ULL << pin))
+      output[pin] = (config->mode & GPIO_MODE_OUTPUT) != 0;
+  }
+  motorChanged(now);
+  pthread_mutex_unlock(&lock);
+  return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t pin) {
+  if (pin < 0 || pin >= GPIO_NUM_MAX)
+    return ESP_ERR_INVALID_ARG;
+  pthread_mutex_lock(&lock);
+  const int64_t now = update();
+  output[pin] = false;
+  level[pin] = 0;
+  motorChanged(now);
+  pthread_mutex_unlock(&lock);
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t value) {
+  if (pin < 0 || pin >= GPIO_NUM_MAX)
+    return ESP_ERR_INVALID_ARG;
+  pthread_mutex_lock(&lock);
+  const int64_t now = update();
+  level[pin] = value ? 1 : 0;
+  motorChanged(now);
+  pthread_mutex_unlock(&lock);
+  return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t pin) {
+  if (pin < 0 || pin >= GPIO_NUM_MAX)
+    return 0;
+  if (pin == CHARGING)
+    return hostWorld.charging;
+  if (pin == TOUCH_PIN)
+    return plantTouched();
+  return output[pin] ? level[pin] : 0;
+}
+
+// ADC. Raw readings are 12 bits over 0 - 3300mV, and calibration is exact.
+
+struct adc_oneshot_unit_ctx_t {
+  adc_unit_t unit;
+};
+
+static adc_oneshot_unit_ctx_t adcUnit;
+
+esp_err_t adc_oneshot_new_unit(const adc_oneshot_unit_init_cfg_t *init_config, adc_oneshot_unit_handle_t *ret_unit) {
+  adcUnit.unit = init_config->unit_id;
+  *ret_unit = &adcUnit;
+  return ESP_OK;
+}
+
+esp_err_t adc_oneshot_config_channel(adc_oneshot_unit_handle_t handle, adc_channel_t channel,
+                                     const adc_oneshot_chan_cfg_t *config) {
+  return handle && channel >= ADC_CHANNEL_0 && channel <= ADC_CHANNEL_6 ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t adc_oneshot_read(adc_oneshot_unit_handle_t handle, adc_channel_t chan, int *out_raw) {
+  if (!handle)
+    return ESP_ERR_INVALID_ARG;
+  int mv = 0;
+  if (chan == (adc_channel_t)BATTERY) {
+    // Through the divider, which halves it
+    pthread_mutex_lock(&lock);
+    const int64_t now = update();
+    mv = ((int)hostWorld.batteryMv - shuntMv(now)) / 2;
+    pthread_mutex_unlock(&lock);
+  } else if (chan == (adc_channel_t)TOUCH_PIN) {
+    *out_raw = plantTouched() ? TOUCHED_RAW : UNTOUCHED_RAW;
+    return ESP_OK;
+  }
+  const int raw = (int)lroundf((float)mv * ADC_MAX / ADC_FULL_SCALE_MV);
+  *out_raw = raw < 0 ? 0 : raw > ADC_MAX ? ADC_MAX : raw;
+  return ESP_OK;
+}
+
+struct adc_cali_scheme_t {
+  adc_atten_t atten;
+};
+
+esp_err_t adc_cali_create_scheme_curve_fitting(const adc_cali_curve_fitting_config_t *config,
+                                               adc_cali_handle_t *ret_handle) {
+  *ret_handle = new adc_cali_scheme_t{config->atten};
+  return ESP_OK;
+}
+
+esp_err_t adc_cali_raw_to_voltage(adc_cali_handle_t handle, int raw, int *voltage) {
+  if (!handle)
+    return ESP_ERR_INVALID_ARG;
+  *voltage = (int)lroundf((float)raw * ADC_FULL_SCALE_MV / ADC_MAX);
+  return ESP_OK;
+}
+
+// The die's temperature sensor
+
+struct temperature_sensor_obj_t {
+  bool enabled;
+};
+
+esp_err_t temperature_sensor_install(const temperature_sensor_config_t *tsens_config,
+                                     temperature_sensor_handle_t *ret_tsens) {
+  *ret_tsens = new temperature_sensor_obj_t{false};
+  return ESP_OK;
+}
+
+esp_err_t temperature_sensor_uninstall(temperature_sensor_handle_t tsens) {
+  delete tsens;
+  return ESP_OK;
+}
+
+esp_err_t temperature_sensor_enable(temperature_sensor_handle_t tsens) {
+  if (tsens->enabled)
+    return ESP_ERR_INVALID_STATE;
+  tsens->enabled = true;
+  return ESP_OK;
+}
+
+esp_err_t temperature_sensor_disable(temperature_sensor_handle_t tsens) {
+  if (!tsens->enabled)
+    return ESP_ERR_INVALID_STATE;
+  tsens->enabled = false;
+  return ESP_OK;
+}
+
+esp_err_t temperature_sensor_get_celsius(temperature_sensor_handle_t tsens, float *out_celsius) {
+  if (!tsens->enabled)
+    return ESP_ERR_INVALID_STATE;
+  *out_celsius = plantRoom() + DIE_ABOVE_ROOM;
+  return ESP_OK;
+}
+
+// The undocumented raw reading mcu_temp.cpp uses, which on the C6 is close to °C
+extern "C" int16_t temp_sensor_get_raw_value(bool *range_changed) {
+  if (range_changed)
+    *range_changed = false;
+  return (int16_t)lroundf(plantRoom() + DIE_ABOVE_ROOM);
+}
@@ -0,0 +1,493 @@
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_debug_helpers.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "host.h"
+#include "pins.h"
+
+/* Resets, and the RTC memory that outlives them.
+
+   A wake from deep sleep reboots the chip, so the host does the same: esp_deep_sleep_start() saves
+   the RTC memory (the rtc_data and rtc_noinit sections, see esp_attr.h) and the world outside the
+   chip (host_world) to the state directory, sleeps, and re-runs the program, which loads them again
+   before any constructor runs. esp_restart() does the same without the rtc_data section, which the
+   chip's startup code clears on any reset but a wake. The heap, the tasks, and everything else
+   start again from nothing.
+*/
+
+#define RESUME_ENV "FREEHOUSE_HOST_RESUME"
+#define MAX_SHUTDOWN_HANDLERS 5
+#define MAX_LOG_TAGS 16
+#define HEAP_BYTES (320 * 1024) // Roughly what the C6 has free after the Wi-Fi driver has started
+#define NOT_SAVED 0xFFFFFFFF
+
+extern "C" {
+extern uint8_t __start_rtc_data[], __stop_rtc_data[];
+extern uint8_t __start_rtc_noinit[], __stop_rtc_noinit[];
+extern uint8_t __start_host_world[], __stop_host_world[];
+}
+
+static const struct {
+  uint8_t *start, *stop;
+  bool overSleepOnly;
+} sections[] = {
+  {__start_rtc_data, __stop_rtc_data, true},
+  {__start_rtc_noinit, __stop_rtc_noinit, false},
+  {__start_host_world, __stop_host_world, false},
+};
+
+HOST_WORLD_ATTR host_world_t hostWorld;
+
+static struct timespec bootTime;
+static char **bootArgv;
+static shutdown_handler_t shutdownHandlers[MAX_SHUTDOWN_HANDLERS];
+static uint64_t sleepTimerUs;
+static bool sleepTimer;
+static uint64_t ext1Mask;
+
+// Before the constructors, as the chip's RTC memory is there before its startup code runs
+__attribute__((constructor(101))) static void resume() {
+  clock_gettime(CLOCK_MONOTONIC, &bootTime);
+  const char *path = getenv(RESUME_ENV);
+  if (!path)
+    return;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "host: can't resume from %s: %s\n", path, strerror(errno));
+    return;
+  }
+  for (const auto &s : sections) {
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, f) != 1)
+      break;
+    if (size == NOT_SAVED)
+      continue;
+    if (size != (uint32_t)(s.stop - s.start)) {
+      fprintf(stderr, "host: %s is from another build\n", path);
+      break;
+    }
+    if (fread(s.start, 1, size, f) != size)
+      break;
+  }
+  fclose(f);
+  unsetenv(RESUME_ENV);
+}
+
+static char *rtcPath() {
+  static char path[512];
+  snprintf(path, sizeof(path), "%s/rtc.bin", hostOptions.dir);
+  return path;
+}
+
+static void save(bool sleeping) {
+  FILE *f = fopen(rtcPath(), "wb");
+  if (!f) {
+    fprintf(stderr, "host: can't save %s: %s\n", rtcPath(), strerror(errno));
+    return;
+  }
+  for (const auto &s : sections) {
+    const uint32_t size = s.overSleepOnly && !sleeping ? NOT_SAVED : (uint32_t)(s.stop - s.start);
+    fwrite(&size, sizeof(size), 1, f);
+    if (size != NOT_SAVED)
+      fwrite(s.start, 1, size, f);
+  }
+  fclose(f);
+}
+
+// Restart the program, as the chip resets
+__attribute__((noreturn)) static void reset(esp_reset_reason_t reason) {
+  hostWorld.reset = reason;
+  save(reason == ESP_RST_DEEPSLEEP);
+  fflush(stdout);
+  fflush(stderr);
+  setenv(RESUME_ENV, rtcPath(), 1);
+  close_range(3, ~0U, 0); // Sockets included, so the next boot can bind them again
+  execv("/proc/self/exe", bootArgv);
+  fprintf(stderr, "host: can't restart: %s\n", strerror(errno));
+  _exit(1);
+}
+
+void hostBoot(int argc, char **argv) {
+  bootArgv = argv;
+  if (!hostWorld.started)
+    hostWorld.reset = ESP_RST_POWERON;
+  hostWorld.boots++;
+}
+
+// Time. The chip's clock is real time since the boot, run --slowdown times slower, so that a machine
+// can keep up with that many times as many TRVs. Everything that waits (the FreeRTOS primitives, and
+// sleep) waits on it.
+
+int64_t esp_timer_get_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const int64_t us = (now.tv_sec - bootTime.tv_sec) * 1000000LL + (now.tv_nsec - bootTime.tv_nsec) / 1000;
+  return hostOptions.slowdown == 1 ? us : (int64_t)(us / hostOptions.slowdown);
+}
+
+int64_t hostRealUs(int64_t us) {
+  return hostOptions.slowdown == 1 ? us : (int64_t)(us * hostOptions.slowdown);
+}
+
+uint32_t esp_log_timestamp() {
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+// Logging
+
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static esp_log_level_t defaultLevel = ESP_LOG_INFO;
+static struct {
+  char tag[24];
+  esp_log_level_t level;
+} tagLevels[MAX_LOG_TAGS];
+static int numTags;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  pthread_mutex_lock(&logLock);
+  if (!strcmp(tag, "*")) {
+    defaultLevel = level;
+    numTags = 0; // As IDF, which forgets the tags' own levels
+  } else {
+    int i = 0;
+    while (i < numTags && strcmp(tagLevels[i].tag, tag))
+      i++;
+    if (i < MAX_LOG_TAGS) {
+      strncpy(tagLevels[i].tag, tag, sizeof(tagLevels[i].tag) - 1);
+      tagLevels[i].level = level;
+      if (i == numTags)
+        numTags++;
+    }
+  }
+  pthread_mutex_unlock(&logLock);
+}
+
+esp_log_level_t esp_log_level_get(const char *tag) {
+  pthread_mutex_lock(&logLock);
+  esp_log_level_t level = defaultLevel;
+  for (int i = 0; i < numTags; i++) {
+    if (!strcmp(tagLevels[i].tag, tag)) {
+      level = tagLevels[i].level;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&logLock);
+  return level;
+}
+
+void esp_log_writev(esp_log_level_t level, const char *tag, const char *format, va_list args) {
+  if (level > esp_log_level_get(tag))
+    return;
+  vprintf(format, args);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  esp_log_writev(level, tag, format, args);
+  va_end(args);
+}
+
+// Errors
+
+const char *esp_err_to_name(esp_err_t code) {
+  static const struct {
+    esp_err_t code;
+    const char *name;
+  } names[] = {
+#define NAME(e) {e, #e}
+    NAME(ESP_OK), NAME(ESP_FAIL), NAME(ESP_ERR_NO_MEM), NAME(ESP_ERR_INVALID_ARG),
+    NAME(ESP_ERR_INVALID_STATE), NAME(ESP_ERR_INVALID_SIZE), NAME(ESP_ERR_NOT_FOUND),
+    NAME(ESP_ERR_NOT_SUPPORTED), NAME(ESP_ERR_TIMEOUT), NAME(ESP_ERR_INVALID_RESPONSE),
+    NAME(ESP_ERR_INVALID_CRC), NAME(ESP_ERR_INVALID_VERSION), NAME(ESP_ERR_INVALID_MAC),
+    NAME(ESP_ERR_NOT_FINISHED), NAME(ESP_ERR_NOT_ALLOWED), NAME(ESP_ERR_NVS_NOT_INITIALIZED),
+    NAME(ESP_ERR_NVS_NOT_FOUND), NAME(ESP_ERR_NVS_TYPE_MISMATCH), NAME(ESP_ERR_NVS_READ_ONLY),
+    NAME(ESP_ERR_NVS_NOT_ENOUGH_SPACE), NAME(ESP_ERR_NVS_INVALID_NAME), NAME(ESP_ERR_NVS_INVALID_HANDLE),
+    NAME(ESP_ERR_NVS_INVALID_LENGTH), NAME(ESP_ERR_NVS_NO_FREE_PAGES), NAME(ESP_ERR_NVS_NEW_VERSION_FOUND),
+    NAME(ESP_ERR_OTA_PARTITION_CONFLICT), NAME(ESP_ERR_OTA_SELECT_INFO_INVALID),
+    NAME(ESP_ERR_OTA_VALIDATE_FAILED), NAME(ESP_ERR_OTA_SMALL_SEC_VER), NAME(ESP_ERR_OTA_ROLLBACK_FAILED),
+    NAME(ESP_ERR_OTA_ROLLBACK_INVALID_STATE), NAME(ESP_ERR_HTTP_CONNECT),
+#undef NAME
+  };
+  for (const auto &n : names) {
+    if (n.code == code)
+      return n.name;
+  }
+  return "UNKNOWN ERROR";
+}
+
+void _esp_error_check_failed_without_abort(esp_err_t rc, const char *file, int line, const char *function,
+                                           const char *expression) {
+  printf("ESP_ERROR_CHECK_WITHOUT_ABORT failed: esp_err_t 0x%x (%s) at %p\nfile: \"%s\" line %d\nfunc: %s\n"
+         "expression: %s\n", rc, esp_err_to_name(rc), __builtin_return_address(0), file, line, function, expression);
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function,
+                             const char *expression) {
+  printf("ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %p\nfile: \"%s\" line %d\nfunc: %s\nexpression: %s\n",
+         rc, esp_err_to_name(rc), __builtin_return_address(0), file, line, function, expression);
+  fflush(stdout);
+  abort();
+}
+
+esp_err_t esp_backtrace_print(int depth) {
+  void *frames[64];
+  const int n = backtrace(frames, depth < 64 ? depth : 64);
+  printf("Backtrace:\n");
+  fflush(stdout);
+  backtrace_symbols_fd(frames, n, STDOUT_FILENO);
+  return ESP_OK;
+}
+
+// Restart and sleep
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler) {
+  for (auto &h : shutdownHandlers) {
+    if (h == handler)
+      return ESP_ERR_INVALID_STATE;
+  }
+  for (auto &h : shutdownHandlers) {
+    if (!h) {
+      h = handler;
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_unregister_shutdown_handler(shutdown_handler_t handler) {
+  for (auto &h : shutdownHandlers) {
+    if (h == handler) {
+      h = NULL;
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_INVALID_STATE;
+}
+
+void esp_restart() {
+  for (int i = MAX_SHUTDOWN_HANDLERS - 1; i >= 0; i--) {
+    if (shutdownHandlers[i])
+      shutdownHandlers[i]();
+  }
+  reset(ESP_RST_SW);
+}
+
+esp_reset_reason_t esp_reset_reason() {
+  return hostWorld.reset;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t us) {
+  sleepTimerUs = us;
+  sleepTimer = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode) {
+  ext1Mask = mask;
+  return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() {
+  return hostWorld.reset == ESP_RST_DEEPSLEEP ? hostWorld.wakeCause : ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+// Sleeps for the time asked for, scaled by --sleep-scale, and wakes early for a touch (SIGUSR1) if
+// that's enabled. The model outside the chip moves on by the unscaled time.
+//
+// Each wake ends with a line for tools/fleet-host.py: the time since power on (counting the whole of
+// each sleep), how long this wake took, and what the charge model (BatteryMonitor.cpp) needs.
+void esp_deep_sleep_start() {
+  const float room = plantRoom(); // Brings simSecs up to now
+  printf("host: wake %lu at %.3fs awake %lldms motor %lldms sleep %llus room %.2fC valve %.0f%%\n",
+         (unsigned long)hostWorld.boots, hostWorld.simSecs, esp_timer_get_time() / 1000, plantMotorUs() / 1000,
+         sleepTimer ? sleepTimerUs / 1000000 : 0, room, hostWorld.valve);
+  fflush(stdout);
+  if (hostOptions.wakes && hostWorld.boots >= (uint32_t)hostOptions.wakes) {
+    printf("host: stopping after %d boots\n", hostOptions.wakes);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  const bool touchWakes = ext1Mask & (1ULL << TOUCH_PIN);
+  const double scale = hostOptions.sleepScale;
+  const int64_t scaled = sleepTimer ? (int64_t)(sleepTimerUs * scale) : -1;
+  const int64_t start = esp_timer_get_time();
+  bool touched = false;
+  while (!touched) {
+    const int64_t left = scaled < 0 ? -1 : scaled - (esp_timer_get_time() - start);
+    if (scaled >= 0 && left <= 0)
+      break;
+    touched = plantWaitForTouch(left) && touchWakes;
+  }
+  const double slept = touched && scale > 0 ? (esp_timer_get_time() - start) / scale / 1e6 : sleepTimerUs / 1e6;
+  plantAdvance(slept);
+
+  hostWorld.wakeCause = touched ? ESP_SLEEP_WAKEUP_EXT1 : ESP_SLEEP_WAKEUP_TIMER;
+  hostWorld.touchAtBoot = touched;
+  reset(ESP_RST_DEEPSLEEP);
+}
+
+// The chip
+
+uint32_t esp_random() {
+  uint32_t r;
+  esp_fill_random(&r, sizeof(r));
+  return r;
+}
+
+void esp_fill_random(void *buf, size_t len) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len) {
+    const ssize_t n = getrandom(p, len, 0);
+    if (n > 0) {
+      p += n;
+      len -= n;
+    }
+  }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  crc = ~crc;
+  while (len--)
+    crc = table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+esp_err_t esp_efuse_mac_get_default(uint8_t *mac) {
+  memcpy(mac, hostOptions.mac, 6);
+  return ESP_OK;
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type) {
+  memcpy(mac, hostOptions.mac, 6);
+  // As the chip derives them from the base MAC
+  if (type == ESP_MAC_WIFI_SOFTAP)
+    mac[5] += 1;
+  else if (type == ESP_MAC_BT)
+    mac[5] += 2;
+  return ESP_OK;
+}
+
+/* The heap. Every allocation in the process goes through the hooks heap-stats.cpp defines, as
+   every allocation on the chip does, and the free size is what's left of the C6's heap after the
+   allocations still outstanding. */
+
+extern "C" {
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps);
+void esp_heap_trace_free_hook(void *ptr);
+}
+
+static volatile size_t heapUsed;
+static volatile size_t heapMostUsed;
+
+static void *allocated(void *p) {
+  if (p) {
+    const size_t size = malloc_usable_size(p);
+    esp_heap_trace_alloc_hook(p, size, MALLOC_CAP_DEFAULT);
+    const size_t used = __atomic_add_fetch(&heapUsed, size, __ATOMIC_RELAXED);
+    size_t most = heapMostUsed;
+    while (used > most && !__atomic_compare_exchange_n(&heapMostUsed, &most, used, true, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED)) {
+    }
+  }
+  return p;
+}
+
+static void freeing(void *p) {
+  if (p) {
+    esp_heap_trace_free_hook(p);
+    __atomic_sub_fetch(&heapUsed, malloc_usable_size(p), __ATOMIC_RELAXED);
+  }
+}
+
+extern "C" void *malloc(size_t size) {
+  return allocated(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+  return allocated(__libc_calloc(n, size));
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  const size_t was = ptr ? malloc_usable_size(ptr) : 0;
+  void *p = __libc_realloc(ptr, size);
+  if (!p && size)
+    return NULL; // The old block is still there
+  if (ptr) {
+    esp_heap_trace_free_hook(ptr);
+    __atomic_sub_fetch(&heapUsed, was, __ATOMIC_RELAXED);
+  }
+  return allocated(p);
+}
+
+extern "C" void free(void *ptr) {
+  freeing(ptr);
+  __libc_free(ptr);
+}
+
+static size_t left(size_t used) {
+  return used < HEAP_BYTES ? HEAP_BYTES - used : 0;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  return left(heapUsed);
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+  return left(heapMostUsed);
+}
+
+uint32_t esp_get_free_heap_size() {
+  return left(heapUsed);
+}
+
+uint32_t esp_get_minimum_free_heap_size() {
+  return left(heapMostUsed);
+}
+
+// libc
+
+#ifdef HOST_NEEDS_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  const size_t len = strlen(src);
+  if (size) {
+    const size_t n = len < size ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return len;
+}
+#endif
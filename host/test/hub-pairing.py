@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Runs a freshly flashed trv-host against tools/now-hub.py: the hub names it over ESP-NOW, then it
+joins and sends its state on the wakes that follow. The hub has a setpoint for it, which it sends
+while the TRV is still scanning for hubs as well as after each JOIN.
+
+    host/test/hub-pairing.py <trv-host> [--port 5600]
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+TOOLS = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "tools")
+WAKES = 4
+SETPOINT = '{"system_mode":"heat","current_heating_setpoint":21.5}'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trv_host")
+    parser.add_argument("--port", type=int, default=5600, help="of the medium, apart from any other hub's")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as dir:
+        hub = subprocess.Popen([sys.executable, os.path.join(TOOLS, "now-hub.py"), "--port", str(args.port),
+                                "--passphrase", "test", "--provision", "test-trv", "--send", SETPOINT, "--send-during-scan",
+                                "--duration", "60"],
+                               stdout=subprocess.PIPE, text=True)
+        trv = subprocess.run([args.trv_host, "--dir", dir, "--port", str(args.port), "--sleep-scale", "0.02",
+                              "--wakes", str(WAKES)], stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                             text=True, timeout=60)
+        hub.terminate()
+        out = hub.communicate(timeout=10)[0]
+    print(trv.stdout)
+    print(out)
+
+    failures = []
+    if trv.returncode != 0:
+        failures.append("trv-host exited with %d" % trv.returncode)
+    if "provisioned" not in out:
+        failures.append("the hub didn't provision it")
+    if "JOIN, rssi -60: test-trv" not in out:
+        failures.append("it didn't join the hub under its new name")
+    states = [line for line in out.splitlines() if '{"rssi":' in line]
+    if len(states) < WAKES - 1:
+        failures.append("the hub heard %d states over %d wakes" % (len(states), WAKES))
+    if not any('"current_heating_setpoint":21.5' in state for state in states):
+        failures.append("it didn't take the hub's setpoint")
+    for failure in failures:
+        print("FAIL:", failure)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,55 @@
+// Generated by `tools/prov-hub.py vectors > host/test/prov-vectors.h`: one provisioning exchange,
+// with fixed keys and IV, as the hub's side computes it
+#ifndef PROV_VECTORS_H
+#define PROV_VECTORS_H
+
+#include <stdint.h>
+
+#define PROV_VECTOR_NAME "lounge"
+#define PROV_VECTOR_SLEEP_TIME 30
+#define PROV_VECTOR_BACKOFF_MS 50
+#define PROV_VECTOR_STALL_MS 400
+#define PROV_VECTOR_MOTOR_REVERSED 0
+
+static const uint8_t provTrvSecret[32] = {
+  0x08, 0xc5, 0x45, 0x3d, 0x88, 0xd0, 0x0d, 0xf2, 0x1e, 0x14, 0x79, 0xb0,
+  0x92, 0x5a, 0x49, 0x0d, 0x3f, 0x9c, 0x1f, 0x24, 0xef, 0xd0, 0x4b, 0xf1,
+  0x08, 0x5e, 0x01, 0x4a, 0xdc, 0xbc, 0x8d, 0x51,
+};
+static const uint8_t provTrvPublic[32] = {
+  0x86, 0xdc, 0x90, 0x97, 0xfc, 0xf3, 0x17, 0x73, 0x68, 0xcf, 0x87, 0xc2,
+  0x6b, 0x5d, 0x91, 0x3a, 0x9d, 0xf9, 0xda, 0x13, 0x65, 0x67, 0x89, 0x84,
+  0x8d, 0x1a, 0xd5, 0x6d, 0xfd, 0xec, 0x38, 0x6a,
+};
+static const uint8_t provPassKey[32] = {
+  0x29, 0xa6, 0xa5, 0xe3, 0xc3, 0x98, 0x62, 0x76, 0x6d, 0x20, 0x05, 0x57,
+  0x89, 0x4f, 0x42, 0xfe, 0x0a, 0xfe, 0xd0, 0x52, 0x34, 0x81, 0x6b, 0x0c,
+  0xa9, 0xcb, 0xb5, 0x9b, 0xbc, 0x1d, 0x60, 0x23,
+};
+static const uint8_t provSessionKey[32] = {
+  0xef, 0x75, 0x8a, 0x0f, 0x98, 0x5f, 0x66, 0x91, 0x56, 0xf0, 0x3e, 0xd1,
+  0xf7, 0xc5, 0xb4, 0x2b, 0x1b, 0x61, 0x99, 0x4a, 0xd9, 0xc4, 0x47, 0x64,
+  0x5f, 0xc1, 0x90, 0x2c, 0x87, 0x32, 0x9f, 0x9c,
+};
+// The hub's PRCF
+static const uint8_t provOffer[136] = {
+  0x50, 0x52, 0x43, 0x46, 0x01, 0x00, 0x00, 0x00, 0xea, 0x4c, 0x6b, 0x08,
+  0x56, 0x58, 0x0c, 0xa1, 0x0a, 0xc9, 0xda, 0x3d, 0x38, 0xe9, 0xc7, 0x41,
+  0xf5, 0xb2, 0x8d, 0x11, 0x3e, 0xcc, 0x8c, 0x22, 0x01, 0x71, 0xa5, 0xa3,
+  0x6c, 0xa9, 0x11, 0x03, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xb2, 0x4c, 0xaa, 0x6f,
+  0x9b, 0xe1, 0x71, 0x22, 0x6c, 0xe0, 0x57, 0x30, 0x83, 0x36, 0xeb, 0x57,
+  0xe8, 0x05, 0x01, 0x18, 0xfc, 0x84, 0x19, 0x5d, 0xdb, 0xad, 0xa4, 0x32,
+  0x06, 0x47, 0x09, 0xf0, 0xe7, 0x3f, 0x13, 0x07, 0xd2, 0xe9, 0xe5, 0x0f,
+  0xa3, 0xdc, 0x98, 0xf6, 0x46, 0x5e, 0x7e, 0x0d, 0xe2, 0xde, 0x76, 0x49,
+  0x1f, 0x80, 0x49, 0xad, 0x58, 0x1e, 0x19, 0x15, 0x2e, 0xc8, 0xfe, 0x4b,
+  0x54, 0xa3, 0x3a, 0x18, 0xf6, 0x1f, 0x65, 0x50, 0x47, 0xb0, 0x96, 0x31,
+  0x2b, 0xae, 0x98, 0x31,
+};
+// The TRV's PRDN
+static const uint8_t provDone[20] = {
+  0x50, 0x52, 0x44, 0x4e, 0xfe, 0x00, 0x04, 0x12, 0xa9, 0xd0, 0xe9, 0xd2,
+  0x0c, 0x6a, 0x97, 0x09, 0x7f, 0x5f, 0x49, 0xdd,
+};
+
+#endif
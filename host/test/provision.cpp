@@ -0,0 +1,177 @@
+/* The TRV's side of provisioning (main/net/provision.cpp) against known answers from the hub's side,
+   tools/prov-hub.py: prov-vectors.h is one exchange it generated with fixed keys and IV. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "provision.hpp"
+#include "prov-vectors.h"
+#include "trv.h"
+
+// What main.cpp and the host's main.cpp define, which this replaces
+extern "C" {
+const char *TAG = "TRV";
+}
+char versionDetail[110];
+host_options_t hostOptions = {
+  .dir = ".",
+  .mac = {0x02, 0x00, 0x00, 0x00, 0x01, 0x01},
+  .port = 5557,
+  .sleepScale = 1,
+  .slowdown = 1,
+};
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("%s:%d: FAIL: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+#define HUB_KEY (provOffer + 8) // prov_offer_t.key
+
+static const uint8_t hubMac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint8_t otherHubMac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// Provisioning with the vectors' key pair, rather than one from request()
+class KnownKeys : public Provisioning {
+public:
+  KnownKeys(const uint8_t *secret = provTrvSecret) {
+    memcpy(secretKey, secret, sizeof(secretKey));
+    memcpy(publicKey, provTrvPublic, sizeof(publicKey));
+  }
+  bool derive(const uint8_t *hubKey) { return Provisioning::derive(hubKey); }
+  const uint8_t *session() const { return sessionKey; }
+
+  void offer(const uint8_t *mac, uint8_t channel, const uint8_t *frame = provOffer, int len = sizeof(provOffer)) {
+    const now_recv_info_t info = {.src = mac, .dst = broadcast, .channel = channel, .second = 0, .rssi = -60};
+    receive(&info, frame, len);
+  }
+};
+
+static void frameSizes() {
+  CHECK(sizeof(prov_offer_t) == sizeof(provOffer));
+  CHECK(sizeof(prov_done_t) == sizeof(provDone));
+}
+
+static void request() {
+  Provisioning prov;
+  prov_request_t frame;
+  CHECK(prov.request(&frame));
+  CHECK(!memcmp(frame.tag, "PRRQ", 4));
+  CHECK(frame.version == PROV_VERSION);
+  CHECK(!strcmp(frame.model, FREEHOUSE_MODEL));
+}
+
+static void derive() {
+  KnownKeys prov;
+  CHECK(prov.derive(HUB_KEY));
+  CHECK(!memcmp(prov.session(), provSessionKey, sizeof(provSessionKey)));
+}
+
+static void open() {
+  KnownKeys prov;
+  prov.offer(hubMac, 6);
+  CHECK(prov.hubs() == 1);
+  prov_config_t config;
+  uint8_t mac[6], channel;
+  CHECK(prov.open(&config, mac, &channel));
+  CHECK(config.magic == PROV_MAGIC);
+  CHECK(!strcmp(config.device_name, PROV_VECTOR_NAME));
+  CHECK(!memcmp(config.pass_key, provPassKey, sizeof(provPassKey)));
+  CHECK(config.sleep_time == PROV_VECTOR_SLEEP_TIME);
+  CHECK(config.backoff_ms == PROV_VECTOR_BACKOFF_MS);
+  CHECK(config.stall_ms == PROV_VECTOR_STALL_MS);
+  CHECK(config.motor_reversed == PROV_VECTOR_MOTOR_REVERSED);
+  CHECK(!memcmp(mac, hubMac, sizeof(mac)));
+  CHECK(channel == 6);
+
+  prov_done_t done;
+  prov.done(&done);
+  CHECK(!memcmp(&done, provDone, sizeof(provDone)));
+}
+
+// The same hub heard on a later channel is still one hub, at the channel it was first heard on
+static void repeatedOffer() {
+  KnownKeys prov;
+  prov.offer(hubMac, 1);
+  prov.offer(hubMac, 11);
+  CHECK(prov.hubs() == 1);
+  prov_config_t config;
+  uint8_t mac[6], channel;
+  CHECK(prov.open(&config, mac, &channel));
+  CHECK(channel == 1);
+}
+
+static void twoHubs() {
+  KnownKeys prov;
+  prov.offer(hubMac, 6);
+  prov.offer(otherHubMac, 6);
+  CHECK(prov.hubs() == 2);
+  prov_config_t config;
+  uint8_t mac[6], channel;
+  CHECK(!prov.open(&config, mac, &channel));
+}
+
+static void notOffers() {
+  KnownKeys prov;
+  uint8_t frame[sizeof(provOffer) + 1];
+  memcpy(frame, provOffer, sizeof(provOffer));
+  prov.offer(hubMac, 6, frame, sizeof(provOffer) - 1);
+  prov.offer(hubMac, 6, frame, sizeof(provOffer) + 1);
+  frame[4] = PROV_VERSION + 1;
+  prov.offer(hubMac, 6, frame, sizeof(provOffer));
+  memcpy(frame, provDone, 4);
+  frame[4] = PROV_VERSION;
+  prov.offer(hubMac, 6, frame, sizeof(provOffer));
+  CHECK(prov.hubs() == 0);
+  prov_config_t config;
+  uint8_t mac[6], channel;
+  CHECK(!prov.open(&config, mac, &channel));
+}
+
+// Settings that don't decrypt to a prov_config_t aren't applied
+static void tampered() {
+  // A flipped bit in the IV garbles the magic; in the last block, the padding
+  static const int offsets[] = {0, PROV_SEALED_LENGTH - 1};
+  for (int offset : offsets) {
+    KnownKeys prov;
+    uint8_t frame[sizeof(provOffer)];
+    memcpy(frame, provOffer, sizeof(frame));
+    frame[40 + offset] ^= 0x01;
+    prov.offer(hubMac, 6, frame, sizeof(frame));
+    prov_config_t config;
+    uint8_t mac[6], channel;
+    CHECK(!prov.open(&config, mac, &channel));
+  }
+  // Nor do they open with a key pair other than the one asked with
+  uint8_t secret[32];
+  memcpy(secret, provTrvSecret, sizeof(secret));
+  secret[1] ^= 0x01;
+  KnownKeys prov(secret);
+  prov.offer(hubMac, 6);
+  prov_config_t config;
+  uint8_t mac[6], channel;
+  CHECK(!prov.open(&config, mac, &channel));
+}
+
+int main() {
+  frameSizes();
+  request();
+  derive();
+  open();
+  repeatedOffer();
+  twoHubs();
+  notOffers();
+  tampered();
+  if (failures)
+    printf("%d failed\n", failures);
+  else
+    printf("All passed\n");
+  return failures ? 1 : 0;
+}
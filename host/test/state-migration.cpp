@@ -0,0 +1,226 @@
+/* The stored state's migrations (migrations[] in trv-state.cpp), on blobs laid out as v7 and v8
+   firmware wrote them to flash. The blobs are built at the chip's offsets rather than through
+   trv_state_t, so a field that moves in a later layout shows up here.
+
+   trv-state.cpp is included, to reach migrateState() and the steps, which are static. */
+
+#include "../../main/src/trv-state.cpp"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "host.h"
+
+// What main.cpp and the host's main.cpp define, which this replaces
+extern "C" {
+const char *TAG = "TRV";
+}
+char versionDetail[110];
+host_options_t hostOptions = {
+  .dir = ".",
+  .mac = {0x02, 0x00, 0x00, 0x00, 0x01, 0x01},
+  .port = 5557,
+  .sleepScale = 1,
+  .slowdown = 1,
+};
+
+#define GUARD 0x5A
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("%s:%d: FAIL: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+template <typename T> static void put(std::vector<uint8_t> &blob, size_t offset, T value) {
+  memcpy(blob.data() + offset, &value, sizeof(value));
+}
+
+template <typename T> static T get(const std::vector<uint8_t> &blob, size_t offset) {
+  T value;
+  memcpy(&value, blob.data() + offset, sizeof(value));
+  return value;
+}
+
+// A blob of `len` bytes as v7 stored it, in a buffer of `capacity` (and a guard byte past that)
+static std::vector<uint8_t> v7Blob(size_t len = STATE_V7_SIZE, size_t capacity = sizeof(trv_state_t)) {
+  std::vector<uint8_t> blob(capacity + 1, 0);
+  blob[capacity] = GUARD;
+  put<uint32_t>(blob, 0, 7);
+  put<float>(blob, 4, 19.25f);        // sensors.local_temperature
+  put<uint8_t>(blob, 18, 40);         // sensors.position
+  put<float>(blob, 20, 19.5f);        // config.current_heating_setpoint
+  put<float>(blob, 24, -1.0f);        // config.local_temperature_calibration
+  put<uint32_t>(blob, 28, ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_HEAT);
+  put<uint32_t>(blob, 32, NET_MODE_ESP_NOW);
+  memcpy(blob.data() + 36, "home", 5);     // config.mqttConfig.wifi_ssid
+  memcpy(blob.data() + 132, "lounge", 7);  // config.mqttConfig.device_name
+  put<uint16_t>(blob, 196, 1883);     // config.mqttConfig.mqtt_port
+  for (int i = 0; i < 32; i++)
+    blob[198 + i] = i + 1;            // config.passKey
+  put<int32_t>(blob, 232, 30);        // config.sleep_time
+  put<uint8_t>(blob, 236, 2);         // config.resolution
+  for (size_t i = STATE_V7_SIZE; i < len; i++)
+    blob[i] = 0xEE;                   // Whatever followed it in the read buffer
+  return blob;
+}
+
+static std::vector<uint8_t> v8Blob(size_t capacity = sizeof(trv_state_t)) {
+  auto blob = v7Blob(STATE_V7_SIZE, capacity);
+  put<uint32_t>(blob, 0, 8);
+  put<uint32_t>(blob, 240, DEBUG_MOTOR_CONTROL); // config.debug_flags
+  put<uint8_t>(blob, 244, false);     // config.motor.reversed
+  put<int32_t>(blob, 248, 150);       // config.motor.backoff_ms
+  put<int32_t>(blob, 252, 300);       // config.motor.stall_ms
+  return blob;
+}
+
+static bool migrate(std::vector<uint8_t> &blob, __SIZE_TYPE__ &len) {
+  const bool ok = migrateState(blob.data(), len, blob.size() - 1);
+  CHECK(blob.back() == GUARD); // Nothing written past the capacity
+  return ok;
+}
+
+// What v7 and v8 have in common, as it should be after either is migrated
+static void checkCommon(const trv_state_t &s) {
+  CHECK(s.version == STATE_VERSION);
+  CHECK(s.sensors.local_temperature == 19.25f);
+  CHECK(s.sensors.position == 40);
+  CHECK(s.config.current_heating_setpoint == 19.5f);
+  CHECK(s.config.local_temperature_calibration == -1.0f);
+  CHECK(s.config.system_mode == ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_HEAT);
+  CHECK(s.config.netMode == NET_MODE_ESP_NOW);
+  CHECK(!strcmp((const char *)s.config.mqttConfig.wifi_ssid, "home"));
+  CHECK(!strcmp(s.config.mqttConfig.device_name, "lounge"));
+  CHECK(s.config.mqttConfig.mqtt_port == 1883);
+  for (int i = 0; i < 32; i++)
+    CHECK(s.config.passKey[i] == i + 1);
+  CHECK(s.config.sleep_time == 30);
+  CHECK(s.config.resolution == 2);
+}
+
+static void v7ToV9() {
+  auto blob = v7Blob();
+  __SIZE_TYPE__ len = STATE_V7_SIZE;
+  CHECK(migrate(blob, len));
+  CHECK(len == sizeof(trv_state_t));
+  trv_state_t s;
+  memcpy(&s, blob.data(), sizeof(s));
+  checkCommon(s);
+  // v8's fields, as v7 never had them
+  CHECK(s.config.debug_flags == 0);
+  CHECK(s.config.motor.reversed == defaultState.config.motor.reversed);
+  CHECK(s.config.motor.backoff_ms == BACKOFF_MS_DEFAULT);
+  CHECK(s.config.motor.stall_ms == STALL_MS_DEFAULT);
+  // v9's
+  CHECK(s.config.writeback_secs == WRITEBACK_SECS_DEFAULT);
+}
+
+static void v8ToV9() {
+  auto blob = v8Blob();
+  __SIZE_TYPE__ len = STATE_V8_SIZE;
+  CHECK(migrate(blob, len));
+  CHECK(len == sizeof(trv_state_t));
+  trv_state_t s;
+  memcpy(&s, blob.data(), sizeof(s));
+  checkCommon(s);
+  CHECK(s.config.debug_flags == DEBUG_MOTOR_CONTROL);
+  CHECK(s.config.motor.reversed == false);
+  CHECK(s.config.motor.backoff_ms == 150);
+  CHECK(s.config.motor.stall_ms == 300);
+  CHECK(s.config.writeback_secs == WRITEBACK_SECS_DEFAULT);
+}
+
+// Bytes past the stored length (here, from a longer read) don't leak into the new fields
+static void v7IgnoresTrailingBytes() {
+  auto blob = v7Blob(sizeof(trv_state_t));
+  __SIZE_TYPE__ len = STATE_V7_SIZE;
+  CHECK(migrate(blob, len));
+  CHECK(get<uint32_t>(blob, 240) == 0);
+  CHECK(get<uint16_t>(blob, 256) == WRITEBACK_SECS_DEFAULT);
+}
+
+static void currentIsUnchanged() {
+  auto blob = v8Blob();
+  __SIZE_TYPE__ len = STATE_V8_SIZE;
+  CHECK(migrate(blob, len));
+  const auto migrated = blob;
+  CHECK(migrate(blob, len));
+  CHECK(len == sizeof(trv_state_t));
+  CHECK(blob == migrated);
+}
+
+// A buffer too small for the current layout refuses to migrate (rather than write past its end)
+static void capacity() {
+  for (size_t capacity : {(size_t)STATE_V7_SIZE, (size_t)STATE_V8_SIZE, sizeof(trv_state_t) - 1}) {
+    auto blob = v7Blob(STATE_V7_SIZE, capacity);
+    __SIZE_TYPE__ len = STATE_V7_SIZE;
+    CHECK(!migrate(blob, len));
+    CHECK(len == STATE_V7_SIZE);
+  }
+  for (size_t capacity : {(size_t)STATE_V8_SIZE, sizeof(trv_state_t) - 1}) {
+    auto blob = v8Blob(capacity);
+    __SIZE_TYPE__ len = STATE_V8_SIZE;
+    CHECK(!migrate(blob, len));
+    CHECK(len == STATE_V8_SIZE);
+  }
+}
+
+static void sizeErrors() {
+  // Too short to hold a version
+  auto blob = v7Blob();
+  __SIZE_TYPE__ len = 3;
+  CHECK(!migrate(blob, len));
+  // Longer than any layout
+  blob = v7Blob();
+  len = sizeof(trv_state_t) + 1;
+  CHECK(!migrateState(blob.data(), len, sizeof(trv_state_t) + 4));
+  blob = v8Blob();
+  len = sizeof(trv_state_t) + 1;
+  CHECK(!migrateState(blob.data(), len, sizeof(trv_state_t) + 4));
+  // The current version, but not its size
+  blob = v7Blob();
+  put<uint32_t>(blob, 0, STATE_VERSION);
+  len = STATE_V8_SIZE;
+  CHECK(!migrate(blob, len));
+  len = sizeof(trv_state_t) + 4;
+  CHECK(!migrateState(blob.data(), len, sizeof(trv_state_t) + 4));
+  // v7 and v8 blobs of any other size. Zero-filled, 8 bytes would have left sleep_time at 0
+  for (__SIZE_TYPE__ size : {(__SIZE_TYPE__)8, (__SIZE_TYPE__)STATE_V7_SIZE - 1, (__SIZE_TYPE__)STATE_V8_SIZE}) {
+    blob = v7Blob();
+    len = size;
+    CHECK(!migrate(blob, len));
+  }
+  for (__SIZE_TYPE__ size : {(__SIZE_TYPE__)8, (__SIZE_TYPE__)STATE_V7_SIZE, (__SIZE_TYPE__)STATE_V8_SIZE - 1,
+                             sizeof(trv_state_t)}) {
+    blob = v8Blob();
+    len = size;
+    CHECK(!migrate(blob, len));
+  }
+  // Versions with no step: before v7, and from later firmware
+  for (uint32_t version : {0u, 6u, (uint32_t)STATE_VERSION + 1}) {
+    blob = v7Blob();
+    put<uint32_t>(blob, 0, version);
+    len = STATE_V7_SIZE;
+    CHECK(!migrate(blob, len));
+  }
+}
+
+int main() {
+  v7ToV9();
+  v8ToV9();
+  v7IgnoresTrailingBytes();
+  currentIsUnchanged();
+  capacity();
+  sizeErrors();
+  if (failures)
+    printf("%d failed\n", failures);
+  else
+    printf("All passed\n");
+  return failures ? 1 : 0;
+}
@@ -6,6 +6,7 @@
 
 #include "dns_server.h"
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <sys/param.h>
 
@@ -13,6 +14,8 @@
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "lwip/err.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
@@ -22,10 +25,19 @@
 #define DNS_MAX_LEN (256)
 
 #define OPCODE_MASK (0x7800)
-#define QR_FLAG (1 << 7)
+#define QR_FLAG (0x8000)
+#define RD_FLAG (0x0100)
+#define AA_FLAG (0x0400)
 #define QD_TYPE_A (0x0001)
+#define QD_CLASS_IN (0x0001)
 #define ANS_TTL_SEC (300)
 
+// Each source can have this many queries answered per second, with bursts of up to DNS_RATE_BURST.
+// Captive portal probes are a handful of names, so anything beyond that is dropped.
+#define DNS_RATE_PER_SEC (10)
+#define DNS_RATE_BURST (20)
+#define DNS_RATE_SOURCES (8)
+
 extern const char *TAG;
 // DNS Header Packet
 typedef struct __attribute__((__packed__)) {
@@ -53,224 +65,221 @@ typedef struct __attribute__((__packed__)) {
   uint32_t ip_addr;
 } dns_answer_t;
 
+// Token bucket for one source address
+typedef struct {
+  uint32_t addr;
+  uint32_t last_ms;
+  uint16_t tokens;
+} dns_rate_t;
+
 // DNS server handle
 struct dns_server_handle {
-  bool started;
-  TaskHandle_t task;
+  int sock;
+  uint32_t dropped;
+  dns_rate_t rate[DNS_RATE_SOURCES];
+  char packet[DNS_MAX_LEN];     // The query, turned into the reply in place
   int num_of_entries;
-  dns_entry_pair_t entry[];
+  dns_entry_pair_t entry[DNS_SERVER_MAX_ITEMS];
+  dns_answer_t answer[DNS_SERVER_MAX_ITEMS];  // Built once, pointing at the question that follows the header
 };
 
-/*
-    Parse the name from the packet from the DNS name format to a regular .-seperated name
-    returns the pointer to the next part of the packet
-*/
-static char *parse_dns_name(char *raw_name, char *parsed_name, size_t parsed_name_max_len) {
-  char *label = raw_name;
-  char *name_itr = parsed_name;
-  int name_len = 0;
-
-  do {
-    int sub_name_len = *label;
-    // (len + 1) since we are adding  a '.'
-    name_len += (sub_name_len + 1);
-    if (name_len > parsed_name_max_len) {
-      return NULL;
-    }
-
-    // Copy the sub name that follows the the label
-    memcpy(name_itr, label + 1, sub_name_len);
-    name_itr[sub_name_len] = '.';
-    name_itr += (sub_name_len + 1);
-    label += sub_name_len + 1;
-  } while (*label != 0);
-
-  // Terminate the final string, replacing the last '.'
-  parsed_name[name_len - 1] = '\0';
-  // Return pointer to first char after the name
-  return label + 1;
+static uint32_t now_ms(void) {
+  return xTaskGetTickCount() * portTICK_PERIOD_MS;
 }
 
-// Parses the DNS request and prepares a DNS response with the IP of the softAP
-static int parse_dns_request(char *req, size_t req_len, char *dns_reply, size_t dns_reply_max_len, dns_server_handle_t h) {
-  if (req_len > dns_reply_max_len) {
-    return -1;
+// Whether a query from this address is allowed now
+static bool rate_allow(dns_server_handle_t h, uint32_t addr) {
+  const uint32_t now = now_ms();
+  dns_rate_t *r = NULL;
+  dns_rate_t *oldest = &h->rate[0];
+  for (int i = 0; i < DNS_RATE_SOURCES; i++) {
+    if (h->rate[i].addr == addr) {
+      r = &h->rate[i];
+      break;
+    }
+    if (h->rate[i].last_ms < oldest->last_ms || h->rate[i].addr == 0)
+      oldest = &h->rate[i];
   }
-
-  // Prepare the reply
-  memset(dns_reply, 0, dns_reply_max_len);
-  memcpy(dns_reply, req, req_len);
-
-  // Endianess of NW packet different from chip
-  dns_header_t *header = (dns_header_t *)dns_reply;
-  ESP_LOGD(TAG, "DNS query with header id: 0x%X, flags: 0x%X, qd_count: %d",
-           ntohs(header->id), ntohs(header->flags), ntohs(header->qd_count));
-
-  // Not a standard query
-  if ((header->flags & OPCODE_MASK) != 0) {
-    return 0;
+  if (!r) {
+    r = oldest;  // A new source replaces the one heard from least recently
+    r->addr = addr;
+    r->last_ms = now;
+    r->tokens = DNS_RATE_BURST;
   }
 
-  // Set question response flag
-  header->flags |= QR_FLAG;
-
-  uint16_t qd_count = ntohs(header->qd_count);
-  header->an_count = htons(qd_count);
-
-  int reply_len = qd_count * sizeof(dns_answer_t) + req_len;
-  if (reply_len > dns_reply_max_len) {
-    return -1;
+  const uint32_t refill = (now - r->last_ms) * DNS_RATE_PER_SEC / 1000;
+  if (refill) {
+    r->tokens = MIN(DNS_RATE_BURST, r->tokens + refill);
+    r->last_ms = now;
   }
+  if (!r->tokens)
+    return false;
+  r->tokens -= 1;
+  return true;
+}
 
-  // Pointer to current answer and question
-  char *cur_ans_ptr = dns_reply + req_len;
-  char *cur_qd_ptr = dns_reply + sizeof(dns_header_t);
-  char name[128];
-
-  // Respond to all questions based on configured rules
-  for (int qd_i = 0; qd_i < qd_count; qd_i++) {
-    char *name_end_ptr = parse_dns_name(cur_qd_ptr, name, sizeof(name));
-    if (name_end_ptr == NULL) {
-      ESP_LOGE(TAG, "Failed to parse DNS question: %s", cur_qd_ptr);
-      return -1;
+// Walks the question's name (in DNS label format, ending before `end`), and compares it with the
+// dotted `name`, ignoring case. Returns the end of the name, or NULL if it's malformed.
+static const char *match_name(const char *label, const char *end, const char *name, bool *match) {
+  bool same = true;
+  for (bool first = true; label < end && *label; first = false) {
+    const int len = (uint8_t)*label;
+    if (len > 63 || label + 1 + len >= end)
+      return NULL;
+    if (same && !first) {
+      same = *name == '.';
+      name += same;
     }
+    for (int i = 0; same && i < len; i++)
+      same = *name && tolower((unsigned char)label[1 + i]) == tolower((unsigned char)*name++);
+    label += 1 + len;
+  }
+  if (label >= end)
+    return NULL;
+  *match = same && *name == 0;
+  return label + 1;
+}
 
-    dns_question_t *question = (dns_question_t *)(name_end_ptr);
-    uint16_t qd_type = ntohs(question->type);
-    uint16_t qd_class = ntohs(question->class);
+// Turns the query in h->packet into the reply, in place. Returns the length, or 0 to not reply.
+static int build_reply(dns_server_handle_t h, int len) {
+  char *packet = h->packet;
+  dns_header_t *header = (dns_header_t *)packet;
+  if (len < sizeof(dns_header_t) + 1 + sizeof(dns_question_t))
+    return 0;
+  const uint16_t flags = ntohs(header->flags);
+  // Only a standard query, with the single question every resolver sends
+  if ((flags & QR_FLAG) || (flags & OPCODE_MASK) || ntohs(header->qd_count) != 1)
+    return 0;
 
-    ESP_LOGD(TAG, "Received type: %d | Class: %d | Question for: %s", qd_type, qd_class, name);
+  const char *qname = packet + sizeof(dns_header_t);
+  bool match;
+  const char *end = match_name(qname, packet + len, "", &match);
+  if (!end || end + sizeof(dns_question_t) > packet + len)
+    return 0;
 
-    if (qd_type == QD_TYPE_A) {
-      esp_ip4_addr_t ip = {.addr = IPADDR_ANY};
-      // Check the configured rules to decide whether to answer this question or not
-      for (int i = 0; i < h->num_of_entries; ++i) {
-        // check if the name either corresponds to the entry, or if we should answer to all queries ("*")
-        if (strcmp(h->entry[i].name, "*") == 0 || strcmp(h->entry[i].name, name) == 0) {
-          if (h->entry[i].if_key) {
-            esp_netif_ip_info_t ip_info;
-            esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey(h->entry[i].if_key), &ip_info);
-            ip.addr = ip_info.ip.addr;
-            break;
-          } else if (h->entry->ip.addr != IPADDR_ANY) {
-            ip.addr = h->entry[i].ip.addr;
-            break;
-          }
-        }
-      }
-      if (ip.addr == IPADDR_ANY) {  // no rule applies, continue with another question
+  dns_question_t question;
+  memcpy(&question, end, sizeof(question));
+  int answer = -1;
+  if (ntohs(question.type) == QD_TYPE_A && ntohs(question.class) == QD_CLASS_IN) {
+    for (int i = 0; i < h->num_of_entries && answer < 0; i++) {
+      if (h->answer[i].ip_addr == IPADDR_ANY)
         continue;
-      }
-      dns_answer_t *answer = (dns_answer_t *)cur_ans_ptr;
-
-      answer->ptr_offset = htons(0xC000 | (cur_qd_ptr - dns_reply));
-      answer->type = htons(qd_type);
-      answer->class = htons(qd_class);
-      answer->ttl = htonl(ANS_TTL_SEC);
-
-      ESP_LOGD(TAG, "Answer with PTR offset: 0x%" PRIX16 " and IP 0x%" PRIX32, ntohs(answer->ptr_offset), ip.addr);
-
-      answer->addr_len = htons(sizeof(ip.addr));
-      answer->ip_addr = ip.addr;
+      if (strcmp(h->entry[i].name, "*") == 0 || (match_name(qname, end, h->entry[i].name, &match) && match))
+        answer = i;
     }
   }
+  // Otherwise (eg. AAAA), the reply has no records
+
+  // The header and question stay as they are. Anything after the question (eg. an EDNS record) is replaced.
+  int reply_len = end + sizeof(dns_question_t) - packet;
+  if (reply_len + sizeof(dns_answer_t) > sizeof(h->packet))
+    answer = -1; // A name this long leaves no room for the answer
+  header->flags = htons(QR_FLAG | AA_FLAG | (flags & RD_FLAG));
+  header->an_count = htons(answer >= 0 ? 1 : 0);
+  header->ns_count = 0;
+  header->ar_count = 0;
+  if (answer >= 0) {
+    memcpy(packet + reply_len, &h->answer[answer], sizeof(dns_answer_t));
+    reply_len += sizeof(dns_answer_t);
+  }
   return reply_len;
 }
 
-/*
-    Sets up a socket and listen for DNS queries,
-    replies to all type A queries with the IP of the softAP
-*/
-void dns_server_task(void *pvParameters) {
-  char rx_buffer[128];
-  char addr_str[128];
-  int addr_family;
-  int ip_protocol;
-  dns_server_handle_t handle = pvParameters;
-
-  while (handle->started) {
-    struct sockaddr_in dest_addr;
-    dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(DNS_PORT);
-    addr_family = AF_INET;
-    ip_protocol = IPPROTO_IP;
-    inet_ntoa_r(dest_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-
-    int sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
-    if (sock < 0) {
-      ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-      break;
+void dns_server_process(dns_server_handle_t h) {
+  for (;;) {
+    struct sockaddr_in source_addr;
+    socklen_t socklen = sizeof(source_addr);
+    const int len = recvfrom(h->sock, h->packet, sizeof(h->packet), 0, (struct sockaddr *)&source_addr, &socklen);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+      return;
     }
-
-    int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    if (err < 0) {
-      ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+    if (!rate_allow(h, source_addr.sin_addr.s_addr)) {
+      if (h->dropped++ % 100 == 0)
+        ESP_LOGW(TAG, "DNS: rate limited " IPSTR " (%" PRIu32 " dropped)", IP2STR((esp_ip4_addr_t *)&source_addr.sin_addr), h->dropped);
+      continue;
     }
+    const int reply_len = build_reply(h, len);
+    ESP_LOGD(TAG, "DNS: %d bytes from " IPSTR ", reply %d", len, IP2STR((esp_ip4_addr_t *)&source_addr.sin_addr), reply_len);
+    if (reply_len > 0 && sendto(h->sock, h->packet, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr)) < 0)
+      ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+  }
+}
 
-    while (handle->started) {
-      ESP_LOGI(TAG, "DNS Waiting for data");
-      struct sockaddr_in source_addr;  // Large enough for both IPv4 or IPv6
-      socklen_t socklen = sizeof(source_addr);
-      int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
-
-      // Error occurred during receiving
-      if (len < 0) {
-        ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
-        close(sock);
-        break;
-      }
-      // Data received
-      else {
-        // Get the sender's ip address as string
-        if (source_addr.sin_family == PF_INET) {
-          inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-        }
-
-        // Null-terminate whatever we received and treat like a string...
-        rx_buffer[len] = 0;
-
-        char reply[DNS_MAX_LEN];
-        int reply_len = parse_dns_request(rx_buffer, len, reply, DNS_MAX_LEN, handle);
-
-        ESP_LOGI(TAG, "Received %d bytes from %s | DNS reply with len: %d", len, addr_str, reply_len);
-        if (reply_len <= 0) {
-          ESP_LOGE(TAG, "Failed to prepare a DNS reply");
-        } else {
-          int err = sendto(sock, reply, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
-          if (err < 0) {
-            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-            break;
-          }
-        }
-      }
-    }
+int dns_server_fd(dns_server_handle_t h) {
+  return h ? h->sock : -1;
+}
 
-    if (sock != -1) {
-      ESP_LOGE(TAG, "Shutting down socket");
-      shutdown(sock, 0);
-      close(sock);
+void dns_server_poll(dns_server_handle_t h, uint32_t timeout_ms) {
+  const uint32_t until = now_ms() + timeout_ms;
+  for (;;) {
+    const int32_t remaining = (int32_t)(until - now_ms());
+    if (remaining <= 0)
+      return;
+    if (!h) {
+      vTaskDelay(pdMS_TO_TICKS(remaining));
+      return;
     }
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(h->sock, &readable);
+    struct timeval tv = {.tv_sec = remaining / 1000, .tv_usec = (remaining % 1000) * 1000};
+    if (select(h->sock + 1, &readable, NULL, NULL, &tv) > 0)
+      dns_server_process(h);
   }
-  vTaskDelete(NULL);
 }
 
 dns_server_handle_t start_dns_server(dns_server_config_t *config) {
-  dns_server_handle_t handle = calloc(1, sizeof(struct dns_server_handle) + config->num_of_entries * sizeof(dns_entry_pair_t));
+  ESP_RETURN_ON_FALSE(config->num_of_entries <= DNS_SERVER_MAX_ITEMS, NULL, TAG, "Too many DNS entries");
+  dns_server_handle_t handle = calloc(1, sizeof(struct dns_server_handle));
   ESP_RETURN_ON_FALSE(handle, NULL, TAG, "Failed to allocate dns server handle");
 
-  handle->started = true;
   handle->num_of_entries = config->num_of_entries;
   memcpy(handle->entry, config->item, config->num_of_entries * sizeof(dns_entry_pair_t));
 
-  xTaskCreate(dns_server_task, "dns_server", 4096, handle, 5, &handle->task);
+  // The answers are the same for every query, apart from which one applies
+  for (int i = 0; i < handle->num_of_entries; i++) {
+    esp_ip4_addr_t ip = handle->entry[i].ip;
+    if (handle->entry[i].if_key) {
+      esp_netif_ip_info_t ip_info;
+      if (esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey(handle->entry[i].if_key), &ip_info) == ESP_OK)
+        ip = ip_info.ip;
+    }
+    handle->answer[i] = (dns_answer_t){
+      .ptr_offset = htons(0xC000 | sizeof(dns_header_t)),
+      .type = htons(QD_TYPE_A),
+      .class = htons(QD_CLASS_IN),
+      .ttl = htonl(ANS_TTL_SEC),
+      .addr_len = htons(sizeof(ip.addr)),
+      .ip_addr = ip.addr
+    };
+  }
+
+  struct sockaddr_in dest_addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(DNS_PORT),
+    .sin_addr = {.s_addr = htonl(INADDR_ANY)}
+  };
+  handle->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (handle->sock < 0) {
+    ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+    free(handle);
+    return NULL;
+  }
+  if (bind(handle->sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+    ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+    close(handle->sock);
+    free(handle);
+    return NULL;
+  }
+  fcntl(handle->sock, F_SETFL, fcntl(handle->sock, F_GETFL, 0) | O_NONBLOCK);
   return handle;
 }
 
 void stop_dns_server(dns_server_handle_t handle) {
   if (handle) {
-    handle->started = false;
-    vTaskDelete(handle->task);
+    close(handle->sock);
     free(handle);
   }
 }
@@ -59,16 +59,35 @@
  typedef struct dns_server_handle *dns_server_handle_t;
 
  /**
-  * @brief Set ups and starts a simple DNS server that will respond to all A queries (IPv4)
+  * @brief Sets up a simple DNS server that will respond to all A queries (IPv4)
   * based on configured rules, pairs of name and either IPv4 address or a netif ID (to respond by it's IPv4 add)
   *
+  * @note There's no task: the owner calls dns_server_poll() (or selects on dns_server_fd() and calls
+  * dns_server_process()) from its own loop. The answers are built here, so a netif's IP is the one it has now.
+  *
   * @param config Configuration structure listing the pairs of (name, IP/netif-id)
   * @return dns_server's handle on success, NULL on failure
   */
  dns_server_handle_t start_dns_server(dns_server_config_t *config);
 
  /**
-  * @brief Stops and destroys DNS server's task and structs
+  * @brief Answers queries for `timeout_ms`, sleeping in select() between them
+  * @param handle DNS server's handle (if NULL, just delays)
+  */
+ void dns_server_poll(dns_server_handle_t handle, uint32_t timeout_ms);
+
+ /**
+  * @brief The server's (non-blocking) socket, for a caller's own select() loop
+  */
+ int dns_server_fd(dns_server_handle_t handle);
+
+ /**
+  * @brief Answers all the queries waiting on the socket
+  */
+ void dns_server_process(dns_server_handle_t handle);
+
+ /**
+  * @brief Closes DNS server's socket and frees its structs
   * @param handle DNS server's handle to destroy
   */
  void stop_dns_server(dns_server_handle_t handle);
@@ -2,6 +2,7 @@
 
 #include "esp_ota_ops.h"
 #include "esp_log.h"
+#include "../ota/ota-stream.h"
 #include <string.h>
 
 #define OTA_BUFF_SIZE 1024
@@ -9,30 +10,39 @@ extern const char* TAG;
 
 esp_err_t ota_post_handler(httpd_req_t *req)
 {
-    esp_ota_handle_t ota_handle = 0;
+    static ota_stream_t ota_stream; // Too big for the httpd stack. Only one upload at a time anyway.
     const esp_partition_t *ota_partition = esp_ota_get_next_update_partition(NULL);
     char ota_buff[OTA_BUFF_SIZE];
     int received, remaining = req->content_len;
+    char sha256[72];
+    uint8_t expect[32];
 
     ESP_LOGI(TAG, "Starting OTA update, total size: %d", req->content_len);
 
-    if (esp_ota_begin(ota_partition, OTA_SIZE_UNKNOWN, &ota_handle) != ESP_OK) {
+    // The upload can be a full image, or a delta patch against the running image
+    if (ota_stream_begin(&ota_stream, ota_partition) != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_begin failed");
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA Begin Failed");
         return ESP_FAIL;
     }
+    // Optional manifest, e.g. curl -H "X-SHA256: $(sha256sum trv-1.bin)" --data-binary @trv-1.bin
+    if (httpd_req_get_hdr_value_str(req, "X-SHA256", sha256, sizeof(sha256)) == ESP_OK
+        && ota_parse_sha256(sha256, expect)) {
+        ota_stream_expect_sha256(&ota_stream, expect);
+    }
 
+    // Each chunk is written to flash by the stream's writer task while we receive the next
     while (remaining > 0) {
         received = httpd_req_recv(req, ota_buff, MIN(remaining, OTA_BUFF_SIZE));
         if (received <= 0) {
             ESP_LOGE(TAG, "Error in receiving OTA data");
-            esp_ota_end(ota_handle);
+            ota_stream_abort(&ota_stream);
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Receive Error");
             return ESP_FAIL;
         }
-        if (esp_ota_write(ota_handle, ota_buff, received) != ESP_OK) {
+        if (ota_stream_write(&ota_stream, ota_buff, received) != ESP_OK) {
             ESP_LOGE(TAG, "esp_ota_write failed");
-            esp_ota_end(ota_handle);
+            ota_stream_abort(&ota_stream);
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write Error");
             return ESP_FAIL;
         }
@@ -40,7 +50,7 @@ esp_err_t ota_post_handler(httpd_req_t *req)
         remaining -= received;
     }
 
-    if (esp_ota_end(ota_handle) != ESP_OK) {
+    if (ota_stream_end(&ota_stream) != ESP_OK) { // Including the X-SHA256 check
         ESP_LOGE(TAG, "esp_ota_end failed");
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA End Failed");
         return ESP_FAIL;
@@ -125,6 +125,10 @@ static esp_err_t getHandler(httpd_req_t *req) {
     return handler->getHandler(req);
 }
 
+static esp_err_t postHandler(httpd_req_t *req) {
+    return handler->postHandler(req);
+}
+
 void start_web_server(HttpGetHandler *_handler) {
   if (handler) {
     ESP_LOGI(TAG, "Web server already started");
@@ -157,6 +161,12 @@ void start_web_server(HttpGetHandler *_handler) {
     };
 
     httpd_register_uri_handler(server, &anyGet);
+    static const httpd_uri_t anyPost = { // After /ota, as the first match wins
+      .uri = "*",
+      .method = HTTP_POST,
+      .handler = postHandler
+    };
+    httpd_register_uri_handler(server, &anyPost);
     httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, http_404_error_handler);
   }
 }
@@ -171,6 +181,7 @@ void start_captive_portal(HttpGetHandler *_handler, const char *ssid) {
   esp_log_level_set("httpd_parse", ESP_LOG_WARN);
 
   // Initialize Wi-Fi including netif with default config
+  ESP_ERROR_CHECK(dev_netif_init());
   esp_netif_create_default_wifi_ap();
 
   // Initialise ESP32 in SoftAP mode
@@ -189,6 +200,10 @@ void start_captive_portal(HttpGetHandler *_handler, const char *ssid) {
   dns_handle = start_dns_server(&dns_config);
 }
 
+void poll_captive_portal(uint32_t ms) {
+  dns_server_poll(dns_handle, ms);
+}
+
 void stop_web_server(void) {
     if (server) {
         ESP_LOGI(TAG, "Stopping web server");
@@ -205,6 +220,7 @@ void stop_captive_portal(void) {
 
     // Stop DNS server
     stop_dns_server(dns_handle);
+    dns_handle = NULL;
 
     // Stop HTTP server
     stop_web_server();
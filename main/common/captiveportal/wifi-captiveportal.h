@@ -6,9 +6,14 @@
 class HttpGetHandler {
   public:
     virtual esp_err_t getHandler(httpd_req_t *req) = 0;
+    virtual esp_err_t postHandler(httpd_req_t *req) { // Any POST other than /ota
+      return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+    }
   };
 
 void start_captive_portal(HttpGetHandler *handler, const char *ssid);
+// Answers the portal's DNS queries for `ms`. The caller's loop stands in for a DNS task.
+void poll_captive_portal(uint32_t ms);
 void start_web_server(HttpGetHandler *_handler);
 void stop_web_server(void);
 void stop_captive_portal(void);
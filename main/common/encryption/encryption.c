@@ -6,16 +6,6 @@
 
 #define AES_BLOCK_SIZE 16
 
-// PKCS#7 padding
-static size_t pkcs7_pad(const uint8_t *input, size_t input_len, uint8_t **output) {
-  size_t pad_len = AES_BLOCK_SIZE - (input_len % AES_BLOCK_SIZE);
-  size_t out_len = input_len + pad_len;
-  *output = malloc(out_len);
-  memcpy(*output, input, input_len);
-  memset(*output + input_len, pad_len, pad_len);
-  return out_len;
-}
-
 // Remove PKCS#7 padding
 static int pkcs7_unpad(uint8_t *buf, size_t buf_len, size_t *unpadded_len) {
   if (buf_len == 0) return -1;
@@ -40,52 +30,65 @@ int get_key_for_passphrase(const char *passphrase, uint8_t *key) {
   return 0;
 }
 
-// Encrypts input of arbitrary length with passphrase, returns output buffer and sets output_len
-// Output format: [16 bytes IV][ciphertext...]
-int encrypt_bytes_with_passphrase(const char *input, size_t input_len,
-                                  const uint8_t *key,
-                                  uint8_t **output, size_t *output_len) {
+// Encrypts input of arbitrary length into a buffer of output_size bytes, and sets output_len.
+// Output format: [16 bytes IV][ciphertext...]. Returns -1 if it doesn't fit.
+int encrypt_bytes_into(const void *input, size_t input_len, const uint8_t *key,
+                       uint8_t *output, size_t output_size, size_t *output_len) {
   if (input_len == 0) {
     input_len = strlen((const char *)input) + 1;
   }
+  const size_t whole = input_len - input_len % AES_BLOCK_SIZE;
+  const size_t pad_len = AES_BLOCK_SIZE - (input_len % AES_BLOCK_SIZE);
+  *output_len = AES_BLOCK_SIZE + whole + AES_BLOCK_SIZE;
+  if (*output_len > output_size) {
+    return -1;
+  }
 
   uint8_t iv[AES_BLOCK_SIZE];
 
   // Generate random IV
   esp_fill_random(iv, AES_BLOCK_SIZE);
+  memcpy(output, iv, AES_BLOCK_SIZE);
 
-  // Pad input
-  uint8_t *padded = NULL;
-  size_t padded_len = pkcs7_pad((const uint8_t *)input, input_len, &padded);
+  // The last block, with the PKCS#7 padding
+  uint8_t last[AES_BLOCK_SIZE];
+  memcpy(last, (const uint8_t *)input + whole, AES_BLOCK_SIZE - pad_len);
+  memset(last + AES_BLOCK_SIZE - pad_len, pad_len, pad_len);
 
-  // Allocate output: IV + ciphertext
-  *output_len = AES_BLOCK_SIZE + padded_len;
-  *output = malloc(*output_len);
-  memcpy(*output, iv, AES_BLOCK_SIZE);
-
-  // AES-CBC encryption
+  // AES-CBC encryption. The IV is updated by each call, so the two parts chain.
   mbedtls_aes_context aes;
   mbedtls_aes_init(&aes);
   mbedtls_aes_setkey_enc(&aes, key, 256);
-  mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, padded_len, iv, padded, *output + AES_BLOCK_SIZE);
+  if (whole)
+    mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, whole, iv, input, output + AES_BLOCK_SIZE);
+  mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, AES_BLOCK_SIZE, iv, last, output + AES_BLOCK_SIZE + whole);
   mbedtls_aes_free(&aes);
-
-  free(padded);
   return 0;
 }
 
-// Returns 0 on success, negative on error
-int decrypt_bytes_with_passphrase(const uint8_t *input, size_t input_len,
+int encrypt_bytes_with_passphrase(const char *input, size_t input_len,
                                   const uint8_t *key,
-                                  char **output, size_t *output_len) {
+                                  uint8_t **output, size_t *output_len) {
+  if (input_len == 0) {
+    input_len = strlen((const char *)input) + 1;
+  }
+  const size_t size = AES_BLOCK_SIZE + (input_len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+  *output = malloc(size);
+  if (!*output) {
+    return -2;  // memory allocation failed
+  }
+  return encrypt_bytes_into(input, input_len, key, *output, size, output_len);
+}
+
+// Decrypts into a buffer of output_size bytes (which can't be the input), and sets output_len.
+// Returns 0 on success, negative on error
+int decrypt_bytes_into(const uint8_t *input, size_t input_len, const uint8_t *key,
+                       uint8_t *output, size_t output_size, size_t *output_len) {
   if (input_len < AES_BLOCK_SIZE || (input_len - AES_BLOCK_SIZE) % AES_BLOCK_SIZE != 0) {
     return -1;  // invalid input length
   }
 
   uint8_t iv[AES_BLOCK_SIZE];
-  uint8_t *decrypted = NULL;
-
-  *output = NULL;
   *output_len = 0;
 
   // Extract IV
@@ -93,37 +96,43 @@ int decrypt_bytes_with_passphrase(const uint8_t *input, size_t input_len,
 
   size_t ciphertext_len = input_len - AES_BLOCK_SIZE;
   const uint8_t *ciphertext = input + AES_BLOCK_SIZE;
-
-  // Allocate buffer for decrypted data
-  decrypted = malloc(ciphertext_len);
-  if (!decrypted) {
-    return -2;  // memory allocation failed
+  if (ciphertext_len > output_size) {
+    return -1;  // The padding is decrypted into the output too
   }
 
   // AES-CBC decryption
   mbedtls_aes_context aes;
   mbedtls_aes_init(&aes);
   mbedtls_aes_setkey_dec(&aes, key, 256);
-  mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, ciphertext_len, iv, ciphertext, decrypted);
+  mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, ciphertext_len, iv, ciphertext, output);
   mbedtls_aes_free(&aes);
 
   // Remove PKCS#7 padding
-  size_t unpadded_len = 0;
-  if (pkcs7_unpad(decrypted, ciphertext_len, &unpadded_len) != 0) {
+  if (pkcs7_unpad(output, ciphertext_len, output_len) != 0) {
     // Padding error: wrong passphrase or corrupted data
-    free(decrypted);
+    memset(output, 0, ciphertext_len);
     return -3;
   }
+  return 0;
+}
 
-  // Allocate output buffer for unpadded data
-  *output = malloc(unpadded_len);
-  if (!*output) {
-    free(decrypted);
+int decrypt_bytes_with_passphrase(const uint8_t *input, size_t input_len,
+                                  const uint8_t *key,
+                                  char **output, size_t *output_len) {
+  *output = NULL;
+  *output_len = 0;
+  if (input_len < AES_BLOCK_SIZE) {
+    return -1;  // invalid input length
+  }
+  uint8_t *decrypted = malloc(input_len - AES_BLOCK_SIZE);
+  if (!decrypted) {
     return -2;  // memory allocation failed
   }
-  memcpy(*output, decrypted, unpadded_len);
-  *output_len = unpadded_len;
-
-  free(decrypted);
+  const int e = decrypt_bytes_into(input, input_len, key, decrypted, input_len - AES_BLOCK_SIZE, output_len);
+  if (e) {
+    free(decrypted);
+    return e;
+  }
+  *output = (char *)decrypted;
   return 0;
-}
\ No newline at end of file
+}
@@ -20,6 +20,13 @@ int decrypt_bytes_with_passphrase(const uint8_t *input, size_t input_len,
                                   const uint8_t *key,
                                   char **output, size_t *output_len);
 
+// As above, but into the caller's buffer rather than the heap. The encrypted output is at most
+// 32 bytes longer than the input; the decrypted output needs input_len - 16 bytes (for the padding).
+int encrypt_bytes_into(const void *input, size_t input_len, const uint8_t *key,
+                       uint8_t *output, size_t output_size, size_t *output_len);
+int decrypt_bytes_into(const uint8_t *input, size_t input_len, const uint8_t *key,
+                       uint8_t *output, size_t output_size, size_t *output_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,7 +10,6 @@
 
 extern "C" const char* TAG;
 
-static void adc_calibration_deinit(adc_cali_handle_t handle);
 static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle);
 
 static PinMode lastMode[GPIO_NUM_MAX] = {(PinMode)0};
@@ -50,6 +49,13 @@ static adc_oneshot_unit_handle_t adc_handle = NULL;
 // Add a static mutex for protecting adc_handle initialization
 static SemaphoreHandle_t adc_mutex = NULL;
 
+// Per-channel state, kept for the life of the boot. Creating a calibration scheme
+// reads the eFuses and allocates, so we only do it once per (channel, attenuation)
+#define ADC_MAX_CHANNELS 8
+#define ADC_NOT_CONFIGURED ((adc_atten_t)-1)
+static adc_atten_t configuredAtten[ADC_MAX_CHANNELS];
+static adc_cali_handle_t caliHandle[ADC_MAX_CHANNELS][ADC_ATTEN_DB_12 + 1];
+
 // Ensure the mutex is initialized before use
 static void ensure_adc_mutex_initialized() {
   if (adc_mutex == NULL) {
@@ -60,13 +66,11 @@ static void ensure_adc_mutex_initialized() {
   }
 }
 
-int GPIO::analogRead(int pin, adc_atten_t atten, bool calibrated) {
-  ensure_adc_mutex_initialized(); // Ensure the mutex is created
-
-  // Take the mutex before accessing adc_handle
-  if (xSemaphoreTake(adc_mutex, portMAX_DELAY) != pdTRUE) {
-    ESP_LOGE(TAG, "Failed to take ADC mutex");
-    return -1;
+// Must be called with the adc_mutex held
+static bool adc_prepare_channel(int pin, adc_atten_t atten) {
+  if (pin < 0 || pin >= ADC_MAX_CHANNELS || atten < 0 || atten > ADC_ATTEN_DB_12) {
+    ESP_LOGE(TAG, "Invalid ADC channel %d / attenuation %d", pin, atten);
+    return false;
   }
 
   // Initialize adc_handle if it hasn't been initialized yet
@@ -74,49 +78,112 @@ int GPIO::analogRead(int pin, adc_atten_t atten, bool calibrated) {
     adc_oneshot_unit_init_cfg_t unit_config = { ADC_UNIT_1, ADC_DIGI_CLK_SRC_DEFAULT, ADC_ULP_MODE_DISABLE };
     if (ERR_BACKTRACE(adc_oneshot_new_unit(&unit_config, &adc_handle)) != ESP_OK) {
       ESP_LOGE(TAG, "Failed to create ADC unit for pin %d", pin);
-      xSemaphoreGive(adc_mutex); // Release the mutex before returning
-      return -1;
+      return false;
     }
+    for (int i = 0; i < ADC_MAX_CHANNELS; i++)
+      configuredAtten[i] = ADC_NOT_CONFIGURED;
   }
 
-  // Configure the ADC channel
-  adc_oneshot_chan_cfg_t config = {
-    .atten = atten, // = approx 400mv -> 3800mv. Note: battery is divided by 2 in hardware
-    .bitwidth = ADC_BITWIDTH_12,
-  };
+  // Only reconfigure the channel if the settings changed since the last read
+  if (configuredAtten[pin] != atten) {
+    adc_oneshot_chan_cfg_t config = {
+      .atten = atten, // = approx 400mv -> 3800mv. Note: battery is divided by 2 in hardware
+      .bitwidth = ADC_BITWIDTH_12,
+    };
 
-  if (ERR_BACKTRACE(adc_oneshot_config_channel(adc_handle, (adc_channel_t)pin, &config)) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to configure ADC channel for pin %d", pin);
-    xSemaphoreGive(adc_mutex); // Release the mutex before returning
-    return -1;
+    if (ERR_BACKTRACE(adc_oneshot_config_channel(adc_handle, (adc_channel_t)pin, &config)) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to configure ADC channel for pin %d", pin);
+      configuredAtten[pin] = ADC_NOT_CONFIGURED;
+      return false;
+    }
+    configuredAtten[pin] = atten;
   }
+  return true;
+}
 
-  adc_cali_handle_t adc1_cali_chan_handle = NULL;
-  if (calibrated) {
-    if (!adc_calibration_init(ADC_UNIT_1, (adc_channel_t)pin, ADC_ATTEN_DB_12, &adc1_cali_chan_handle)) {
+// Must be called with the adc_mutex held. Returns NULL if the chip can't be calibrated
+static adc_cali_handle_t adc_calibration_get(int pin, adc_atten_t atten) {
+  static bool failed[ADC_MAX_CHANNELS][ADC_ATTEN_DB_12 + 1];
+  if (!caliHandle[pin][atten] && !failed[pin][atten]) {
+    if (!adc_calibration_init(ADC_UNIT_1, (adc_channel_t)pin, atten, &caliHandle[pin][atten])) {
       ESP_LOGE(TAG, "ADC unit 1 failed calibration init for pin %d", pin);
-      adc1_cali_chan_handle = NULL;
+      caliHandle[pin][atten] = NULL;
+      failed[pin][atten] = true; // Don't retry every read
     }
   }
+  return caliHandle[pin][atten];
+}
+
+// Must be called with the adc_mutex held
+static int adc_read_locked(int pin, adc_atten_t atten, bool calibrated) {
+  if (!adc_prepare_channel(pin, atten))
+    return -1;
 
   int adc_reading = 0;
   if (ERR_BACKTRACE(adc_oneshot_read(adc_handle, (adc_channel_t)pin, &adc_reading)) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to read ADC channel for pin %d", pin);
-    xSemaphoreGive(adc_mutex); // Release the mutex before returning
     return -1;
   }
 
-  if (adc1_cali_chan_handle) {
-    int voltage;
-    adc_cali_raw_to_voltage(adc1_cali_chan_handle, adc_reading, &voltage);
-    adc_calibration_deinit(adc1_cali_chan_handle);
-    adc_reading = voltage;
+  if (calibrated) {
+    adc_cali_handle_t cali = adc_calibration_get(pin, atten);
+    if (cali) {
+      int voltage;
+      adc_cali_raw_to_voltage(cali, adc_reading, &voltage);
+      adc_reading = voltage;
+    }
+  }
+  return adc_reading;
+}
+
+int GPIO::analogRead(int pin, adc_atten_t atten, bool calibrated) {
+  int value = -1;
+  analogReadMulti(&pin, &value, 1, atten, calibrated);
+  return value;
+}
+
+int GPIO::analogReadMulti(const int *pins, int *values, int count, adc_atten_t atten, bool calibrated) {
+  ensure_adc_mutex_initialized(); // Ensure the mutex is created
+
+  // Take the mutex once for the whole batch
+  if (xSemaphoreTake(adc_mutex, portMAX_DELAY) != pdTRUE) {
+    ESP_LOGE(TAG, "Failed to take ADC mutex");
+    return 0;
+  }
+
+  int ok = 0;
+  for (int i = 0; i < count; i++) {
+    values[i] = adc_read_locked(pins[i], atten, calibrated);
+    if (values[i] >= 0)
+      ok++;
   }
 
   // Release the mutex after the operation is complete
   xSemaphoreGive(adc_mutex);
 
-  return adc_reading;
+  return ok;
+}
+
+int GPIO::analogReadAverage(int pin, int samples, adc_atten_t atten, bool calibrated) {
+  ensure_adc_mutex_initialized(); // Ensure the mutex is created
+
+  if (xSemaphoreTake(adc_mutex, portMAX_DELAY) != pdTRUE) {
+    ESP_LOGE(TAG, "Failed to take ADC mutex");
+    return -1;
+  }
+
+  int total = 0, ok = 0;
+  for (int i = 0; i < samples; i++) {
+    const int v = adc_read_locked(pin, atten, calibrated);
+    if (v >= 0) {
+      total += v;
+      ok++;
+    }
+  }
+
+  xSemaphoreGive(adc_mutex);
+
+  return ok ? total / ok : -1;
 }
 
 int GPIO::analogReadMilliVolts(int pin) {
@@ -171,14 +238,3 @@ static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_att
 
     return calibrated;
 }
-
-static void adc_calibration_deinit(adc_cali_handle_t handle)
-{
-#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
-    ESP_ERROR_CHECK(adc_cali_delete_scheme_curve_fitting(handle));
-
-#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
-    ESP_LOGI(TAG, "deregister %s calibration scheme", "Line Fitting");
-    ESP_ERROR_CHECK(adc_cali_delete_scheme_line_fitting(handle));
-#endif
-}
\ No newline at end of file
@@ -17,6 +17,11 @@ class GPIO {
         static bool digitalRead(int pin);
         static int analogRead(int pin, adc_atten_t atten = ADC_ATTEN_DB_12, bool calibrated = false);
         static int analogReadMilliVolts(int pin);
+        // Read several channels (or the same channel repeatedly) under a single ADC lock.
+        // Failed reads are returned as -1. Returns the number of successful reads.
+        static int analogReadMulti(const int *pins, int *values, int count, adc_atten_t atten = ADC_ATTEN_DB_12, bool calibrated = false);
+        // Average of `samples` back-to-back conversions, or -1 if they all failed
+        static int analogReadAverage(int pin, int samples, adc_atten_t atten = ADC_ATTEN_DB_12, bool calibrated = false);
 };
 
 #endif // IO_H
\ No newline at end of file
@@ -0,0 +1,532 @@
+#include "ota-stream.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_app_format.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+extern const char* TAG;
+
+#define OTA_WRITER_STACK 4096
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+} ota_stream_chunk_t;
+
+static esp_err_t consume(ota_stream_t *s, const uint8_t *p, size_t len);
+
+static void stream_init(ota_stream_t *s, const esp_partition_t *target) {
+  memset(s, 0, sizeof(*s));
+  s->target = target;
+  s->op = OTA_DELTA_END;
+  portMUX_INITIALIZE(&s->lock);
+  mbedtls_sha256_init(&s->sha);
+  mbedtls_sha256_init(&s->input_sha);
+  mbedtls_sha256_starts(&s->input_sha, 0);
+}
+
+static void writer_task(void *arg) {
+  ota_stream_t *s = (ota_stream_t *)arg;
+  ota_stream_chunk_t chunk;
+  for (;;) {
+    xQueueReceive(s->full, &chunk, portMAX_DELAY);
+    if (!s->failed)
+      consume(s, chunk.data, chunk.len);
+    xQueueSend(s->empty, &chunk.data, portMAX_DELAY);
+  }
+}
+
+// Without the writer task (if there isn't the memory) data is simply written as it arrives
+static void start_writer(ota_stream_t *s) {
+  s->buffers = (uint8_t *)malloc(2 * OTA_STREAM_BUFFER);
+  s->full = xQueueCreate(2, sizeof(ota_stream_chunk_t));
+  s->empty = xQueueCreate(2, sizeof(uint8_t *));
+  if (s->buffers && s->full && s->empty) {
+    for (int i = 0; i < 2; i++) {
+      uint8_t *buffer = s->buffers + i * OTA_STREAM_BUFFER;
+      xQueueSend(s->empty, &buffer, 0);
+    }
+    // The same priority as the receiver, so the writer runs whenever it's waiting on the network
+    if (xTaskCreate(writer_task, "ota_writer", OTA_WRITER_STACK, s, uxTaskPriorityGet(NULL), &s->writer) == pdPASS)
+      return;
+  }
+  ESP_LOGW(TAG, "ota_stream: no pipeline, writing synchronously");
+  s->writer = NULL;
+  if (s->full)
+    vQueueDelete(s->full);
+  if (s->empty)
+    vQueueDelete(s->empty);
+  free(s->buffers);
+  s->full = s->empty = NULL;
+  s->buffers = NULL;
+}
+
+static void submit(ota_stream_t *s) {
+  const ota_stream_chunk_t chunk = { .data = s->fill, .len = s->fill_len };
+  xQueueSend(s->full, &chunk, portMAX_DELAY);
+  s->fill = NULL;
+  s->fill_len = 0;
+}
+
+// Wait for the writer to finish with both buffers, then stop it. A part filled buffer is only
+// written if `flush`, so an abandoned stream stops at a sector boundary.
+static void stop_writer(ota_stream_t *s, bool flush) {
+  if (!s->writer)
+    return;
+  int held = 0;
+  if (s->fill) {
+    if (flush && s->fill_len)
+      submit(s);
+    else
+      held++;
+  }
+  while (held < 2) {
+    uint8_t *buffer;
+    xQueueReceive(s->empty, &buffer, portMAX_DELAY);
+    held++;
+  }
+  vTaskDelete(s->writer);
+  vQueueDelete(s->full);
+  vQueueDelete(s->empty);
+  free(s->buffers);
+  s->writer = NULL;
+  s->full = s->empty = NULL;
+  s->buffers = s->fill = NULL;
+  s->fill_len = 0;
+}
+
+static void release(ota_stream_t *s) {
+  stop_writer(s, false);
+  free(s->lz_window);
+  s->lz_window = NULL;
+  mbedtls_sha256_free(&s->sha);
+  mbedtls_sha256_free(&s->input_sha);
+}
+
+esp_err_t ota_stream_begin(ota_stream_t *s, const esp_partition_t *target) {
+  stream_init(s, target);
+  s->format = OTA_STREAM_DETECT;
+  // Sectors are erased as they're reached, so an image much smaller than the partition is quick to write
+  esp_err_t err = esp_ota_begin(target, OTA_WITH_SEQUENTIAL_WRITES, &s->handle);
+  if (err == ESP_OK)
+    start_writer(s);
+  else
+    release(s);
+  return err;
+}
+
+// Check what's already in flash, and add it to the input hash
+static esp_err_t check_prefix(ota_stream_t *s, uint32_t len, uint32_t crc) {
+  // Nothing's been written yet, so the pipeline's buffers are free to use
+  uint8_t *buffer = s->buffers ? s->buffers : s->buffer;
+  const size_t size = s->buffers ? OTA_STREAM_BUFFER : sizeof(s->buffer);
+  uint32_t actual = 0;
+  for (uint32_t pos = 0; pos < len; pos += size) {
+    const size_t n = MIN(size, len - pos);
+    esp_err_t err = esp_partition_read(s->target, pos, buffer, n);
+    if (err != ESP_OK)
+      return err;
+    actual = esp_rom_crc32_le(actual, buffer, n);
+    mbedtls_sha256_update(&s->input_sha, buffer, n);
+  }
+  if (actual != crc) {
+    ESP_LOGW(TAG, "ota_stream: partial image in flash doesn't match");
+    return ESP_ERR_INVALID_CRC;
+  }
+  return ESP_OK;
+}
+
+esp_err_t ota_stream_resume(ota_stream_t *s, const esp_partition_t *target, uint32_t offset, uint32_t crc) {
+  stream_init(s, target);
+  s->format = OTA_STREAM_RAW;
+  start_writer(s);
+  esp_err_t err = offset <= target->size ? check_prefix(s, offset, crc) : ESP_ERR_INVALID_SIZE;
+  if (err == ESP_OK)
+    err = esp_ota_resume(target, OTA_WITH_SEQUENTIAL_WRITES, offset, &s->handle);
+  if (err != ESP_OK) {
+    release(s);
+    return err;
+  }
+  s->written = offset;
+  s->committed = offset;
+  s->committed_crc = crc;
+  return ESP_OK;
+}
+
+void ota_stream_expect_sha256(ota_stream_t *s, const uint8_t sha256[32]) {
+  memcpy(s->expect_sha256, sha256, sizeof(s->expect_sha256));
+  s->expect = true;
+}
+
+static esp_err_t emit(ota_stream_t *s, const uint8_t *data, size_t len) {
+  if (s->format == OTA_STREAM_DELTA) {
+    if (s->written + len > s->header.target_size) {
+      ESP_LOGE(TAG, "ota_stream: patch output exceeds target size %lu", s->header.target_size);
+      return ESP_ERR_INVALID_SIZE;
+    }
+    mbedtls_sha256_update(&s->sha, data, len);
+  }
+  esp_err_t err = esp_ota_write(s->handle, data, len);
+  if (err == ESP_OK)
+    s->written += len;
+  return err;
+}
+
+static esp_err_t check_header(ota_stream_t *s) {
+  const ota_delta_header_t *h = &s->header;
+  if (memcmp(h->magic, OTA_DELTA_MAGIC, sizeof(h->magic)) || h->version != OTA_DELTA_VERSION) {
+    ESP_LOGE(TAG, "ota_stream: not an app image or delta patch");
+    return ESP_ERR_INVALID_VERSION;
+  }
+  if (h->target_size > s->target->size) {
+    ESP_LOGE(TAG, "ota_stream: target of %lu bytes won't fit", h->target_size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // The patch only makes sense against the image it was generated from
+  s->source = esp_ota_get_running_partition();
+  uint8_t sha[32];
+  esp_err_t err = esp_partition_get_sha256(s->source, sha);
+  if (err != ESP_OK)
+    return err;
+  if (memcmp(sha, h->source_sha256, sizeof(sha))) {
+    ESP_LOGE(TAG, "ota_stream: patch is for a different source image");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  mbedtls_sha256_starts(&s->sha, 0);
+  return ESP_OK;
+}
+
+static esp_err_t copy_from_source(ota_stream_t *s, uint32_t from, uint32_t len) {
+  if (from + len < from || from + len > s->header.source_size || from + len > s->source->size) {
+    ESP_LOGE(TAG, "ota_stream: copy %lu+%lu is outside the source", from, len);
+    return ESP_ERR_INVALID_ARG;
+  }
+  while (len) {
+    const size_t n = MIN(len, sizeof(s->buffer));
+    esp_err_t err = esp_partition_read(s->source, from, s->buffer, n);
+    if (err == ESP_OK)
+      err = emit(s, s->buffer, n);
+    if (err != ESP_OK)
+      return err;
+    from += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+// Consume as much of the input as makes up the current op, returning the number of bytes used (or -1)
+static int delta_step(ota_stream_t *s, const uint8_t *p, size_t len) {
+  if (s->finished) {
+    ESP_LOGE(TAG, "ota_stream: data after the end of the patch");
+    return -1;
+  }
+
+  if (s->op == OTA_DELTA_END) {
+    s->op = *p;
+    s->arg = 0;
+    s->shift = 0;
+    s->value = 0;
+    if (s->op == OTA_DELTA_END) {
+      s->finished = true;
+    } else if (s->op != OTA_DELTA_COPY && s->op != OTA_DELTA_INSERT) {
+      ESP_LOGE(TAG, "ota_stream: bad op 0x%02x", s->op);
+      return -1;
+    }
+    return 1;
+  }
+
+  if (s->op == OTA_DELTA_INSERT && s->arg == 1) {
+    // Literal bytes, straight through
+    const size_t n = MIN(len, s->remaining);
+    if (emit(s, p, n) != ESP_OK)
+      return -1;
+    s->remaining -= n;
+    if (!s->remaining)
+      s->op = OTA_DELTA_END;
+    return n;
+  }
+
+  // LEB128 varint argument
+  if (s->shift > 28) {
+    ESP_LOGE(TAG, "ota_stream: bad varint");
+    return -1;
+  }
+  s->value |= (uint32_t)(*p & 0x7F) << s->shift;
+  s->shift += 7;
+  if (*p & 0x80)
+    return 1;
+
+  const uint32_t value = s->value;
+  s->value = 0;
+  s->shift = 0;
+  if (s->op == OTA_DELTA_COPY) {
+    if (s->arg++ == 0) {
+      s->copy_from = value;
+    } else {
+      if (copy_from_source(s, s->copy_from, value) != ESP_OK)
+        return -1;
+      s->op = OTA_DELTA_END;
+    }
+  } else { // OTA_DELTA_INSERT length
+    s->arg = 1;
+    s->remaining = value;
+    if (!value)
+      s->op = OTA_DELTA_END;
+  }
+  return 1;
+}
+
+static void detect(ota_stream_t *s, uint8_t first) {
+  s->format = first == ESP_IMAGE_HEADER_MAGIC ? OTA_STREAM_RAW : OTA_STREAM_DELTA;
+  ESP_LOGI(TAG, "ota_stream: %s%s", s->compressed ? "compressed " : "", s->format == OTA_STREAM_RAW ? "app image" : "delta patch");
+}
+
+// The image (or patch), after any decompression
+static esp_err_t write_image(ota_stream_t *s, const uint8_t *p, size_t len) {
+  if (s->format == OTA_STREAM_DETECT && len)
+    detect(s, p[0]);
+
+  if (s->format == OTA_STREAM_RAW) {
+    esp_err_t err = esp_ota_write(s->handle, p, len);
+    if (err == ESP_OK)
+      s->written += len;
+    return err;
+  }
+
+  while (len) {
+    if (s->header_len < sizeof(s->header)) {
+      const size_t n = MIN(len, sizeof(s->header) - s->header_len);
+      memcpy((uint8_t *)&s->header + s->header_len, p, n);
+      s->header_len += n;
+      p += n;
+      len -= n;
+      if (s->header_len == sizeof(s->header) && check_header(s) != ESP_OK)
+        return ESP_FAIL;
+      continue;
+    }
+    const int used = delta_step(s, p, len);
+    if (used < 0)
+      return ESP_FAIL;
+    p += used;
+    len -= used;
+  }
+  return ESP_OK;
+}
+
+enum { LZ_TAG, LZ_LITERAL, LZ_DISTANCE, LZ_LENGTH };
+
+static esp_err_t lz_flush(ota_stream_t *s) {
+  const size_t n = s->lz_stage_len;
+  s->lz_stage_len = 0;
+  return n ? write_image(s, s->lz_stage, n) : ESP_OK;
+}
+
+static esp_err_t lz_output(ota_stream_t *s, uint8_t byte) {
+  if (s->lz_out >= s->lz_header.size) {
+    ESP_LOGE(TAG, "ota_stream: decompressed data exceeds %lu bytes", s->lz_header.size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  const uint32_t mask = (1UL << s->lz_header.window_bits) - 1;
+  s->lz_window[s->lz_out & mask] = byte;
+  s->lz_out++;
+  s->lz_stage[s->lz_stage_len++] = byte;
+  return s->lz_stage_len == sizeof(s->lz_stage) ? lz_flush(s) : ESP_OK;
+}
+
+static esp_err_t lz_check_header(ota_stream_t *s) {
+  const ota_lz_header_t *h = &s->lz_header;
+  if (memcmp(h->magic, OTA_LZ_MAGIC, sizeof(h->magic)) || h->version != OTA_LZ_VERSION
+    || h->window_bits < 4 || h->window_bits > OTA_LZ_MAX_WINDOW_BITS
+    || h->length_bits < 1 || h->length_bits > 8) {
+    ESP_LOGE(TAG, "ota_stream: unsupported compression (window %u, length %u bits)", h->window_bits, h->length_bits);
+    return ESP_ERR_INVALID_VERSION;
+  }
+  if (h->size > s->target->size) {
+    ESP_LOGE(TAG, "ota_stream: decompressed image of %lu bytes won't fit", h->size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  s->lz_window = (uint8_t *)malloc(1UL << h->window_bits);
+  return s->lz_window ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+// Decompress into write_image()
+static esp_err_t lz_write(ota_stream_t *s, const uint8_t *p, size_t len) {
+  esp_err_t err = ESP_OK;
+  while (len && err == ESP_OK) {
+    if (s->lz_header_len < sizeof(s->lz_header)) {
+      const size_t n = MIN(len, sizeof(s->lz_header) - s->lz_header_len);
+      memcpy((uint8_t *)&s->lz_header + s->lz_header_len, p, n);
+      s->lz_header_len += n;
+      p += n;
+      len -= n;
+      if (s->lz_header_len == sizeof(s->lz_header))
+        err = lz_check_header(s);
+      continue;
+    }
+
+    s->lz_bits = (s->lz_bits << 8) | *p++;
+    s->lz_bit_count += 8;
+    len--;
+    // Decode every field that's now complete. The padding after the last one is never used.
+    while (err == ESP_OK && s->lz_out < s->lz_header.size) {
+      const uint8_t need = s->lz_state == LZ_TAG ? 1 : s->lz_state == LZ_LITERAL ? 8
+        : s->lz_state == LZ_DISTANCE ? s->lz_header.window_bits : s->lz_header.length_bits;
+      if (s->lz_bit_count < need)
+        break;
+      s->lz_bit_count -= need;
+      const uint32_t value = (s->lz_bits >> s->lz_bit_count) & ((1UL << need) - 1);
+
+      switch (s->lz_state) {
+        case LZ_TAG:
+          s->lz_state = value ? LZ_LITERAL : LZ_DISTANCE;
+          break;
+        case LZ_LITERAL:
+          err = lz_output(s, value);
+          s->lz_state = LZ_TAG;
+          break;
+        case LZ_DISTANCE:
+          s->lz_distance = value + 1;
+          s->lz_state = LZ_LENGTH;
+          break;
+        case LZ_LENGTH: {
+          if (s->lz_distance > s->lz_out) {
+            ESP_LOGE(TAG, "ota_stream: back reference %u before the start", s->lz_distance);
+            return ESP_ERR_INVALID_ARG;
+          }
+          const uint32_t mask = (1UL << s->lz_header.window_bits) - 1;
+          for (uint32_t n = value + OTA_LZ_MIN_MATCH; n && err == ESP_OK; n--)
+            err = lz_output(s, s->lz_window[(s->lz_out - s->lz_distance) & mask]);
+          s->lz_state = LZ_TAG;
+          break;
+        }
+      }
+    }
+  }
+  return err == ESP_OK ? lz_flush(s) : err;
+}
+
+// Run by the writer task (or by ota_stream_write, without one)
+static esp_err_t consume(ota_stream_t *s, const uint8_t *data, size_t len) {
+  esp_err_t err = s->compressed ? lz_write(s, data, len) : write_image(s, data, len);
+  if (err != ESP_OK) {
+    s->failed = true;
+    return err;
+  }
+  const uint32_t crc = esp_rom_crc32_le(s->committed_crc, data, len);
+  taskENTER_CRITICAL(&s->lock);
+  s->committed += len;
+  s->committed_crc = crc;
+  taskEXIT_CRITICAL(&s->lock);
+  return ESP_OK;
+}
+
+esp_err_t ota_stream_write(ota_stream_t *s, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  if (s->failed)
+    return ESP_FAIL;
+
+  // The first byte says what we've got. A compressed image's own format is found once it's decompressed.
+  if (!s->compressed && s->format == OTA_STREAM_DETECT && len) {
+    if (p[0] == OTA_LZ_MAGIC[0])
+      s->compressed = true;
+    else
+      detect(s, p[0]);
+  }
+  mbedtls_sha256_update(&s->input_sha, p, len);
+
+  if (!s->writer)
+    return consume(s, p, len);
+
+  while (len) {
+    if (!s->fill)
+      xQueueReceive(s->empty, &s->fill, portMAX_DELAY);
+    const size_t n = MIN(len, OTA_STREAM_BUFFER - s->fill_len);
+    memcpy(s->fill + s->fill_len, p, n);
+    s->fill_len += n;
+    p += n;
+    len -= n;
+    if (s->fill_len == OTA_STREAM_BUFFER)
+      submit(s);
+  }
+  // An error from the writer shows up a buffer or two late
+  return s->failed ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t ota_stream_end(ota_stream_t *s) {
+  stop_writer(s, true);
+  if (s->failed || s->format == OTA_STREAM_DETECT
+    || (s->format == OTA_STREAM_DELTA && s->header_len < sizeof(s->header))
+    || (s->compressed && s->lz_out != s->lz_header.size)) {
+    ota_stream_abort(s);
+    return ESP_FAIL;
+  }
+
+  uint8_t sha[32];
+  mbedtls_sha256_finish(&s->input_sha, sha);
+  if (s->expect && memcmp(sha, s->expect_sha256, sizeof(sha))) {
+    ESP_LOGE(TAG, "ota_stream: SHA-256 doesn't match the manifest");
+    ota_stream_abort(s);
+    return ESP_ERR_INVALID_CRC;
+  }
+  if (s->format == OTA_STREAM_DELTA) {
+    mbedtls_sha256_finish(&s->sha, sha);
+    if (!s->finished || s->written != s->header.target_size
+      || memcmp(sha, s->header.target_sha256, sizeof(sha))) {
+      ESP_LOGE(TAG, "ota_stream: patched image doesn't match (%lu of %lu bytes)", s->written, s->header.target_size);
+      ota_stream_abort(s);
+      return ESP_ERR_INVALID_CRC;
+    }
+  }
+
+  const esp_ota_handle_t handle = s->handle;
+  s->handle = 0;
+  release(s);
+  // Also checks the image's own checksum & appended SHA-256
+  return esp_ota_end(handle);
+}
+
+void ota_stream_abort(ota_stream_t *s) {
+  stop_writer(s, false);
+  if (s->handle) {
+    esp_ota_abort(s->handle);
+    s->handle = 0;
+  }
+  release(s);
+}
+
+uint32_t ota_stream_committed(ota_stream_t *s, uint32_t *crc) {
+  taskENTER_CRITICAL(&s->lock);
+  const uint32_t committed = s->committed;
+  if (crc)
+    *crc = s->committed_crc;
+  taskEXIT_CRITICAL(&s->lock);
+  return committed;
+}
+
+static int nibble(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = tolower((unsigned char)c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+bool ota_parse_sha256(const char *hex, uint8_t sha256[32]) {
+  if (!hex)
+    return false;
+  for (int i = 0; i < 32; i++) {
+    const int hi = nibble(hex[i * 2]);
+    const int lo = hi < 0 ? -1 : nibble(hex[i * 2 + 1]);
+    if (lo < 0)
+      return false;
+    sha256[i] = (hi << 4) | lo;
+  }
+  // Allow for sha256sum's output, with the file name after the hash
+  return !hex[64] || isspace((unsigned char)hex[64]);
+}
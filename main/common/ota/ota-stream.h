@@ -0,0 +1,159 @@
+#ifndef OTA_STREAM_H
+#define OTA_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mbedtls/sha256.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A sink for OTA data that accepts either a plain app image, or a delta patch generated by
+   tools/ota-delta.py against the image that's currently running, either of which can also be
+   compressed by tools/ota-compress.py. The format is detected from the first byte, so the HTTP,
+   portal upload and ESP-NOW paths don't need to know which they're being sent.
+
+   Delta format (little endian):
+     ota_delta_header_t
+     { op } ...
+   where each op is a tag byte followed by LEB128 varints:
+     OTA_DELTA_COPY   <source offset> <length>    Copy bytes from the running partition
+     OTA_DELTA_INSERT <length> <bytes...>         Literal bytes
+     OTA_DELTA_END
+
+   Compressed format: ota_lz_header_t followed by an LZSS bit stream (MSB first), as heatshrink:
+     1 <8 bits>                                   A literal byte
+     0 <window_bits: distance-1> <length_bits: length-OTA_LZ_MIN_MATCH>   Repeat earlier output
+   The decoder needs a window of 1 << window_bits bytes, so that's limited to OTA_LZ_MAX_WINDOW_BITS.
+
+   Writes are pipelined: ota_stream_write() copies into one sector-sized buffer while a writer task
+   erases & writes (or patches from) the other, so the network and the flash overlap. The SHA-256
+   of the input, as transferred, is also calculated on the way through, and can be checked against
+   a manifest (ota_stream_expect_sha256) before the image is accepted.
+*/
+
+#define OTA_DELTA_MAGIC "TRVD"
+#define OTA_DELTA_VERSION 1
+
+#define OTA_DELTA_END     0x00
+#define OTA_DELTA_COPY    0x01
+#define OTA_DELTA_INSERT  0x02
+
+#define OTA_LZ_MAGIC "LZSS"
+#define OTA_LZ_VERSION 1
+#define OTA_LZ_MIN_MATCH 2
+#define OTA_LZ_MAX_WINDOW_BITS 12
+
+#define OTA_STREAM_BUFFER 4096  // One flash sector, so what's committed is always sector aligned
+
+typedef struct __attribute__((packed)) {
+  char magic[4];                // OTA_DELTA_MAGIC
+  uint8_t version;              // OTA_DELTA_VERSION
+  uint8_t reserved[3];
+  uint32_t source_size;
+  uint8_t source_sha256[32];    // As reported by esp_partition_get_sha256() for the running image
+  uint32_t target_size;
+  uint8_t target_sha256[32];    // Of the image the patch produces
+} ota_delta_header_t;
+
+typedef struct __attribute__((packed)) {
+  char magic[4];                // OTA_LZ_MAGIC
+  uint8_t version;              // OTA_LZ_VERSION
+  uint8_t window_bits;
+  uint8_t length_bits;
+  uint8_t reserved;
+  uint32_t size;                // Decompressed
+} ota_lz_header_t;
+
+typedef enum {
+  OTA_STREAM_DETECT,
+  OTA_STREAM_RAW,
+  OTA_STREAM_DELTA
+} ota_stream_format_t;
+
+typedef struct {
+  esp_ota_handle_t handle;
+  const esp_partition_t *target;
+  const esp_partition_t *source;
+  ota_stream_format_t format;   // Of the image, once decompressed
+  bool compressed;
+  uint32_t written;             // Bytes written to the target partition
+  volatile bool failed;
+
+  // Pipeline. If the writer task can't be started, data is written synchronously instead.
+  TaskHandle_t writer;
+  QueueHandle_t full;           // Buffers for the writer
+  QueueHandle_t empty;          // Buffers it's finished with
+  uint8_t *buffers;             // 2 * OTA_STREAM_BUFFER
+  uint8_t *fill;                // The buffer being filled (NULL while waiting for one)
+  size_t fill_len;
+  portMUX_TYPE lock;
+  uint32_t committed;           // Bytes of input that have reached flash (under lock)
+  uint32_t committed_crc;       // CRC32 of those bytes (under lock)
+
+  // Verification of the input against a manifest
+  mbedtls_sha256_context input_sha;
+  uint8_t expect_sha256[32];
+  bool expect;
+
+  // Delta decoder
+  ota_delta_header_t header;
+  size_t header_len;
+  uint8_t op;                   // Current op, or OTA_DELTA_END when waiting for the next
+  uint8_t arg;                  // Which varint of the op we're reading
+  uint8_t shift;
+  uint32_t value;
+  uint32_t copy_from;
+  uint32_t remaining;           // Of the current INSERT, once its length is known
+  bool finished;                // OTA_DELTA_END seen
+  mbedtls_sha256_context sha;
+  uint8_t buffer[256];          // For copying from the source partition
+
+  // LZSS decoder
+  ota_lz_header_t lz_header;
+  size_t lz_header_len;
+  uint8_t *lz_window;           // The last 1 << window_bits bytes of output
+  uint32_t lz_out;              // Bytes of output so far
+  uint32_t lz_bits;             // Bits read but not yet used (the low lz_bit_count of them)
+  uint8_t lz_bit_count;
+  uint8_t lz_state;
+  uint16_t lz_distance;
+  uint8_t lz_stage[256];        // Output waiting to be written
+  size_t lz_stage_len;
+} ota_stream_t;
+
+// Start writing a new image to the target partition (normally esp_ota_get_next_update_partition(NULL))
+esp_err_t ota_stream_begin(ota_stream_t *s, const esp_partition_t *target);
+// Continue a plain image that was interrupted after `offset` bytes had been written. The flash is
+// checked against `crc` (from ota_stream_committed) first, and hashed for ota_stream_expect_sha256.
+esp_err_t ota_stream_resume(ota_stream_t *s, const esp_partition_t *target, uint32_t offset, uint32_t crc);
+// Check the SHA-256 of all the input (including any resumed from) in ota_stream_end()
+void ota_stream_expect_sha256(ota_stream_t *s, const uint8_t sha256[32]);
+esp_err_t ota_stream_write(ota_stream_t *s, const void *data, size_t len);
+// Verify the image. It's up to the caller to call esp_ota_set_boot_partition()
+esp_err_t ota_stream_end(ota_stream_t *s);
+// Give up. Full buffers already queued are still written, so a plain image can be resumed from
+// what's been committed.
+void ota_stream_abort(ota_stream_t *s);
+// Bytes of input in flash, and their CRC32. Always a multiple of OTA_STREAM_BUFFER until the end.
+uint32_t ota_stream_committed(ota_stream_t *s, uint32_t *crc);
+
+// Parse a 64 character hex SHA-256, as used in manifests and the hub's messages
+bool ota_parse_sha256(const char *hex, uint8_t sha256[32]);
+
+// Only a plain image can be resumed part way through, as the decoders' state isn't kept
+static inline bool ota_stream_resumable(const ota_stream_t *s) { return s->format == OTA_STREAM_RAW && !s->compressed; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OTA_STREAM_H
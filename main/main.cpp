@@ -2,12 +2,16 @@
 
 #include "common/gpio/gpio.hpp"
 #include "esp_app_desc.h"
-#include "esp_netif.h"
 #include "esp_sleep.h"
+#include "esp_system.h"
 #include "net/esp-now.hpp"
-#include "nvs_flash.h"
+#include "net/device-radio.hpp"
 #include "pins.h"
+#include "src/board.h"
 #include "src/CaptiveWifi.h"
+#include "src/event-log.h"
+#include "src/heap-stats.h"
+#include "src/probation.h"
 #include "src/WithTask.hpp"
 #include "src/trv-state.h"
 #include "trv.h"
@@ -21,9 +25,13 @@ static RTC_DATA_ATTR int messageCheckCount = 0;
 static RTC_DATA_ATTR int wakeCount = 0;
 char versionDetail[110] = {0};
 #define RECALIBRATE_PERIOD_SECS (24 * 3600 * 25) // Recalibrate every 25 days
+#define LOW_BATTERY_DAYS 7 // Check in less often when the battery will last less than this
+#define WAKE_BUDGET_MS 90000 // Cancel outstanding tasks after this long awake (a calibration takes ~45s)
+#define LOW_BATTERY_WAKE_BUDGET_MS 30000
 
 uint32_t woken() {
   Trv trv; // Loads static state from FS
+  Probation::pass(PROBATION_TRV);
   if (debugFlag(DEBUG_LOG_INFO))
     esp_log_level_set(TAG, ESP_LOG_INFO);
   if (debugFlag(DEBUG_DELAY_LOGGING)) {
@@ -34,43 +42,56 @@ uint32_t woken() {
   }
   if (trv.flatBattery() && !trv.is_charging()) {
     ESP_LOGW(TAG, "Battery exhausted");
+    EventLog::add(EV_FLAT_BATTERY);
     // Skip tidy up - we're dead
     esp_sleep_enable_ext1_wakeup(1ULL << TOUCH_PIN, ESP_EXT1_WAKEUP_ANY_HIGH);
+    Probation::endWake(false);
     return 0x7FFFFFFF;
   }
 
   ESP_LOGI(TAG, "Build: %s. Wake: %d reset: %d count: %d",
     versionDetail, esp_sleep_get_wakeup_cause(), esp_reset_reason(), wakeCount);
+  EventLog::add(EV_WAKE, esp_sleep_get_wakeup_cause(), esp_reset_reason(), wakeCount);
 
-  if (wakeCount > RECALIBRATE_PERIOD_SECS / trv.getConfig().sleep_time) {
+  const auto batteryDays = trv.batteryDays();
+  const bool lowBattery = !trv.is_charging() && batteryDays >= 0 && batteryDays < LOW_BATTERY_DAYS;
+  if (wakeCount > RECALIBRATE_PERIOD_SECS / trv.getConfig().sleep_time && !lowBattery) {
     ESP_LOGI(TAG, "Recalibration period reached (%d secs), starting calibration", RECALIBRATE_PERIOD_SECS);
     trv.calibrate();
     wakeCount = 0;
   }
 
-  EspNet net; // Start Wi-Fi based on Trv state (loaded above)
+  if (EspNet::paired())
+    Probation::pass(PROBATION_PAIRED);
+  DeviceRadio radio;
+  EspNet net(radio); // Start Wi-Fi based on Trv state (loaded above)
 
   uint32_t dreamSecs = 1;
+  uint32_t wakeBudget = lowBattery ? LOW_BATTERY_WAKE_BUDGET_MS : WAKE_BUDGET_MS;
   TouchButton touchButton;
   if (!trv.deviceName()[0] || touchButton.pressed() == PRESSED) {
     ESP_LOGI(TAG, "Touch button pressed / device name '%s'", trv.deviceName());
-    CaptivePortal portal(&trv, trv.deviceName());
-    switch (portal.exitStatus) {
-      case exit_status_t::CALIBRATE:
-        trv.calibrate();
-        break;
-      case exit_status_t::TEST_MODE:
-        trv.testMode(touchButton);
-        break;
-      case exit_status_t::POWER_OFF:
-        ESP_LOGI(TAG, "Power off requested");
-        dreamSecs = 0x7FFFFFFF;  // Forever
-        EspNet::unpair();
-        break;
-      case exit_status_t::CLOSED:
-      case exit_status_t::NONE:
-      case exit_status_t::TIME_OUT:
-        break;
+    wakeBudget = 0xFFFFFFFF; // The user is interacting, so don't cut anything short
+    // A hub with its pairing window open can set us up over ESP-NOW. Otherwise it's the portal.
+    if (!net.provision(&trv)) {
+      CaptivePortal portal(&trv, trv.deviceName());
+      switch (portal.exitStatus) {
+        case exit_status_t::CALIBRATE:
+          trv.calibrate();
+          break;
+        case exit_status_t::TEST_MODE:
+          trv.testMode(touchButton);
+          break;
+        case exit_status_t::POWER_OFF:
+          ESP_LOGI(TAG, "Power off requested");
+          dreamSecs = 0x7FFFFFFF;  // Forever
+          EspNet::unpair();
+          break;
+        case exit_status_t::CLOSED:
+        case exit_status_t::NONE:
+        case exit_status_t::TIME_OUT:
+          break;
+      }
     }
   } else {
     net.checkMessages(&trv);
@@ -85,14 +106,46 @@ uint32_t woken() {
       messageCheckCount = 0;
 
     dreamSecs = trv.getConfig().sleep_time;
+    if (lowBattery) {
+      ESP_LOGI(TAG, "Battery low (%d days left), extending sleep", batteryDays);
+      dreamSecs *= 2;
+    }
   }
 
+  bool cancelling = false;
   while (WithTask::waitForAllTasks(1234) == TIMEOUT) {
-    if (net.wait(1) != TIMEOUT) {
-      net.sendStateToHub(&trv);
+    if (!cancelling && millis() > wakeBudget) {
+      ESP_LOGW(TAG, "Wake budget of %lums exceeded, cancelling tasks", wakeBudget);
+      EventLog::add(EV_BUDGET_EXCEEDED, wakeBudget);
+      WithTask::cancelAll();
+      cancelling = true;
+    }
+    if (net.wait(1) != TIMEOUT && net.sendStateToHub(&trv)) {
+      Probation::pass(PROBATION_HUB_ACK);
     }
   }
-  net.sendStateToHub(&trv);
+  if (net.sendStateToHub(&trv)) {
+    Probation::pass(PROBATION_HUB_ACK);
+    Probation::reported();
+  }
+  net.sendEventLog(); // After the state, so it includes this wake's events so far
+  if (!cancelling)
+    Probation::pass(PROBATION_WAKE_TIME);
+
+  // Firmware offered by the hub is pulled over ESP-NOW for the rest of the wake budget. A plain image
+  // that isn't finished carries on next wake.
+  if (!lowBattery && millis() < wakeBudget && net.receiveFirmware(wakeBudget)) {
+    ESP_LOGI(TAG, "Firmware received, restarting");
+    esp_restart(); // Flushes any pending state first
+  }
+
+  // A new image that fails its health checks rolls back (and restarts) here
+  Probation::endWake(wakeBudget != 0xFFFFFFFF);
+
+  if (lowBattery || dreamSecs == 0x7FFFFFFF) {
+    // Don't hold changes in RTC memory if we might not wake again
+    trv.flush();
+  }
 
   if (trv.requiresNetworkControl()) {
     // We have to do this incase there's a pending OTA request executed by the TRV desctructor
@@ -123,26 +176,27 @@ extern "C" void app_main() {
   esp_log_level_set("wifi", ESP_LOG_ERROR);
 
   wakeCount += 1;
+  EventLog::begin();
 
   const auto app = esp_app_get_description();
   snprintf((char*)versionDetail, sizeof versionDetail, "%s %s %s",
            app->version, app->date, app->time);
 
-  esp_err_t ret = nvs_flash_init();
-  if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
-      ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-    ESP_ERROR_CHECK(nvs_flash_erase());
-    ret = nvs_flash_init();
-  }
-  ESP_ERROR_CHECK(ret);
-  ESP_ERROR_CHECK(esp_netif_init());
-  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  // On a warm wake the state comes from RTC memory, so NVS is initialised by whatever first needs it
+  // (the radio, for its calibration data). The netif & event loop are left to the portal, OTA and pairing.
+  if (!Trv::warmBoot())
+    ESP_ERROR_CHECK(dev_nvs_init());
+  Probation::begin();
 
   auto dreamSecs = woken();
 
   GPIO::digitalWrite(LED_BUILTIN, true);
   GPIO::pinMode(TOUCH_PIN, INPUT);
 
+  BatteryMonitor::accountWake(millis(), dreamSecs);
+  EventLog::add(EV_SLEEP, dreamSecs, millis());
+  const auto heap = HeapStats::get();
+  EventLog::add(EV_HEAP, heap.allocs, heap.bytes, heap.frees, heap.min_free);
   esp_sleep_enable_timer_wakeup(dreamSecs * 1000000ULL);
   ESP_LOGW(TAG, FREEHOUSE_MODEL " (build %s) device '%s' dbg=0x%04x. Deep sleep %u secs\n", versionDetail, Trv::deviceName(), debugFlag(DEBUG_ALL), dreamSecs);
 
@@ -0,0 +1,12 @@
+#ifndef DEVICE_RADIO_H
+#define DEVICE_RADIO_H
+
+// The radio main.cpp gives EspNet: ESP-NOW on the chip, or the simulated one in a host build (host/)
+#ifdef FREEHOUSE_HOST
+#include "host-radio.hpp"
+#else
+#include "esp-now-transport.hpp"
+typedef EspNowTransport DeviceRadio;
+#endif
+
+#endif
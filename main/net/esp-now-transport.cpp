@@ -0,0 +1,139 @@
+#include "esp-now-transport.hpp"
+
+#include "esp_log.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include "string.h"
+
+#include "../src/board.h"
+#include "../trv.h"
+
+static_assert(NOW_MAX_DATA_LEN == ESP_NOW_MAX_DATA_LEN_V2, "NOW_MAX_DATA_LEN doesn't match ESP-NOW");
+
+static now_recv_cb_t receiver = NULL;
+static now_send_cb_t sender = NULL;
+
+static void boundRx(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len) {
+  if (!receiver)
+    return;
+  const now_recv_info_t info = {
+    .src = esp_now_info->src_addr,
+    .dst = esp_now_info->des_addr,
+    .channel = (uint8_t)esp_now_info->rx_ctrl->channel,
+    .second = (uint8_t)esp_now_info->rx_ctrl->second,
+    .rssi = (int8_t)esp_now_info->rx_ctrl->rssi,
+  };
+  receiver(&info, data, data_len);
+}
+
+static void boundTx(const esp_now_send_info_t *tx_info, esp_now_send_status_t status) {
+  if (sender)
+    sender(tx_info->des_addr, status == ESP_NOW_SEND_SUCCESS);
+}
+
+esp_err_t EspNowTransport::begin(now_recv_cb_t rx, now_send_cb_t tx) {
+  // 1. Configure WiFi
+  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(dev_wifi_init(&cfg));
+
+  // 2. Avoid NVS usage for faster startup
+  ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+  // 3. Set minimal WiFi mode (STA or AP)
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  ESP_ERROR_CHECK(esp_wifi_start());
+
+  // 4. Initialize ESP-NOW
+  ESP_ERROR_CHECK(esp_now_init());
+
+  // 5. Register callbacks
+  receiver = rx;
+  sender = tx;
+  esp_now_register_recv_cb(boundRx);
+  esp_now_register_send_cb(boundTx);
+  return ESP_OK;
+}
+
+esp_err_t EspNowTransport::end() {
+  receiver = NULL;
+  sender = NULL;
+  watchChannel(false);
+  ESP_ERROR_CHECK(esp_now_deinit());
+  ESP_ERROR_CHECK(esp_wifi_stop());
+  return dev_wifi_deinit();
+}
+
+esp_err_t EspNowTransport::addPeer(const uint8_t *mac, uint8_t channel) {
+  esp_now_peer_info_t peer;
+  memset(&peer, 0, sizeof(peer));
+  memcpy(peer.peer_addr, mac, sizeof(peer.peer_addr));
+  peer.channel = channel;
+  peer.encrypt = false;
+
+  return (esp_now_is_peer_exist(mac) ? esp_now_mod_peer
+                                     : esp_now_add_peer)(&peer);
+}
+
+static volatile uint8_t new_channel = 0xFF; // Invalid channel
+static void channel_change_event(void *event_handler_arg,
+                                 esp_event_base_t event_base, int32_t event_id,
+                                 void *event_data) {
+  // ESP_LOGI(TAG, "Channel change event %s %ld", event_base, event_id);
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_HOME_CHANNEL_CHANGE) {
+    wifi_event_home_channel_change_t *event =
+        (wifi_event_home_channel_change_t *)event_data;
+    // ESP_LOGI(TAG, "Channel change %u+%u was %u+%u", event->new_chan,
+    // event->new_snd, event->old_chan, event->old_snd);
+    new_channel = event->new_chan;
+  }
+}
+
+// Settling waits for the channel change event. The event loop isn't created on a normal wake, so
+// this is only done the first time a wake needs it (pairing, provisioning).
+void EspNowTransport::watchChannel(bool watch) {
+  if (watch == watchingChannel)
+    return;
+  if (watch) {
+    ESP_ERROR_CHECK(dev_event_loop_init());
+    esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_HOME_CHANNEL_CHANGE,
+                               channel_change_event, NULL);
+  } else {
+    esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_HOME_CHANNEL_CHANGE,
+                                 channel_change_event);
+  }
+  watchingChannel = watch;
+}
+
+esp_err_t EspNowTransport::setChannel(uint8_t channel, bool settle) {
+  if (!settle)
+    return esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+
+  watchChannel(true);
+  uint8_t current;
+  wifi_second_chan_t secondary;
+  esp_err_t e = esp_wifi_get_channel(&current, &secondary);
+  ESP_LOGI(TAG, "Set wifi channel %d, current = %d", channel, current);
+  if (e == ESP_OK && current == channel) {
+    return ESP_OK;
+  }
+  new_channel = 0xFF; // Reset volatile
+  e = esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+  if (e == ESP_OK) {
+    int elapsed = 0;
+    while (new_channel != channel && elapsed < 500) {
+      delay(5);
+      elapsed += 5;
+    }
+    if (new_channel != channel) {
+      ESP_LOGW(TAG, "Timed out waiting for channel %d change event", channel);
+      e = ESP_ERR_TIMEOUT;
+    }
+  } else {
+    ESP_LOGE(TAG, "Failed to set channel %d", channel);
+  }
+  return e;
+}
+
+esp_err_t EspNowTransport::send(const uint8_t *mac, const uint8_t *data, size_t len) {
+  return esp_now_send(mac, data, len);
+}
@@ -0,0 +1,20 @@
+#ifndef ESP_NOW_TRANSPORT_H
+#define ESP_NOW_TRANSPORT_H
+
+#include "now-transport.hpp"
+
+// The real radio. ESP-NOW has one set of callbacks, so there's only ever one of these.
+class EspNowTransport : public NowTransport {
+protected:
+  bool watchingChannel = false;
+  void watchChannel(bool watch);
+
+public:
+  esp_err_t begin(now_recv_cb_t rx, now_send_cb_t tx) override;
+  esp_err_t end() override;
+  esp_err_t addPeer(const uint8_t *mac, uint8_t channel) override;
+  esp_err_t setChannel(uint8_t channel, bool settle = true) override;
+  esp_err_t send(const uint8_t *mac, const uint8_t *data, size_t len) override;
+};
+
+#endif
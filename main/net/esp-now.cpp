@@ -1,20 +1,21 @@
 #include "esp-now.hpp"
 
-#include <sstream>
-#include <string>
-
 #include "esp_log.h"
-#include "esp_wifi.h"
+#include "esp_system.h"
 #include "string.h"
 
 #include "../common/encryption/encryption.h"
-#include "../src/board.h"
+#include "../src/event-log.h"
+#include "../src/StrBuf.hpp"
+#include "fw-transfer.hpp"
 #include "helpers.h"
+#include "provision.hpp"
 
 #define PAIR_DELIM "\x1D"
 #define MACSTR "%02X:%02X:%02X:%02X:%02X:%02X"
 #define MAC2STR(mac) mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]
 #define NOW_RESPONSE_TIME 20 // Was 50ms
+#define NOW_BULK_TRIES 3     // Sends of an event log frame before we give up until the next wake
 
 typedef uint8_t MACAddr[6];
 
@@ -23,35 +24,28 @@ RTC_DATA_ATTR static MACAddr hub = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 RTC_DATA_ATTR static int wifiChannel = 0;
 RTC_DATA_ATTR static signed int avgRssi = 0;
 
+// A JSON message that arrived before we had a Trv to give it to
+static char bufferedMessage[NOW_MAX_DATA_LEN + 1];
+// The state as sent to the hub. The task stats are dropped if they'd make it too big to send.
+static char stateJson[NOW_MAX_DATA_LEN + 1];
+
 // Hack to debug the latest connection info
-std::string debugNetworkInfo() {
-  std::stringstream ss;
-  char macStr[18];
-  snprintf(macStr, sizeof(macStr), MACSTR, MAC2STR(hub));
-  ss << "Hub: " << macStr << ", Channel: " << wifiChannel
-     << ", Avg RSSI: " << avgRssi;
-  return ss.str();
+const char *debugNetworkInfo() {
+  static char info[64];
+  snprintf(info, sizeof(info), "Hub: " MACSTR ", Channel: %d, Avg RSSI: %d", MAC2STR(hub), wifiChannel, avgRssi);
+  return info;
 }
 
 typedef struct {
   MACAddr mac;
-  esp_wifi_rxctrl_t rx;
+  uint8_t channel;
+  uint8_t second;
+  int8_t rssi;
 } pairing_info_t;
 
 static pairing_info_t pairInfo[20];
 static pairing_info_t *nextPair = NULL;
 
-esp_err_t add_peer(const uint8_t *mac, uint8_t channel) {
-  esp_now_peer_info_t peer;
-  memset(&peer, 0, sizeof(peer));
-  memcpy(peer.peer_addr, mac, sizeof(peer.peer_addr));
-  peer.channel = channel;
-  peer.encrypt = false;
-
-  return (esp_now_is_peer_exist(mac) ? esp_now_mod_peer
-                                     : esp_now_add_peer)(&peer);
-}
-
 void EspNet::setTrv(Trv *t) {
   if (t == NULL) {
     ESP_LOGE(TAG, "setTrv: trv is NULL");
@@ -62,42 +56,98 @@ void EspNet::setTrv(Trv *t) {
   trv = t;
 }
 
-void EspNet::sendStateToHub(Trv *t) {
+bool EspNet::sendStateToHub(Trv *t) {
   setTrv(t);
   wait(); // Ensure discovery is finished
 
-  if (!bufferedMessage.empty()) {
-    trv->processNetMessage(bufferedMessage.c_str());
-    bufferedMessage.clear();
+  if (bufferedMessage[0]) {
+    trv->processNetMessage(bufferedMessage);
+    bufferedMessage[0] = 0;
   }
 
   if (wifiChannel == 0 || memcmp(hub, BROADCAST_ADDR, sizeof(hub)) == 0) {
     ESP_LOGW(TAG, "Not paired with hub, not sending state");
-    return;
+    return false;
   }
 
-  add_peer(hub, wifiChannel);
+  radio.addPeer(hub, wifiChannel);
 
   // TODO: Check if the state has changed since the last update
-  const trv_state_t &state = trv->getState(); // causes a wait()
-  auto json = trv->asJson(state, avgRssi);
-  xEventGroupClearBits(sendEvent, BIT0);
-  auto status = esp_now_send(hub, (uint8_t *)json.c_str(), json.length());
+  // We don't need to wait for the Trv task (which may be moving the valve), just the sensor readings
+  const trv_state_t &state = *trv->sensorsRead.get();
+  StrBuf json(stateJson);
+  trv->asJson(json, state, avgRssi);
+  if (json.overflowed())
+    ESP_LOGW(TAG, "Send state: truncated at %u bytes", json.length());
+  xEventGroupClearBits(sendEvent, BIT0 | BIT1);
+  auto status = radio.send(hub, (const uint8_t *)json.c_str(), json.length());
   if (status == ESP_OK) {
-    if (!(xEventGroupWaitBits(sendEvent, BIT0, pdTRUE, pdTRUE, pdMS_TO_TICKS(100)) & BIT0))
+    const auto bits = xEventGroupWaitBits(sendEvent, BIT0, pdFALSE, pdTRUE, pdMS_TO_TICKS(100));
+    EventLog::add(EV_HUB_SEND, json.length(), status, (bits & BIT1) != 0);
+    if (!(bits & BIT0))
       ESP_LOGW(TAG, "Send state [%u] %s Timed-out", json.length(), json.c_str());
     else
       ESP_LOGI(TAG, "Send state [%u] %s", json.length(), json.c_str());
-  } else {
-    ESP_LOGI(TAG, "Send state [%u] %s failed (%u)", json.length(), json.c_str(), status);
+    return bits & BIT1;
+  }
+  EventLog::add(EV_HUB_SEND, json.length(), status, false);
+  ESP_LOGI(TAG, "Send state [%u] %s failed (%u)", json.length(), json.c_str(), status);
+  return false;
+}
+
+bool EspNet::pendingMessages() const {
+  return bufferedMessage[0] != 0;
+}
+
+bool EspNet::sendToHub(const uint8_t *data, size_t len) {
+  if (wifiChannel == 0 || memcmp(hub, BROADCAST_ADDR, sizeof(hub)) == 0)
+    return false;
+  return radio.send(hub, data, len) == ESP_OK;
+}
+
+bool EspNet::receiveFirmware(uint32_t untilMs) {
+  if (!FirmwareTransfer::pending())
+    return false;
+  wait();
+  radio.addPeer(hub, wifiChannel);
+  FirmwareTransfer transfer(this);
+  bulkSending = true; // A lost FWAK is sent again when the window times out
+  const bool complete = transfer.run(untilMs);
+  bulkSending = false;
+  return complete;
+}
+
+void EspNet::sendEventLog() {
+  if (!EventLog::requested())
+    return;
+  wait();
+  if (wifiChannel == 0 || memcmp(hub, BROADCAST_ADDR, sizeof(hub)) == 0)
+    return;
+  radio.addPeer(hub, wifiChannel);
+  event_log_frame_t frame;
+  size_t len;
+  bulkSending = true;
+  while ((len = EventLog::nextFrame(&frame)) > 0) {
+    bool acked = false;
+    for (int tries = 0; tries < NOW_BULK_TRIES && !acked; tries++) {
+      xEventGroupClearBits(sendEvent, BIT0 | BIT1);
+      if (radio.send(hub, (const uint8_t *)&frame, len) != ESP_OK)
+        break;
+      // One frame at a time, so we don't overrun the send queue
+      acked = xEventGroupWaitBits(sendEvent, BIT0, pdFALSE, pdTRUE, pdMS_TO_TICKS(100)) & BIT1;
+    }
+    if (!acked) {
+      ESP_LOGW(TAG, "Event log: frame from %lu not acked", frame.first);
+      break;
+    }
   }
+  bulkSending = false;
 }
 
-void EspNet::data_receive_callback(const esp_now_recv_info_t *esp_now_info,
+void EspNet::data_receive_callback(const now_recv_info_t *info,
                                    const uint8_t *data, int data_len)
 {
-  avgRssi = avgRssi ? (avgRssi + esp_now_info->rx_ctrl->rssi) / 2
-                    : esp_now_info->rx_ctrl->rssi;
+  avgRssi = avgRssi ? (avgRssi + info->rssi) / 2 : info->rssi;
 
   // JSON message received
   if (data[0] == '{')
@@ -105,18 +155,34 @@ void EspNet::data_receive_callback(const esp_now_recv_info_t *esp_now_info,
     // We got some data
     if (trv == NULL)
     {
-      if (!bufferedMessage.empty())
+      if (bufferedMessage[0])
       {
-        ESP_LOGW(TAG, "recv-now: Overwriting buffered message: '%s'", bufferedMessage.c_str());
+        ESP_LOGW(TAG, "recv-now: Overwriting buffered message: '%s'", bufferedMessage);
       }
       ESP_LOGI(TAG, "recv-now: Message received but trv is NULL (buffering)");
-      bufferedMessage = std::string((const char *)data, data_len);
+      const int len = data_len < (int)sizeof(bufferedMessage) - 1 ? data_len : sizeof(bufferedMessage) - 1;
+      memcpy(bufferedMessage, data, len);
+      bufferedMessage[len] = 0;
       return;
     }
     trv->processNetMessage((const char *)data);
     return;
   }
 
+  // Firmware block transfer
+  if (data_len >= 4 && memcmp(data, "FW", 2) == 0)
+  {
+    FirmwareTransfer::dispatch(data, data_len);
+    return;
+  }
+
+  // Provisioning reply
+  if (data_len >= 4 && memcmp(data, "PR", 2) == 0)
+  {
+    Provisioning::dispatch(info, data, data_len);
+    return;
+  }
+
   // Pairing acknowledgement received
   if (memcmp(data, "PACK", 4) == 0)
   {
@@ -134,18 +200,22 @@ void EspNet::data_receive_callback(const esp_now_recv_info_t *esp_now_info,
     // Avoid duplicate macs
     for (auto p = pairInfo; p < nextPair; p++)
     {
-      if (memcmp(p->mac, esp_now_info->src_addr, sizeof(MACAddr)) == 0)
+      if (memcmp(p->mac, info->src, sizeof(MACAddr)) == 0)
       {
-        if (p->rx.rssi < esp_now_info->rx_ctrl->rssi)
+        if (p->rssi < info->rssi)
         {
-          p->rx = *esp_now_info->rx_ctrl;
+          p->channel = info->channel;
+          p->second = info->second;
+          p->rssi = info->rssi;
         }
         return;
       }
     }
     auto p = nextPair++;
-    p->rx = *esp_now_info->rx_ctrl;
-    memcpy(p->mac, esp_now_info->src_addr, sizeof(MACAddr));
+    memcpy(p->mac, info->src, sizeof(MACAddr));
+    p->channel = info->channel;
+    p->second = info->second;
+    p->rssi = info->rssi;
     return;
   }
 
@@ -153,20 +223,19 @@ void EspNet::data_receive_callback(const esp_now_recv_info_t *esp_now_info,
   {
     // We're not a hub/mesh. Just ignore this
     ESP_LOGI(TAG, "Ignore JOIN: src:" MACSTR " dst: " MACSTR ", ch %u+%u, rssi %d",
-             MAC2STR(esp_now_info->src_addr), MAC2STR(esp_now_info->des_addr),
-             esp_now_info->rx_ctrl->channel, esp_now_info->rx_ctrl->second,
-             esp_now_info->rx_ctrl->rssi);
+             MAC2STR(info->src), MAC2STR(info->dst),
+             info->channel, info->second, info->rssi);
     return;
   }
 
   if (memcmp(data, "NACK", 4) == 0)
   {
-    if (wifiChannel > 0 && (wifiChannel == esp_now_info->rx_ctrl->channel ||
-                            wifiChannel == esp_now_info->rx_ctrl->second))
+    if (wifiChannel > 0 && (wifiChannel == info->channel ||
+                            wifiChannel == info->second))
     {
+      EventLog::add(EV_HUB_NACK, info->channel);
       ESP_LOGW(TAG, "NACK from hub " MACSTR " on channel %d+%d. Disconnecting",
-               MAC2STR(esp_now_info->src_addr), esp_now_info->rx_ctrl->channel,
-               esp_now_info->rx_ctrl->second);
+               MAC2STR(info->src), info->channel, info->second);
       unpair();
       return;
     }
@@ -174,19 +243,22 @@ void EspNet::data_receive_callback(const esp_now_recv_info_t *esp_now_info,
 
   // Other unknown message received
   ESP_LOGI(TAG, "?recv-now: src:" MACSTR " dst: " MACSTR ", ch %u+%u, rssi %d: %.*s",
-           MAC2STR(esp_now_info->src_addr), MAC2STR(esp_now_info->des_addr),
-           esp_now_info->rx_ctrl->channel, esp_now_info->rx_ctrl->second,
-           esp_now_info->rx_ctrl->rssi, data_len, data);
+           MAC2STR(info->src), MAC2STR(info->dst),
+           info->channel, info->second, info->rssi, data_len, data);
   return;
 }
 
-void EspNet::data_send_callback(const uint8_t *mac_addr,
-                                esp_now_send_status_t status) {
-  if (sendEvent)
-    xEventGroupSetBits(sendEvent, BIT0);
-  if (status != ESP_NOW_SEND_SUCCESS) {
-    if (memcmp(hub, mac_addr, sizeof(hub)) == 0) {
+void EspNet::data_send_callback(const uint8_t *mac_addr, bool acked) {
+  BatteryMonitor::accountTx();
+  if (sendEvent) // BIT0: sent, BIT1: acked
+    xEventGroupSetBits(sendEvent, acked ? BIT0 | BIT1 : BIT0);
+  if (!acked) {
+    if (memcmp(hub, mac_addr, sizeof(hub)) == 0 && bulkSending) {
+      // Retried by the sender, so one lost frame doesn't throw away the pairing mid transfer
+      ESP_LOGI(TAG, "send-now: " MACSTR " %s", MAC2STR(mac_addr), "failed - will retry");
+    } else if (memcmp(hub, mac_addr, sizeof(hub)) == 0) {
       ESP_LOGI(TAG, "send-now: " MACSTR " %s (hub )" MACSTR " %s)", MAC2STR(mac_addr), MAC2STR(hub), "failed - disconnecting");
+      EventLog::add(EV_SEND_FAILED);
       unpair();
     } else {
       // This can happen if we get a NACK from a hub we tried to contact, or we moved hubs
@@ -198,18 +270,17 @@ void EspNet::data_send_callback(const uint8_t *mac_addr,
 }
 
 EspNet *instance;
-static void boundRx(const esp_now_recv_info_t *esp_now_info,
+static void boundRx(const now_recv_info_t *info,
                     const uint8_t *data, int data_len) {
   if (instance)
-    instance->data_receive_callback(esp_now_info, data, data_len);
+    instance->data_receive_callback(info, data, data_len);
 }
-static void boundTx(const esp_now_send_info_t *tx_info,
-                    esp_now_send_status_t status) {
+static void boundTx(const uint8_t *mac, bool acked) {
   if (instance)
-    instance->data_send_callback(tx_info->des_addr, status);
+    instance->data_send_callback(mac, acked);
 }
 
-EspNet::EspNet() : trv(NULL) {
+EspNet::EspNet(NowTransport &radio) : radio(radio), trv(NULL) {
   ESP_LOGI(TAG, "Init EspNet");
   instance = this;
   sendEvent = xEventGroupCreate();
@@ -218,15 +289,11 @@ EspNet::EspNet() : trv(NULL) {
 
 void EspNet::deinit() {
   ESP_LOGI(TAG, "De-init radio");
-  ESP_ERROR_CHECK(esp_now_deinit());
-  ESP_ERROR_CHECK(esp_wifi_stop());
-  ESP_ERROR_CHECK(dev_wifi_deinit());
+  ESP_ERROR_CHECK(radio.end());
 }
 
 EspNet::~EspNet() {
   instance = NULL;
-  if (this->joinPhrase)
-    free(this->joinPhrase);
   if (sendEvent)
     vEventGroupDelete(sendEvent);
 
@@ -234,102 +301,53 @@ EspNet::~EspNet() {
   // deinit();
 }
 
-static volatile uint8_t new_channel = 0xFF; // Invalid channel
-static void channel_change_event(void *event_handler_arg,
-                                 esp_event_base_t event_base, int32_t event_id,
-                                 void *event_data) {
-  // ESP_LOGI(TAG, "Channel change event %s %ld", event_base, event_id);
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_HOME_CHANNEL_CHANGE) {
-    wifi_event_home_channel_change_t *event =
-        (wifi_event_home_channel_change_t *)event_data;
-    // ESP_LOGI(TAG, "Channel change %u+%u was %u+%u", event->new_chan,
-    // event->new_snd, event->old_chan, event->old_snd);
-    new_channel = event->new_chan;
-  }
-}
+// Broadcast the frame on every channel, waiting a moment on each for the replies
+void EspNet::scan_channels(const uint8_t *frame, size_t len) {
+  radio.addPeer(BROADCAST_ADDR, 0);
 
-esp_err_t set_channel(uint8_t channel) {
-  uint8_t current;
-  wifi_second_chan_t secondary;
-  esp_err_t e = esp_wifi_get_channel(&current, &secondary);
-  ESP_LOGI(TAG, "Set wifi channel %d, current = %d", channel, current);
-  if (e == ESP_OK && current == channel) {
-    return ESP_OK;
-  }
-  new_channel = 0xFF; // Reset volatile
-  e = esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
-  if (e == ESP_OK) {
-    int elapsed = 0;
-    while (new_channel != channel && elapsed < 500) {
-      delay(5);
-      elapsed += 5;
-    }
-    if (new_channel != channel) {
-      ESP_LOGW(TAG, "Timed out waiting for channel %d change event", channel);
-      e = ESP_ERR_TIMEOUT;
-    } else {
-      wifiChannel = channel;
-    }
-  } else {
-    ESP_LOGE(TAG, "Failed to set channel %d", channel);
+  for (uint8_t ch = NOW_FIRST_CHANNEL; ch < NOW_FIRST_CHANNEL + NOW_CHANNELS; ch++) {
+    radio.setChannel(ch);
+    radio.send(BROADCAST_ADDR, frame, len);
+    delay(NOW_RESPONSE_TIME); // Wait for responses
   }
-  return e;
 }
 
 void EspNet::pair_with_hub() {
-  esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_HOME_CHANNEL_CHANGE,
-                             channel_change_event, NULL);
-
-  add_peer(BROADCAST_ADDR, 0);
   memset(pairInfo, 0, sizeof(pairInfo));
   nextPair = pairInfo;
-
-  wifi_country_t country = {.cc = "GB",
-                            .schan = 1,
-                            .nchan = 13,
-                            .policy = WIFI_COUNTRY_POLICY_MANUAL};
-
-  ESP_LOGI(TAG, "Wifi channel info %3s %d %d policy %d", country.cc,
-           country.schan, country.nchan, country.policy);
-
-  for (uint8_t ch = country.schan; ch < country.schan + country.nchan; ch++) {
-    set_channel(ch);
-    esp_now_send(BROADCAST_ADDR, this->joinPhrase, this->joinPhraseLen);
-    delay(NOW_RESPONSE_TIME); // Wait for responses
-  }
+  scan_channels(this->joinPhrase, this->joinPhraseLen);
   pairing_info_t *lastPair = nextPair;
   nextPair = NULL;
 
   pairing_info_t *best = NULL;
   for (auto p = pairInfo; p < lastPair; p++) {
-    add_peer(p->mac, p->rx.channel);
-    if (!best || p->rx.rssi > best->rx.rssi)
+    radio.addPeer(p->mac, p->channel);
+    if (!best || p->rssi > best->rssi)
       best = p;
   }
 
   if (best == NULL) {
+    EventLog::add(EV_PAIR_FAILED);
     ESP_LOGW(TAG, "Failed to find hub");
   } else {
     ESP_LOGI(TAG, "Best hub " MACSTR " channel %d+%d, rssi %d",
-             MAC2STR(best->mac), best->rx.channel, best->rx.second,
-             best->rx.rssi);
+             MAC2STR(best->mac), best->channel, best->second, best->rssi);
     for (auto p = pairInfo; p < lastPair; p++) {
       if (p != best && memcmp(p->mac, best->mac, sizeof(MACAddr))) {
-        add_peer(p->mac, p->rx.channel);
-        set_channel(p->rx.channel);
-        ERR_BACKTRACE(esp_now_send(p->mac, (const uint8_t *)"NACK", 5));
+        radio.setChannel(p->channel);
+        ERR_BACKTRACE(radio.send(p->mac, (const uint8_t *)"NACK", 5));
         ESP_LOGI(TAG, "Nack'd hub " MACSTR " channel %d+%d, rssi %d",
-                 MAC2STR(p->mac), p->rx.channel, p->rx.second, p->rx.rssi);
+                 MAC2STR(p->mac), p->channel, p->second, p->rssi);
       }
     }
 
     memcpy(hub, best->mac, sizeof(MACAddr));
-    set_channel(best->rx.channel);
+    radio.setChannel(best->channel);
+    wifiChannel = best->channel;
+    EventLog::add(EV_PAIRED, wifiChannel, best->rssi, lastPair - pairInfo);
     ESP_LOGI(TAG, "Paired with hub " MACSTR " on channel %d", MAC2STR(hub),
              wifiChannel);
   }
-  esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_HOME_CHANNEL_CHANGE,
-                               channel_change_event);
 }
 
 void EspNet::unpair() {
@@ -338,6 +356,10 @@ void EspNet::unpair() {
   wifiChannel = 0;
 }
 
+bool EspNet::paired() {
+  return !(wifiChannel == 0 || memcmp(hub, BROADCAST_ADDR, sizeof(hub)) == 0);
+}
+
 typedef struct {
   size_t len;
   uint8_t phrase[512];
@@ -346,11 +368,9 @@ typedef struct {
 } join_cache_t;
 
 RTC_DATA_ATTR static join_cache_t prevJoin;
+#define JOIN_PLAIN_MAX 448 // The pairing JSON. Encrypted, it has to fit prevJoin.phrase.
 
-void EspNet::task() {
-  uint8_t *out;
-  size_t out_len;
-
+void EspNet::buildJoinPhrase() {
   const char* currentName = Trv::deviceName();
   const uint8_t* currentKey = Trv::getPassKey();
 
@@ -362,70 +382,42 @@ void EspNet::task() {
                     (memcmp(prevJoin.passKey, currentKey, 32) == 0);
 
   if (cacheValid) {
-    this->joinPhrase = (uint8_t *)malloc(prevJoin.len);
-    memcpy(this->joinPhrase, prevJoin.phrase, prevJoin.len);
-    this->joinPhraseLen = prevJoin.len;
-    ESP_LOGI(TAG, "Using cached JOIN phrase (%d bytes)", (int)this->joinPhraseLen);
+    ESP_LOGI(TAG, "Using cached JOIN phrase (%d bytes)", (int)prevJoin.len);
   } else {
-    std::stringstream pairName;
-    pairName << currentName
-             << PAIR_DELIM "FreeHouse" PAIR_DELIM "{"
-                           "\"model\":\"" FREEHOUSE_MODEL "\","
-                           "\"state_version\":"
-             << Trv::stateVersion()
-             << ","
-                "\"build\":\""
-             << versionDetail
-             << "\","
-                "\"writeable\":[";
-
-    for (auto p = Trv::writeable; *p; p++) {
-      if (p != Trv::writeable)
-        pairName << ",";
-      pairName << "\"" << *p << "\"";
-    }
-    pairName << "]}";
-
-    ESP_LOGI(TAG, "Pairing as: %s", pairName.str().c_str());
-    if (encrypt_bytes_with_passphrase(pairName.str().c_str(), 0,
-                                      currentKey, &out,
-                                      &out_len) == 0) {
-      this->joinPhraseLen = out_len + 4;
-      this->joinPhrase = (uint8_t *)malloc(this->joinPhraseLen);
-      *((uint32_t *)this->joinPhrase) = *((const uint32_t *)"JOIN");
-      memcpy(this->joinPhrase + 4, out, out_len);
-      free(out);
-
-      // Update RTC cache for future wakes
-      if (this->joinPhraseLen <= sizeof(prevJoin.phrase)) {
-        prevJoin.len = this->joinPhraseLen;
-        memcpy(prevJoin.phrase, this->joinPhrase, prevJoin.len);
-        strncpy(prevJoin.deviceName, currentName, sizeof(prevJoin.deviceName)-1);
-        memcpy(prevJoin.passKey, currentKey, 32);
-      }
+    // Built straight into the RTC cache, for future wakes
+    prevJoin.len = 0;
+    char plain[JOIN_PLAIN_MAX];
+    StrBuf pairName(plain);
+    pairName.printf("%s" PAIR_DELIM "FreeHouse" PAIR_DELIM "{"
+                    "\"model\":\"" FREEHOUSE_MODEL "\","
+                    "\"state_version\":%lu,"
+                    "\"build\":\"%s\","
+                    "\"writeable\":[",
+                    currentName, (unsigned long)Trv::stateVersion(), versionDetail);
+    for (auto p = Trv::writeable; *p; p++)
+      pairName.printf("%s\"%s\"", p != Trv::writeable ? "," : "", *p);
+    pairName.add("]}");
+
+    ESP_LOGI(TAG, "Pairing as: %s", plain);
+    size_t out_len;
+    if (!pairName.overflowed() &&
+        encrypt_bytes_into(plain, 0, currentKey, prevJoin.phrase + 4,
+                           sizeof(prevJoin.phrase) - 4, &out_len) == 0) {
+      memcpy(prevJoin.phrase, "JOIN", 4);
+      prevJoin.len = out_len + 4;
+      strncpy(prevJoin.deviceName, currentName, sizeof(prevJoin.deviceName)-1);
+      memcpy(prevJoin.passKey, currentKey, 32);
     } else {
-      prevJoin.len = 0;
       ESP_LOGW(TAG, "Failed to encrypt JOIN");
     }
   }
+  this->joinPhrase = prevJoin.len ? prevJoin.phrase : NULL;
+  this->joinPhraseLen = prevJoin.len;
+}
 
-  // 2. Configure WiFi (formerly in constructor)
-  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-  ESP_ERROR_CHECK(dev_wifi_init(&cfg));
-
-  // 3. Avoid NVS usage for faster startup
-  ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-  // 4. Set minimal WiFi mode (STA or AP)
-  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_start());
-
-  // 5. Initialize ESP-NOW
-  ESP_ERROR_CHECK(esp_now_init());
-
-  // 7. Register callbacks
-  esp_now_register_recv_cb(boundRx);
-  esp_now_register_send_cb(boundTx);
+void EspNet::task() {
+  buildJoinPhrase();
+  ESP_ERROR_CHECK(radio.begin(boundRx, boundTx));
   ESP_LOGI(TAG, "EspNet created");
 
   for (int retries = 0; retries < 2; retries++) {
@@ -438,10 +430,10 @@ void EspNet::task() {
       this->pair_with_hub();
     } else {
       ESP_LOGI(TAG, "Already paired with hub " MACSTR, MAC2STR(hub));
-      esp_wifi_set_channel(wifiChannel, WIFI_SECOND_CHAN_NONE);
+      radio.setChannel(wifiChannel, false);
       // We send a PAIR here just to elicit any deferred messages
-      add_peer(hub, wifiChannel);
-      esp_now_send(hub, this->joinPhrase, this->joinPhraseLen);
+      radio.addPeer(hub, wifiChannel);
+      radio.send(hub, this->joinPhrase, this->joinPhraseLen);
     }
     delay(NOW_RESPONSE_TIME); // Wait for responses
     // If we were disconnected from the hub, try again (once)
@@ -451,15 +443,79 @@ void EspNet::task() {
   }
 }
 
+// The Trv is only set once the exchange is over: until then, JSON from a hub is buffered, as handling it
+// can wait() on the Trv task, and would hold up the receive callback while the PRCF arrives.
+bool EspNet::provision(Trv *t) {
+  wait(); // The radio is started by the task
+
+  Provisioning provisioning;
+  prov_request_t request;
+  if (!provisioning.request(&request))
+    return false;
+
+  ESP_LOGI(TAG, "Provisioning: asking for settings");
+  scan_channels((const uint8_t *)&request, sizeof(request));
+
+  prov_config_t config;
+  MACAddr mac;
+  uint8_t channel;
+  if (!provisioning.open(&config, mac, &channel)) {
+    if (!provisioning.hubs())
+      ESP_LOGI(TAG, "Provisioning: no hub replied");
+    // Back to the hub we were paired with, if any
+    if (wifiChannel)
+      radio.setChannel(wifiChannel);
+    return false;
+  }
+
+  // All the settings are applied & written together
+  trv_mqtt_t mqttConfig = t->getConfig().mqttConfig;
+  strncpy(mqttConfig.device_name, config.device_name, sizeof(mqttConfig.device_name));
+  t->setNetMode(NET_MODE_ESP_NOW, &mqttConfig);
+  t->setPassKey(config.pass_key);
+  if (config.sleep_time)
+    t->setSleepTime(config.sleep_time);
+  motor_params_t motor = t->getConfig().motor;
+  if (config.motor_reversed >= 0)
+    motor.reversed = config.motor_reversed;
+  if (config.backoff_ms >= 0)
+    motor.backoff_ms = config.backoff_ms;
+  if (config.stall_ms > 0)
+    motor.stall_ms = config.stall_ms;
+  t->setMotorParameters(motor);
+  t->flush();
+  memset(&config, 0, sizeof(config));
+
+  // Pair with the hub that provisioned us, and tell it we're done
+  memcpy(hub, mac, sizeof(hub));
+  radio.setChannel(channel);
+  wifiChannel = channel;
+  radio.addPeer(hub, wifiChannel);
+  prov_done_t done;
+  provisioning.done(&done);
+  ERR_BACKTRACE(radio.send(hub, (const uint8_t *)&done, sizeof(done)));
+  EventLog::add(EV_PROVISIONED, wifiChannel);
+
+  // JOIN as the new device, so the hub has our details
+  buildJoinPhrase();
+  if (this->joinPhrase)
+    radio.send(hub, this->joinPhrase, this->joinPhraseLen);
+  delay(NOW_RESPONSE_TIME);
+  setTrv(t);
+
+  ESP_LOGW(TAG, "Provisioned as '%s' by hub " MACSTR " on channel %d", Trv::deviceName(), MAC2STR(hub), wifiChannel);
+  return true;
+}
+
 void EspNet::checkMessages(Trv *t) {
   // Wait for the background discovery/ping to complete
   wait();
 
   setTrv(t);
 
-  if (!bufferedMessage.empty()) {
-    trv->processNetMessage(bufferedMessage.c_str()); // Will trv->wait() if necessary
-    bufferedMessage.clear();
+  if (bufferedMessage[0]) {
+    trv->processNetMessage(bufferedMessage); // Will trv->wait() if necessary
+    bufferedMessage[0] = 0;
   }
 
   // If discovery hasn't settled on a hub, the task will yield.
@@ -1,31 +1,45 @@
-#include "esp_now.h"
+#include "now-transport.hpp"
 #include "../src/trv-state.h"
 #include "../trv.h"
 
 class EspNet : public WithTask {
 protected:
+  NowTransport &radio;
   Trv *trv;
-  uint8_t *joinPhrase = NULL;
+  const uint8_t *joinPhrase = NULL; // In RTC memory, so it's reused next wake
   size_t joinPhraseLen = 0;
   void pair_with_hub();
+  void scan_channels(const uint8_t *frame, size_t len);
+  void buildJoinPhrase();
   EventGroupHandle_t sendEvent;
-  std::string bufferedMessage;
+  // While sending firmware acks or the event log, which retry their own frames. A failed send to
+  // the hub only unpairs us outside these (the JOIN and the state).
+  volatile bool bulkSending = false;
 
   void setTrv(Trv *trv);
   void task() override;
 
 public:
-  EspNet();
+  EspNet(NowTransport &radio); // Which the task starts
   ~EspNet();
   void deinit();
-  void sendStateToHub(Trv *trv); // Calls setTrv()
+  bool sendStateToHub(Trv *trv); // Calls setTrv(). True if the hub acked it
   void checkMessages(Trv *trv); // Calls setTrv()
-  bool pendingMessages() const {
-    return !bufferedMessage.empty();
-  }
+  bool pendingMessages() const;
   static void unpair();
+  static bool paired(); // With a hub, as of the last JOIN
+  // Send a frame to the hub without waiting for the send callback. False if not paired.
+  bool sendToHub(const uint8_t *data, size_t len);
+  // If the hub has offered firmware, receive it until done or the deadline (in millis()).
+  // On success the new image is the boot partition and the caller should restart.
+  bool receiveFirmware(uint32_t untilMs);
+  // Send the event log, if the hub has asked for it (see event-log.h)
+  void sendEventLog();
+  // Ask for settings from a hub that's waiting to provision a device (see provision.hpp).
+  // True if we were provisioned, and are now paired with that hub.
+  bool provision(Trv *trv);
 
   // Internal referenced from statics
-  void data_receive_callback(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len);
-  void data_send_callback(const uint8_t *mac_addr, esp_now_send_status_t status);
+  void data_receive_callback(const now_recv_info_t *info, const uint8_t *data, int data_len);
+  void data_send_callback(const uint8_t *mac_addr, bool acked);
 };
@@ -0,0 +1,223 @@
+#include "fw-transfer.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+
+#include "../common/ota/ota-stream.h"
+#include "../trv.h"
+#include "esp-now.hpp"
+#include "helpers.h"
+
+#define FW_TRANSFER_MAGIC 0xF1A4E001
+#define FW_WINDOW_MS 80   // Re-ack if no fragment has arrived for this long
+#define FW_RETRIES 8      // Re-acks without progress before we give up for this wake
+
+static_assert(OTA_STREAM_BUFFER % FW_BLOCK == 0, "The stream commits whole blocks");
+
+// The transfer in progress, kept across deep sleep
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  uint8_t sha256[32];
+  uint32_t partition;   // Address of the partition being written
+  uint32_t written;     // Bytes in flash, in whole blocks (only for a plain image, which can be resumed)
+  uint32_t crc;         // Of those bytes
+} fw_transfer_t;
+static RTC_DATA_ATTR fw_transfer_t transfer;
+
+// The block being received. Filled by the ESP-NOW receive callback.
+static uint8_t blockData[FW_BLOCK];
+static volatile uint32_t blockNumber;
+static volatile uint32_t blockReceived;
+static volatile bool refused;
+static portMUX_TYPE blockLock = portMUX_INITIALIZER_UNLOCKED;
+static FirmwareTransfer *receiver = NULL;
+
+static uint32_t session() {
+  uint32_t s;
+  memcpy(&s, transfer.sha256, sizeof(s));
+  return s;
+}
+
+static uint32_t blockCount() {
+  return (transfer.size + FW_BLOCK - 1) / FW_BLOCK;
+}
+
+void FirmwareTransfer::offer(uint32_t size, const char *sha256hex) {
+  uint8_t sha[32];
+  if (!ota_parse_sha256(sha256hex, sha) || size == 0) {
+    ESP_LOGW(TAG, "Firmware offer: bad size or sha256");
+    return;
+  }
+  if (pending() && transfer.size == size && !memcmp(transfer.sha256, sha, sizeof(sha)))
+    return; // Already in progress
+
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (!partition || size > partition->size) {
+    ESP_LOGW(TAG, "Firmware offer: %lu bytes won't fit", size);
+    return;
+  }
+  transfer = {
+    .magic = FW_TRANSFER_MAGIC,
+    .size = size,
+    .sha256 = {0},
+    .partition = partition->address,
+    .written = 0,
+    .crc = 0
+  };
+  memcpy(transfer.sha256, sha, sizeof(sha));
+  ESP_LOGI(TAG, "Firmware offer: %lu bytes, session %08lx", size, session());
+}
+
+bool FirmwareTransfer::pending() {
+  return transfer.magic == FW_TRANSFER_MAGIC;
+}
+
+FirmwareTransfer::FirmwareTransfer(EspNet *net) : net(net) {
+  arrived = xEventGroupCreate();
+  receiver = this;
+}
+
+FirmwareTransfer::~FirmwareTransfer() {
+  receiver = NULL;
+  vEventGroupDelete(arrived);
+}
+
+bool FirmwareTransfer::sendAck(uint32_t block, uint32_t received) {
+  fw_ack_t ack = {
+    .tag = {'F', 'W', 'A', 'K'},
+    .session = session(),
+    .block = block,
+    .received = received
+  };
+  return net->sendToHub((const uint8_t *)&ack, sizeof(ack));
+}
+
+void FirmwareTransfer::receive(const uint8_t *data, int len) {
+  if (len >= 8 && !memcmp(data, "FWNO", 4)) {
+    uint32_t s;
+    memcpy(&s, data + 4, sizeof(s));
+    if (s == session()) {
+      refused = true;
+      xEventGroupSetBits(arrived, BIT0);
+    }
+    return;
+  }
+
+  const fw_data_t *frame = (const fw_data_t *)data;
+  if (len < (int)offsetof(fw_data_t, data) || memcmp(frame->tag, "FWDT", 4)
+    || frame->session != session() || frame->fragment >= FW_FRAGMENTS
+    || frame->length > FW_FRAGMENT || len < (int)offsetof(fw_data_t, data) + frame->length)
+    return;
+
+  const uint32_t offset = frame->fragment * FW_FRAGMENT;
+  if (offset + frame->length > FW_BLOCK)
+    return;
+  taskENTER_CRITICAL(&blockLock);
+  if (frame->block == blockNumber && !(blockReceived & (1UL << frame->fragment))) {
+    memcpy(blockData + offset, frame->data, frame->length);
+    blockReceived = blockReceived | (1UL << frame->fragment); // Not |=, deprecated on a volatile in C++20
+  }
+  taskEXIT_CRITICAL(&blockLock);
+  xEventGroupSetBits(arrived, BIT0);
+}
+
+bool FirmwareTransfer::receiveBlock(uint32_t block, uint32_t length, uint32_t untilMs) {
+  const uint32_t fragments = (length + FW_FRAGMENT - 1) / FW_FRAGMENT;
+  const uint32_t all = fragments >= 32 ? 0xFFFFFFFF : (1UL << fragments) - 1;
+
+  taskENTER_CRITICAL(&blockLock);
+  blockNumber = block;
+  blockReceived = 0;
+  taskEXIT_CRITICAL(&blockLock);
+
+  int retries = 0;
+  while (retries < FW_RETRIES && millis() < untilMs && !refused) {
+    const uint32_t before = blockReceived;
+    if ((before & all) == all)
+      return true;
+    xEventGroupClearBits(arrived, BIT0);
+    sendAck(block, before);
+    // Keep waiting as long as the window is still arriving
+    while ((blockReceived & all) != all
+      && (xEventGroupWaitBits(arrived, BIT0, pdTRUE, pdTRUE, pdMS_TO_TICKS(FW_WINDOW_MS)) & BIT0)
+      && !refused)
+      ;
+    if (blockReceived == before)
+      retries++;
+    else
+      retries = 0;
+  }
+  return (blockReceived & all) == all;
+}
+
+bool FirmwareTransfer::run(uint32_t untilMs) {
+  if (!pending())
+    return false;
+
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (!partition || partition->address != transfer.partition) {
+    transfer.magic = 0;
+    return false;
+  }
+
+  refused = false;
+  ota_stream_t *stream = (ota_stream_t *)malloc(sizeof(ota_stream_t));
+  if (!stream)
+    return false;
+
+  // Resume a plain image where the last wake stopped. The stream re-hashes what's already in flash,
+  // so the SHA-256 check still covers the whole image.
+  esp_err_t err = ESP_FAIL;
+  if (transfer.written) {
+    ESP_LOGI(TAG, "Firmware transfer: resuming at block %lu of %lu", transfer.written / FW_BLOCK, blockCount());
+    err = ota_stream_resume(stream, partition, transfer.written, transfer.crc);
+  }
+  if (err != ESP_OK) {
+    transfer.written = 0;
+    err = ota_stream_begin(stream, partition);
+  }
+  if (err == ESP_OK)
+    ota_stream_expect_sha256(stream, transfer.sha256);
+
+  bool complete = false;
+  const uint32_t blocks = blockCount();
+  uint32_t block = transfer.written / FW_BLOCK;
+  while (err == ESP_OK && block < blocks) {
+    const uint32_t length = MIN(FW_BLOCK, transfer.size - block * FW_BLOCK);
+    if (!receiveBlock(block, length, untilMs))
+      break;
+    // Copied, and written while we receive the next block
+    err = ota_stream_write(stream, blockData, length);
+    block += 1;
+  }
+
+  if (err == ESP_OK && block == blocks) {
+    sendAck(blocks, 0); // Tell the hub we're done
+    if (ERR_BACKTRACE(ota_stream_end(stream)) == ESP_OK) // Including the SHA-256 from the offer
+      complete = ERR_BACKTRACE(esp_ota_set_boot_partition(partition)) == ESP_OK;
+    transfer.magic = 0;
+  } else {
+    ota_stream_abort(stream);
+    if (err != ESP_OK || refused) {
+      ESP_LOGW(TAG, "Firmware transfer: %s", refused ? "refused by hub" : "write failed");
+      transfer.magic = 0;
+    } else {
+      // A delta patch can't be resumed part way through, so only a plain image records its progress
+      if (ota_stream_resumable(stream))
+        transfer.written = ota_stream_committed(stream, &transfer.crc);
+      ESP_LOGI(TAG, "Firmware transfer: paused at block %lu of %lu", transfer.written / FW_BLOCK, blocks);
+    }
+  }
+  free(stream);
+  return complete;
+}
+
+void FirmwareTransfer::dispatch(const uint8_t *data, int len) {
+  if (receiver)
+    receiver->receive(data, len);
+}
@@ -0,0 +1,70 @@
+#ifndef FW_TRANSFER_H
+#define FW_TRANSFER_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+/* Firmware distribution from the hub over ESP-NOW, without joining an AP.
+
+   The hub offers an image in a JSON message: {"ota":{"size":<bytes>,"sha256":"<hex>"}}.
+   The TRV then pulls it a block at a time. For each block it sends an FWAK frame with a bitmap of
+   the fragments it already has (0 for a new block), and the hub replies with all the missing
+   fragments in one window of FWDT frames. Lost fragments are asked for again in the next FWAK.
+   An FWAK for the block after the last one tells the hub the transfer is complete.
+   The hub replies FWNO if it no longer has the image.
+
+   Blocks are streamed into the OTA partition (via ota_stream, so a compressed image or delta patch
+   works too). Progress is kept in RTC memory, so a plain image continues on the next wake if this
+   one runs out of time.
+   tools/fw-hub.py is a stand-in for the hub's side, over UDP.
+*/
+
+#define FW_FRAGMENT 200   // Data bytes per FWDT frame, within ESP-NOW's 250 byte limit
+#define FW_BLOCK 4096     // One flash sector, so progress checkpoints are sector aligned
+#define FW_FRAGMENTS ((FW_BLOCK + FW_FRAGMENT - 1) / FW_FRAGMENT) // Must fit the 32 bit bitmap
+
+typedef struct __attribute__((packed)) {
+  char tag[4];        // "FWAK"
+  uint32_t session;   // The first 4 bytes of the image's SHA-256
+  uint32_t block;
+  uint32_t received;  // Bitmap of this block's fragments we already have
+} fw_ack_t;
+
+typedef struct __attribute__((packed)) {
+  char tag[4];        // "FWDT"
+  uint32_t session;
+  uint32_t block;
+  uint8_t fragment;
+  uint8_t reserved;
+  uint16_t length;
+  uint8_t data[FW_FRAGMENT];
+} fw_data_t;
+
+class EspNet;
+
+class FirmwareTransfer {
+protected:
+  EspNet *net;
+  EventGroupHandle_t arrived;
+
+  bool sendAck(uint32_t block, uint32_t received);
+  bool receiveBlock(uint32_t block, uint32_t length, uint32_t untilMs);
+
+public:
+  // From the hub's JSON. Starts a new transfer, unless this image is already in progress.
+  static void offer(uint32_t size, const char *sha256hex);
+  static bool pending();
+  // Pass on an FW* frame from the ESP-NOW receive callback, if a transfer is running
+  static void dispatch(const uint8_t *data, int len);
+
+  FirmwareTransfer(EspNet *net);
+  ~FirmwareTransfer();
+  // Receive blocks until the image is complete or the deadline (in millis()) is reached.
+  // True if the image has been verified and set as the boot partition.
+  bool run(uint32_t untilMs);
+  void receive(const uint8_t *data, int len);
+};
+
+#endif
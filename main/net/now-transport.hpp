@@ -0,0 +1,52 @@
+#ifndef NOW_TRANSPORT_H
+#define NOW_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* The radio under EspNet: the parts of ESP-NOW it uses, so the pairing, NACK, buffering and send
+   logic can run over something other than the real radio.
+
+   EspNowTransport (esp-now-transport.hpp) is ESP-NOW itself. UdpTransport (udp-transport.hpp)
+   simulates it over UDP multicast, with channels and RSSI, so several TRVs and a stand-in hub
+   (tools/now-hub.py) can run on one machine.
+
+   Frames are addressed by MAC, and are only heard by radios on the channel they were sent on.
+   Received frames are passed to the receive callback from the transport's own task, as ESP-NOW
+   does from the Wi-Fi task.
+*/
+
+#define NOW_MAX_DATA_LEN 1470   // ESP_NOW_MAX_DATA_LEN_V2
+#define NOW_FIRST_CHANNEL 1     // The channels of the country set by dev_wifi_init()
+#define NOW_CHANNELS 13
+
+typedef struct {
+  const uint8_t *src;
+  const uint8_t *dst;
+  uint8_t channel;
+  uint8_t second;       // The secondary channel, or 0
+  int8_t rssi;
+} now_recv_info_t;
+
+typedef void (*now_recv_cb_t)(const now_recv_info_t *info, const uint8_t *data, int len);
+// Called once for each frame send() accepted. `acked` is false if the peer didn't acknowledge it
+// (broadcasts are never acknowledged, and always succeed).
+typedef void (*now_send_cb_t)(const uint8_t *mac, bool acked);
+
+class NowTransport {
+public:
+  virtual ~NowTransport() {}
+  // Starts the radio. The callbacks stay registered until end().
+  virtual esp_err_t begin(now_recv_cb_t rx, now_send_cb_t tx) = 0;
+  virtual esp_err_t end() = 0;
+  // Adds a peer, or updates its channel. Channel 0 means whichever channel we're on.
+  virtual esp_err_t addPeer(const uint8_t *mac, uint8_t channel) = 0;
+  // With `settle`, returns once frames go out on the new channel (or with ESP_ERR_TIMEOUT).
+  virtual esp_err_t setChannel(uint8_t channel, bool settle = true) = 0;
+  // Queues a frame for a peer added with addPeer(). The send callback says whether it arrived.
+  virtual esp_err_t send(const uint8_t *mac, const uint8_t *data, size_t len) = 0;
+};
+
+#endif
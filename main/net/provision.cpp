@@ -0,0 +1,181 @@
+#include "provision.hpp"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "mbedtls/ecdh.h"
+#include "mbedtls/sha256.h"
+
+#include "../common/encryption/encryption.h"
+#include "../src/board.h"
+#include "../trv.h"
+
+// A reply from a hub. Filled by the ESP-NOW receive callback.
+typedef struct {
+  uint8_t mac[6];
+  uint8_t channel;
+  prov_offer_t offer;
+} prov_reply_t;
+
+static prov_reply_t replies[PROV_MAX_HUBS];
+static volatile int replyCount;
+static volatile bool overflowed;
+static portMUX_TYPE replyLock = portMUX_INITIALIZER_UNLOCKED;
+static Provisioning *receiver = NULL;
+
+static int randomBytes(void *context, unsigned char *buf, size_t len) {
+  esp_fill_random(buf, len);
+  return 0;
+}
+
+Provisioning::Provisioning() {
+  memset(secretKey, 0, sizeof(secretKey));
+  memset(sessionKey, 0, sizeof(sessionKey));
+  replyCount = 0;
+  overflowed = false;
+  receiver = this;
+}
+
+Provisioning::~Provisioning() {
+  receiver = NULL;
+  memset(secretKey, 0, sizeof(secretKey));
+  memset(sessionKey, 0, sizeof(sessionKey));
+}
+
+bool Provisioning::request(prov_request_t *frame) {
+  mbedtls_ecp_group grp;
+  mbedtls_mpi d;
+  mbedtls_ecp_point Q;
+  size_t len;
+  mbedtls_ecp_group_init(&grp);
+  mbedtls_mpi_init(&d);
+  mbedtls_ecp_point_init(&Q);
+  const bool ok = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519) == 0
+    && mbedtls_ecp_gen_keypair(&grp, &d, &Q, randomBytes, NULL) == 0
+    && mbedtls_mpi_write_binary_le(&d, secretKey, sizeof(secretKey)) == 0
+    && mbedtls_ecp_point_write_binary(&grp, &Q, MBEDTLS_ECP_PF_UNCOMPRESSED, &len, publicKey, sizeof(publicKey)) == 0
+    && len == sizeof(publicKey);
+  mbedtls_ecp_point_free(&Q);
+  mbedtls_mpi_free(&d);
+  mbedtls_ecp_group_free(&grp);
+  if (!ok) {
+    ESP_LOGE(TAG, "Provisioning: key generation failed");
+    return false;
+  }
+
+  memset(frame, 0, sizeof(*frame));
+  memcpy(frame->tag, "PRRQ", 4);
+  frame->version = PROV_VERSION;
+  memcpy(frame->key, publicKey, sizeof(frame->key));
+  strncpy(frame->model, FREEHOUSE_MODEL, sizeof(frame->model));
+  return true;
+}
+
+// The session key is SHA-256(shared secret | our public key | the hub's public key)
+bool Provisioning::derive(const uint8_t *hubKey) {
+  mbedtls_ecp_group grp;
+  mbedtls_mpi d, z;
+  mbedtls_ecp_point Q;
+  uint8_t shared[32];
+  mbedtls_ecp_group_init(&grp);
+  mbedtls_mpi_init(&d);
+  mbedtls_mpi_init(&z);
+  mbedtls_ecp_point_init(&Q);
+  const bool ok = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519) == 0
+    && mbedtls_mpi_read_binary_le(&d, secretKey, sizeof(secretKey)) == 0
+    && mbedtls_ecp_point_read_binary(&grp, &Q, hubKey, 32) == 0
+    && mbedtls_ecdh_compute_shared(&grp, &z, &Q, &d, randomBytes, NULL) == 0
+    && mbedtls_mpi_write_binary_le(&z, shared, sizeof(shared)) == 0;
+  mbedtls_ecp_point_free(&Q);
+  mbedtls_mpi_free(&z);
+  mbedtls_mpi_free(&d);
+  mbedtls_ecp_group_free(&grp);
+  if (!ok)
+    return false;
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, shared, sizeof(shared));
+  mbedtls_sha256_update(&sha, publicKey, sizeof(publicKey));
+  mbedtls_sha256_update(&sha, hubKey, 32);
+  mbedtls_sha256_finish(&sha, sessionKey);
+  mbedtls_sha256_free(&sha);
+  memset(shared, 0, sizeof(shared));
+  return true;
+}
+
+void Provisioning::receive(const now_recv_info_t *info, const uint8_t *data, int len) {
+  const prov_offer_t *offer = (const prov_offer_t *)data;
+  if (len != sizeof(prov_offer_t) || memcmp(offer->tag, "PRCF", 4) || offer->version != PROV_VERSION)
+    return;
+
+  taskENTER_CRITICAL(&replyLock);
+  int i = 0;
+  while (i < replyCount && memcmp(replies[i].mac, info->src, sizeof(replies[i].mac)))
+    i++;
+  if (i == replyCount) { // The first reply from this hub (on any channel) is the one we keep
+    if (i < PROV_MAX_HUBS) {
+      memcpy(replies[i].mac, info->src, sizeof(replies[i].mac));
+      replies[i].channel = info->channel;
+      replies[i].offer = *offer;
+      replyCount = i + 1;
+    } else {
+      overflowed = true;
+    }
+  }
+  taskEXIT_CRITICAL(&replyLock);
+}
+
+int Provisioning::hubs() {
+  return overflowed ? PROV_MAX_HUBS + 1 : replyCount;
+}
+
+bool Provisioning::open(prov_config_t *config, uint8_t *mac, uint8_t *channel) {
+  if (hubs() != 1) {
+    if (hubs())
+      ESP_LOGW(TAG, "Provisioning: %d hubs replied, ignoring them all", hubs());
+    return false;
+  }
+  const prov_reply_t &reply = replies[0];
+  if (!derive(reply.offer.key)) {
+    ESP_LOGW(TAG, "Provisioning: bad key from " MACSTR, MAC2STR(reply.mac));
+    return false;
+  }
+
+  uint8_t plain[PROV_SEALED_LENGTH - 16];
+  size_t len;
+  const bool ok = decrypt_bytes_into(reply.offer.sealed, sizeof(reply.offer.sealed), sessionKey, plain, sizeof(plain), &len) == 0;
+  if (ok && len == sizeof(*config))
+    memcpy(config, plain, sizeof(*config));
+  memset(plain, 0, sizeof(plain));
+  if (!ok || len != sizeof(*config) || config->magic != PROV_MAGIC) {
+    ESP_LOGW(TAG, "Provisioning: settings from " MACSTR " don't decrypt", MAC2STR(reply.mac));
+    return false;
+  }
+  config->device_name[sizeof(config->device_name) - 1] = 0;
+  memcpy(mac, reply.mac, sizeof(reply.mac));
+  *channel = reply.channel;
+  return true;
+}
+
+void Provisioning::done(prov_done_t *frame) {
+  uint8_t hash[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, sessionKey, sizeof(sessionKey));
+  mbedtls_sha256_update(&sha, (const uint8_t *)"PRDN", 4);
+  mbedtls_sha256_finish(&sha, hash);
+  mbedtls_sha256_free(&sha);
+
+  memcpy(frame->tag, "PRDN", 4);
+  memcpy(frame->confirm, hash, sizeof(frame->confirm));
+}
+
+void Provisioning::dispatch(const now_recv_info_t *info, const uint8_t *data, int len) {
+  if (receiver)
+    receiver->receive(info, data, len);
+}
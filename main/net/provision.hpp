@@ -0,0 +1,86 @@
+#ifndef PROVISION_H
+#define PROVISION_H
+
+#include <stdint.h>
+
+#include "now-transport.hpp"
+
+/* Provisioning from the hub over ESP-NOW, as a quicker alternative to the captive portal.
+
+   It works like WPS push-button setup. The hub's pairing button opens a short window on the hub,
+   and a press of the TRV's touch button makes the TRV broadcast a PRRQ on every channel. The PRRQ
+   carries a fresh X25519 public key. A hub with an open window replies with a PRCF, which holds its
+   own public key and the settings (prov_config_t). The settings are encrypted with a key derived
+   from the two public keys and the shared secret.
+
+   If more than one hub replies, the TRV does nothing, since it can't tell which hub was pressed.
+   Otherwise it applies the settings, pairs with that hub, and replies with a PRDN. The PRDN's
+   `confirm` shows that the TRV derived the same key.
+
+   The exchange keeps the pass key from anyone listening. Like WPS, it relies on the button presses
+   (and the hub's window) to authenticate both ends.
+   tools/prov-hub.py is a stand-in for the hub's side, over UDP.
+*/
+
+#define PROV_VERSION 1
+#define PROV_MAGIC 0x56504846 // "FHPV", at the start of the decrypted settings
+#define PROV_MAX_HUBS 4       // Distinct hubs that can reply to one request
+
+typedef struct __attribute__((packed)) {
+  char tag[4];          // "PRRQ"
+  uint8_t version;
+  uint8_t reserved[3];
+  uint8_t key[32];      // The TRV's X25519 public key, for this attempt only
+  char model[16];       // FREEHOUSE_MODEL
+} prov_request_t;
+
+// The settings from the hub. Fields the hub leaves alone are "unchanged".
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  char device_name[32];
+  uint8_t pass_key[32];
+  uint16_t sleep_time;    // Seconds, or 0 for unchanged
+  int16_t backoff_ms;     // -1 for unchanged
+  int16_t stall_ms;       // 0 for unchanged
+  int8_t motor_reversed;  // -1 for unchanged
+} prov_config_t;
+
+// IV + AES-256-CBC ciphertext of prov_config_t, padded to a whole block (as encryption.c)
+#define PROV_SEALED_LENGTH (16 + (sizeof(prov_config_t) / 16 + 1) * 16)
+
+typedef struct __attribute__((packed)) {
+  char tag[4];          // "PRCF"
+  uint8_t version;
+  uint8_t reserved[3];
+  uint8_t key[32];      // The hub's X25519 public key
+  uint8_t sealed[PROV_SEALED_LENGTH];
+} prov_offer_t;
+
+typedef struct __attribute__((packed)) {
+  char tag[4];          // "PRDN"
+  uint8_t confirm[16];  // The first half of SHA-256(session key | "PRDN")
+} prov_done_t;
+
+class Provisioning {
+protected:
+  uint8_t secretKey[32];
+  uint8_t publicKey[32];
+  uint8_t sessionKey[32];
+
+  bool derive(const uint8_t *hubKey);
+
+public:
+  // Pass on a PR* frame from EspNet's receive callback, while provisioning is running
+  static void dispatch(const now_recv_info_t *info, const uint8_t *data, int len);
+
+  Provisioning();
+  ~Provisioning();
+  bool request(prov_request_t *frame); // Generates our key pair
+  void receive(const now_recv_info_t *info, const uint8_t *data, int len);
+  int hubs();                          // The distinct hubs that replied
+  // Decrypts the reply, if exactly one hub replied. Fills in the hub's address & channel.
+  bool open(prov_config_t *config, uint8_t *mac, uint8_t *channel);
+  void done(prov_done_t *frame);
+};
+
+#endif
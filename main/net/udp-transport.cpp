@@ -0,0 +1,285 @@
+#include "udp-transport.hpp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "../trv.h"
+
+static const uint8_t BROADCAST[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+UdpTransport::UdpTransport(const uint8_t *mac, int8_t rssi, uint8_t lossPercent, uint16_t port, uint16_t mediumPort)
+    : rssi(rssi), lossPercent(lossPercent), port(port), mediumPort(mediumPort) {
+  memcpy(this->mac, mac, sizeof(this->mac));
+}
+
+UdpTransport::~UdpTransport() {
+  end();
+}
+
+esp_err_t UdpTransport::begin(now_recv_cb_t rx, now_send_cb_t tx) {
+  if (sock >= 0)
+    return ESP_ERR_INVALID_STATE;
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "UDP radio: unable to create socket: errno %d", errno);
+    return ESP_FAIL;
+  }
+
+  // Every radio on the machine binds the same port
+  const int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  struct ip_mreq group = {};
+  group.imr_multiaddr.s_addr = inet_addr(UDP_NOW_GROUP);
+  group.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+  struct in_addr loopback = {};
+  loopback.s_addr = htonl(INADDR_LOOPBACK);
+  const uint8_t loop = 1, ttl = 0; // Heard by the other processes here, and never leaves the machine
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0
+      || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0
+      || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+      || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+    ESP_LOGE(TAG, "UDP radio: unable to join " UDP_NOW_GROUP ":%u: errno %d", port, errno);
+    close(sock);
+    sock = -1;
+    return ESP_FAIL;
+  }
+
+  receiver = rx;
+  sender = tx;
+  running = true;
+  stopped.reset();
+  if (xTaskCreate(task, "UdpTransport", UDP_NOW_STACK, this, UDP_NOW_PRIORITY, NULL) != pdPASS) {
+    running = false;
+    close(sock);
+    sock = -1;
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::end() {
+  if (sock < 0)
+    return ESP_OK;
+  running = false;
+  stopped.wait();
+  close(sock);
+  sock = -1;
+  receiver = NULL;
+  sender = NULL;
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::addPeer(const uint8_t *mac, uint8_t channel) {
+  esp_err_t e = ESP_OK;
+  taskENTER_CRITICAL(&lock);
+  int i = 0;
+  while (i < numPeers && memcmp(peers[i].mac, mac, sizeof(peers[i].mac)))
+    i++;
+  if (i < UDP_NOW_MAX_PEERS) {
+    memcpy(peers[i].mac, mac, sizeof(peers[i].mac));
+    peers[i].channel = channel;
+    if (i == numPeers)
+      numPeers++;
+  } else {
+    e = ESP_ERR_NO_MEM;
+  }
+  taskEXIT_CRITICAL(&lock);
+  return e;
+}
+
+// There's nothing to wait for: the next frame goes out on the new channel
+esp_err_t UdpTransport::setChannel(uint8_t channel, bool settle) {
+  if (channel < NOW_FIRST_CHANNEL || channel >= NOW_FIRST_CHANNEL + NOW_CHANNELS)
+    return ESP_ERR_INVALID_ARG;
+  this->channel = channel;
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::send(const uint8_t *mac, const uint8_t *data, size_t len) {
+  if (sock < 0)
+    return ESP_ERR_INVALID_STATE;
+  if (len == 0 || len > NOW_MAX_DATA_LEN)
+    return ESP_ERR_INVALID_ARG;
+  const bool broadcast = memcmp(mac, BROADCAST, sizeof(BROADCAST)) == 0;
+
+  esp_err_t e = ESP_OK;
+  int slot = -1;
+  taskENTER_CRITICAL(&lock);
+  int i = 0;
+  while (i < numPeers && memcmp(peers[i].mac, mac, sizeof(peers[i].mac)))
+    i++;
+  if (i == numPeers) {
+    e = ESP_ERR_NOT_FOUND;
+  } else if (peers[i].channel && peers[i].channel != channel) {
+    e = ESP_ERR_INVALID_STATE; // As ESP-NOW, which won't send to a peer on another channel
+  } else if (!broadcast) {
+    for (slot = 0; slot < UDP_NOW_MAX_PENDING && pending[slot].waiting; slot++)
+      ;
+    if (slot < UDP_NOW_MAX_PENDING) {
+      pending[slot].waiting = true;
+      memcpy(pending[slot].mac, mac, sizeof(pending[slot].mac));
+      pending[slot].seq = seq;
+      pending[slot].deadline = xTaskGetTickCount() + pdMS_TO_TICKS(UDP_NOW_ACK_MS);
+    } else {
+      e = ESP_ERR_NO_MEM; // The send queue is full
+    }
+  }
+  const uint8_t frameSeq = seq++;
+  taskEXIT_CRITICAL(&lock);
+  if (e != ESP_OK)
+    return e;
+
+  if (transmit(UDP_NOW_DATA, mac, frameSeq, data, len) != ESP_OK) {
+    if (!broadcast) {
+      taskENTER_CRITICAL(&lock);
+      pending[slot].waiting = false;
+      taskEXIT_CRITICAL(&lock);
+    }
+    return ESP_FAIL;
+  }
+  counts.sent++;
+  if (broadcast && sender)
+    sender(mac, true);
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::transmit(uint8_t type, const uint8_t *dst, uint8_t seq, const uint8_t *data, size_t len) {
+  udp_now_header_t header;
+  memcpy(header.tag, "SNOW", 4);
+  header.type = type;
+  header.channel = channel;
+  header.rssi = rssi;
+  header.seq = seq;
+  memcpy(header.src, mac, sizeof(header.src));
+  memcpy(header.dst, dst, sizeof(header.dst));
+
+  struct sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_port = htons(mediumPort ? mediumPort : port);
+  to.sin_addr.s_addr = inet_addr(UDP_NOW_GROUP);
+  struct iovec parts[2] = {
+    {.iov_base = &header, .iov_len = sizeof(header)},
+    {.iov_base = (void *)data, .iov_len = len},
+  };
+  struct msghdr msg = {};
+  msg.msg_name = &to;
+  msg.msg_namelen = sizeof(to);
+  msg.msg_iov = parts;
+  msg.msg_iovlen = data ? 2 : 1;
+  if (sendmsg(sock, &msg, 0) < 0) {
+    ESP_LOGE(TAG, "UDP radio: send failed: errno %d", errno);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+void UdpTransport::receive(int len) {
+  const udp_now_header_t *header = (const udp_now_header_t *)packet;
+  // Our own frames come back from the group too
+  if (len < (int)sizeof(*header) || memcmp(header->tag, "SNOW", 4)
+      || memcmp(header->src, mac, sizeof(mac)) == 0 || header->channel != channel)
+    return;
+  const bool toUs = memcmp(header->dst, mac, sizeof(mac)) == 0;
+  if (!toUs && memcmp(header->dst, BROADCAST, sizeof(BROADCAST)))
+    return;
+  if (lossPercent && rand() % 100 < lossPercent) {
+    counts.lost++;
+    return;
+  }
+
+  if (header->type == UDP_NOW_ACK) {
+    if (toUs)
+      acked(header->src, header->seq);
+    return;
+  }
+  if (header->type != UDP_NOW_DATA)
+    return;
+  if (toUs)
+    transmit(UDP_NOW_ACK, header->src, header->seq, NULL, 0);
+  counts.received++;
+  if (receiver) {
+    const now_recv_info_t info = {
+      .src = header->src,
+      .dst = header->dst,
+      .channel = header->channel,
+      .second = 0,
+      .rssi = header->rssi,
+    };
+    receiver(&info, packet + sizeof(*header), len - sizeof(*header));
+  }
+}
+
+void UdpTransport::acked(const uint8_t *from, uint8_t frameSeq) {
+  bool found = false;
+  taskENTER_CRITICAL(&lock);
+  for (int i = 0; i < UDP_NOW_MAX_PENDING && !found; i++) {
+    if (pending[i].waiting && pending[i].seq == frameSeq && memcmp(pending[i].mac, from, sizeof(pending[i].mac)) == 0) {
+      pending[i].waiting = false;
+      found = true;
+    }
+  }
+  taskEXIT_CRITICAL(&lock);
+  if (found) {
+    counts.acked++;
+    if (sender)
+      sender(from, true);
+  }
+}
+
+TickType_t UdpTransport::expire() {
+  const TickType_t now = xTaskGetTickCount();
+  TickType_t next = pdMS_TO_TICKS(UDP_NOW_ACK_MS);
+  for (int i = 0; i < UDP_NOW_MAX_PENDING; i++) {
+    uint8_t to[6];
+    taskENTER_CRITICAL(&lock);
+    const bool overdue = pending[i].waiting && (int32_t)(now - pending[i].deadline) >= 0;
+    if (overdue) {
+      pending[i].waiting = false;
+      memcpy(to, pending[i].mac, sizeof(to));
+    } else if (pending[i].waiting && pending[i].deadline - now < next) {
+      next = pending[i].deadline - now;
+    }
+    taskEXIT_CRITICAL(&lock);
+    if (overdue) {
+      counts.unacked++;
+      if (sender)
+        sender(to, false);
+    }
+  }
+  return next;
+}
+
+void UdpTransport::task(void *p) {
+  UdpTransport *radio = (UdpTransport *)p;
+  while (radio->running) {
+    const uint32_t ms = radio->expire() * portTICK_PERIOD_MS;
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(radio->sock, &readable);
+    struct timeval tv = {.tv_sec = 0, .tv_usec = (suseconds_t)(ms ? ms : 1) * 1000};
+    if (select(radio->sock + 1, &readable, NULL, NULL, &tv) > 0) {
+      const int len = recv(radio->sock, radio->packet, sizeof(radio->packet), 0);
+      if (len > 0)
+        radio->receive(len);
+    }
+  }
+  radio->stopped.complete();
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,111 @@
+#ifndef UDP_TRANSPORT_H
+#define UDP_TRANSPORT_H
+
+#include "now-transport.hpp"
+#include "../src/WithTask.hpp"
+
+/* A simulated ESP-NOW radio, for running EspNet on a Linux host (or anywhere with sockets).
+
+   Every radio joins one multicast group on the loopback interface, so the "air" is shared by all
+   the processes on the machine and never leaves it. Each frame is sent to the group with a header
+   saying which channel it was sent on, who it's from and to, and how strongly it's heard (the
+   sender's `rssi`). A radio only hears frames on the channel it's on.
+
+   A unicast frame is acknowledged by the radio it's addressed to, as the ESP-NOW MAC layer does,
+   and the sender's send callback reports whether the ACK came back in time. A radio set to lose a
+   percentage of frames drops that share of what it hears (ACKs included), so the sender sees
+   unacknowledged frames as it would on a poor link.
+
+   Frames can instead be sent to a relay on `mediumPort`, which passes on to the group only those
+   that survive the air it models (tools/fleet-host.py: airtime, carrier sense and collisions).
+
+   tools/now-hub.py is a stand-in hub on the same medium.
+*/
+
+#define UDP_NOW_GROUP "239.255.70.72"
+#define UDP_NOW_PORT 5557
+#define UDP_NOW_ACK_MS 20     // How long a sender waits for an ACK
+#define UDP_NOW_MAX_PEERS 20  // As ESP_NOW_MAX_TOTAL_PEER_NUM
+#define UDP_NOW_MAX_PENDING 8 // Unicast frames awaiting an ACK
+#define UDP_NOW_STACK 8192    // The receive task runs EspNet's callback, as the Wi-Fi task does
+#define UDP_NOW_PRIORITY 5    // Above the WithTask workers
+
+enum : uint8_t {
+  UDP_NOW_DATA = 1,
+  UDP_NOW_ACK = 2,
+};
+
+typedef struct __attribute__((packed)) {
+  char tag[4];        // "SNOW"
+  uint8_t type;
+  uint8_t channel;    // The sender's channel
+  int8_t rssi;        // As the receiver will see it
+  uint8_t seq;        // Matches an ACK to its frame
+  uint8_t src[6];
+  uint8_t dst[6];
+} udp_now_header_t;   // Followed by the frame, for UDP_NOW_DATA
+
+typedef struct {
+  uint32_t sent;      // Frames accepted by send()
+  uint32_t acked;
+  uint32_t unacked;   // Unicast frames whose ACK didn't arrive
+  uint32_t received;  // Frames passed to the receive callback
+  uint32_t lost;      // Frames (and ACKs) dropped by the simulated loss
+} udp_now_stats_t;
+
+// The receive task is a plain FreeRTOS task rather than a WithTask, as ESP-NOW's Wi-Fi task is: it
+// runs until end(), and isn't one of the tasks the wake waits for (or cancels).
+class UdpTransport : public NowTransport {
+protected:
+  uint8_t mac[6];
+  int8_t rssi;
+  uint8_t lossPercent;
+  uint16_t port;
+  uint16_t mediumPort;
+  int sock = -1;
+  volatile bool running = false;
+  Completion stopped;
+  volatile uint8_t channel = NOW_FIRST_CHANNEL;
+  uint8_t seq = 0;
+  now_recv_cb_t receiver = NULL;
+  now_send_cb_t sender = NULL;
+  udp_now_stats_t counts = {};
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+  struct {
+    uint8_t mac[6];
+    uint8_t channel;
+  } peers[UDP_NOW_MAX_PEERS];
+  int numPeers = 0;
+
+  struct {
+    bool waiting;
+    uint8_t mac[6];
+    uint8_t seq;
+    uint32_t deadline;  // In ticks
+  } pending[UDP_NOW_MAX_PENDING] = {};
+
+  uint8_t packet[sizeof(udp_now_header_t) + NOW_MAX_DATA_LEN]; // Used by the task only
+
+  esp_err_t transmit(uint8_t type, const uint8_t *dst, uint8_t seq, const uint8_t *data, size_t len);
+  void receive(int len);
+  void acked(const uint8_t *mac, uint8_t seq);
+  TickType_t expire(); // Reports ACKs that are overdue. Returns the ticks until the next one is.
+  static void task(void *p);
+
+public:
+  // `rssi` is how strongly other radios hear this one. `lossPercent` of the frames it hears are lost.
+  // Frames are sent to the relay on `mediumPort`, if it's not 0.
+  UdpTransport(const uint8_t *mac, int8_t rssi = -60, uint8_t lossPercent = 0, uint16_t port = UDP_NOW_PORT,
+               uint16_t mediumPort = 0);
+  ~UdpTransport();
+  esp_err_t begin(now_recv_cb_t rx, now_send_cb_t tx) override;
+  esp_err_t end() override;
+  esp_err_t addPeer(const uint8_t *mac, uint8_t channel) override;
+  esp_err_t setChannel(uint8_t channel, bool settle = true) override;
+  esp_err_t send(const uint8_t *mac, const uint8_t *data, size_t len) override;
+
+  const udp_now_stats_t &stats() const { return counts; }
+};
+
+#endif
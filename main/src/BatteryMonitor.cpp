@@ -1,9 +1,73 @@
+#include <atomic>
+
 #include "pins.h"
 #include "../trv.h"
 #include "../common/gpio/gpio.hpp"
+#include "esp_attr.h"
 #include "BatteryMonitor.h"
 
-#define DISCHARGE_FLOOR 3200
+#define CHARGE_BIAS 150           // 0.15v is a typical charge bias voltage for constant current charge circuit
+#define BATTERY_CAPACITY_MAH 1000 // Nominal LiPo cell capacity
+
+// Typical consumption of each activity, in mA
+#define SLEEP_MA 0.03f   // Deep sleep, including the regulator quiescent current
+#define AWAKE_MA 45.0f   // CPU + radio in RX, averaged over a wake
+#define MOTOR_MA 300.0f  // Motor drive, in addition to AWAKE_MA
+#define TX_MAS 0.4f      // mA.s per ESP-NOW frame (~2ms at 200mA)
+
+// How strongly a rested voltage reading pulls the coulomb count (1/n per wake)
+#define OCV_WEIGHT 8
+// If the two disagree by more than this, the coulomb count is discarded
+#define OCV_RESEED_MAH (BATTERY_CAPACITY_MAH / 4)
+// Duty cycle history is decayed after this long so it tracks the current settings
+#define DUTY_WINDOW_SECS (7 * 24 * 3600)
+
+#define MODEL_MAGIC 0xBA77E001
+
+// Open circuit voltage (mV) to state of charge (%) for a single LiPo cell, in descending order
+static const struct {
+  int mv;
+  uint8_t percent;
+} ocvCurve[] = {
+  {4200, 100}, {4150, 95}, {4110, 90}, {4080, 85}, {4020, 80}, {3980, 75},
+  {3950, 70}, {3910, 65}, {3870, 60}, {3850, 55}, {3840, 50}, {3820, 45},
+  {3800, 40}, {3790, 35}, {3770, 30}, {3750, 25}, {3730, 20}, {3710, 15},
+  {3690, 10}, {3610, 5}, {3300, 0}
+};
+
+typedef struct {
+  uint32_t magic;
+  float remaining_mAh;   // Coulomb-counted charge left in the cell
+  float used_mAh;        // Charge used over...
+  uint32_t elapsed_secs; // ...this period, which gives the average duty cycle
+} battery_model_t;
+
+static RTC_DATA_ATTR battery_model_t model;
+static bool correctedThisWake = false; // Not RTC, so reset every wake
+static std::atomic<int> txFrames(0); // Sent this wake, from the send callback, which mustn't race the model
+
+static uint8_t ocvPercent(int mv) {
+  const int n = sizeof(ocvCurve) / sizeof(ocvCurve[0]);
+  if (mv >= ocvCurve[0].mv)
+    return 100;
+  for (int i = 1; i < n; i++) {
+    if (mv >= ocvCurve[i].mv) {
+      const auto &hi = ocvCurve[i - 1];
+      const auto &lo = ocvCurve[i];
+      return lo.percent + (mv - lo.mv) * (hi.percent - lo.percent) / (hi.mv - lo.mv);
+    }
+  }
+  return 0;
+}
+
+static void consume(float mAh) {
+  if (model.magic != MODEL_MAGIC)
+    return;
+  model.remaining_mAh -= mAh;
+  if (model.remaining_mAh < 0)
+    model.remaining_mAh = 0;
+  model.used_mAh += mAh;
+}
 
 BatteryMonitor::BatteryMonitor() {
   GPIO::pinMode(CHARGING, INPUT);
@@ -19,13 +83,9 @@ int BatteryMonitor::getRawValue() {
 }
 
 int BatteryMonitor::getValue(int samples) {
-  auto a = 0;
-  for (int i=0; i<samples; i++) {
-    delay(10);
-    a += getRawValue();
-  }
-
-  return a / samples;
+  // Back-to-back conversions under one ADC lock. Callers that want them spread out (the motor loop) pace themselves.
+  const int mv = GPIO::analogReadAverage(BATTERY, samples, ADC_ATTEN_DB_12, true);
+  return mv < 0 ? mv : mv * 2;
 }
 
 uint8_t BatteryMonitor::getPercent(int raw) {
@@ -34,17 +94,69 @@ uint8_t BatteryMonitor::getPercent(int raw) {
 
   if (raw < 0) {
     // Something bad happend - just ignore it for now
-    return 50;
+    return model.magic == MODEL_MAGIC ? (uint8_t)getStateOfCharge() : 50;
   }
 
-  if (is_charging()) {
-    raw -= 150; // 0.15v is a typical charge bias voltage for constant current charge circuit
+  const float ocv_mAh = ocvPercent(is_charging() ? raw - CHARGE_BIAS : raw) * BATTERY_CAPACITY_MAH / 100.0f;
+  const float drift = ocv_mAh - model.remaining_mAh;
+  if (model.magic != MODEL_MAGIC || is_charging() || drift > OCV_RESEED_MAH || drift < -OCV_RESEED_MAH) {
+    // We can't count charge going in, so while charging (or with no history) the voltage is all we have
+    const bool keepHistory = model.magic == MODEL_MAGIC;
+    model.magic = MODEL_MAGIC;
+    model.remaining_mAh = ocv_mAh;
+    if (!keepHistory) {
+      model.used_mAh = 0;
+      model.elapsed_secs = 0;
+    }
+    correctedThisWake = true;
+  } else if (!correctedThisWake) {
+    // Nudge the coulomb count towards the rested voltage, once per wake, to correct drift
+    model.remaining_mAh += drift / OCV_WEIGHT;
+    correctedThisWake = true;
   }
+  return (uint8_t)getStateOfCharge();
+}
 
-  auto percent = 100 * (raw - DISCHARGE_FLOOR) / (3900 - DISCHARGE_FLOOR);
+int BatteryMonitor::getStateOfCharge() {
+  if (model.magic != MODEL_MAGIC)
+    return NO_VALUE;
+
+  auto percent = (int)(100 * model.remaining_mAh / BATTERY_CAPACITY_MAH + 0.5f);
   if (percent < 0)
     percent = 0;
   else if (percent > 100)
     percent = 100;
-  return (uint8_t)percent;
+  return percent;
+}
+
+int BatteryMonitor::remainingDays() {
+  if (model.magic != MODEL_MAGIC || model.elapsed_secs < 3600 || model.used_mAh <= 0)
+    return -1;
+  const float mAhPerDay = model.used_mAh * (24 * 3600) / model.elapsed_secs;
+  return (int)(model.remaining_mAh / mAhPerDay);
+}
+
+void BatteryMonitor::accountMotor(uint32_t ms) {
+  consume(MOTOR_MA * ms / 3600000.0f);
+}
+
+void BatteryMonitor::accountTx(int count) {
+  txFrames += count;
+}
+
+void BatteryMonitor::accountWake(uint32_t awakeMs, uint32_t sleepSecs) {
+  const int frames = txFrames.exchange(0);
+  if (model.magic != MODEL_MAGIC)
+    return;
+  if (sleepSecs > DUTY_WINDOW_SECS) {
+    // Sleeping "forever" (powered off or flat) - we've no idea how long for, so re-seed from the voltage on wake
+    model.magic = 0;
+    return;
+  }
+  consume(AWAKE_MA * awakeMs / 3600000.0f + SLEEP_MA * sleepSecs / 3600.0f + TX_MAS * frames / 3600.0f);
+  model.elapsed_secs += awakeMs / 1000 + sleepSecs;
+  if (model.elapsed_secs > DUTY_WINDOW_SECS) {
+    model.elapsed_secs /= 2;
+    model.used_mAh /= 2;
+  }
 }
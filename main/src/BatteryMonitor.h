@@ -11,8 +11,17 @@ class BatteryMonitor {
  public:
   BatteryMonitor();
   bool is_charging();
-  uint8_t getPercent(int raw = NO_VALUE);
-  int getValue(int samples = 3); // Get an average value
+  uint8_t getPercent(int raw = NO_VALUE); // Fuses the open-circuit voltage with the charge model. Only call when the motor is idle
+  // The charge model alone, which is valid when the voltage is sagging under load. NO_VALUE if there's no
+  // model yet, as seeding one is left to getPercent()
+  int getStateOfCharge();
+  int getValue(int samples = 8); // Get an average value, or a negative value if the ADC failed
+  int remainingDays(); // At the measured duty cycle, or -1 if not yet known
+
+  // Charge accounting. These are static as they persist (in RTC memory) across instances and wakes
+  static void accountMotor(uint32_t ms);
+  static void accountTx(int count = 1); // Safe from any task. Counted, and added to the model by accountWake()
+  static void accountWake(uint32_t awakeMs, uint32_t sleepSecs);
 };
 
-#endif
\ No newline at end of file
+#endif
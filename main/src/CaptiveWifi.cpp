@@ -3,13 +3,18 @@
 
 #include "../common/gpio/gpio.hpp"
 
-#include <sstream>
+#include "cJSON.h"
+#include "esp_rom_crc.h"
+#include "heap-stats.h"
+#include "helpers.h"
 #include <trv.h>
 
 #define PORTAL_TTL  60000
-#define MULTILINE_STRING(...) #__VA_ARGS__
 
-CaptivePortal::CaptivePortal(Trv* trv, const char *name) : trv(trv) {
+extern const uint8_t portal_html_gz_start[] asm("_binary_portal_html_gz_start");
+extern const uint8_t portal_html_gz_end[]   asm("_binary_portal_html_gz_end");
+
+CaptivePortal::CaptivePortal(Trv* trv, const char *name) : trv(trv), events(trv) {
   ESP_LOGI(TAG, "CaptivePortal::CaptivePortal");
   exitStatus = NONE;
   timeout = millis() + PORTAL_TTL;
@@ -20,9 +25,9 @@ CaptivePortal::CaptivePortal(Trv* trv, const char *name) : trv(trv) {
   start_captive_portal(this, ssid);
   while (millis() < timeout && exitStatus == NONE) {
     GPIO::digitalWrite(LED_BUILTIN, true);
-    delay(125);
+    poll_captive_portal(125);
     GPIO::digitalWrite(LED_BUILTIN, false);
-    delay(125);
+    poll_captive_portal(125);
   }
   if (exitStatus == NONE) {
     exitStatus = TIME_OUT;
@@ -30,6 +35,8 @@ CaptivePortal::CaptivePortal(Trv* trv, const char *name) : trv(trv) {
   // Close the portal
   GPIO::digitalWrite(LED_BUILTIN, true);
   delay(250);
+  events.cancel(); // The stream has to be finished before the server is stopped
+  events.wait();
   stop_captive_portal();
 }
 
@@ -85,29 +92,18 @@ static const char* sepdef(char **a, const char *b, const char *c) {
   const auto p = strsep(a,b);
   return p ? p : c;
 }
-esp_err_t CaptivePortal::getHandler(httpd_req_t *req) {
-  static char buffer[sizeof req->uri];
-
-  ESP_LOGI(TAG, "Serve %s", req->uri);
-  if (exitStatus != NONE) {
-    std::stringstream html;
-    httpd_resp_set_type(req, "text/html");
-    html << "<html><body>Closing..." << exitStatus << "</body></html>";
-    httpd_resp_send(req, html.str().c_str(), HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
-  }
-
-  timeout = millis() + PORTAL_TTL;
-
-  auto url = req->uri;
+esp_err_t CaptivePortal::sendClosing(httpd_req_t *req) {
+  char html[48];
+  snprintf(html, sizeof html, "<html><body>Closing...%d</body></html>", exitStatus);
+  httpd_resp_set_type(req, "text/html");
+  return httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
+}
 
-  // Check the URLs to manage the TRV
+// Actions a URL: `arg` is the JSON, passphrase or network settings (from the GET URL or the POST body)
+void CaptivePortal::command(const char *url, char *arg) {
   if (startsWith(url, "/process")) {
-    const char *json = strchr(url, '?');
-    if (json) {
-      unencode(buffer, json + 1, sizeof buffer);
-      trv->processNetMessage(buffer);
-    }
+    if (arg && arg[0])
+      trv->processNetMessage(arg);
   } else if (startsWith(url, "/close")) {
     exitPortal(CLOSED);
   } else if (startsWith(url, "/test-mode")) {
@@ -116,22 +112,19 @@ esp_err_t CaptivePortal::getHandler(httpd_req_t *req) {
     exitPortal(CALIBRATE);
   } else if (startsWith(url, "/power-off")) {
     exitPortal(POWER_OFF);
-  } else if (startsWith(url, "/set-passphrase/")) {
-    char passphrase[64];
-    unencode(passphrase, req->uri + 16, sizeof(passphrase));
+  } else if (startsWith(url, "/set-passphrase")) {
     uint8_t passKey[32]; // ENCRYPTION_KEY is 32 bytes
-    if (strlen(passphrase) && get_key_for_passphrase(passphrase, passKey) == 0) {
+    if (arg && strlen(arg) && get_key_for_passphrase(arg, passKey) == 0) {
       trv->setPassKey(passKey);
     }
   // } else if (startsWith(url, "/net-zigbee")) {
   //   trv->setNetMode(NET_MODE_ZIGBEE);
   //   delay(200);
   //   esp_restart();
-  } else if (startsWith(url, "/net-")) {
-    unencode(buffer, strchr(url + 1, '/') + 1, sizeof buffer);
-    ESP_LOGI(TAG, "Set networking %s", buffer);
+  } else if (startsWith(url, "/net-") && arg) {
+    ESP_LOGI(TAG, "Set networking %s", arg);
 
-    char *saveptr = buffer;
+    char *saveptr = arg;
     const char *device = sepdef(&saveptr, "\x1D", "");
     ESP_LOGI(TAG, "Set networking device: %s", device);
     const char *ssid = sepdef(&saveptr, "\x1D", "");
@@ -158,170 +151,210 @@ esp_err_t CaptivePortal::getHandler(httpd_req_t *req) {
     exitPortal(CLOSED);
     // esp_restart();
   }
+}
+
+esp_err_t CaptivePortal::getHandler(httpd_req_t *req) {
+  static char buffer[sizeof req->uri];
+
+  ESP_LOGI(TAG, "Serve %s", req->uri);
+  if (exitStatus != NONE)
+    return sendClosing(req);
+
+  timeout = millis() + PORTAL_TTL;
+
+  auto url = req->uri;
+  if (startsWith(url, "/events"))
+    return events.begin(req) ? ESP_OK : httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No stream");
 
+  // The GET forms of the commands, with the argument in the URL
+  const char *arg = NULL;
+  if (startsWith(url, "/process"))
+    arg = strchr(url, '?');
+  else if (startsWith(url, "/set-passphrase/") || startsWith(url, "/net-"))
+    arg = strchr(url + 1, '/');
+  if (arg)
+    unencode(buffer, arg + 1, sizeof buffer);
+  command(url, arg ? buffer : NULL);
+
+  if (startsWith(url, "/state.json") || startsWith(url, "/process")) {
+    return sendState(req);
+  }
   if (strcmp(url, root)) {
     httpd_resp_set_status(req, "302 Found");
     httpd_resp_set_hdr(req, "Location", "/");
     const char *resp_str = "<html><body>Redirecting</body></html>";
     httpd_resp_send(req, resp_str, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
-  } else {
-    // Send back the current status
-    httpd_resp_set_type(req, "text/html");
-
-    std::stringstream html;
-    /*if (calibrating) {
-      html << MULTILINE_STRING(
-        <!DOCTYPE html>
-        <html>
-        <head>
-        <meta charset="UTF-8">
-        <meta name="viewport" content="width=device-width, initial-scale=1">
-        <title>FreeHouse-TRV</title>
-        <style>* { font-family: sans-serif; } button { display: block; margin: 0.5em; }</style>
-        <script>setTimeout(function(){ window.location.reload() },3000)</script>
-        </head>
-        <body>
-        <h1>FreeHouse-TRV</h1>
-        <h2>calibrating...</h2>
-        </body>
-        </html>
-      );
-    } else*/ {
-      static const char checked[] = "checked";
-      const auto state = trv->getState();
-
-      html << "<!DOCTYPE html>\n"
-        "<html>\n"
-        "<head>\n"
-        "<meta charset=\"UTF-8\">\n"
-        "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
-        "<title>FreeHouse-TRV</title>\n"
-        "<style>* { font-family: sans-serif; } button { display: block; margin: 0.5em; }</style>\n"
-        "<script>"
-        MULTILINE_STRING(
-  function ota_upload(elt) {
-    elt.disabled = true;
-    const input = document.getElementById('firmware');
-    if (!input.files.length || !(input.files[0] instanceof Blob)) {
-      alert('Please select a file.');
-      return;
+  }
+  return sendPage(req);
+}
+
+// Reads the whole request body into `body`, or replies with an error and returns -1
+static int receiveBody(httpd_req_t *req, char *body, size_t size) {
+  if (req->content_len >= size) {
+    httpd_resp_set_status(req, "413 Content Too Large");
+    httpd_resp_send(req, NULL, 0);
+    return -1;
+  }
+  size_t length = 0;
+  while (length < req->content_len) {
+    const int received = httpd_req_recv(req, body + length, req->content_len - length);
+    if (received == HTTPD_SOCK_ERR_TIMEOUT)
+      continue;
+    if (received <= 0) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Receive error");
+      return -1;
     }
+    length += received;
+  }
+  body[length] = 0;
+  return length;
+}
+
+// The page sends its commands as POSTs (with the argument as the body), and gets the new state back
+esp_err_t CaptivePortal::postHandler(httpd_req_t *req) {
+  static char body[sizeof req->uri];
+
+  ESP_LOGI(TAG, "Post %s", req->uri);
+  if (exitStatus != NONE)
+    return sendClosing(req);
+
+  timeout = millis() + PORTAL_TTL;
+
+  if (startsWith(req->uri, "/api/config"))
+    return configHandler(req);
+
+  if (receiveBody(req, body, sizeof body) < 0)
+    return ESP_OK;
+  command(req->uri, body);
+  return exitStatus != NONE ? sendClosing(req) : sendState(req);
+}
+
+// POST /api/config: any number of the fields a hub can send (see Trv::writeable) in one JSON object, eg.
+//   curl -d '{"current_heating_setpoint":19.5,"sleep_time":30,"system_mode":"auto"}' http://192.168.4.1/api/config
+// They're applied together and written to flash once, and the reply is the new state.
+esp_err_t CaptivePortal::configHandler(httpd_req_t *req) {
+  char *body = (char *)malloc(CONFIG_API_MAX_BODY);
+  if (!body)
+    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+
+  const bool received = receiveBody(req, body, CONFIG_API_MAX_BODY) >= 0;
+  const bool applied = received && trv->processNetMessage(body);
+  free(body);
+  if (!received)
+    return ESP_OK;
+  if (!applied)
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+
+  trv->flush();
+  return sendState(req);
+}
 
-    const file = input.files[0];
-    const xhr = new XMLHttpRequest();
-
-    // Optional: Show progress in the console; replace with UI update as needed
-    xhr.upload.onprogress = function(event) {
-      if (event.lengthComputable) {
-        const percentComplete = (event.loaded / event.total) * 100;
-        elt.textContent = (`${percentComplete.toFixed(2)}% complete`);
-      } else {
-        elt.textContent = (`Uploaded ${event.loaded} bytes`);
-      }
-    };
-
-    xhr.onload = function() {
-      if (xhr.status === 200) {
-        alert('Upload successful!');
-      } else {
-        alert('Upload failed.');
-      }
-      elt.disabled = false;
-    };
-
-    xhr.onerror = function() {
-      alert('Upload error\n\n' + xhr.statusText);
-      elt.disabled = false;
-    };
-
-    xhr.open('POST', '/ota', true);
-    xhr.send(file);
+// The UI is static and gzipped at build time (see main/CMakeLists.txt). The browser revalidates it
+// on each load, and gets a 304 unless the firmware has changed.
+esp_err_t CaptivePortal::sendPage(httpd_req_t *req) {
+  static char etag[12];
+  const size_t size = portal_html_gz_end - portal_html_gz_start;
+  if (!etag[0])
+    snprintf(etag, sizeof etag, "\"%08lx\"", esp_rom_crc32_le(0, portal_html_gz_start, size));
+
+  char match[sizeof etag];
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof match) == ESP_OK && !strcmp(match, etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
   }
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  return httpd_resp_send(req, (const char *)portal_html_gz_start, size);
+}
 
-  function processMessage(e,k,v) {
-    if (e instanceof HTMLElement) {
-      if (k === undefined) k = e.name;
-      if (v === undefined) v = Number(e.value);
-    }
-    window.location.href = "/process?"+JSON.stringify({[k]:v})
+// The live values for the UI: the state as sent to the hub, plus what only the portal shows
+esp_err_t CaptivePortal::sendState(httpd_req_t *req) {
+  static char buffer[STATE_MAX_LENGTH]; // The server is single threaded
+  const auto &state = trv->getState();
+  StrBuf json(buffer);
+  trv->asJson(json, state);
+  const bool stateOverflowed = json.overflowed(); // truncate() below would clear it
+
+  cJSON *extra = cJSON_CreateObject();
+  cJSON_AddStringToObject(extra, "net_mode", netModes[state.config.netMode]);
+  cJSON_AddStringToObject(extra, "device_name", (const char *)state.config.mqttConfig.device_name);
+  cJSON_AddStringToObject(extra, "version", versionDetail);
+  cJSON_AddStringToObject(extra, "network", debugNetworkInfo());
+  char *fields = cJSON_PrintUnformatted(extra); // For the escaping
+  cJSON_Delete(extra);
+  json.truncate(json.length() - 1); // Merge into the state object
+  json.add(",\"tasks\":");
+  WithTask::statsJson(json);
+  json.add(",\"heap\":");
+  HeapStats::json(json);
+  if (fields) {
+    json.add(',');
+    json.add(fields + 1);
+    cJSON_free(fields);
+  } else {
+    json.add('}');
   }
-  )
-        "</script>"
-        "</head>\n"
-        "<body>\n"
-        "<h1>FreeHouse-TRV</h1>\n"
-        "<input name='system_mode' onclick='processMessage(this,undefined,\"" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_HEAT] << "\")' type='radio' " << (state.config.system_mode == ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_HEAT ? checked : "") << "/>" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_HEAT] << "\n"
-        "<input name='system_mode' onclick='processMessage(this,undefined,\"" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_AUTO] << "\")' type='radio' " << (state.config.system_mode == ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_AUTO ? checked : "") << "/>" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_AUTO] << "\n"
-        "<input name='system_mode' onclick='processMessage(this,undefined,\"" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_OFF] << "\")' type='radio' " << (state.config.system_mode == ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_OFF ? checked : "") << "/>" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_OFF] << "\n"
-        "<input name='system_mode' onclick='processMessage(this,undefined,\"" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_SLEEP] << "\")' type='radio' " << (state.config.system_mode == ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_SLEEP ? checked : "") << "/>" << systemModes[ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_SLEEP] << "\n"
-        "<table>\n"
-          "<tr><td>valve</td><td>" << (int)state.sensors.position << " (" << MotorController::lastStatus << ")</td></tr>\n"
-          "<tr><td>syetem mode</td><td>" << systemModes[state.config.system_mode] << '(' << state.config.system_mode << ")</td></tr>\n"
-          "<tr><td>local_temperature</td><td>" << state.sensors.local_temperature << " °C</td></tr>\n"
-          "<tr><td>sensor_temperature</td><td>" << state.sensors.sensor_temperature << " °C</td></tr>\n"
-          "<tr><td>battery (raw)</td><td>" << state.sensors.battery_raw << "mV</td></tr>\n"
-          "<tr><td>battery %</td><td>" << (int)state.sensors.battery_percent << "%</td></tr>\n"
-          "<tr><td>power source</td><td>" << (state.sensors.is_charging ? "charging" : "battery power") << "</td></tr>\n"
-          "<tr><td>heating setpoint</td>"
-            "<td><input style='width:6em;' type='number' value='" << (state.config.current_heating_setpoint) << "' name='current_heating_setpoint' onchange='processMessage(this)'>°C</td>"
-          "</tr>\n"
-          "<tr><td>temp. calibration</td>"
-            "<td><input style='width:6em;' type='number' value='" << (state.config.local_temperature_calibration) << "' name='local_temperature_calibration' onchange='processMessage(this)'>°C</td>"
-          "</tr>\n"
-          "<tr><td>Temp. resoluation</td>"
-            "<td><select style='width:6em;' type='number' value='" << (int)(state.config.resolution) << "' name='resolution' onchange='processMessage(this,undefined,Number(this.selectedOptions[0].value))'>"
-              "<option value='0.5' " << (state.config.resolution==0 ? "selected":"") << ">0.5°C</option>"
-              "<option value='0.25' " << (state.config.resolution==1 ? "selected":"") << ">0.25°C</option>"
-              "<option value='0.125' " << (state.config.resolution==2 ? "selected":"") << ">0.125°C</option>"
-              "<option value='0.0625' " << (state.config.resolution==3 ? "selected":"") << ">0.0625°C</option>"
-            "</select></td>"
-          "</tr>\n"
-          "<tr><td>Sleep time</td>"
-            "<td><input style='width:6em;' type='number' value='" << (state.config.sleep_time) << "' name='sleep_time' onchange='processMessage(this)'>s</td>"
-          "</tr>\n"
-          "<tr><td>Back-off burst</td>"
-            "<td><input style='width:6em;' type='number' value='" << (state.config.motor.backoff_ms) << "' name='backoff_ms' onchange='processMessage(this)'>ms</td>"
-          "</tr>\n"
-          "<tr><td>Stall time</td>"
-            "<td><input style='width:6em;' type='number' value='" << (state.config.motor.stall_ms) << "' name='stall_ms' onchange='processMessage(this)'>ms</td>"
-          "</tr>\n"
-          "<tr><td>Motor reversed</td>"
-              "<td><input type=\"checkbox\" " << (state.config.motor.reversed ? "checked":"") << " name='motor_reversed' onchange='processMessage(this,undefined,this.checked)'></td>"
-          "</tr>\n"
-          "<tr><td>Debug flags</td>"
-            "<td><input style='width:6em;' type='number' value='" << (state.config.debug_flags) << "' name='debug_flags' onchange='processMessage(this)'></td>"
-          "</tr>\n"
-          "</table>\n"
-
-        "<h2>Networking</h2>"
-        "<table>\n"
-          "<tr><td>Message comms mode</td><td>" << netModes[state.config.netMode] << "</td></tr>\n"
-          "<tr><td>MQTT/ESP-NOW device name</td><td><input id='device' value=\"" << state.config.mqttConfig.device_name << "\"></td></tr>\n"
-        // "<tr style='display:none;'><td>WiFi SSID</td><td><input id='ssid' value=\"" << state.config.mqttConfig.wifi_ssid << "\"></td></tr>\n"
-        // "<tr style='display:none;'><td>WiFi password</td><td><input id='pwd' value=\"" << state.config.mqttConfig.wifi_pwd << "\"></td></tr>\n"
-        // "<tr style='display:none;'><td>MQTT server</td><td><input id='mqtt' value=\"" << state.config.mqttConfig.mqtt_server << ':' << state.config.mqttConfig.mqtt_port << "\"></td></tr>\n"
-        "</table>\n"
-        "<button onclick='window.location.href = \"/net-esp/\"+encodeURIComponent(document.getElementById(\"device\").value)'>Enable ESP-NOW</button>"
-        // "<button onclick='window.location.href = \"/net-mqtt/\"+encodeURIComponent(\"device,ssid,pwd,mqtt\".split(\",\").map(id => document.getElementById(id).value).join(\"-\"))'>Enable MQTT</button>\n"
-        // "<button onclick='window.location.href = \"/net-zigbee\"'>Disable MQTT</button>\n"
-        "<button onclick=\"const n = prompt('Enter the new FreeHouse network passphrase'); if (n) fetch('/set-passphrase/'+encodeURIComponent(n));\">Set FreeHouse network name</button>"
-
-        "<h2>Actions</h2>"
-        "<button onclick='window.location.href = \"/close\"'>Close</button>\n"
-        "<button onclick='window.location.href = \"/calibrate\"'>Calibrate valve</button>\n"
-        "<button onclick='window.location.href = \"/test-mode\"'>Test mode</button>\n"
-        "<button onclick='window.location.href = \"/power-off\"'>Power Off</button>\n"
-
-        "<h2>OTA Update</h2>"
-        "<input type='file' id='firmware'>"
-        "<button onclick='ota_upload(this)'>Update</button>"
-        "<div>Current: " << versionDetail << "</div>"
-        "<div>" << debugNetworkInfo() << "</div>"
-        "</body></html>";
+  if (stateOverflowed || json.overflowed())
+    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "State too long");
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json.c_str(), json.length());
+}
+
+bool PortalEvents::begin(httpd_req_t *req) {
+  if (isRunning()) {
+    // One stream at a time: a reloaded page replaces the old one
+    cancel();
+    wait();
+  }
+  httpd_req_t *async;
+  if (ERR_BACKTRACE(httpd_req_async_handler_begin(req, &async)) != ESP_OK)
+    return false;
+  stream = async;
+  if (!StartTask(PortalEvents)) {
+    httpd_req_async_handler_complete(stream);
+    stream = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Sends the live values whenever they change, so a valve movement can be watched as it happens. The state is
+// read without waiting for the Trv, which would hold us up until any movement had finished.
+void PortalEvents::task() {
+  char last[EVENTS_MAX_LENGTH] = "";
+  char event[EVENTS_MAX_LENGTH];
+  int idle = 0;
+
+  httpd_resp_set_type(stream, "text/event-stream");
+  httpd_resp_set_hdr(stream, "Cache-Control", "no-store");
+  while (!cancelled()) {
+    const auto &s = trv->currentState();
+    snprintf(event, sizeof event, "data: {\"position\":%d,\"motor\":\"%s\",\"local_temperature\":%g,"
+      "\"sensor_temperature\":%g,\"battery_percent\":%d,\"battery_mv\":%lu,\"is_charging\":%s}\n\n",
+      (int)s.sensors.position, MotorController::lastStatus, s.sensors.local_temperature,
+      s.sensors.sensor_temperature, (int)s.sensors.battery_percent, (unsigned long)s.sensors.battery_raw,
+      s.sensors.is_charging ? "true" : "false");
+
+    esp_err_t sent = ESP_OK;
+    if (strcmp(event, last)) {
+      sent = httpd_resp_send_chunk(stream, event, HTTPD_RESP_USE_STRLEN);
+      strcpy(last, event);
+      idle = 0;
+    } else if (++idle * EVENTS_POLL_MS >= EVENTS_KEEPALIVE_MS) {
+      sent = httpd_resp_send_chunk(stream, ":\n\n", HTTPD_RESP_USE_STRLEN); // A comment, to spot a closed connection
+      idle = 0;
     }
-    httpd_resp_send(req, html.str().c_str(), HTTPD_RESP_USE_STRLEN);
+    if (sent != ESP_OK)
+      break; // The page has gone
 
-    return ESP_OK;
+    pause(EVENTS_POLL_MS);
   }
+  httpd_resp_send_chunk(stream, NULL, 0);
+  httpd_req_async_handler_complete(stream);
+  stream = NULL;
 }
@@ -13,16 +13,43 @@ typedef enum {
   POWER_OFF
 } exit_status_t;
 
+// The page's live values (see /events) are polled this often, and sent when they change
+#define EVENTS_POLL_MS 250
+#define EVENTS_KEEPALIVE_MS 15000
+#define EVENTS_MAX_LENGTH 200
+// The largest body accepted by POST /api/config
+#define CONFIG_API_MAX_BODY 2048
+#define STATE_MAX_LENGTH 3072 // /state.json, with every class's task stats
+
+// A server-sent event stream of the live values, to a single page at a time
+class PortalEvents : public WithTask {
+ protected:
+  Trv* trv;
+  httpd_req_t* stream = NULL; // Detached from the httpd task by httpd_req_async_handler_begin()
+
+ public:
+  PortalEvents(Trv* trv) : trv(trv) {}
+  bool begin(httpd_req_t* req);
+  void task();
+};
+
 class CaptivePortal : public HttpGetHandler {
  protected:
   Trv* trv;
+  PortalEvents events;
   uint32_t timeout;
   bool calibrating = false;
   void exitPortal(exit_status_t status);
+  void command(const char* url, char* arg);
+  esp_err_t configHandler(httpd_req_t* req);
+  esp_err_t sendClosing(httpd_req_t* req);
+  esp_err_t sendPage(httpd_req_t* req);
+  esp_err_t sendState(httpd_req_t* req);
 
  public:
   CaptivePortal(Trv* trv, const char* name);
   virtual esp_err_t getHandler(httpd_req_t* req);
+  virtual esp_err_t postHandler(httpd_req_t* req);
   exit_status_t exitStatus;
 };
 
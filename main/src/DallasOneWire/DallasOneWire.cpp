@@ -5,6 +5,8 @@
 
 #include "../../trv.h"
 
+#define CONVERSION_TIMEOUT_MS 2000 // 12-bit conversions take 750ms
+
 extern "C" {
 #include "ds18b20.h"
 #include "ow_rom.h"
@@ -26,9 +28,11 @@ static void retryReset(OW *ow) {
 DallasOneWire::DallasOneWire(float& temp, uint8_t resolution) : temp(temp), resolution(resolution) {
   if (ow_init(&ow, DTEMP) != ESP_OK) {
     ESP_LOGW(TAG, "DallasOneWire: FAILED TO INIT DS18B20");
+    reading.resolve(temp);
     return;
   }
-  StartTask(DallasOneWire);
+  if (!StartTask(DallasOneWire, 2, 0, CONVERSION_TIMEOUT_MS))
+    reading.resolve(temp);
 }
 
 DallasOneWire::~DallasOneWire() {
@@ -38,8 +42,7 @@ DallasOneWire::~DallasOneWire() {
 }
 
 float DallasOneWire::readTemp() {
-  wait();
-  return temp;
+  return reading.get();
 }
 
 void DallasOneWire::setResolution(uint8_t res /* 0-3 */) {
@@ -93,7 +96,8 @@ void DallasOneWire::task() {
   t = millis();
   do {
     delay(2);
-  } while (ow_read(&ow) == 0);
+  } while (ow_read(&ow) == 0 && !cancelled());
+  if (cancelled()) goto fail;
   t = millis() - t;
   if (ow_reset(&ow) != ESP_OK) goto fail;
   ow_send(&ow, OW_SKIP_ROM);
@@ -110,11 +114,14 @@ void DallasOneWire::task() {
     goto fail;
   } else {
     temp = (signed)(data) / 16.0;
+    valid = true;
     ESP_LOGI(TAG, "Temp is %f, r=0x%02x [0x%02x 0x%02x 0x%02x], t=%lu", temp, targetConfig, scratchpad[2], scratchpad[3], scratchpad[4], t);
   }
+  reading.resolve(temp);
   return;
 
 fail:
   ESP_LOGW(TAG, "DallasOneWire: FAILED TO RESET");
+  reading.resolve(temp);
   return;
 }
@@ -25,6 +25,8 @@ class DallasOneWire: public WithTask {
   ~DallasOneWire();
   void setResolution(uint8_t res);
   float readTemp();
+  Future<float> reading; // Resolved when the conversion completes (or fails, leaving the previous value)
+  bool valid = false;    // Whether the conversion succeeded
   void task();
 };
 #endif
\ No newline at end of file
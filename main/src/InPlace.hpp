@@ -0,0 +1,32 @@
+#ifndef INPLACE_H
+#define INPLACE_H
+
+#include <new>
+#include <stdint.h>
+#include <utility>
+
+// Static storage for one object, constructed and destroyed in place rather than on the heap. For the
+// objects each wake creates, which would otherwise fragment the heap of a device that never reboots cleanly.
+template <typename T>
+class InPlace {
+protected:
+  alignas(T) uint8_t storage[sizeof(T)];
+  T *object = NULL;
+
+public:
+  template <typename... Args>
+  T *make(Args &&...args) {
+    destroy();
+    object = new (storage) T(std::forward<Args>(args)...);
+    return object;
+  }
+  void destroy() {
+    if (object) {
+      object->~T();
+      object = NULL;
+    }
+  }
+  T *get() const { return object; }
+};
+
+#endif
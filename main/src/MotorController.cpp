@@ -2,6 +2,7 @@
 
 #include "../common/gpio/gpio.hpp"
 #include "../trv.h"
+#include "event-log.h"
 #include "pins.h"
 
 #define BAR_SCALE 1000
@@ -11,6 +12,7 @@
 #define peakLoPercent 92
 #define peakHiPercent 102
 #define peakAvgPercent 80
+#define sampleMs 30 // Between battery readings while the motor runs. The stall thresholds are tuned to it.
 /* In testing:
   typical Vshunt at full stall in 0.23v (batt=4110mv, R=0.66ohms), making
   I=0.338mA and Rmotor=12.16-Rshunt, or 11.48ohms In-rush Vshunt on *reversal*
@@ -89,12 +91,16 @@ void MotorController::calibrate() {
   }
   calibrating = true;
   ESP_LOGI(TAG, "MotorController::calibrating = true");
-  setValvePosition(100);
-  wait();
-  setValvePosition(0);
-  wait();
-  setValvePosition(100);
-  wait();
+  // Stop the sequence if any stroke was cancelled
+  const int strokes[] = {100, 0, 100};
+  for (auto pos : strokes) {
+    setValvePosition(pos);
+    wait();
+    if (cancelled()) {
+      ESP_LOGW(TAG, "MotorController::calibrate cancelled");
+      break;
+    }
+  }
   calibrating = false;
   ESP_LOGI(TAG, "MotorController::calibrating = false");
 }
@@ -106,21 +112,16 @@ static void charChart(int b, char c) {
   bar[b] = c;
 }
 
+template <int size>
 class MovingAverage {
 private:
-  int *values;
+  int values[size] = {0};
   int index;
   int count;
   int total;
-  int size;
 
 public:
-  MovingAverage(int size) : index(0), count(0), total(0), size(size) {
-    values = new int[size];
-    memset(values, 0, sizeof(int) * size);
-  }
-
-  ~MovingAverage() { delete[] values; }
+  MovingAverage() : index(0), count(0), total(0) {}
 
   int add(int value) {
     total -= values[index];
@@ -140,6 +141,7 @@ void MotorController::task() {
   auto noloadBatt = battery->getValue();
 
   if (noloadBatt < 3000) {
+    EventLog::add(EV_MOTOR_LOW_BATTERY, noloadBatt);
     ESP_LOGW(TAG, "MotorController: noloadBatt %f too low, stop",
              noloadBatt / 1000.0);
     lastStatus = "low-battery";
@@ -155,11 +157,17 @@ void MotorController::task() {
   int minRatio = 0, maxRatio = 0;
   int currentRatio = 0;
 
-  MovingAverage battAvg(6);
+  MovingAverage<6> battAvg;
+  const unsigned int motorStart = millis();
 
   while (true) {
     if (target == current)
       break;
+    if (cancelled()) {
+      lastStatus = "cancelled";
+      target = current;
+      break;
+    }
     const auto dir = target > current ? 1 : -1;
     now = millis();
     const auto runTime = startTime ? now - startTime : 0;
@@ -182,6 +190,7 @@ void MotorController::task() {
       current = 1 + (runTime * 98 / maxMotorTime);
     }
 
+    delay(sampleMs);
     int spotBatt = battery->getValue();
     batt = battAvg.add(spotBatt);
 
@@ -268,6 +277,10 @@ void MotorController::task() {
     trackRatio = ((trackRatio + currentRatio) * peakAvgPercent) / 200;
   }
   setDirection(0);
+  if (startTime)
+    BatteryMonitor::accountMotor(millis() - motorStart);
+  EventLog::add(EV_MOTOR_DONE, eventTag(lastStatus), target, current, now - startTime);
+  EventLog::add(EV_MOTOR_LOAD, noloadBatt, batt, trackRatio, currentRatio);
   ESP_LOGI(TAG,
            "MotorController %10s: dir: %2d, noloadBatt %4dmV, batt %4dmV, ΔV "
            "%3dmV, Vpeak %3dmV, target %3d, current %3d, runTime: %5lu, "
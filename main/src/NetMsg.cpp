@@ -6,6 +6,8 @@
 #include "trv-state.h"
 #include "trv.h"
 #include "../common/gpio/gpio.hpp"
+#include "../net/fw-transfer.hpp"
+#include "event-log.h"
 #include "cJSON.h"
 
 extern const char *systemModes[];
@@ -21,8 +23,11 @@ FIELD(backoff_ms);
 FIELD(stall_ms);
 FIELD(motor_reversed);
 FIELD(debug_flags);
+FIELD(writeback_secs);
 FIELD(unpair);
 FIELD(calibrate);
+FIELD(task_stats);
+FIELD(event_log);
 
 const char* Trv::writeable[] = {
     field_current_heating_setpoint,
@@ -34,16 +39,19 @@ const char* Trv::writeable[] = {
     field_stall_ms,
     field_motor_reversed,
     field_debug_flags,
+    field_writeback_secs,
     field_unpair,
     field_calibrate,
+    field_task_stats,
+    field_event_log,
     NULL
 };
 
-void Trv::processNetMessage(const char *json) {
+bool Trv::processNetMessage(const char *json) {
   cJSON *root = cJSON_Parse(json);
   if (!root) {
     ESP_LOGW(TAG, "JSON parse failed: %s", json);
-    return;
+    return false;
   }
   ESP_LOGI(TAG, "JSON message: %s", json);
 
@@ -52,15 +60,24 @@ void Trv::processNetMessage(const char *json) {
   cJSON *system_mode = cJSON_GetObjectItem(root, field_system_mode);
   cJSON *sleep_time = cJSON_GetObjectItem(root, field_sleep_time);
   cJSON *debug_flags = cJSON_GetObjectItem(root, field_debug_flags);
+  cJSON *writeback_secs = cJSON_GetObjectItem(root, field_writeback_secs);
   cJSON *resolution = cJSON_GetObjectItem(root, field_resolution);
   cJSON *stall_ms = cJSON_GetObjectItem(root, field_stall_ms);
   cJSON *backoff_ms = cJSON_GetObjectItem(root, field_backoff_ms);
   cJSON *motor_reversed = cJSON_GetObjectItem(root, field_motor_reversed);
   cJSON *unpair = cJSON_GetObjectItem(root, field_unpair);
   cJSON *calibrate = cJSON_GetObjectItem(root, field_calibrate);
+  cJSON *task_stats = cJSON_GetObjectItem(root, field_task_stats);
+  cJSON *event_log = cJSON_GetObjectItem(root, field_event_log);
 
   auto unpairRequest = cJSON_IsTrue(unpair);
   auto calibrateRequest = cJSON_IsTrue(calibrate);
+  if (cJSON_IsTrue(task_stats)) {
+    reportTaskStats = true; // Sent with the next state update
+  }
+  if (cJSON_IsNumber(event_log)) {
+    EventLog::request((uint32_t)event_log->valuedouble); // Sent after the state, at the end of the wake
+  }
 
   if (cJSON_IsString(system_mode) && (system_mode->valuestring != NULL)) {
     for (esp_zb_zcl_thermostat_system_mode_t mode = ESP_ZB_ZCL_THERMOSTAT_SYSTEM_MODE_OFF;
@@ -87,6 +104,9 @@ void Trv::processNetMessage(const char *json) {
   if (cJSON_IsNumber(debug_flags)) {
     setDebugFlags(debug_flags->valueint);
   }
+  if (cJSON_IsNumber(writeback_secs)) {
+    setWriteBack(writeback_secs->valueint);
+  }
 
   if (cJSON_IsNumber(resolution)) {
     int res = -1;
@@ -110,11 +130,18 @@ void Trv::processNetMessage(const char *json) {
     cJSON *url = cJSON_GetObjectItem(ota, "url");
     cJSON *ssid = cJSON_GetObjectItem(ota, "ssid");
     cJSON *pwd = cJSON_GetObjectItem(ota, "pwd");
+    cJSON *size = cJSON_GetObjectItem(ota, "size");
+    cJSON *sha256 = cJSON_GetObjectItem(ota, "sha256");
     if (cJSON_IsString(url) && (url->valuestring != NULL)
       && cJSON_IsString(ssid) && (ssid->valuestring != NULL)
       && cJSON_IsString(pwd) && (pwd->valuestring != NULL)) {
         ESP_LOGI(TAG, "OTA URL: %s, Wifi %s", url->valuestring, ssid->valuestring);
-        requestUpdate(url->valuestring, ssid->valuestring, pwd->valuestring) ;
+        requestUpdate(url->valuestring, ssid->valuestring, pwd->valuestring,
+          cJSON_IsString(sha256) ? sha256->valuestring : NULL);
+    }
+    // Or, the hub can send the image itself over ESP-NOW
+    if (!cJSON_IsString(url) && cJSON_IsNumber(size) && cJSON_IsString(sha256)) {
+        FirmwareTransfer::offer((uint32_t)size->valuedouble, sha256->valuestring);
     }
   }
   // Free the root object
@@ -126,4 +153,5 @@ void Trv::processNetMessage(const char *json) {
   if (unpairRequest) {
     doUnpair();
   }
+  return true;
 }
@@ -0,0 +1,51 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Builds a string in a caller's buffer, like a stringstream without the heap. Anything that doesn't fit
+// is cut off, and overflowed() says so.
+class StrBuf {
+protected:
+  char *buf;
+  size_t size;
+  size_t len = 0;
+  bool over = false;
+
+public:
+  StrBuf(char *buf, size_t size) : buf(buf), size(size) { buf[0] = 0; }
+  template <size_t N>
+  StrBuf(char (&buf)[N]) : StrBuf(buf, N) {}
+
+  StrBuf &printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(buf + len, size - len, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= size - len) {
+      over = true;
+      len = size - 1;
+    } else {
+      len += n;
+    }
+    return *this;
+  }
+  StrBuf &add(const char *s) { return printf("%s", s); }
+  StrBuf &add(char c) { return printf("%c", c); }
+  // Back to an earlier length, eg. to drop something that didn't fit
+  void truncate(size_t length) {
+    if (length < len) {
+      len = length;
+      buf[len] = 0;
+      over = false;
+    }
+  }
+
+  const char *c_str() const { return buf; }
+  size_t length() const { return len; }
+  bool overflowed() const { return over; }
+};
+
+#endif
@@ -29,7 +29,10 @@ protected:
         state = PRESSED;
         return;
       }
-      delay(70);
+      if (!pause(70)) {
+        state = NOT_PRESSED;
+        return;
+      }
     }
   }
 
@@ -1,15 +1,92 @@
 #include "WithTask.hpp"
 #include "../trv.h"
 
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_attr.h"
 #include "esp_log.h"
 
 static spinlock_t spinlock = SPINLOCK_INITIALIZER;
+// Protects the worker pool and the waiter lists. Critical sections, as they're very short
+static portMUX_TYPE poolLock = portMUX_INITIALIZER_UNLOCKED;
 EventGroupHandle_t WithTask::anyTasks = NULL;
 int WithTask::numRunning = 0;
+volatile uint32_t WithTask::cancelEpoch = 0;
+
+#define PAUSE_SLICE_MS 50 // How often pause() checks for cancellation
+
+typedef struct {
+  WithTask *task;
+  const char *name;
+  UBaseType_t priority;
+} withtask_job_t;
+
+// The worker pools, smallest stack first. Stacks are static so starting a task doesn't touch the heap.
+// The largest is for classes that haven't run yet (or need that much), so it has just the one worker.
+#define POOL_CLASSES 3
+#define SMALL_STACK (WITHTASK_POOL_STACK * 3 / 8)
+#define MEDIUM_STACK (WITHTASK_POOL_STACK * 5 / 8)
+
+typedef struct {
+  const int stackSize;
+  const int size;             // Workers
+  StackType_t *const stacks;  // stackSize apart
+  StaticTask_t *const tcbs;
+  uint8_t *const jobStorage;
+  StaticQueue_t jobQueue;
+  QueueHandle_t jobs;
+  int numWorkers;
+  int idleWorkers;
+} withtask_pool_t;
+
+static StackType_t smallStacks[WITHTASK_POOL_SIZE][SMALL_STACK];
+static StackType_t mediumStacks[WITHTASK_POOL_SIZE][MEDIUM_STACK];
+static StackType_t largeStack[WITHTASK_POOL_STACK];
+static StaticTask_t smallTcbs[WITHTASK_POOL_SIZE], mediumTcbs[WITHTASK_POOL_SIZE], largeTcb;
+static uint8_t jobStorage[POOL_CLASSES][WITHTASK_POOL_SIZE * sizeof(withtask_job_t)];
+static withtask_pool_t pools[POOL_CLASSES] = {
+  {SMALL_STACK, WITHTASK_POOL_SIZE, smallStacks[0], smallTcbs, jobStorage[0]},
+  {MEDIUM_STACK, WITHTASK_POOL_SIZE, mediumStacks[0], mediumTcbs, jobStorage[1]},
+  {WITHTASK_POOL_STACK, 1, largeStack, &largeTcb, jobStorage[2]},
+};
+
+#define STACK_FILL_BYTE 0xa5   // As used by FreeRTOS to measure the high-water mark
+#define STACK_GUARD 64         // Leave the end-of-stack watchpoint alone
+#define STACK_MARGIN 1024      // Added to the worst case seen when deriving a stack size
+#define STACK_MIN 2048
+
+static RTC_DATA_ATTR withtask_stats_t stats[WITHTASK_MAX_STATS];
+
+static withtask_stats_t *statsFor(const char *name, bool create) {
+  for (int i = 0; i < WITHTASK_MAX_STATS; i++) {
+    if (!stats[i].name[0]) {
+      if (!create)
+        return NULL;
+      strncpy(stats[i].name, name, sizeof stats[i].name - 1);
+      return &stats[i];
+    }
+    if (!strncmp(stats[i].name, name, sizeof stats[i].name - 1))
+      return &stats[i];
+  }
+  return NULL;
+}
+
+// Re-fill the unused part of a worker's stack so the high-water mark measures just the next job
+static void repaintStack(StackType_t *stack) {
+  volatile uint8_t marker;
+  uint8_t *top = (uint8_t *)&marker - 256; // Room for memset's own frame
+  uint8_t *bottom = (uint8_t *)stack + STACK_GUARD;
+  if (top > bottom)
+    memset(bottom, STACK_FILL_BYTE, top - bottom);
+}
 
 WithTask::WithTask() {
-  running = NULL;
   spinlock_acquire(&spinlock, SPINLOCK_WAIT_FOREVER);
+  for (auto &pool : pools) {
+    if (pool.jobs == NULL)
+      pool.jobs = xQueueCreateStatic(pool.size, sizeof(withtask_job_t), pool.jobStorage, &pool.jobQueue);
+  }
   if (anyTasks == NULL) {
     anyTasks = xEventGroupCreate();
     // Initially no tasks are running, so we mark it as finished.
@@ -21,17 +98,76 @@ WithTask::WithTask() {
   spinlock_release(&spinlock);
 }
 
-WithTaskState WithTask::wait(TickType_t delay) {
-  if (running) {
-    if (xEventGroupWaitBits(running, WITHTASK_FINISHED, pdFALSE, pdTRUE, delay) & WITHTASK_FINISHED) {
-      running = NULL;
-      return FINISHED;
-    } else {
-      return TIMEOUT;
+void Completion::lock() { taskENTER_CRITICAL(&poolLock); }
+void Completion::unlock() { taskEXIT_CRITICAL(&poolLock); }
+
+bool Completion::wait(TickType_t delay) {
+  if (!done && delay) {
+    // Register for the completion notification. We clear any stale notification first, as a previous
+    // wait() may have timed out just before the task it was waiting for finished.
+    ulTaskNotifyTakeIndexed(WITHTASK_NOTIFY_INDEX, pdTRUE, 0);
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int slot = -1;
+    taskENTER_CRITICAL(&poolLock);
+    if (!done) {
+      for (int i = 0; i < WITHTASK_MAX_WAITERS; i++) {
+        if (!waiters[i]) {
+          waiters[i] = self;
+          slot = i;
+          break;
+        }
+      }
+    }
+    taskEXIT_CRITICAL(&poolLock);
+
+    if (slot >= 0) {
+      const TickType_t start = xTaskGetTickCount();
+      while (!done) {
+        const TickType_t elapsed = xTaskGetTickCount() - start;
+        if (delay != portMAX_DELAY && elapsed >= delay)
+          break;
+        ulTaskNotifyTakeIndexed(WITHTASK_NOTIFY_INDEX, pdTRUE, delay == portMAX_DELAY ? portMAX_DELAY : delay - elapsed);
+      }
+      taskENTER_CRITICAL(&poolLock);
+      if (waiters[slot] == self)
+        waiters[slot] = NULL;
+      taskEXIT_CRITICAL(&poolLock);
+    } else if (!done) {
+      // Too many waiters - poll instead
+      ESP_LOGW(TAG, "WithTask: too many waiters, polling");
+      const TickType_t start = xTaskGetTickCount();
+      while (!done && (delay == portMAX_DELAY || xTaskGetTickCount() - start < delay))
+        vTaskDelay(2);
     }
-  } else {
+  }
+  return done;
+}
+
+// Mark as done and wake anyone waiting. We must not touch `this` after setting `done`,
+// as a waiter may then delete us.
+void Completion::complete() {
+  TaskHandle_t notify[WITHTASK_MAX_WAITERS];
+  taskENTER_CRITICAL(&poolLock);
+  memcpy(notify, waiters, sizeof notify);
+  memset(waiters, 0, sizeof waiters);
+  done = true;
+  taskEXIT_CRITICAL(&poolLock);
+
+  for (int i = 0; i < WITHTASK_MAX_WAITERS; i++) {
+    if (notify[i])
+      xTaskNotifyGiveIndexed(notify[i], WITHTASK_NOTIFY_INDEX);
+  }
+}
+
+WithTaskState WithTask::wait(TickType_t delay) {
+  if (!active)
     return NOT_RUNNING;
+
+  if (completion.wait(delay)) {
+    active = false;
+    return FINISHED;
   }
+  return TIMEOUT;
 }
 
 WithTask::~WithTask() { wait(); }
@@ -47,15 +183,71 @@ WithTaskState WithTask::waitForAllTasks(TickType_t delay) {
 
 void WithTask::taskRunner(void *p) {
   WithTask *self = static_cast<WithTask *>(p);
-  self->start();
+  self->start(pcTaskGetName(NULL), self->stackSize);
   vTaskDelete(NULL);
 }
 
-bool WithTask::startTask(const char *name, int priority, int stackSize) {
+// p is the worker's number, as given by startTask()
+void WithTask::workerLoop(void *p) {
+  withtask_pool_t &pool = pools[(intptr_t)p / WITHTASK_POOL_SIZE];
+  StackType_t *stack = pool.stacks + (intptr_t)p % WITHTASK_POOL_SIZE * pool.stackSize;
+  withtask_job_t job;
+  while (true) {
+    if (xQueueReceive(pool.jobs, &job, portMAX_DELAY) == pdTRUE) {
+      vTaskPrioritySet(NULL, job.priority);
+      repaintStack(stack);
+      job.task->start(job.name, pool.stackSize);
+      taskENTER_CRITICAL(&poolLock);
+      pool.idleWorkers++;
+      taskEXIT_CRITICAL(&poolLock);
+    }
+  }
+}
+
+int WithTask::stackSizeFor(const char *name) {
+  const withtask_stats_t *s = statsFor(name, false);
+  if (!s || !s->stack_used)
+    return WITHTASK_POOL_STACK;
+  int size = ((s->stack_used * 3 / 2 + STACK_MARGIN) + 511) & ~511;
+  if (size < STACK_MIN)
+    size = STACK_MIN;
+  if (size > WITHTASK_POOL_STACK)
+    size = WITHTASK_POOL_STACK;
+  return size;
+}
+
+bool WithTask::cancelled() const {
+  return cancelRequested || epoch != cancelEpoch
+    || (deadline && (int32_t)(xTaskGetTickCount() - deadline) >= 0);
+}
+
+bool WithTask::pause(uint32_t ms) {
+  while (ms && !cancelled()) {
+    const uint32_t slice = ms < PAUSE_SLICE_MS ? ms : PAUSE_SLICE_MS;
+    delay(slice);
+    ms -= slice;
+  }
+  return !cancelled();
+}
+
+void WithTask::cancelAll() {
+  ESP_LOGI(TAG, "WithTask cancelAll (%d running)", numRunning);
+  cancelEpoch = cancelEpoch + 1;
+}
+
+bool WithTask::startTask(const char *name, int priority, int stackSize, uint32_t timeoutMs) {
   if (isRunning()) {
     ESP_LOGI(TAG,"WithTask %s already running", name);
     return false;
   }
+  cancelRequested = false;
+  epoch = cancelEpoch;
+  deadline = timeoutMs ? xTaskGetTickCount() + pdMS_TO_TICKS(timeoutMs) : 0;
+  if (timeoutMs && !deadline)
+    deadline = 1; // Tick count wrapped to exactly 0
+  if (stackSize <= 0)
+    stackSize = stackSizeFor(name);
+  this->stackSize = stackSize;
 
   spinlock_acquire(&spinlock, SPINLOCK_WAIT_FOREVER);
 
@@ -75,23 +267,55 @@ bool WithTask::startTask(const char *name, int priority, int stackSize) {
 
   spinlock_release(&spinlock);
 
-  // Cleanup old running handle if it wasn't waited on
-  if (running != NULL) {
-    vEventGroupDelete(running);
-    running = NULL;
+  // Claim an idle worker, or a slot for a new one, in the smallest pool that's big enough and not busy
+  int index = 0;
+  int newWorker = -1;
+  withtask_pool_t *pool = NULL;
+  taskENTER_CRITICAL(&poolLock);
+  for (; index < POOL_CLASSES; index++) {
+    withtask_pool_t &p = pools[index];
+    if (p.stackSize < stackSize || !p.jobs)
+      continue;
+    if (p.idleWorkers > 0) {
+      p.idleWorkers--;
+      pool = &p;
+      break;
+    }
+    if (p.numWorkers < p.size) {
+      newWorker = p.numWorkers++;
+      pool = &p;
+      break;
+    }
   }
+  completion.reset();
+  active = true;
+  taskEXIT_CRITICAL(&poolLock);
 
-  EventGroupHandle_t newGroup = xEventGroupCreate();
-  running = newGroup;
+  if (newWorker >= 0) {
+    const int worker = index * WITHTASK_POOL_SIZE + newWorker;
+    char workerName[configMAX_TASK_NAME_LEN];
+    snprintf(workerName, sizeof workerName, "withtask%d", worker);
+    xTaskCreateStatic(workerLoop, workerName, pool->stackSize, (void *)(intptr_t)worker, priority,
+                      pool->stacks + newWorker * pool->stackSize, &pool->tcbs[newWorker]);
+  }
 
-  if (xTaskCreate(taskRunner, name, stackSize, this, priority, nullptr) == pdPASS) {
+  if (pool) {
+    withtask_job_t job = {.task = this, .name = name, .priority = (UBaseType_t)priority};
+    // There's always space, as the queue is as long as the pool and we claimed a worker
+    if (xQueueSend(pool->jobs, &job, 0) == pdTRUE)
+      return true;
+    ESP_LOGE(TAG, "WithTask %s: job queue full", name);
+  } else if (xTaskCreate(taskRunner, name, stackSize, this, priority, nullptr) == pdPASS) {
     return true;
   }
 
   // Task creation failed, revert state
-  if (newGroup)
-    vEventGroupDelete(newGroup);
-  running = NULL;
+  active = false;
+  if (pool) {
+    taskENTER_CRITICAL(&poolLock);
+    pool->idleWorkers++;
+    taskEXIT_CRITICAL(&poolLock);
+  }
 
   spinlock_acquire(&spinlock, SPINLOCK_WAIT_FOREVER);
   numRunning--;
@@ -102,23 +326,34 @@ bool WithTask::startTask(const char *name, int priority, int stackSize) {
   return false;
 }
 
-void WithTask::start() {
-  TaskStatus_t taskInfo = {.pcTaskName = "-"};
-
-  vTaskGetInfo(NULL, &taskInfo, pdTRUE, eInvalid);
-  ESP_LOGI(TAG, "WithTask started  %s %d %d", taskInfo.pcTaskName, numRunning);
+void WithTask::start(const char *name, int stackSize) {
+  ESP_LOGI(TAG, "WithTask started  %s %d", name, numRunning);
 
   auto msecs = millis();
   task(); // Run user task logic
   msecs = millis() - msecs;
-  ESP_LOGI(TAG, "WithTask finishing %s %u msecs", taskInfo.pcTaskName, msecs);
+  ESP_LOGI(TAG, "WithTask finishing %s %u msecs", name, msecs);
 
-  if (running) {
-    xEventGroupSetBits(running, WITHTASK_FINISHED);
+  // Record the stats while we still know who we are. StackType_t is a byte in ESP-IDF
+  const uint32_t freeStack = uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t);
+  const uint32_t used = stackSize > (int)freeStack ? stackSize - freeStack : 0;
+  taskENTER_CRITICAL(&poolLock);
+  withtask_stats_t *s = statsFor(name, true);
+  if (s) {
+    s->starts++;
+    s->total_ms += msecs;
+    if (msecs > s->max_ms)
+      s->max_ms = msecs;
+    if (used > s->stack_used)
+      s->stack_used = used;
+    s->stack_size = stackSize;
+  }
+  taskEXIT_CRITICAL(&poolLock);
+  if (debugFlag(DEBUG_TASK_STATS) && freeStack < WITHTASK_LOW_HEADROOM) {
+    ESP_LOGW(TAG, "WithTask %s low stack headroom: %lu of %d bytes free", name, freeStack, stackSize);
   }
 
-  // Log status before decrementing? Or after? original logged after, but inside
-  // lock? We log after decrementing logic, but OUTSIDE lock for performance.
+  completion.complete();
 
   spinlock_acquire(&spinlock, SPINLOCK_WAIT_FOREVER);
   numRunning--;
@@ -129,5 +364,17 @@ void WithTask::start() {
   }
   spinlock_release(&spinlock);
 
-  ESP_LOGI(TAG, "WithTask finished %s %d", taskInfo.pcTaskName, currentCount);
+  ESP_LOGI(TAG, "WithTask finished %s %d", name, currentCount);
+}
+
+void WithTask::statsJson(StrBuf &json) {
+  json.add('[');
+  for (int i = 0; i < WITHTASK_MAX_STATS && stats[i].name[0]; i++) {
+    const auto &s = stats[i];
+    if (i)
+      json.add(',');
+    json.printf("{\"name\":\"%s\",\"starts\":%lu,\"avg_ms\":%lu,\"max_ms\":%lu,\"stack\":%lu,\"stack_used\":%lu}",
+      s.name, s.starts, s.starts ? s.total_ms / s.starts : 0, s.max_ms, s.stack_size, s.stack_used);
+  }
+  json.add(']');
 }
@@ -3,12 +3,36 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
 #include <freertos/task.h>
+#include <string.h>
+
+#include "StrBuf.hpp"
 
 #define StartTask(Cl, ...) (this->startTask(#Cl, ##__VA_ARGS__))
 
 #define WITHTASK_FINISHED (1 << 0)
 
+// Tasks are run on pools of workers with static stacks, created on demand: a pool for each of a few stack
+// sizes, and a task runs on the smallest free one that holds the stack derived from its class's previous
+// runs. If they're all busy (or a larger stack is requested), we fall back to creating a dedicated task.
+#ifndef WITHTASK_POOL_SIZE
+#define WITHTASK_POOL_SIZE 3 // Workers in each of the smaller pools. The largest has one
+#endif
+#ifndef WITHTASK_POOL_STACK
+#define WITHTASK_POOL_STACK 8192 // Of the largest pool. The others' are 3/8 and 5/8 of it
+#endif
+// Completion is signalled to waiters with this task notification index. Index 0 is left to ESP-IDF.
+#define WITHTASK_NOTIFY_INDEX 1
+// The number of tasks that can wait() on the same WithTask concurrently
+#define WITHTASK_MAX_WAITERS 4
+// The number of then() continuations a Future can hold
+#define FUTURE_MAX_CONTINUATIONS 4
+// Per-class statistics are kept in RTC memory for up to this many classes
+#define WITHTASK_MAX_STATS 12
+// Warn (with DEBUG_TASK_STATS) when a task has less free stack than this
+#define WITHTASK_LOW_HEADROOM 512
+
 // Truthy if not running (not started or finished), falsy if still running after delay running
 enum WithTaskState {
   TIMEOUT = 0,  // The wait timed out
@@ -16,24 +40,145 @@ enum WithTaskState {
   FINISHED      // The task just finished (subsequent calls will be NOT_RUNNING)
 };
 
+// Per-class statistics, accumulated across deep-sleep wakes
+typedef struct {
+  char name[configMAX_TASK_NAME_LEN];
+  uint32_t starts;
+  uint32_t total_ms;
+  uint32_t max_ms;
+  uint32_t stack_size;   // Of the most recent run
+  uint32_t stack_used;   // Worst case seen, in bytes
+} withtask_stats_t;
+
+// A one-shot completion signal that any number of tasks (up to WITHTASK_MAX_WAITERS) can block on
+class Completion {
+protected:
+  volatile bool done = false;
+  TaskHandle_t waiters[WITHTASK_MAX_WAITERS] = {0};
+  static void lock();
+  static void unlock();
+
+public:
+  void reset() { done = false; }
+  void complete(); // Wakes all waiters. Don't touch the object afterwards, as a waiter may delete it
+  bool wait(TickType_t delay = portMAX_DELAY); // True if complete
+  bool isDone() const { return done; }
+};
+
+// The result of some asynchronous work, eg. a sensor reading. Continuations registered with then()
+// are run by the task that calls resolve(), or immediately by the caller if already resolved.
+template <typename T>
+class Future : public Completion {
+private:
+  T value;
+  bool settled = false;
+  void (*continuations[FUTURE_MAX_CONTINUATIONS])(const T &value, void *context) = {0};
+  void *contexts[FUTURE_MAX_CONTINUATIONS] = {0};
+
+public:
+  void resolve(const T &v) {
+    if (settled)
+      return;
+    value = v;
+    void (*run[FUTURE_MAX_CONTINUATIONS])(const T &, void *);
+    void *ctx[FUTURE_MAX_CONTINUATIONS];
+    lock();
+    memcpy(run, continuations, sizeof run);
+    memcpy(ctx, contexts, sizeof ctx);
+    memset(continuations, 0, sizeof continuations);
+    settled = true;
+    unlock();
+    for (int i = 0; i < FUTURE_MAX_CONTINUATIONS; i++) {
+      if (run[i])
+        run[i](value, ctx[i]);
+    }
+    complete();
+  }
+
+  bool then(void (*fn)(const T &value, void *context), void *context = NULL) {
+    lock();
+    if (!settled) {
+      for (int i = 0; i < FUTURE_MAX_CONTINUATIONS; i++) {
+        if (!continuations[i]) {
+          continuations[i] = fn;
+          contexts[i] = context;
+          unlock();
+          return true;
+        }
+      }
+      unlock();
+      return false; // No room
+    }
+    unlock();
+    fn(value, context);
+    return true;
+  }
+
+  const T &get() {
+    wait();
+    return value;
+  }
+
+  bool get(T &out, TickType_t delay) {
+    if (!wait(delay))
+      return false;
+    out = value;
+    return true;
+  }
+};
+
+// Wait for all the futures (or Completions) to be resolved, within an overall time limit
+template <typename... C>
+bool when_all(TickType_t delay, C &...completions) {
+  const TickType_t start = xTaskGetTickCount();
+  auto remaining = [&]() -> TickType_t {
+    if (delay == portMAX_DELAY)
+      return portMAX_DELAY;
+    const TickType_t elapsed = xTaskGetTickCount() - start;
+    return elapsed >= delay ? 0 : delay - elapsed;
+  };
+  return (completions.wait(remaining()) && ...);
+}
+
 class WithTask {
 private:
-  void start();
+  void start(const char *name, int stackSize);
   static void taskRunner(void *p);
+  static void workerLoop(void *p);
+  static int stackSizeFor(const char *name);
 
 protected:
-  EventGroupHandle_t running;
+  volatile bool active = false; // Started, and the completion not yet collected by wait()
+  Completion completion;
+  int stackSize = WITHTASK_POOL_STACK;
+  volatile bool cancelRequested = false;
+  TickType_t deadline = 0; // 0 = none
+  uint32_t epoch = 0;      // Of cancelAll() when started
+  static volatile uint32_t cancelEpoch;
   static EventGroupHandle_t anyTasks;
   static int numRunning;
 
+  // For use within task(): delay, but return false early if cancelled
+  bool pause(uint32_t ms);
+
 public:
   static WithTaskState waitForAllTasks(TickType_t delay = portMAX_DELAY);
+  static void statsJson(StrBuf &json); // Appends the per-class stats, as an array
+  // Ask every running task to stop at its next cancellation point
+  static void cancelAll();
 
   WithTask();
   virtual ~WithTask();
   WithTaskState wait(TickType_t delay = portMAX_DELAY);
   bool isRunning(TickType_t delay = 0) { return wait(delay) == TIMEOUT; }
-  bool startTask(const char *name, int priority = 2, int stackSize = 8192);
+  // A stackSize of 0 uses the size derived from previous runs of the same class (or WITHTASK_POOL_STACK).
+  // If timeoutMs is non-zero, the task is cancelled once it has run for that long.
+  bool startTask(const char *name, int priority = 2, int stackSize = 0, uint32_t timeoutMs = 0);
+
+  // Cooperative cancellation: task() implementations check cancelled() (or use pause()) and return early.
+  // A cancelled task stays cancelled until it's started again.
+  void cancel() { cancelRequested = true; }
+  bool cancelled() const;
 
   // Pure virtual function to be implemented by derived classes
   virtual void task() = 0;
@@ -2,8 +2,53 @@
 #include "../common/gpio/gpio.hpp"
 
 #include "nvs.h"
+#include "nvs_flash.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "freertos/semphr.h"
+
+// Serialises the one-off initialisations, which may be requested by more than one task
+static SemaphoreHandle_t initLock() {
+    static StaticSemaphore_t buffer;
+    static SemaphoreHandle_t lock = xSemaphoreCreateMutexStatic(&buffer);
+    return lock;
+}
+
+esp_err_t dev_nvs_init(void) {
+    static bool done = false;
+    xSemaphoreTake(initLock(), portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if (!done) {
+        ret = nvs_flash_init();
+        if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+            ESP_ERROR_CHECK(nvs_flash_erase());
+            ret = nvs_flash_init();
+        }
+        done = ret == ESP_OK;
+    }
+    xSemaphoreGive(initLock());
+    return ret;
+}
+
+esp_err_t dev_event_loop_init(void) {
+    xSemaphoreTake(initLock(), portMAX_DELAY);
+    esp_err_t ret = esp_event_loop_create_default();
+    xSemaphoreGive(initLock());
+    return ret == ESP_ERR_INVALID_STATE ? ESP_OK : ret; // Already created
+}
+
+esp_err_t dev_netif_init(void) {
+    xSemaphoreTake(initLock(), portMAX_DELAY);
+    esp_err_t ret = esp_netif_init();
+    xSemaphoreGive(initLock());
+    return ret == ESP_OK ? dev_event_loop_init() : ret;
+}
 
 esp_err_t dev_wifi_init(wifi_init_config_t *config) {
+    // The PHY calibration data is in NVS. Without it, the radio does a full calibration, which is
+    // slower than initialising NVS.
+    dev_nvs_init();
+
     GPIO::pinMode(3, OUTPUT);
     GPIO::pinMode(14, OUTPUT);
     GPIO::digitalWrite(3, 0);
@@ -10,6 +10,12 @@
 esp_err_t dev_wifi_init(wifi_init_config_t *config);
 esp_err_t dev_wifi_deinit(void);
 
+// These are done on demand, rather than in app_main, so a warm wake doesn't pay for them unless it
+// needs them. All are safe to call more than once.
+esp_err_t dev_nvs_init(void);
+esp_err_t dev_event_loop_init(void);
+esp_err_t dev_netif_init(void); // Also creates the event loop. Only needed for IP (the portal & OTA)
+
 // #ifdef __cplusplus
 // }
 // #endif
@@ -0,0 +1,82 @@
+#include "event-log.h"
+
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+// Changes with the record layout, so a new image doesn't misread the last one's ring
+#define EVENT_LOG_MAGIC (0xE7E10600 | sizeof(event_record_t))
+
+typedef struct {
+  uint32_t magic;
+  uint32_t next;        // The sequence number of the next record. Its slot is next % EVENT_LOG_RECORDS.
+  uint16_t wake;
+  event_record_t records[EVENT_LOG_RECORDS];
+} event_ring_t;
+
+// Not cleared by a software reset, so the events leading up to a crash are still there
+static RTC_NOINIT_ATTR event_ring_t ring;
+static portMUX_TYPE ringLock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool pendingRequest = false;
+static uint32_t sendFrom;
+
+void EventLog::begin() {
+  if (ring.magic != EVENT_LOG_MAGIC) {
+    // Power on (or a new layout), so the memory is garbage
+    memset(&ring, 0, sizeof(ring));
+    ring.magic = EVENT_LOG_MAGIC;
+  }
+  ring.wake++;
+}
+
+void EventLog::add(event_id_t id, int32_t a, int32_t b, int32_t c, int32_t d) {
+  const uint32_t us = (uint32_t)esp_timer_get_time();
+  taskENTER_CRITICAL(&ringLock);
+  event_record_t &r = ring.records[ring.next++ % EVENT_LOG_RECORDS];
+  r.id = id;
+  r.wake = ring.wake;
+  r.us = us;
+  r.arg[0] = a;
+  r.arg[1] = b;
+  r.arg[2] = c;
+  r.arg[3] = d;
+  taskEXIT_CRITICAL(&ringLock);
+}
+
+void EventLog::request(uint32_t from) {
+  sendFrom = from;
+  pendingRequest = true;
+}
+
+bool EventLog::requested() {
+  return pendingRequest;
+}
+
+size_t EventLog::nextFrame(event_log_frame_t *frame) {
+  if (!pendingRequest)
+    return 0;
+  taskENTER_CRITICAL(&ringLock);
+  const uint32_t next = ring.next;
+  const uint32_t oldest = next > EVENT_LOG_RECORDS ? next - EVENT_LOG_RECORDS : 0;
+  // A request from the future is from before a power cycle, so it gets everything
+  if (sendFrom < oldest || sendFrom > next)
+    sendFrom = oldest;
+  uint8_t count = 0;
+  for (; count < EVENT_LOG_PER_FRAME && sendFrom + count < next; count++)
+    frame->records[count] = ring.records[(sendFrom + count) % EVENT_LOG_RECORDS];
+  frame->wake = ring.wake;
+  taskEXIT_CRITICAL(&ringLock);
+
+  // The first frame goes even if it's empty, so the hub learns `next`
+  memcpy(frame->tag, "LGDT", 4);
+  frame->first = sendFrom;
+  frame->next = next;
+  frame->count = count;
+  frame->size = sizeof(event_record_t);
+  sendFrom += count;
+  pendingRequest = sendFrom < next;
+  return offsetof(event_log_frame_t, records) + count * sizeof(event_record_t);
+}
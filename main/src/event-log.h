@@ -0,0 +1,81 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A binary log of field diagnostics, for when the ESP_LOGx calls are compiled out.
+
+   Each event is an id, a timestamp and up to 4 integers, written to a ring buffer in RTC memory.
+   There's no formatting on the device: the format strings are the comments on event_id_t below,
+   which tools/event-log.py reads to decode the records. So logging is a few stores, and the
+   ring survives deep sleep and software resets (a panic, the watchdog, esp_restart()).
+
+   The hub asks for the log with {"event_log":<sequence>} and gets every record from that
+   sequence number on (or as many as are still in the ring), in LGDT frames at the end of the wake.
+   Each frame says the next sequence number, so the hub can ask for only new records next time.
+*/
+
+#define EVENT_LOG_RECORDS 64    // In the ring. 1.5KB of RTC memory.
+#define EVENT_LOG_PER_FRAME 9   // Within ESP-NOW's 250 byte limit
+
+// The comment after each id is its format. Ids are never reused, so old logs still decode.
+// `%4s` prints an eventTag() of up to 4 characters.
+typedef enum : uint16_t {
+  EV_NONE = 0,
+  EV_WAKE = 1,              // "wake: cause %d, reset %d, count %d"
+  EV_FLAT_BATTERY = 2,      // "battery exhausted"
+  EV_SENSORS = 3,           // "sensors: battery %dmV, temperature %d centi-C (valid %d), position %d"
+  EV_STATE_SAVED = 4,       // "state saved: dirty 0x%x, ok %d"
+  EV_MOTOR_LOW_BATTERY = 5, // "motor: battery %dmV too low"
+  EV_MOTOR_DONE = 6,        // "motor %4s: target %d, current %d, %dms"
+  EV_MOTOR_LOAD = 7,        // "motor load: no-load %dmV, loaded %dmV, track ratio %d, ratio %d"
+  EV_PAIRED = 8,            // "paired: channel %d, rssi %d, %d hubs replied"
+  EV_PAIR_FAILED = 9,       // "no hub replied"
+  EV_HUB_NACK = 10,         // "NACK from hub on channel %d"
+  EV_HUB_SEND = 11,         // "state sent: %d bytes, status 0x%x, acked %d"
+  EV_SEND_FAILED = 12,      // "send to hub failed, unpaired"
+  EV_PROVISIONED = 13,      // "provisioned on channel %d"
+  EV_BUDGET_EXCEEDED = 14,  // "wake budget of %dms exceeded"
+  EV_SLEEP = 15,            // "sleep %ds after %dms awake"
+  EV_HEAP = 16,             // "heap: %d allocations (%d bytes), %d frees, %d bytes minimum free"
+} event_id_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t id;          // event_id_t
+  uint16_t wake;        // The wake it was logged in (the low 16 bits of a count since power on)
+  uint32_t us;          // Since the wake started. Wraps after 71 minutes.
+  int32_t arg[4];
+} event_record_t;
+
+typedef struct __attribute__((packed)) {
+  char tag[4];          // "LGDT"
+  uint32_t first;       // The sequence number of records[0]
+  uint32_t next;        // The sequence number the next record will have
+  uint8_t count;
+  uint8_t size;         // sizeof(event_record_t)
+  uint16_t wake;        // The current wake
+  event_record_t records[EVENT_LOG_PER_FRAME];
+} event_log_frame_t;
+
+// Up to 4 characters of a string, as an argument for `%4s`
+static inline int32_t eventTag(const char *s) {
+  uint32_t tag = 0;
+  for (int i = 0; i < 4 && s && s[i]; i++)
+    tag |= (uint32_t)(uint8_t)s[i] << (8 * i);
+  return (int32_t)tag;
+}
+
+class EventLog {
+public:
+  static void begin();  // At the start of a wake. Clears the ring if it doesn't survive the reset.
+  static void add(event_id_t id, int32_t a = 0, int32_t b = 0, int32_t c = 0, int32_t d = 0);
+
+  // From the hub's JSON
+  static void request(uint32_t from);
+  static bool requested();
+  // Fills the next frame for the hub. Returns its length, or 0 when the request has been met.
+  static size_t nextFrame(event_log_frame_t *frame);
+};
+
+#endif
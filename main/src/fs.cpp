@@ -1,10 +1,257 @@
 #include "../trv.h"
 #include "esp_err.h"
 #include <unistd.h>
+#include <string.h>
 
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
 #include "nvs_flash.h"
 #include "fs.h"
 
+/* The state is kept in an append-only journal in the "fs" partition, falling back to NVS.
+
+  Each 4KB sector starts with a header holding a sequence number. Only the sector with the highest
+  sequence is live. It holds a snapshot record of the whole image, followed by delta records that
+  each hold the changed byte ranges from one write(). When the sector fills, the current image is
+  written as a snapshot into the next (erased) sector, whose header is written last to commit it.
+  Sectors are used in rotation, which spreads the erases across the partition.
+
+  A record is only applied if its CRC is valid, so a write torn by a reset or brown-out is ignored
+  and the previous state is used.
+*/
+#define JOURNAL_PARTITION "fs"
+#define JOURNAL_SECTOR 4096
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_MAX_IMAGE 512
+#define RECORD_MAGIC 0xA5
+#define RECORD_SNAPSHOT 1
+#define RECORD_DELTA 2
+#define DELTA_GAP 8 // Changed ranges closer than this are merged
+
+#define ALIGN4(n) (((n) + 3) & ~3)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+} sector_header_t;
+
+typedef struct {
+  uint8_t magic;
+  uint8_t type;
+  uint16_t image_size;
+  uint16_t length; // Of the payload that follows
+  uint16_t reserved;
+  uint32_t crc;    // Of this header (with crc = 0) and the payload
+} record_header_t;
+
+// Delta payloads are a sequence of these, each followed by `length` bytes (padded to 4)
+typedef struct {
+  uint16_t offset;
+  uint16_t length;
+} delta_range_t;
+
+// Mounted journal state. It's cheap to rebuild, so it isn't kept across deep sleep
+static const esp_partition_t *partition = NULL;
+static bool mounted = false;
+static int numSectors = 0;
+static int activeSector = -1;
+static uint32_t seq = 0;
+static uint32_t writePos = 0;
+static bool needsCompaction = false;
+static uint8_t image[JOURNAL_MAX_IMAGE];
+static uint16_t imageSize = 0;
+static uint8_t payload[JOURNAL_MAX_IMAGE * 2]; // Scratch space for a record
+
+static uint32_t recordCrc(record_header_t hdr, const uint8_t *payload) {
+  hdr.crc = 0;
+  auto crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, sizeof hdr);
+  return esp_rom_crc32_le(crc, payload, hdr.length);
+}
+
+static bool applyRecord(const record_header_t &hdr, const uint8_t *payload) {
+  if (hdr.type == RECORD_SNAPSHOT) {
+    if (hdr.length != hdr.image_size)
+      return false;
+    memcpy(image, payload, hdr.length);
+    imageSize = hdr.image_size;
+    return true;
+  }
+  if (hdr.type != RECORD_DELTA || hdr.image_size != imageSize)
+    return false;
+  for (uint32_t pos = 0; pos + sizeof(delta_range_t) <= hdr.length;) {
+    delta_range_t range;
+    memcpy(&range, payload + pos, sizeof range);
+    pos += sizeof range;
+    if (range.offset + range.length > imageSize || pos + range.length > hdr.length)
+      return false;
+    memcpy(image + range.offset, payload + pos, range.length);
+    pos += ALIGN4(range.length);
+  }
+  return true;
+}
+
+static void replay(int sector) {
+  const uint32_t base = sector * JOURNAL_SECTOR;
+  uint32_t pos = sizeof(sector_header_t);
+  imageSize = 0;
+
+  while (pos + sizeof(record_header_t) <= JOURNAL_SECTOR) {
+    record_header_t hdr;
+    if (esp_partition_read(partition, base + pos, &hdr, sizeof hdr) != ESP_OK)
+      break;
+    if (hdr.magic == 0xFF) {
+      writePos = pos; // Erased: this is the end of the log
+      return;
+    }
+    const bool valid = hdr.magic == RECORD_MAGIC
+      && hdr.length <= sizeof payload
+      && pos + sizeof hdr + hdr.length <= JOURNAL_SECTOR
+      && esp_partition_read(partition, base + pos + sizeof hdr, payload, hdr.length) == ESP_OK
+      && recordCrc(hdr, payload) == hdr.crc
+      && (imageSize || hdr.type == RECORD_SNAPSHOT);
+    if (!valid || !applyRecord(hdr, payload)) {
+      ESP_LOGW(TAG, "TrvFS: bad record at %lu in sector %d", pos, sector);
+      break;
+    }
+    pos += ALIGN4(sizeof hdr + hdr.length);
+  }
+  // Full, or a torn/corrupt record we can't append after
+  writePos = JOURNAL_SECTOR;
+  needsCompaction = true;
+}
+
+static bool mount() {
+  if (mounted)
+    return partition != NULL;
+  mounted = true;
+
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, JOURNAL_PARTITION);
+  if (!partition) {
+    ESP_LOGW(TAG, "TrvFS: no '%s' partition, using NVS", JOURNAL_PARTITION);
+    return false;
+  }
+  numSectors = partition->size / JOURNAL_SECTOR;
+
+  for (int s = 0; s < numSectors; s++) {
+    sector_header_t hdr;
+    if (esp_partition_read(partition, s * JOURNAL_SECTOR, &hdr, sizeof hdr) == ESP_OK
+        && hdr.magic == JOURNAL_MAGIC && (activeSector < 0 || hdr.seq > seq)) {
+      activeSector = s;
+      seq = hdr.seq;
+    }
+  }
+  if (activeSector >= 0) {
+    replay(activeSector);
+    ESP_LOGI(TAG, "TrvFS: mounted sector %d seq %lu, %u bytes, next write at %lu", activeSector, seq, imageSize, writePos);
+  }
+  return true;
+}
+
+// The header is written first, so a torn payload fails its CRC rather than leaving dirty flash after the log
+static bool appendRecord(uint8_t type, const uint8_t *data, uint16_t length, uint16_t size) {
+  record_header_t hdr = {
+    .magic = RECORD_MAGIC,
+    .type = type,
+    .image_size = size,
+    .length = length,
+    .reserved = 0xFFFF,
+    .crc = 0
+  };
+  hdr.crc = recordCrc(hdr, data);
+  const uint32_t base = activeSector * JOURNAL_SECTOR;
+  if (esp_partition_write(partition, base + writePos, &hdr, sizeof hdr) != ESP_OK
+      || esp_partition_write(partition, base + writePos + sizeof hdr, data, length) != ESP_OK) {
+    needsCompaction = true;
+    return false;
+  }
+  writePos += ALIGN4(sizeof hdr + length);
+  return true;
+}
+
+// Write the image as a snapshot into the next sector, and make that sector live
+static bool compact(const void *p, uint16_t size) {
+  const int next = (activeSector + 1) % numSectors;
+  const uint32_t base = next * JOURNAL_SECTOR;
+  if (esp_partition_erase_range(partition, base, JOURNAL_SECTOR) != ESP_OK)
+    return false;
+
+  activeSector = next;
+  writePos = sizeof(sector_header_t);
+  needsCompaction = true; // Until the header is committed
+  if (!appendRecord(RECORD_SNAPSHOT, (const uint8_t *)p, size, size))
+    return false;
+
+  // Commit the sector by writing its header last
+  const sector_header_t hdr = {.magic = JOURNAL_MAGIC, .seq = seq + 1};
+  if (esp_partition_write(partition, base, &hdr, sizeof hdr) != ESP_OK)
+    return false;
+  seq = hdr.seq;
+  needsCompaction = false;
+  memcpy(image, p, size);
+  imageSize = size;
+  ESP_LOGI(TAG, "TrvFS: compacted into sector %d seq %lu", activeSector, seq);
+  return true;
+}
+
+// Clear the magic of every sector header, so the journal reads as empty and NVS is used instead
+static void invalidateJournal() {
+  static const uint32_t zero = 0;
+  for (int s = 0; s < numSectors; s++) {
+    sector_header_t hdr;
+    if (esp_partition_read(partition, s * JOURNAL_SECTOR, &hdr, sizeof hdr) == ESP_OK && hdr.magic == JOURNAL_MAGIC)
+      esp_partition_write(partition, s * JOURNAL_SECTOR, &zero, sizeof zero);
+  }
+  activeSector = -1;
+  imageSize = 0;
+}
+
+static bool journalWrite(const void *p, __SIZE_TYPE__ size) {
+  if (!mount() || size > JOURNAL_MAX_IMAGE)
+    return false;
+  if (activeSector < 0 || needsCompaction || size != imageSize)
+    return compact(p, size);
+
+  // Build a single delta record of the changed ranges, so the whole write is applied or not at all
+  const uint8_t *next = (const uint8_t *)p;
+  uint16_t length = 0;
+  for (uint16_t i = 0; i < size;) {
+    if (next[i] == image[i]) {
+      i++;
+      continue;
+    }
+    uint16_t end = i + 1, same = 0;
+    for (uint16_t j = end; j < size && same < DELTA_GAP; j++) {
+      if (next[j] == image[j]) {
+        same++;
+      } else {
+        same = 0;
+        end = j + 1;
+      }
+    }
+    const delta_range_t range = {.offset = i, .length = (uint16_t)(end - i)};
+    if (length + sizeof range + ALIGN4(range.length) > sizeof payload)
+      return compact(p, size);
+    memcpy(payload + length, &range, sizeof range);
+    memcpy(payload + length + sizeof range, next + i, range.length);
+    memset(payload + length + sizeof range + range.length, 0xFF, ALIGN4(range.length) - range.length);
+    length += sizeof range + ALIGN4(range.length);
+    i = end;
+  }
+
+  if (length == 0)
+    return true; // Nothing changed
+
+  // A large delta is no better than a snapshot, which is simpler to replay
+  const bool snapshot = length >= size;
+  const uint16_t recordLen = snapshot ? size : length;
+  if (writePos + ALIGN4(sizeof(record_header_t) + recordLen) > JOURNAL_SECTOR)
+    return compact(p, size);
+  if (!(snapshot ? appendRecord(RECORD_SNAPSHOT, next, size, size) : appendRecord(RECORD_DELTA, payload, length, size)))
+    return compact(p, size);
+  memcpy(image, p, size);
+  return true;
+}
+
 TrvFS::TrvFS() {
 }
 
@@ -12,6 +259,13 @@ TrvFS::~TrvFS() {
 }
 
 __SIZE_TYPE__ TrvFS::read(const char *name, void *p, __SIZE_TYPE__ size) {
+  if (mount() && imageSize) {
+    if (imageSize > size)
+      return 0; // As NVS, the buffer must be large enough
+    memcpy(p, image, imageSize);
+    return imageSize;
+  }
+
   nvs_handle_t nvs_handle = 0;
   __SIZE_TYPE__ len = size;
 
@@ -28,6 +282,10 @@ __SIZE_TYPE__ TrvFS::read(const char *name, void *p, __SIZE_TYPE__ size) {
 }
 
 bool TrvFS::write(const char *name, void *p, __SIZE_TYPE__ size) {
+  if (journalWrite(p, size))
+    return true;
+  ESP_LOGW(TAG, "TrvFS: journal write failed, using NVS");
+
   nvs_handle_t nvs_handle = 0;
   auto err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
   if (err == ESP_ERR_NVS_NOT_INITIALIZED) {
@@ -37,5 +295,7 @@ bool TrvFS::write(const char *name, void *p, __SIZE_TYPE__ size) {
   auto failed = err != ESP_OK
     || nvs_set_blob(nvs_handle, "trv1", p, size) != ESP_OK;
   if (nvs_handle) nvs_close(nvs_handle);
+  if (!failed && partition)
+    invalidateJournal(); // Otherwise the (stale) journal would be read in preference to NVS
   return !failed;
 }
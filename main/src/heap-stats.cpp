@@ -0,0 +1,33 @@
+#include "heap-stats.h"
+
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+
+static volatile uint32_t allocs = 0;
+static volatile uint32_t frees = 0;
+static volatile uint32_t bytes = 0;
+
+// Called by the heap for every allocation, so they have to be quick, and in IRAM
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps) {
+  allocs = allocs + 1;
+  bytes = bytes + size;
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void *ptr) {
+  frees = frees + 1;
+}
+
+heap_stats_t HeapStats::get() {
+  return {
+    .allocs = allocs,
+    .frees = frees,
+    .bytes = bytes,
+    .min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT)
+  };
+}
+
+void HeapStats::json(StrBuf &json) {
+  const auto h = get();
+  json.printf("{\"allocs\":%lu,\"frees\":%lu,\"bytes\":%lu,\"min_free\":%lu}",
+    (unsigned long)h.allocs, (unsigned long)h.frees, (unsigned long)h.bytes, (unsigned long)h.min_free);
+}
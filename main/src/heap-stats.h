@@ -0,0 +1,26 @@
+#ifndef HEAP_STATS_H
+#define HEAP_STATS_H
+
+#include <stdint.h>
+
+#include "StrBuf.hpp"
+
+/* Heap use since the wake started (each wake is a boot), counted by ESP-IDF's allocation hooks
+   (CONFIG_HEAP_USE_HOOKS). It includes the radio driver's allocations as well as ours, so it's the change
+   from one build to the next that matters. Reported with the task stats, and logged at the end of each wake.
+*/
+
+typedef struct {
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t bytes;     // Allocated in total
+  uint32_t min_free;  // The low-water mark of the default heap
+} heap_stats_t;
+
+class HeapStats {
+public:
+  static heap_stats_t get();
+  static void json(StrBuf &json); // Appends {"allocs":...}
+};
+
+#endif
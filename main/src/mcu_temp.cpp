@@ -74,15 +74,13 @@ static void linear_regression(const float *x, const float *y, int n, float
   */
 
 McuTempSensor::McuTempSensor() {
-  StartTask(McuTempSensor);
+  if (!StartTask(McuTempSensor))
+    reading.resolve(temp);
 }
 
 McuTempSensor::~McuTempSensor() {}
 float McuTempSensor::read() {
-  if (temp < 0) {
-    wait();
-  }
-  return temp;
+  return reading.get();
 }
 
 void McuTempSensor::task() {
@@ -92,5 +90,6 @@ void McuTempSensor::task() {
   temp = mcu_temp_read();
   delay(10); // Just because other tasks are more important
   ESP_LOGI(TAG, "MCU temp: %f", temp);
+  reading.resolve(temp);
   mcu_temp_deinit();
 }
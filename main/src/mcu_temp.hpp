@@ -15,5 +15,6 @@ private:
   McuTempSensor();
   virtual ~McuTempSensor();
   float read();
+  Future<float> reading;
 };
 #endif /* MCU_TEMP_H */
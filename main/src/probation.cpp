@@ -0,0 +1,256 @@
+#include "probation.h"
+
+#include <atomic>
+#include <string.h>
+
+#include "esp_app_desc.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "nvs.h"
+
+#include "../trv.h"
+#include "board.h"
+#include "helpers.h"
+
+#define PROBATION_MAGIC 0x9B0BA710
+#define PROBATION_NAMESPACE "probation"
+#define PROBATION_KEY "record"
+#define PROBATION_IMAGE_KEY "image"  // The ELF SHA of the last image to run off probation
+#define PROBATION_INCOMPLETE 0x80  // In `missed`: the wake never finished
+
+typedef enum : uint8_t {
+  OUTCOME_NONE,
+  OUTCOME_TESTING,
+  OUTCOME_PASSED,
+  OUTCOME_ROLLED_BACK,
+  OUTCOME_FAILED        // Failed, but there was no image to roll back to
+} probation_outcome_t;
+static const char *outcomes[] = {"none", "testing", "passed", "rolled_back", "failed"};
+
+typedef struct {
+  uint32_t magic;
+  char elf_sha[17];     // The image on probation, as esp_app_get_elf_sha256()
+  char version[32];
+  uint8_t wakes_left;
+  uint8_t in_wake;      // Set for the duration of each probation wake
+  uint8_t outcome;
+  uint8_t missed;       // The checks the failing wake missed
+  uint8_t hub_acked;    // The hub has acked a state during probation
+  uint8_t unacked_left; // Paired wakes without a hub ack before we roll back
+} probation_t;
+
+static RTC_DATA_ATTR bool active;   // There's a record in NVS, so a warm wake needs to open it
+static probation_t record;
+static char knownImage[sizeof(record.elf_sha)]; // Empty if there's no record (eg. the last image predates this)
+static bool loaded = false;
+static std::atomic<uint32_t> passed(0);
+
+static void load() {
+  nvs_handle_t nvs;
+  size_t len = sizeof(record);
+  bool found = false;
+  if (dev_nvs_init() == ESP_OK && nvs_open(PROBATION_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    found = nvs_get_blob(nvs, PROBATION_KEY, &record, &len) == ESP_OK
+      && len == sizeof(record) && record.magic == PROBATION_MAGIC;
+    len = sizeof(knownImage);
+    if (nvs_get_str(nvs, PROBATION_IMAGE_KEY, knownImage, &len) != ESP_OK)
+      knownImage[0] = 0;
+    nvs_close(nvs);
+  }
+  if (!found)
+    memset(&record, 0, sizeof(record));
+}
+
+static void saveKnownImage(const char *sha) {
+  nvs_handle_t nvs;
+  if (!strcmp(knownImage, sha) || ERR_BACKTRACE(nvs_open(PROBATION_NAMESPACE, NVS_READWRITE, &nvs)) != ESP_OK)
+    return;
+  if (ERR_BACKTRACE(nvs_set_str(nvs, PROBATION_IMAGE_KEY, sha)) == ESP_OK)
+    strlcpy(knownImage, sha, sizeof(knownImage));
+  nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+static void save() {
+  nvs_handle_t nvs;
+  if (ERR_BACKTRACE(nvs_open(PROBATION_NAMESPACE, NVS_READWRITE, &nvs)) != ESP_OK)
+    return;
+  if (record.outcome == OUTCOME_NONE)
+    nvs_erase_key(nvs, PROBATION_KEY);
+  else
+    ERR_BACKTRACE(nvs_set_blob(nvs, PROBATION_KEY, &record, sizeof(record)));
+  nvs_commit(nvs);
+  nvs_close(nvs);
+  active = record.outcome != OUTCOME_NONE;
+}
+
+static bool pendingVerify() {
+  esp_ota_img_states_t state;
+  return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK
+    && state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+// Whether this is the first boot of an image. Only a bootloader built with CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+// marks a new image PENDING_VERIFY, and bootloaders aren't updated over the air, so most devices in the field
+// boot it as ESP_OTA_IMG_NEW. So we also compare it with the last image to run. With no record of that (the
+// update came from an image older than this check), it's new if there's an image to roll back to.
+static bool newImage(const char *sha) {
+  if (pendingVerify())
+    return true;
+  if (knownImage[0])
+    return strcmp(knownImage, sha) != 0;
+  if (record.outcome == OUTCOME_TESTING && strcmp(record.elf_sha, sha))
+    return false; // Another image was on probation, and it's been rolled back to us
+  const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+  esp_app_desc_t desc;
+  return previous && esp_ota_get_partition_description(previous, &desc) == ESP_OK;
+}
+
+// Stop the bootloader rolling back on the next reset (including waking from deep sleep)
+static void confirmBoot() {
+  if (pendingVerify())
+    ERR_BACKTRACE(esp_ota_mark_app_valid_cancel_rollback());
+}
+
+static void rollBack(uint8_t missed) {
+  record.missed = missed;
+  record.in_wake = 0;
+  const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+  esp_app_desc_t desc;
+  if (!previous || esp_ota_get_partition_description(previous, &desc) != ESP_OK) {
+    ESP_LOGE(TAG, "Probation: failed (missed 0x%02x), but there's no image to roll back to", missed);
+    record.outcome = OUTCOME_FAILED;
+    save();
+    saveKnownImage(record.elf_sha); // We're stuck with it, so don't put it on probation again
+    confirmBoot();
+    return;
+  }
+
+  ESP_LOGE(TAG, "Probation: failed (missed 0x%02x), rolling back to %s", missed, desc.version);
+  record.outcome = OUTCOME_ROLLED_BACK;
+  save();
+  if (pendingVerify())
+    esp_ota_mark_app_invalid_rollback_and_reboot(); // Only returns if it fails
+  if (ERR_BACKTRACE(esp_ota_set_boot_partition(previous)) == ESP_OK)
+    esp_restart(); // Flushes any pending state first
+
+  record.outcome = OUTCOME_FAILED;
+  save();
+  saveKnownImage(record.elf_sha);
+  confirmBoot();
+}
+
+void Probation::begin() {
+  passed = 0;
+  if (esp_reset_reason() == ESP_RST_DEEPSLEEP && !active)
+    return; // Nothing on probation or to report, and NVS might not even be initialised
+
+  load();
+  loaded = true;
+  char sha[sizeof(record.elf_sha)];
+  esp_app_get_elf_sha256(sha, sizeof(sha));
+  bool ours = !strcmp(record.elf_sha, sha);
+
+  if (record.outcome == OUTCOME_ROLLED_BACK && !ours) {
+    // We're the image that was rolled back to, so we're known to be good
+    confirmBoot();
+  } else if (newImage(sha)) {
+    if (record.outcome != OUTCOME_TESTING || !ours) {
+      // The first boot of a new image
+      record = {
+        .magic = PROBATION_MAGIC,
+        .elf_sha = {0},
+        .version = {0},
+        .wakes_left = PROBATION_WAKES,
+        .in_wake = 0,
+        .outcome = OUTCOME_TESTING,
+        .missed = 0,
+        .hub_acked = 0,
+        .unacked_left = PROBATION_UNACKED_WAKES
+      };
+      strlcpy(record.elf_sha, sha, sizeof(record.elf_sha));
+      strlcpy(record.version, esp_app_get_description()->version, sizeof(record.version));
+      ours = true;
+      ESP_LOGW(TAG, "Probation: new image %s, on probation for %d wakes", record.version, PROBATION_WAKES);
+    }
+  }
+
+  if (record.outcome != OUTCOME_TESTING) {
+    active = record.outcome != OUTCOME_NONE;
+    saveKnownImage(sha);
+    return;
+  }
+  if (!ours) {
+    // The image on probation crashed on its first boot, and the bootloader rolled back to us
+    record.outcome = OUTCOME_ROLLED_BACK;
+    record.missed = PROBATION_INCOMPLETE;
+    save();
+    return;
+  }
+  if (record.in_wake) {
+    rollBack(PROBATION_INCOMPLETE);
+    if (record.outcome != OUTCOME_TESTING)
+      return;
+  }
+  record.in_wake = 1;
+  save();
+}
+
+void Probation::pass(uint32_t checks) {
+  passed |= checks;
+}
+
+void Probation::endWake(bool counts) {
+  if (!loaded || record.outcome != OUTCOME_TESTING || !record.in_wake)
+    return;
+  record.in_wake = 0;
+  if (passed & PROBATION_HUB_ACK)
+    record.hub_acked = 1;
+  if (!counts) {
+    // Nothing to judge, so leave it to the other wakes. The bootloader can't wait that long.
+    confirmBoot();
+    save();
+    return;
+  }
+
+  const uint8_t missed = PROBATION_EVERY_WAKE & ~passed;
+  if (missed) {
+    rollBack(missed);
+    return;
+  }
+  if (!record.hub_acked && (passed & PROBATION_PAIRED) && --record.unacked_left == 0) {
+    rollBack(PROBATION_HUB_ACK);
+    return;
+  }
+  confirmBoot();
+  if (record.wakes_left)
+    record.wakes_left--;
+  if (!record.wakes_left && record.hub_acked) {
+    ESP_LOGW(TAG, "Probation: %s passed", record.version);
+    record.outcome = OUTCOME_PASSED;
+    saveKnownImage(record.elf_sha);
+  } else if (!record.wakes_left) {
+    ESP_LOGI(TAG, "Probation: waiting for the hub to ack, %d paired wakes to go", record.unacked_left);
+  } else {
+    ESP_LOGI(TAG, "Probation: wake passed, %d to go", record.wakes_left);
+  }
+  save();
+}
+
+bool Probation::reporting() {
+  return loaded && record.outcome != OUTCOME_NONE;
+}
+
+void Probation::json(StrBuf &json) {
+  json.printf("{\"state\":\"%s\",\"version\":\"%s\",\"wakes_left\":%d,\"missed\":%d}",
+    outcomes[record.outcome], record.version, (int)record.wakes_left, (int)record.missed);
+}
+
+void Probation::reported() {
+  if (!loaded || record.outcome == OUTCOME_NONE || record.outcome == OUTCOME_TESTING)
+    return;
+  record.outcome = OUTCOME_NONE;
+  save();
+}
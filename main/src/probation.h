@@ -0,0 +1,54 @@
+#ifndef PROBATION_H
+#define PROBATION_H
+
+#include <stdint.h>
+
+#include "StrBuf.hpp"
+
+/* After an OTA update, the new image runs on probation for its first PROBATION_WAKES wakes. Each must
+   pass the health checks in PROBATION_EVERY_WAKE, or we roll back to the previous image. A wake that never
+   finishes (a crash or watchdog reset) counts as a failure.
+
+   The hub need only ack our state once during probation, as one lost ack or a hub that's down for a while
+   says nothing about the image. It stays on probation until it has, and rolls back if PROBATION_UNACKED_WAKES
+   wakes that started paired with a hub go unacked. Unpaired wakes had no hub to ack them, so aren't judged.
+
+   A new image is one the bootloader marks PENDING_VERIFY, or whose ELF SHA differs from the last image to
+   run off probation (also in NVS). Only a bootloader built with CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE does
+   the former, and the bootloader isn't updated over the air, so devices in the field rely on the latter.
+   Without that bootloader, a crash on the first boot just boots the new image again, which then finds the
+   unfinished wake and rolls back itself.
+
+   The bootloader's own rollback only lasts until the next reset, and waking from deep sleep is a reset,
+   so the first wake decides whether to call esp_ota_mark_app_valid_cancel_rollback(). After that we roll
+   back by selecting the other partition.
+
+   The probation record is in NVS, as RTC memory doesn't survive a crash or a change of image. The outcome
+   is reported in the telemetry (by whichever image is running) until the hub acks it.
+*/
+
+#define PROBATION_WAKES 5
+#define PROBATION_UNACKED_WAKES 5
+
+typedef enum {
+  PROBATION_TRV         = 1 << 0,  // The Trv constructor completed
+  PROBATION_TEMPERATURE = 1 << 1,  // The temperature sensor was read
+  PROBATION_HUB_ACK     = 1 << 2,  // The hub acked our state
+  PROBATION_WAKE_TIME   = 1 << 3,  // Everything finished within the wake budget
+  PROBATION_PAIRED      = 1 << 4,  // Paired with a hub at the start of the wake, so there was one to ack
+  PROBATION_EVERY_WAKE  = PROBATION_TRV | PROBATION_TEMPERATURE | PROBATION_WAKE_TIME
+} probation_check_t;
+
+class Probation {
+public:
+  static void begin();                // At the start of a wake
+  static void pass(uint32_t checks);
+  // At the end of a wake. `counts` is false for wakes that can't be judged (the user is in the portal,
+  // or the battery is flat). May roll back and restart.
+  static void endWake(bool counts);
+  static bool reporting();            // There's something for the telemetry
+  static void json(StrBuf &json);     // Appends it
+  static void reported();             // The hub has acked the telemetry
+};
+
+#endif
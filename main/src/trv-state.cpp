@@ -1,21 +1,54 @@
 #include "../trv.h"
 
+#include <stddef.h>
 #include <string.h>
-#include <sstream>
+#include <time.h>
+#include <esp_system.h>
+#include <esp_rom_crc.h>
 
 #include "trv-state.h"
 #include "mcu_temp.hpp"
+#include "event-log.h"
+#include "heap-stats.h"
+#include "InPlace.hpp"
+#include "probation.h"
 #include "pins.h"
 #include "helpers.h"
 #include <net/esp-now.hpp>
 
-#define STATE_VERSION 8L
+#define STATE_VERSION 9L
 
 #define STALL_MS_DEFAULT 100
 #define BACKOFF_MS_DEFAULT 100
+#define WRITEBACK_SECS_DEFAULT 120
+#define WRITEBACK_SECS_MAX 3600
 
 extern const char *systemModes[];
 static RTC_DATA_ATTR trv_state_t globalState;
+
+// Changes not yet written to flash. These survive deep sleep, but not a reset, so we flush before
+// anything that might reset (OTA, a flat battery, power off)
+typedef struct {
+  uint32_t dirty;           // trv_dirty_t
+  time_t since;             // When the oldest pending change was made
+  trv_config_t persisted;   // As last read or written, to spot changes that have been reverted
+} pending_write_t;
+static RTC_DATA_ATTR pending_write_t pending;
+
+// Over globalState & pending as they were when we went to sleep. If it doesn't match on waking, the RTC
+// memory can't be trusted and we reload from flash.
+static RTC_DATA_ATTR uint32_t rtcCrc;
+
+static uint32_t rtcStateCrc() {
+  auto crc = esp_rom_crc32_le(0, (const uint8_t *)&globalState, sizeof(globalState));
+  return esp_rom_crc32_le(crc, (const uint8_t *)&pending, sizeof(pending));
+}
+
+bool Trv::warmBoot() {
+  return esp_reset_reason() == ESP_RST_DEEPSLEEP
+    && globalState.version == STATE_VERSION
+    && rtcCrc == rtcStateCrc();
+}
 const trv_state_t defaultState = {
   .version = STATE_VERSION,
   .sensors = {
@@ -46,7 +79,8 @@ const trv_state_t defaultState = {
       .reversed = true,
       .backoff_ms = 259,
       .stall_ms = 1
-    }
+    },
+    .writeback_secs = WRITEBACK_SECS_DEFAULT
   }
 };
 
@@ -58,64 +92,159 @@ const char *Trv::deviceName() { return globalState.config.mqttConfig.device_name
 const uint8_t *Trv::getPassKey() { return globalState.config.passKey; }
 uint32_t Trv::stateVersion() { return globalState.version; }
 
-#define UPDATE_STATE(number, default_expr) \
-  if (state.version == number) { \
-    state.version +=1; \
-    default_expr; \
-    configDirty = true; \
-    ESP_LOGI(TAG, "Read state: %u bytes version %lu", r, state.version);\
+// Schema migrations. Each step takes a stored blob of version `from` (of `len` bytes, in a buffer of
+// `capacity` bytes), rewrites it in place as version `from + 1`, and updates `len`. Steps are applied
+// in sequence until the blob is at STATE_VERSION. A version with no step (or a step that fails) falls
+// back to defaultState. Layouts before v7 were never recorded, so they still get the defaults.
+// A blob that isn't exactly its version's size is something else, and falls back to defaultState too.
+typedef bool (*state_migration_t)(uint8_t *blob, __SIZE_TYPE__ &len, __SIZE_TYPE__ capacity);
+
+#define STATE_V7_SIZE 240 // To the end of config.resolution, padded
+#define STATE_V8_SIZE 256 // To the end of config.motor
+static_assert(offsetof(trv_state_t, config.debug_flags) == STATE_V7_SIZE, "v8 added debug_flags after v7's fields");
+static_assert(offsetof(trv_state_t, config.writeback_secs) == STATE_V8_SIZE, "v9 added writeback_secs after v8's fields");
+
+// v7 is a prefix of v8, without debug_flags and the motor config
+static bool migrate_v7(uint8_t *blob, __SIZE_TYPE__ &len, __SIZE_TYPE__ capacity) {
+  if (capacity < sizeof(trv_state_t) || len != STATE_V7_SIZE)
+    return false;
+  memset(blob + len, 0, sizeof(trv_state_t) - len);
+  trv_state_t *state = (trv_state_t *)blob;
+  state->config.debug_flags = 0;
+  state->config.motor.reversed = defaultState.config.motor.reversed; // Not 0: v7 had no choice of wiring
+  state->config.motor.backoff_ms = BACKOFF_MS_DEFAULT;
+  state->config.motor.stall_ms = STALL_MS_DEFAULT;
+  state->version = 8;
+  len = STATE_V8_SIZE;
+  return true;
+}
+
+// v8 is a prefix of v9, without writeback_secs
+static bool migrate_v8(uint8_t *blob, __SIZE_TYPE__ &len, __SIZE_TYPE__ capacity) {
+  if (capacity < sizeof(trv_state_t) || len != STATE_V8_SIZE)
+    return false;
+  memset(blob + len, 0, sizeof(trv_state_t) - len);
+  trv_state_t *state = (trv_state_t *)blob;
+  state->config.writeback_secs = WRITEBACK_SECS_DEFAULT;
+  state->version = 9;
+  len = sizeof(trv_state_t);
+  return true;
+}
+
+static const struct {
+  uint32_t from;
+  state_migration_t step;
+} migrations[] = {
+  { 7, migrate_v7 },
+  { 8, migrate_v8 },
+};
+
+// True if the blob is now a valid, current trv_state_t
+static bool migrateState(uint8_t *blob, __SIZE_TYPE__ &len, __SIZE_TYPE__ capacity) {
+  uint32_t version;
+  if (len < sizeof(version))
+    return false;
+  memcpy(&version, blob, sizeof(version));
+  while (version != STATE_VERSION) {
+    unsigned i = 0;
+    while (i < sizeof(migrations) / sizeof(migrations[0]) && migrations[i].from != version)
+      i++;
+    if (i == sizeof(migrations) / sizeof(migrations[0]) || !migrations[i].step(blob, len, capacity))
+      return false;
+    memcpy(&version, blob, sizeof(version));
+    if (version != migrations[i].from + 1)
+      return false;
+    ESP_LOGI(TAG, "Migrated state to version %lu (%u bytes)", version, len);
   }
+  return len == sizeof(trv_state_t);
+}
 
 static McuTempSensor* mcuTempSensor = NULL;
+static Trv *current = NULL;
+
+// The objects each wake creates. There's only one Trv at a time, so they needn't be on the heap.
+static InPlace<TrvFS> fsStorage;
+static InPlace<BatteryMonitor> batteryStorage;
+static InPlace<DallasOneWire> tempSensorStorage;
+static InPlace<MotorController> motorStorage;
+static InPlace<McuTempSensor> mcuTempStorage;
+
+// The fields in which two configs differ
+static uint32_t changedFields(const trv_config_t &a, const trv_config_t &b) {
+  uint32_t fields = 0;
+  if (a.current_heating_setpoint != b.current_heating_setpoint) fields |= DIRTY_SETPOINT;
+  if (a.local_temperature_calibration != b.local_temperature_calibration) fields |= DIRTY_CALIBRATION;
+  if (a.system_mode != b.system_mode) fields |= DIRTY_MODE;
+  if (a.netMode != b.netMode || memcmp(&a.mqttConfig, &b.mqttConfig, sizeof(a.mqttConfig))) fields |= DIRTY_NET;
+  if (memcmp(a.passKey, b.passKey, sizeof(a.passKey))) fields |= DIRTY_PASSKEY;
+  if (a.sleep_time != b.sleep_time) fields |= DIRTY_SLEEP;
+  if (a.resolution != b.resolution) fields |= DIRTY_RESOLUTION;
+  if (a.debug_flags != b.debug_flags) fields |= DIRTY_DEBUG;
+  if (a.motor.reversed != b.motor.reversed || a.motor.backoff_ms != b.motor.backoff_ms
+    || a.motor.stall_ms != b.motor.stall_ms) fields |= DIRTY_MOTOR;
+  if (a.writeback_secs != b.writeback_secs) fields |= DIRTY_WRITEBACK;
+  return fields;
+}
+
+// esp_restart() (eg. after an OTA upload from the portal) would lose anything still pending
+static void flushOnRestart() {
+  if (current)
+    current->flush();
+}
 
 // On construction, the state is guaranteed to be valid, and asynchronously the sensors, etc are initialized
 Trv::Trv() {
   mustCalibrate = false;
-  configDirty = false;
-  fs = new TrvFS();
+  fs = fsStorage.make();
 
-  // On timer wake (ESP-NOW check), trust the RTC state if version matches
-  if (esp_reset_reason() == ESP_RST_DEEPSLEEP && globalState.version == STATE_VERSION) {
+  // On timer wake (ESP-NOW check), trust the RTC state if version and CRC match
+  if (warmBoot()) {
       // RTC state is valid, skip FS read
   } else {
-    trv_state_t state;
+    trv_state_t state = {0};
     // Try loading the config from the filesystem
     __SIZE_TYPE__ r = fs->read("/trv/state", &state, sizeof(state));
     ESP_LOGI(TAG, "Read state: %u bytes version %lu", r, state.version);
-    if (r && (r <= sizeof(state) || state.version < STATE_VERSION)) {
-        UPDATE_STATE(7, state.config.debug_flags = 0; state.config.motor.backoff_ms = BACKOFF_MS_DEFAULT; state.config.motor.stall_ms = STALL_MS_DEFAULT; )
-        r = sizeof(state);
-    }
-
-    if (r != sizeof (state) || state.version != STATE_VERSION) {
-        ESP_LOGI(TAG, "Default state, version %lu != %lu", state.version, STATE_VERSION);
-        globalState = defaultState;
-    } else {
+    const uint32_t stored = r ? state.version : 0;
+    if (r && migrateState((uint8_t *)&state, r, sizeof(state))) {
         globalState = state;
         globalState.sensors = defaultState.sensors;
+    } else {
+        ESP_LOGI(TAG, "Default state, version %lu != %lu", stored, STATE_VERSION);
+        globalState = defaultState;
     }
+    // Anything pending in RTC memory from before the reset has been lost
+    pending.dirty = 0;
+    pending.persisted = globalState.config;
+    if (stored && stored != STATE_VERSION && globalState.version == STATE_VERSION)
+      markDirty(DIRTY_LAYOUT); // Persist the migrated layout
     mustCalibrate = true;
   }
+  current = this;
+  esp_register_shutdown_handler(flushOnRestart);
   // We crerate the battery monitor here, as it's fast and not task based, which makes testing for a flat battery quick
-  battery = new BatteryMonitor();
-  StartTask(Trv);
+  battery = batteryStorage.make();
+  if (!StartTask(Trv))
+    sensorsRead.resolve(&globalState);
 }
 
 void Trv::task() {
   // Get the sensor values
-  tempSensor = new DallasOneWire(globalState.sensors.sensor_temperature, globalState.config.resolution);
-  motor = new MotorController(battery, globalState.sensors.position, globalState.config.motor);
-  if (mustCalibrate) {
-      motor->calibrate();
-  }
-  if (!mcuTempSensor) mcuTempSensor = new McuTempSensor(); // Lazily get MCU temp
+  tempSensor = tempSensorStorage.make(globalState.sensors.sensor_temperature, globalState.config.resolution);
+  motor = motorStorage.make(battery, globalState.sensors.position, globalState.config.motor);
+  if (!mcuTempSensor) mcuTempSensor = mcuTempStorage.make(); // Lazily get MCU temp
 
   globalState.sensors.is_charging = battery->is_charging();
   globalState.sensors.position = motor->getValvePosition();
-  // We only update battery values when the motor is off. If it's moving, it will drop due to the loading
+  // We only read the battery voltage when the motor is off. If it's moving, it will drop due to the loading,
+  // so we report the charge model instead (or the last reading, until there's a model to report)
   if (motor->getDirection() == 0) {
     globalState.sensors.battery_raw = battery->getValue();
     globalState.sensors.battery_percent = battery->getPercent(globalState.sensors.battery_raw);
+  } else {
+    const int percent = battery->getStateOfCharge();
+    if (percent != NO_VALUE)
+      globalState.sensors.battery_percent = percent;
   }
 
   // We choose to keep a running average the temp to minimize the heating effect of operating
@@ -125,7 +254,17 @@ void Trv::task() {
     compensation = 1.0; // TODO: calibrate this value from the MCU temperature
   }
   auto local = tempSensor->readTemp() + globalState.config.local_temperature_calibration + compensation;
+  if (tempSensor->valid)
+    Probation::pass(PROBATION_TEMPERATURE);
   globalState.sensors.local_temperature = (local + globalState.sensors.local_temperature) / 2;
+  EventLog::add(EV_SENSORS, globalState.sensors.battery_raw, (int32_t)(local * 100), tempSensor->valid,
+    globalState.sensors.position);
+
+  // The telemetry can go now. Calibration takes a while, so we do it after the sensors are read
+  sensorsRead.resolve(&globalState);
+  if (mustCalibrate) {
+      motor->calibrate();
+  }
 }
 
 bool Trv::requiresNetworkControl() {
@@ -134,15 +273,20 @@ bool Trv::requiresNetworkControl() {
 
 Trv::~Trv() {
   wait();
-  if (configDirty) saveState(); // Update NVS if necessary
+  // Write back now if we're about to update, or might not wake again
+  saveState(this->otaUrl.length() || (flatBattery() && !is_charging()));
+  esp_unregister_shutdown_handler(flushOnRestart);
+  current = NULL;
+  rtcCrc = rtcStateCrc();
   if (this->otaUrl.length()) {
     doUpdate();
   }
-  if (mcuTempSensor) delete mcuTempSensor;
-  delete motor;
-  delete tempSensor;
-  delete battery;
-  delete fs;
+  mcuTempStorage.destroy();
+  mcuTempSensor = NULL;
+  motorStorage.destroy();
+  tempSensorStorage.destroy();
+  batteryStorage.destroy();
+  fsStorage.destroy();
 }
 
 void Trv::setSleepTime(int seconds) {
@@ -152,7 +296,7 @@ void Trv::setSleepTime(int seconds) {
   }
   if (globalState.config.sleep_time != seconds) {
     globalState.config.sleep_time = seconds;
-    configDirty = true;
+    markDirty(DIRTY_SLEEP);
   }
   ESP_LOGI(TAG, "Set sleep time to %d seconds", seconds);
 }
@@ -160,57 +304,120 @@ void Trv::setSleepTime(int seconds) {
 void Trv::setDebugFlags(uint32_t flags) {
   if (globalState.config.debug_flags != flags) {
     globalState.config.debug_flags = flags;
-    configDirty = true;
+    markDirty(DIRTY_DEBUG);
   }
-  ESP_LOGI(TAG, "Set debug flags to 0x%04X. dirty=%d", flags, configDirty);
+  ESP_LOGI(TAG, "Set debug flags to 0x%04X. dirty=0x%lx", flags, pending.dirty);
 }
 
-std::string Trv::asJson(const trv_state_t& s, signed int rssi) {
+void Trv::asJson(StrBuf &json, const trv_state_t& s, signed int rssi) {
   const auto mcuTemp = mcuTempSensor->read();
-  std::stringstream json;
-  json << "{";
-  if (rssi) json << "\"rssi\":" << rssi << ",";
-  json << "\"mcu_temperature\":" << mcuTemp << ","
-    "\"local_temperature\":" << s.sensors.local_temperature << ","
-    "\"sensor_temperature\":" << s.sensors.sensor_temperature << ","
-    "\"battery_percent\":" << (int)s.sensors.battery_percent << ","
-    "\"battery_mv\":" << (int)s.sensors.battery_raw << ","
-    "\"is_charging\":" << (s.sensors.is_charging ? "true" : "false") << ","
-    "\"position\":" << (int)s.sensors.position << ","
-    "\"motor\":\"" << MotorController::lastStatus << "\","
-    "\"current_heating_setpoint\":" << s.config.current_heating_setpoint << ","
-    "\"local_temperature_calibration\":" << s.config.local_temperature_calibration << ","
-    "\"system_mode\":\"" << systemModes[s.config.system_mode] << "\","
-    "\"sleep_time\":" << s.config.sleep_time << ","
-    "\"resolution\":" << (0.5 / (float)(1 << s.config.resolution)) << ","
-    "\"backoff_ms\":" << s.config.motor.backoff_ms << ","
-    "\"stall_ms\":" << s.config.motor.stall_ms << ","
-    "\"motor_reversed\":" << (s.config.motor.reversed ? "true":"false") << ","
-    "\"debug_flags\":" << s.config.debug_flags << ","
+  json.add('{');
+  if (rssi) json.printf("\"rssi\":%d,", rssi);
+  json.printf("\"mcu_temperature\":%g,"
+    "\"local_temperature\":%g,"
+    "\"sensor_temperature\":%g,"
+    "\"battery_percent\":%d,"
+    "\"battery_mv\":%d,"
+    "\"battery_days\":%d,"
+    "\"is_charging\":%s,"
+    "\"position\":%d,"
+    "\"motor\":\"%s\",",
+    mcuTemp, s.sensors.local_temperature, s.sensors.sensor_temperature, (int)s.sensors.battery_percent,
+    (int)s.sensors.battery_raw, battery->remainingDays(), s.sensors.is_charging ? "true" : "false",
+    (int)s.sensors.position, MotorController::lastStatus);
+  json.printf("\"current_heating_setpoint\":%g,"
+    "\"local_temperature_calibration\":%g,"
+    "\"system_mode\":\"%s\","
+    "\"sleep_time\":%d,"
+    "\"resolution\":%g,"
+    "\"backoff_ms\":%d,"
+    "\"stall_ms\":%d,"
+    "\"motor_reversed\":%s,"
+    "\"debug_flags\":%lu,"
+    "\"writeback_secs\":%u,"
     "\"unpair\":false,"
-    "\"calibrate\":false"
-    "}";
-
-  return json.str();
+    "\"calibrate\":false,",
+    s.config.current_heating_setpoint, s.config.local_temperature_calibration,
+    systemModes[s.config.system_mode], s.config.sleep_time, 0.5 / (float)(1 << s.config.resolution),
+    (int)s.config.motor.backoff_ms, (int)s.config.motor.stall_ms, s.config.motor.reversed ? "true" : "false",
+    (unsigned long)s.config.debug_flags, (unsigned)s.config.writeback_secs);
+  if (Probation::reporting()) {
+    json.add("\"probation\":");
+    Probation::json(json);
+    json.add(',');
+  }
+  const size_t before = json.length();
+  const bool stats = reportTaskStats;
+  if (stats) {
+    json.add("\"task_stats\":");
+    WithTask::statsJson(json);
+    json.add(",\"heap\":");
+    HeapStats::json(json);
+    json.add('}');
+    reportTaskStats = false;
+  }
+  if (!stats || json.overflowed()) {
+    // The stats are the only part that can be long, so they're what we leave out
+    json.truncate(before);
+    json.add("\"task_stats\":false}");
+  }
 }
 
 void Trv::doUnpair() {
   EspNet::unpair();
 }
 
-void Trv::saveState() {
-  globalState.sensors.position = motor->getValvePosition(); // Should be benign as MotorController is passed a reference to this value
+void Trv::markDirty(uint32_t fields) {
+  if (!pending.dirty)
+    pending.since = time(NULL);
+  pending.dirty |= fields;
+}
+
+void Trv::flush() {
+  saveState(true);
+}
+
+void Trv::saveState(bool force) {
+  // Forget any fields that have been changed back to their stored value
+  pending.dirty &= DIRTY_LAYOUT | changedFields(globalState.config, pending.persisted);
+  if (!pending.dirty)
+    return;
+
+  const time_t age = time(NULL) - pending.since;
+  if (!force && age >= 0 && age < globalState.config.writeback_secs) {
+    ESP_LOGI(TAG, "saveState: deferred, dirty=0x%lx for %llds", pending.dirty, (long long)age);
+    return;
+  }
+
+  if (motor)
+    globalState.sensors.position = motor->getValvePosition(); // Should be benign as MotorController is passed a reference to this value
+  const uint32_t dirty = pending.dirty;
   auto saved = fs->write("/trv/state", &globalState, sizeof(globalState));
-  configDirty = !saved;
+  if (saved) {
+    pending.dirty = 0;
+    pending.persisted = globalState.config;
+  }
+  EventLog::add(EV_STATE_SAVED, dirty, saved);
   ESP_LOGI(TAG, "saveState: %d", saved);
 }
 
+void Trv::setWriteBack(int seconds) {
+  if (seconds < 0 || seconds > WRITEBACK_SECS_MAX) {
+    ESP_LOGW(TAG, "Invalid write-back delay %d, must be between 0 and %d", seconds, WRITEBACK_SECS_MAX);
+    return;
+  }
+  if (globalState.config.writeback_secs != seconds) {
+    globalState.config.writeback_secs = seconds;
+    markDirty(DIRTY_WRITEBACK);
+  }
+}
+
 void Trv::setMotorParameters(const motor_params_t& params) {
   if (params.reversed == true || params.reversed == false) {
     if (globalState.config.motor.reversed != params.reversed) {
       wait();
       globalState.config.motor.reversed = params.reversed;
-      configDirty = true;
+      markDirty(DIRTY_MOTOR);
       const auto pos = motor->getValvePosition();
 
       globalState.sensors.position = 50; // Invalidate position
@@ -220,13 +427,13 @@ void Trv::setMotorParameters(const motor_params_t& params) {
   if (params.stall_ms > 0) {
     if (globalState.config.motor.stall_ms != params.stall_ms) {
         globalState.config.motor.stall_ms = params.stall_ms;
-        configDirty = true;
+        markDirty(DIRTY_MOTOR);
     }
   }
   if (params.backoff_ms >= 0) {
     if (globalState.config.motor.backoff_ms != params.backoff_ms) {
         globalState.config.motor.backoff_ms = params.backoff_ms;
-        configDirty = true;
+        markDirty(DIRTY_MOTOR);
     }
   }
 }
@@ -240,6 +447,10 @@ const trv_state_t& Trv::getState() {
   return globalState;
 }
 
+const trv_state_t& Trv::currentState() {
+  return globalState;
+}
+
 void Trv::setNetMode(net_mode_t mode, trv_mqtt_t *mqtt){
   bool changed = false;
   if (globalState.config.netMode != mode) {
@@ -254,7 +465,7 @@ void Trv::setNetMode(net_mode_t mode, trv_mqtt_t *mqtt){
     }
   }
   if (changed) {
-      configDirty = true;
+      markDirty(DIRTY_NET);
       // We should probably do a restart to make sure there are no clashes with other operations
   }
 }
@@ -262,7 +473,7 @@ void Trv::setNetMode(net_mode_t mode, trv_mqtt_t *mqtt){
 void Trv::setPassKey(const uint8_t *key) {
   if (memcmp(globalState.config.passKey, key, sizeof(globalState.config.passKey)) != 0) {
       memcpy(globalState.config.passKey, key, sizeof(globalState.config.passKey));
-      configDirty = true;
+      markDirty(DIRTY_PASSKEY);
   }
 }
 
@@ -276,13 +487,17 @@ bool Trv::is_charging() {
   return battery->is_charging();
 }
 
+int Trv::batteryDays() {
+  return battery->remainingDays();
+}
+
 void Trv::setTempResolution(uint8_t res) {
   res &= 0x03;
   if (globalState.config.resolution == res)
     return;
 
   globalState.config.resolution = res;
-  configDirty = true;
+  markDirty(DIRTY_RESOLUTION);
   wait();
   tempSensor->setResolution(globalState.config.resolution);
 }
@@ -290,20 +505,20 @@ void Trv::setTempResolution(uint8_t res) {
 void Trv::setTempCalibration(float temp) {
   if (globalState.config.local_temperature_calibration == temp) return;
   globalState.config.local_temperature_calibration = temp;
-  configDirty = true;
+  markDirty(DIRTY_CALIBRATION);
   checkAutoState();
 }
 
 void Trv::setHeatingSetpoint(float temp) {
   if (globalState.config.current_heating_setpoint == temp) return;
   globalState.config.current_heating_setpoint = temp;
-  configDirty = true;
+  markDirty(DIRTY_SETPOINT);
   checkAutoState();
 }
 
 void Trv::setSystemMode(esp_zb_zcl_thermostat_system_mode_t mode) {
   if (globalState.config.system_mode != mode) {
-      configDirty = true;
+      markDirty(DIRTY_MODE);
   }
   globalState.config.system_mode = mode;
   wait();
@@ -337,12 +552,12 @@ void Trv::calibrate() {
   motor->calibrate();
   globalState.sensors.position = motor->getValvePosition();
   setSystemMode(mode);
-  ESP_LOGI(TAG,"Calibrated state: '%s' mqtt://%s:%d, wifi %s >> %s",
+  ESP_LOGI(TAG,"Calibrated state: '%s' mqtt://%s:%d, wifi %s >> position %d, motor %s",
     globalState.config.mqttConfig.device_name,
     globalState.config.mqttConfig.mqtt_server,
     globalState.config.mqttConfig.mqtt_port,
     globalState.config.mqttConfig.wifi_ssid,
-    asJson(globalState).c_str());
+    (int)globalState.sensors.position, MotorController::lastStatus);
 }
 
 void Trv::testMode(TouchButton &touchButton) {
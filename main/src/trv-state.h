@@ -3,6 +3,7 @@
 
 #include <string>
 
+#include "StrBuf.hpp"
 #include "WithTask.hpp"
 #include "trv.h"
 
@@ -49,6 +50,7 @@ typedef struct trv_config_s {
   uint8_t resolution; // 0=9-bit, 1=10-bit, 2=11-bit, 3=12-bit
   uint32_t debug_flags;
   motor_params_t motor;
+  uint16_t writeback_secs; // Changes are held in RTC memory for up to this long before being written to flash
 } trv_config_t;
 
 typedef struct trv_state_s
@@ -66,6 +68,21 @@ typedef struct trv_state_s
   trv_config_t config;
 } trv_state_t;
 
+// Persisted fields (or groups of fields) changed since the state was last written
+typedef enum {
+  DIRTY_SETPOINT    = 1 << 0,
+  DIRTY_CALIBRATION = 1 << 1,
+  DIRTY_MODE        = 1 << 2,
+  DIRTY_NET         = 1 << 3, // netMode & mqttConfig
+  DIRTY_PASSKEY     = 1 << 4,
+  DIRTY_SLEEP       = 1 << 5,
+  DIRTY_RESOLUTION  = 1 << 6,
+  DIRTY_DEBUG       = 1 << 7,
+  DIRTY_MOTOR       = 1 << 8,
+  DIRTY_WRITEBACK   = 1 << 9,
+  DIRTY_LAYOUT      = 1u << 31 // The stored blob needs rewriting even though no field has changed (eg. migrated)
+} trv_dirty_t;
+
 class Trv: public WithTask
 {
 protected:
@@ -73,17 +90,19 @@ protected:
   MotorController *motor = NULL;
   BatteryMonitor *battery = NULL;
   TrvFS *fs = NULL;
-  bool configDirty;
   bool mustCalibrate;
+  bool reportTaskStats = false;
 
   std::string otaUrl;
   std::string otaSsid;
   std::string otaPwd;
-  void requestUpdate(const char *otaUrl, const char *otaSsid, const char *otaPwd);
+  std::string otaSha256;    // Manifest for the image, if the hub sent one
+  void requestUpdate(const char *otaUrl, const char *otaSsid, const char *otaPwd, const char *otaSha256);
   void doUnpair();
   void doUpdate();
   void checkAutoState();
-  void saveState();
+  void markDirty(uint32_t fields);
+  void saveState(bool force);
   void task();
   void setDebugFlags(uint32_t flags);
 
@@ -91,6 +110,9 @@ public:
   Trv();
   virtual ~Trv();
   const trv_state_t &getState();
+  const trv_state_t &currentState(); // Doesn't wait, so the sensors & position may be mid-update
+  // Resolved as soon as the sensors have been read, without waiting for any valve movement to finish
+  Future<const trv_state_t *> sensorsRead;
   const trv_config_t &getConfig(); // Doesn't wait, since config isn't asynchronously
   void setHeatingSetpoint(float temp);
   void setSystemMode(esp_zb_zcl_thermostat_system_mode_t mode);
@@ -98,19 +120,23 @@ public:
   void setTempResolution(uint8_t res);
   bool flatBattery();
   bool is_charging();
+  int batteryDays(); // -1 if not yet known
   void setNetMode(net_mode_t mode, trv_mqtt_t *mqtt = NULL);
   void setPassKey(const uint8_t *key);
   void setSleepTime(int seconds);
   void setMotorParameters(const motor_params_t &params);
+  void setWriteBack(int seconds);
+  void flush(); // Write any pending changes now, regardless of writeback_secs
   void calibrate();
   void testMode(TouchButton &touchButton);
-  void processNetMessage(const char *json);
+  bool processNetMessage(const char *json); // False if the JSON can't be parsed
   bool requiresNetworkControl();
 
   static const char* deviceName();
   static const uint8_t* getPassKey();
   static uint32_t stateVersion();
-  std::string asJson(const trv_state_t& state, signed int rssi = 0);
+  static bool warmBoot(); // Woken from deep sleep with valid state in RTC memory
+  void asJson(StrBuf &json, const trv_state_t& state, signed int rssi = 0); // Appends the state object
   static const char* writeable[];
 };
 
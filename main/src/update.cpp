@@ -11,17 +11,143 @@
 #include "esp_ota_ops.h"
 #include "esp_http_client.h"
 #endif
+#include "esp_rom_crc.h"
 #include "../common/gpio/gpio.hpp"
+#include "../common/ota/ota-stream.h"
 
-static int64_t content_len = -1;
-static int64_t content_read = 0;
-static int lastPercent = -1;
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define OTA_ATTEMPTS 4        // Connections per wake. Each resumes where the last one stopped
+#define OTA_PROGRESS_MAGIC 0x07A9E5E1
+
+// Download progress, so an update interrupted by the SoftWatchDog (or a dropped connection) resumes
+// on the next attempt with a Range request rather than starting again. Kept in RTC memory, so it
+// survives deep sleep but not a power cycle.
+typedef struct {
+  uint32_t magic;
+  uint32_t url_crc;
+  uint32_t etag_crc;       // 0 if the server didn't send one
+  uint32_t partition;      // Address of the partition being written
+  uint32_t image_size;     // 0 if unknown
+  uint32_t written;        // Bytes in flash, always a whole number of sectors
+  uint32_t crc;            // Of those bytes, to check the flash before resuming
+} ota_progress_t;
+static RTC_DATA_ATTR ota_progress_t progress;
 
 typedef struct {
-  esp_ota_handle_t handle;
+  ota_stream_t stream;     // Accepts a full image or a delta patch
+  bool open;
   const esp_partition_t *partition;
+  uint32_t url_crc;
+  uint32_t etag_crc;
+  uint32_t range_start;    // From Content-Range, if the server honoured our Range request
+  uint32_t image_size;
+  uint32_t offset;         // Bytes of the image received so far (including any resumed from)
+  bool expect;             // Whether there's a manifest to check the image against
+  uint8_t sha256[32];
+  int lastPercent;
+  bool failed;             // Give up on this response (we'll retry)
+  bool done;               // Image written and verified
 } ota_data_t;
 
+static uint32_t crc32(const void *p, size_t len, uint32_t crc = 0) {
+  return esp_rom_crc32_le(crc, (const uint8_t *)p, len);
+}
+
+// Whether the progress is for this download. The flash itself is checked when the stream resumes.
+static bool verifyProgress(const ota_data_t *update) {
+  return progress.magic == OTA_PROGRESS_MAGIC && progress.url_crc == update->url_crc
+    && progress.partition == update->partition->address && progress.written
+    && progress.written <= update->partition->size;
+}
+
+// Record what's reached flash, so a later attempt can resume from it.
+// A delta patch has to start again from the beginning, so isn't checkpointed.
+static void checkpoint(ota_data_t *update) {
+  if (progress.magic == OTA_PROGRESS_MAGIC && ota_stream_resumable(&update->stream))
+    progress.written = ota_stream_committed(&update->stream, &progress.crc);
+}
+
+// Open the OTA handle on the first data of a response, once we know whether the server sent what we asked for
+static bool otaStart(ota_data_t *update, esp_http_client_handle_t client) {
+  const int status = esp_http_client_get_status_code(client);
+  if (status == 206 && update->offset && update->range_start == update->offset
+    && update->etag_crc == progress.etag_crc
+    && (!progress.image_size || update->image_size == progress.image_size)) {
+    ESP_LOGI(TAG, "OTA: resuming at %lu of %lu", update->offset, update->image_size);
+    update->open = ERR_BACKTRACE(ota_stream_resume(&update->stream, update->partition, update->offset, progress.crc)) == ESP_OK;
+    if (update->open) {
+      if (update->expect)
+        ota_stream_expect_sha256(&update->stream, update->sha256);
+      return true;
+    }
+    progress.magic = 0;
+    return false;
+  }
+  if (status != 200) {
+    // Includes a 206 we can't use. Forget the progress, so the next attempt starts again
+    ESP_LOGW(TAG, "OTA: unexpected HTTP status %d", status);
+    progress.magic = 0;
+    return false;
+  }
+
+  update->offset = 0;
+  const int64_t len = esp_http_client_get_content_length(client);
+  update->image_size = len > 0 ? (uint32_t)len : 0;
+  progress = {
+    .magic = OTA_PROGRESS_MAGIC,
+    .url_crc = update->url_crc,
+    .etag_crc = update->etag_crc,
+    .partition = update->partition->address,
+    .image_size = update->image_size,
+    .written = 0,
+    .crc = 0
+  };
+  update->open = ERR_BACKTRACE(ota_stream_begin(&update->stream, update->partition)) == ESP_OK;
+  if (update->open && update->expect)
+    ota_stream_expect_sha256(&update->stream, update->sha256);
+  return update->open;
+}
+
+static void otaWrite(ota_data_t *update, const uint8_t *data, size_t len) {
+  // Written to flash by the stream's own task, while we carry on receiving
+  if (ERR_BACKTRACE(ota_stream_write(&update->stream, data, len)) != ESP_OK) {
+    update->failed = true;
+    return;
+  }
+  update->offset += len;
+  checkpoint(update);
+
+  if (update->image_size) {
+    const int percent = ((int64_t)update->offset * 100) / update->image_size;
+    if (percent != update->lastPercent) {
+      ESP_LOGI(TAG, "Download progress: %d%% (%lu of %lu)", percent, update->offset, update->image_size);
+      update->lastPercent = percent;
+      GPIO::digitalWrite(LED_BUILTIN, !GPIO::digitalRead(LED_BUILTIN));
+    }
+  }
+}
+
+// Verify the complete image before we boot from it
+static void otaFinish(ota_data_t *update) {
+  if (!update->open || update->failed)
+    return;
+  if (update->image_size && update->offset != update->image_size) {
+    ESP_LOGW(TAG, "OTA: response ended at %lu of %lu", update->offset, update->image_size);
+    return; // Not an error: we'll resume from here
+  }
+  update->open = false;
+  // Checks the image against the manifest, and its own SHA-256
+  if (ERR_BACKTRACE(ota_stream_end(&update->stream)) != ESP_OK) {
+    progress.magic = 0;
+    return;
+  }
+  progress.magic = 0;
+  update->done = ERR_BACKTRACE(esp_ota_set_boot_partition(update->partition)) == ESP_OK;
+}
+
 esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
   ota_data_t *update = (ota_data_t *)evt->user_data;
@@ -38,29 +164,29 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
         break;
     case HTTP_EVENT_ON_HEADER:
         ESP_LOGI(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+        if (!strcasecmp(evt->header_key, "ETag")) {
+          update->etag_crc = crc32(evt->header_value, strlen(evt->header_value));
+        } else if (!strcasecmp(evt->header_key, "Content-Range")) {
+          // bytes <start>-<end>/<size>
+          unsigned long start = 0, end = 0, size = 0;
+          if (sscanf(evt->header_value, "bytes %lu-%lu/%lu", &start, &end, &size) == 3) {
+            update->range_start = start;
+            update->image_size = size;
+          }
+        }
         break;
     case HTTP_EVENT_ON_DATA:
-        if (!esp_http_client_is_chunked_response(evt->client)) {
-            // If user_data buffer is configured, copy the response into the buffer
-            if (content_len == -1) {
-                content_len = esp_http_client_get_content_length(evt->client);
-                ESP_LOGI(TAG, "content_len=%lld", content_len);
-            }
-            content_read += evt->data_len;
-            int percent = (content_read * 100) / content_len;
-            if (percent != lastPercent) {
-                ESP_LOGI(TAG, "Download progress: %d%% (%lld of %lld)", percent, content_read, content_len);
-                lastPercent = percent;
-                GPIO::digitalWrite(LED_BUILTIN, !GPIO::digitalRead(LED_BUILTIN));
-            }
-            ERR_BACKTRACE(esp_ota_write(update->handle, evt->data, evt->data_len));
+        if (update->failed || esp_http_client_get_status_code(evt->client) / 100 == 3)
+          break; // The body of a redirect isn't the image
+        if (!update->open && !otaStart(update, evt->client)) {
+          update->failed = true;
+          break;
         }
+        otaWrite(update, (const uint8_t *)evt->data, evt->data_len);
         break;
     case HTTP_EVENT_ON_FINISH:
         ESP_LOGI(TAG, "HTTP_EVENT_ON_FINISH");
-        ERR_BACKTRACE(esp_ota_end(update->handle));
-        ERR_BACKTRACE(esp_ota_set_boot_partition(update->partition));
-        esp_restart(); // Full restart, 'cos the new code might restore the state in a different way
+        otaFinish(update);
         break;
     case HTTP_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
@@ -75,23 +201,42 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
   return ESP_OK;
 }
 
+// The image's SHA-256 from <image>.sha256 beside it (as written by sha256sum), if there is one
+static bool fetchManifest(const std::string &imageUrl, uint8_t sha256[32]) {
+  const std::string url = imageUrl + ".sha256";
+  esp_http_client_config_t config = {
+    .url = url.c_str(),
+    .timeout_ms = 5000,
+  };
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  char text[100] = {0};
+  bool found = false;
+  if (esp_http_client_open(client, 0) == ESP_OK && esp_http_client_fetch_headers(client) >= 0
+    && esp_http_client_get_status_code(client) == 200) {
+    found = esp_http_client_read_response(client, text, sizeof(text) - 1) >= 64 && ota_parse_sha256(text, sha256);
+  }
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+  ESP_LOGI(TAG, "OTA manifest %s: %s", url.c_str(), found ? "found" : "none");
+  return found;
+}
+
 class SoftWatchDog: public WithTask {
   public:
   int seconds;
-  bool cancel;
   SoftWatchDog(int seconds): seconds(seconds) {
     StartTask(SoftWatchDog);
   }
   ~SoftWatchDog() {
-    cancel = true;
+    cancel();
   }
   void task() {
-    while (seconds-- > 0 && !cancel) {
-      ESP_LOGI(TAG, "SoftWatchDog %d %d", seconds, cancel);
+    while (seconds-- > 0 && !cancelled()) {
+      ESP_LOGI(TAG, "SoftWatchDog %d", seconds);
       GPIO::digitalWrite(LED_BUILTIN, !GPIO::digitalRead(LED_BUILTIN));
-      vTaskDelay(1000 / portTICK_PERIOD_MS);
+      pause(1000);
     }
-    if (!cancel && seconds <= 0) {
+    if (!cancelRequested && seconds <= 0) {
       ESP_LOGW(TAG, "SoftWatchDog restart!");
       vTaskDelay(100 / portTICK_PERIOD_MS);
       // Soft restart, becuase the download failed and we should just continue like normal.
@@ -101,8 +246,9 @@ class SoftWatchDog: public WithTask {
   }
 };
 
-void Trv::requestUpdate(const char *otaUrl, const char *otaSsid, const char *otaPwd) {
+void Trv::requestUpdate(const char *otaUrl, const char *otaSsid, const char *otaPwd, const char *otaSha256) {
   this->otaUrl = otaUrl;
+  this->otaSha256 = otaSha256 ? otaSha256 : "";
   this->otaSsid = otaSsid;
   this->otaPwd = otaPwd;
 }
@@ -117,7 +263,7 @@ void Trv::doUpdate() {
     otaUrlStr += CONFIG_IDF_TARGET;
     otaUrlStr += "/";
     otaUrlStr += "trv-1.bin";
-    saveState();
+    flush();
 
     WiFiStation sta((const uint8_t *)otaSsid.c_str(), (const uint8_t *)otaPwd.c_str(), Trv::deviceName(), 1);
     sta.connect();
@@ -134,23 +280,49 @@ void Trv::doUpdate() {
     if (otaUrlStr.starts_with("http://")) {
       // Get OTA partition
       SoftWatchDog woof(150);
-      const esp_partition_t *update_partition = esp_ota_get_next_update_partition(NULL);
-      esp_ota_handle_t update_handle = 0;
-      ERR_BACKTRACE(esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle));
-      ota_data_t od = {.handle = update_handle, .partition = update_partition};
+      ota_data_t od = {
+        .partition = esp_ota_get_next_update_partition(NULL),
+        .url_crc = crc32(otaUrlStr.c_str(), otaUrlStr.length()),
+        .lastPercent = -1
+      };
       config.user_data = &od;
+      od.expect = ota_parse_sha256(otaSha256.c_str(), od.sha256) || fetchManifest(otaUrlStr, od.sha256);
+      if (!od.expect)
+        ESP_LOGW(TAG, "OTA: no manifest, relying on the image's own hash");
 
-      esp_http_client_handle_t client = esp_http_client_init(&config);
-      esp_err_t err = esp_http_client_perform(client);
-      if (err == ESP_OK) {
-          ESP_LOGI(TAG, "HTTP GET Status = %d, content_length = %" PRId64,
-                  esp_http_client_get_status_code(client),
-                  esp_http_client_get_content_length(client));
-      } else {
-          ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+      for (int attempt = 0; attempt < OTA_ATTEMPTS && !od.done && !woof.cancelled(); attempt++) {
+        od.offset = verifyProgress(&od) ? progress.written : 0;
+        od.range_start = 0;
+        od.image_size = progress.image_size;
+        od.etag_crc = 0;
+        od.failed = false;
+
+        esp_http_client_handle_t client = esp_http_client_init(&config);
+        if (od.offset) {
+          char range[32];
+          snprintf(range, sizeof range, "bytes=%lu-", od.offset);
+          esp_http_client_set_header(client, "Range", range);
+        }
+        esp_err_t err = esp_http_client_perform(client);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "HTTP GET Status = %d, content_length = %" PRId64,
+                    esp_http_client_get_status_code(client),
+                    esp_http_client_get_content_length(client));
+        } else {
+            ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+        }
+        esp_http_client_cleanup(client);
+        if (od.open) {
+          // The connection dropped part way through. Every complete sector is kept.
+          ota_stream_abort(&od.stream);
+          checkpoint(&od);
+          od.open = false;
+        }
       }
-      esp_http_client_cleanup(client);
 
+      if (od.done) {
+        esp_restart(); // Full restart, 'cos the new code might restore the state in a different way
+      }
       ESP_LOGI(TAG, "Woof %d", woof.seconds);
     } else {
       esp_https_ota_config_t ota_config = {
@@ -5,7 +5,6 @@
 #include "esp_wifi.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
-#include "nvs_flash.h"
 #include "board.h"
 
 #include "../trv.h"
@@ -44,7 +43,7 @@ void WiFiStation::event_handler(esp_event_base_t event_base, int32_t event_id, v
 }
 
 void WiFiStation::wifi_init_sta(void) {
-  // ESP_ERROR_CHECK(esp_event_loop_create_default());
+  ESP_ERROR_CHECK(dev_netif_init());
   s_retry_num = 0;
   sta_netif = esp_netif_create_default_wifi_sta();
   esp_netif_set_hostname(sta_netif, device_name);
@@ -121,12 +120,7 @@ WiFiStation::~WiFiStation(){
 }
 
 void WiFiStation::connect() {
-  esp_err_t ret = nvs_flash_init();
-  if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-    ESP_ERROR_CHECK(nvs_flash_erase());
-    ret = nvs_flash_init();
-  }
-  ESP_ERROR_CHECK(ret);
+  ESP_ERROR_CHECK(dev_nvs_init());
 
   ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
   wifi_init_sta();
@@ -30,11 +30,12 @@ extern char versionDetail[];
 }
 
 #include <string>
-extern std::string debugNetworkInfo();
+extern const char *debugNetworkInfo();
 enum DebugFlags {
   DEBUG_LOG_INFO = 0x01,
   DEBUG_MOTOR_CONTROL = 0x02,
   DEBUG_DELAY_LOGGING = 0x04,
+  DEBUG_TASK_STATS = 0x08,
   DEBUG_ALL = 0x7FFFFFFF
 };
 extern uint32_t debugFlag(DebugFlags mask);
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Decode a TRV's event log, as sent to the hub in LGDT frames.
+
+    tools/event-log.py [frames.txt ...] [--header main/src/event-log.h]
+
+Each input line is one LGDT frame in hex, as the hub received it (spaces and colons are ignored).
+With no files, the frames are read from stdin. Records are printed in order, one per line:
+
+    <sequence> wake <n> +<ms>  <message>
+
+The messages come from the comments on event_id_t in event-log.h, so decode with the header from the
+firmware that wrote the log (ids are never reused, so a newer header works too). See event-log.h for
+the frame layout.
+"""
+
+import argparse
+import binascii
+import os
+import re
+import struct
+import sys
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "main", "src", "event-log.h")
+FRAME = struct.Struct("<4sIIBBH")   # tag, first, next, count, size, wake
+RECORD = struct.Struct("<HHI4i")    # id, wake, us, args
+EVENT = re.compile(r'^\s*(EV_\w+)\s*=\s*(\d+)\s*,\s*//\s*"(.*)"')
+CONVERSION = re.compile(r"%(\d*)([a-zA-Z%])")
+
+
+def load_formats(header):
+    formats = {}
+    with open(header) as f:
+        for line in f:
+            m = EVENT.match(line)
+            if m:
+                formats[int(m.group(2))] = (m.group(1), m.group(3))
+    return formats
+
+
+def tag(value):
+    return struct.pack("<i", value).rstrip(b"\0").decode("ascii", errors="replace")
+
+
+def render(fmt, args):
+    args = list(args)
+    out = []
+    pos = 0
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        width, kind = m.groups()
+        if kind == "%":
+            out.append("%")
+        elif not args:
+            out.append(m.group(0))
+        elif kind == "s":
+            out.append(tag(args.pop(0)))    # Only eventTag() strings are logged
+        elif kind == "x":
+            out.append(("%" + width + "x") % (args.pop(0) & 0xFFFFFFFF))
+        else:
+            out.append(("%" + width + kind) % args.pop(0))
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def frames(lines):
+    for n, line in enumerate(lines, 1):
+        text = re.sub(r"[\s:]", "", line)
+        if not text:
+            continue
+        try:
+            data = binascii.unhexlify(text)
+        except (binascii.Error, ValueError):
+            sys.exit("Line %d isn't hex" % n)
+        if len(data) < FRAME.size or data[:4] != b"LGDT":
+            sys.exit("Line %d isn't an LGDT frame" % n)
+        yield data
+
+
+def decode(lines, formats):
+    records = {}
+    wake = next_seq = None
+    for data in frames(lines):
+        _, first, next_seq, count, size, wake = FRAME.unpack_from(data)
+        if size < RECORD.size or len(data) < FRAME.size + count * size:
+            sys.exit("Frame from %d is truncated" % first)
+        for i in range(count):
+            records[first + i] = RECORD.unpack_from(data, FRAME.size + i * size)
+
+    expected = None
+    for seq in sorted(records):
+        if expected is not None and seq != expected:
+            print("-- %d records missing" % (seq - expected))
+        expected = seq + 1
+        ev, ev_wake, us, *args = records[seq]
+        _, fmt = formats.get(ev, ("EV_%d" % ev, "unknown event, args %d %d %d %d"))
+        print("%6d wake %5d +%7.1fms  %s" % (seq, ev_wake, us / 1000, render(fmt, args)))
+    if next_seq is not None:
+        print("-- current wake %d; ask for {\"event_log\":%d} next time" % (wake, next_seq))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("files", nargs="*")
+    parser.add_argument("--header", default=HEADER, help="event-log.h, for the event formats")
+    args = parser.parse_args()
+    formats = load_formats(args.header)
+    if not formats:
+        sys.exit("No events found in %s" % args.header)
+    lines = []
+    for name in args.files or ["-"]:
+        lines += (sys.stdin if name == "-" else open(name)).read().splitlines()
+    decode(lines, formats)
+
+
+if __name__ == "__main__":
+    main()
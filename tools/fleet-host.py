@@ -0,0 +1,416 @@
+#!/usr/bin/env python3
+"""Run a fleet of real TRVs: one trv-host process per TRV (see host/CMakeLists.txt), and
+tools/now-hub.py hubs, all on the simulated ESP-NOW medium of main/net/udp-transport.hpp.
+
+    tools/fleet-host.py <trv-host> [--trvs 6] [--hubs 1] [--duration 120] [--sleep-scale 0.02]
+                        [--slowdown 1] [--loss 0] [--setpoint 21] [--outage <at>:<secs> ...]
+                        [--port 5620] [--dir <dir>] [--csv wakes.csv] [--seed 1]
+
+Each TRV is the firmware itself: Trv, EspNet and MotorController run as they do on the chip. Its
+valve, battery and room are simulated by the host (host/src/plant.cpp, a first order thermal model
+per room), and deep sleep restarts the process, with the sleep scaled by --sleep-scale. Each TRV
+starts unnamed, with a room between 14C and 19C and an RSSI between -85 and -45dBm (how the others
+hear it). The first hub names each one over ESP-NOW. Every hub sends the TRVs --setpoint in AUTO
+mode after each JOIN. The hubs are on channels 1, 6 and 11 in turn.
+
+--outage turns every hub off <at> seconds into the run, for <secs> seconds, to see the TRVs
+re-pair when they come back.
+
+Every radio sends its frames to a relay on --port + 1, which is the air (see Medium): frames take
+their airtime at 1Mbps, senders defer to a busy channel, and frames that overlap collide, unless
+one is 10dB stronger, as in tools/fleet-sim.py. Only the frames that survive reach the radios. It
+has no path loss: every radio hears a TRV at the one RSSI, and doesn't miss frames while it
+changes channel.
+
+--slowdown runs the TRVs' clock (their FreeRTOS ticks, timers and sleeps), the hubs' and the
+relay's that many times slower than real time, so that a machine can keep up with that many times
+as many TRVs, with the host's scheduling that much less of each wake's timings. --duration and
+--outage are on that clock.
+
+It reports for each TRV, per simulated day:
+  - wakes, and the time each took
+  - the frames it sent and their airtime at 1Mbps (as tools/fleet-sim.py counts it), and how many
+    were lost in collisions
+  - its unicast frames that weren't acknowledged, and its searches for a hub (broadcast JOINs on
+    every channel)
+  - the charge used, from the constants of BatteryMonitor.cpp: awake and motor time, frames sent,
+    and the rest of the time asleep
+These are from the end of its first wake on, as that wake calibrates the valve and asks for the
+TRV's settings. The first wake's length is reported on its own.
+and for each channel, its share of the time busy, and the frames lost on it.
+
+The TRVs' and hubs' output is kept in --dir (a temporary directory, by default).
+"""
+
+import argparse
+import collections
+import csv
+import importlib.util
+import os
+import random
+import re
+import select
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+TOOLS = os.path.dirname(os.path.abspath(__file__))
+CHANNELS = (1, 6, 11)
+PASSPHRASE = "fleet"
+SO_TIMESTAMPNS = getattr(socket, "SO_TIMESTAMPNS", 35)  # Linux's, which Python doesn't always name
+STAMP = struct.Struct("qq")  # Its struct timespec
+ACK_LATENCY = 0.002  # Seconds a radio takes to ACK a frame the relay passed on, in real time
+WAKE = re.compile(r"^host: wake (\d+) at ([\d.]+)s awake (\d+)ms motor (\d+)ms sleep (\d+)s room ([-\d.]+)C valve (\d+)%")
+
+
+def load_tool(name):
+    spec = importlib.util.spec_from_file_location(name.replace("-", "_"), os.path.join(TOOLS, name + ".py"))
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+sim = load_tool("fleet-sim")
+hub = load_tool("now-hub")
+
+
+def mac_str(mac):
+    return ":".join("%02x" % b for b in mac)
+
+
+class Frame:
+    def __init__(self, packet, at):
+        self.packet = packet
+        _, self.kind, self.channel, self.rssi, self.seq, self.src, self.dst = hub.HEADER.unpack_from(packet)
+        self.body = packet[hub.HEADER.size:]
+        self.at = at            # When it's next tried: when it arrives, or after its sender's last frame or a backoff
+        self.start = self.end = None
+        self.backed_off = False
+        self.lost = False
+
+    def airtime(self):
+        if self.kind == hub.ACK:
+            return sim.ACK_US
+        return sim.PREAMBLE_US + (sim.FRAME_OVERHEAD + len(self.body)) * sim.US_PER_BYTE
+
+
+class Medium(threading.Thread):
+    """The air between the radios. They send every frame here (trv-host --medium), and each sender's
+    frames go on the air in turn, for their airtime at 1Mbps. A DATA frame waits for its channel to
+    be clear (and for the ACK to a unicast frame on it), then DIFS and a random backoff, as
+    tools/fleet-sim.py does; an ACK doesn't. Frames on
+    a channel that overlap collide, and are dropped, unless one is CAPTURE_DB stronger than the
+    other. What survives is passed on to the radios' group as its last bit leaves the air.
+
+    Time here is the TRVs' clock, in microseconds: real time run --slowdown times slower."""
+
+    def __init__(self, args):
+        super().__init__(daemon=True)
+        self.args = args
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(("", args.port + 1))
+        loopback = socket.inet_aton("127.0.0.1")
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, socket.inet_aton(hub.GROUP) + loopback)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, loopback)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 0)
+        # Frames arrive when the kernel had them, rather than when this thread gets to them
+        self.sock.setsockopt(socket.SOL_SOCKET, SO_TIMESTAMPNS, 1)
+        self.running = True
+        self.started = time.time()
+        self.queues = collections.defaultdict(collections.deque)   # Sender -> its frames not yet on the air
+        self.air = []                           # Frames on the air, by when they end
+        self.nav = {}                           # Channel -> until when it's reserved for an ACK
+        # By sender, from its first state on: the end of a TRV's first wake, which provisions it
+        self.reported = set()
+        self.sent = collections.Counter()       # Frames
+        self.airtime = collections.Counter()    # Microseconds
+        self.broadcast_joins = collections.Counter()
+        self.states = collections.Counter()
+        self.unacked = collections.Counter()
+        self.collided = collections.Counter()   # Frames lost, by sender
+        self.busy = collections.Counter()       # Microseconds, by channel
+        self.lost = collections.Counter()       # By channel
+        self.pending = {}                       # (src, dst, seq) -> when its ACK is due, in real time
+
+    def now(self, real=None):
+        return ((real or time.time()) - self.started) * 1e6 / self.args.slowdown
+
+    def run(self):
+        while self.running:
+            wait = 0.1
+            due = self.next_event()
+            if due is not None:
+                wait = min(wait, max(0, (due - self.now()) * self.args.slowdown / 1e6))
+            if select.select([self.sock], [], [], wait)[0]:
+                packet, ancillary, _, _ = self.sock.recvmsg(2048, socket.CMSG_SPACE(STAMP.size))
+                real = None
+                for level, kind, data in ancillary:
+                    if level == socket.SOL_SOCKET and kind == SO_TIMESTAMPNS:
+                        secs, ns = STAMP.unpack(data[:STAMP.size])
+                        real = secs + ns / 1e9
+                if len(packet) >= hub.HEADER.size and packet[:4] == b"SNOW":
+                    self.arrived(Frame(packet, self.now(real)))
+            now = self.now()
+            while True:
+                due = self.next_event()
+                if due is None or due > now:
+                    break
+                self.step()
+            self.expire(time.time())
+
+    def next_event(self):
+        times = [q[0].at for q in self.queues.values() if q] + [f.end for f in self.air[:1]]
+        return min(times) if times else None
+
+    def step(self):
+        heads = [q[0] for q in self.queues.values() if q]
+        frame = min(heads, key=lambda f: f.at) if heads else None
+        if self.air and (frame is None or self.air[0].end <= frame.at):
+            self.release(self.air.pop(0))
+            return
+        # A DATA frame backs off before it's sent, and again while the channel's busy: with a frame
+        # that started at least a slot ago, or reserved for the ACK to one
+        if frame.kind == hub.DATA:
+            busy = [o.end for o in self.air if o.channel == frame.channel and o.start + sim.SLOT_US <= frame.at]
+            busy.append(self.nav.get(frame.channel, 0))
+            if max(busy) > frame.at or not frame.backed_off:
+                frame.at = max(busy + [frame.at]) + sim.DIFS_US + random.randint(0, sim.CW_MIN) * sim.SLOT_US
+                frame.backed_off = True
+                return
+        queue = self.queues[frame.src]
+        queue.popleft()
+        frame.start = frame.at
+        frame.end = frame.start + frame.airtime()
+        if queue:
+            queue[0].at = max(queue[0].at, frame.end)
+        if frame.kind == hub.ACK:
+            self.nav[frame.channel] = frame.start  # Its reservation is over: the ACK is on the air
+        for other in self.air:
+            if other.channel == frame.channel and other.src != frame.src:
+                if other.rssi < frame.rssi + sim.CAPTURE_DB:
+                    frame.lost = True
+                if frame.rssi < other.rssi + sim.CAPTURE_DB:
+                    other.lost = True
+        self.air.append(frame)
+        self.air.sort(key=lambda f: f.end)
+
+        us = frame.end - frame.start
+        self.busy[frame.channel] += us
+        if frame.kind == hub.DATA and frame.dst != hub.BROADCAST:
+            due = (frame.end + sim.ACK_US) * self.args.slowdown / 1e6 + hub.ACK_WAIT * self.args.slowdown
+            self.pending[(frame.src, frame.dst, frame.seq)] = self.started + due
+        if frame.src in self.reported:
+            self.airtime[frame.src] += us
+
+    def arrived(self, frame):
+        self.queues[frame.src].append(frame)
+        if frame.kind == hub.DATA and frame.body[:1] == b"{":
+            self.reported.add(frame.src)
+        if frame.src in self.reported:
+            self.sent[frame.src] += 1
+            if frame.body[:4] == b"JOIN" and frame.dst == hub.BROADCAST:
+                self.broadcast_joins[frame.src] += 1
+            elif frame.body[:1] == b"{":
+                self.states[frame.src] += 1
+
+    def release(self, frame):
+        if frame.lost:
+            self.lost[frame.channel] += 1
+            if frame.src in self.reported:
+                self.collided[frame.src] += 1
+            return
+        if frame.kind == hub.ACK:
+            self.pending.pop((frame.dst, frame.src, frame.seq), None)
+        elif frame.dst != hub.BROADCAST:
+            # Its Duration field keeps the others off the channel for the ACK, which the host takes a
+            # while to turn round
+            nav = frame.end + sim.SIFS_US + sim.ACK_US + ACK_LATENCY * 1e6 / self.args.slowdown
+            self.nav[frame.channel] = max(self.nav.get(frame.channel, 0), nav)
+        self.sock.sendto(frame.packet, (hub.GROUP, self.args.port))
+
+    def expire(self, now):
+        for key, due in list(self.pending.items()):
+            if due <= now:
+                del self.pending[key]
+                if key[0] in self.reported:
+                    self.unacked[key[0]] += 1
+
+    def stop(self):
+        self.running = False
+        self.join()
+        self.sock.close()
+
+
+class Trv:
+    def __init__(self, args, index, root):
+        self.mac = bytes([0x02, 0x00, 0x00, 0x00, 0x02, index + 1])
+        self.rssi = random.randint(-85, -45)
+        self.room = round(random.uniform(14, 19), 1)
+        self.dir = os.path.join(root, "trv-%02d" % (index + 1))
+        os.makedirs(self.dir, exist_ok=True)
+        self.log = os.path.join(self.dir, "trv.log")
+        self.process = subprocess.Popen(
+            [args.trv_host, "--dir", self.dir, "--mac", mac_str(self.mac), "--rssi", str(self.rssi),
+             "--loss", str(args.loss), "--port", str(args.port), "--medium", str(args.port + 1),
+             "--sleep-scale", str(args.sleep_scale), "--slowdown", str(args.slowdown), "--room", str(self.room)],
+            stdout=open(self.log, "w"), stderr=subprocess.STDOUT)
+
+    def stop(self):
+        self.process.send_signal(signal.SIGTERM)
+        self.process.wait()
+
+    def wakes(self):
+        with open(self.log, errors="replace") as f:
+            return [tuple(float(v) for v in m.groups()) for m in map(WAKE.match, f) if m]
+
+
+class Hubs:
+    def __init__(self, args, root):
+        self.args = args
+        self.root = root
+        self.processes = []
+        self.runs = 0
+
+    def start(self, secs):
+        self.runs += 1
+        for i in range(self.args.hubs):
+            command = [sys.executable, os.path.join(TOOLS, "now-hub.py"), "--mac", "02:00:00:00:00:%02x" % (i + 1),
+                       "--channel", str(CHANNELS[i % len(CHANNELS)]), "--passphrase", PASSPHRASE,
+                       "--send", '{"system_mode":"auto","current_heating_setpoint":%s}' % self.args.setpoint,
+                       "--duration", "%.1f" % secs, "--port", str(self.args.port), "--medium", str(self.args.port + 1),
+                       "--slowdown", str(self.args.slowdown)]
+            if i == 0:
+                command += ["--provision", "trv-{mac}"]
+            log = open(os.path.join(self.root, "hub-%d.%d.log" % (i + 1, self.runs)), "w")
+            self.processes.append(subprocess.Popen(command, stdout=log, stderr=subprocess.STDOUT))
+
+    def stop(self):
+        for p in self.processes:
+            p.send_signal(signal.SIGINT)  # It reports as it exits
+        for p in self.processes:
+            p.wait()
+        self.processes = []
+
+
+def run(args, root):
+    medium = Medium(args)
+    medium.start()
+    outages = sorted(tuple(float(v) for v in o.split(":")) for o in args.outage)
+    hubs = Hubs(args, root)
+    hubs.start(args.duration)
+    time.sleep(0.5)  # For the hubs to join the medium
+    trvs = [Trv(args, i, root) for i in range(args.trvs)]
+    started = time.monotonic()
+    print("%d TRVs and %d hubs on udp/%d, for %ds, %gx slower than real time, in %s" % (
+        args.trvs, args.hubs, args.port, args.duration, args.slowdown, root))
+
+    # On the TRVs' clock
+    def now():
+        return (time.monotonic() - started) / args.slowdown
+
+    def sleep_until(t):
+        time.sleep(max(0, (t - now()) * args.slowdown))
+
+    try:
+        for at, secs in outages:
+            sleep_until(at)
+            print("%6.1fs hubs off for %.0fs" % (now(), secs))
+            hubs.stop()
+            sleep_until(now() + secs)
+            print("%6.1fs hubs on" % now())
+            hubs.start(max(1, args.duration - now()))
+        sleep_until(args.duration)
+    except KeyboardInterrupt:
+        pass
+    elapsed = now()
+    for trv in trvs:
+        trv.stop()
+    hubs.stop()
+    medium.stop()
+    return report(args, trvs, medium, elapsed)
+
+
+def report(args, trvs, medium, elapsed):
+    c = sim.firmware_constants()
+    columns = "%-17s %5s %7s %6s %6s %8s %6s %7s %7s %6s %6s %8s %6s %6s %6s"
+    print("\n" + columns % ("", "", "first", "", "", "", "", "", "", "", "", "", "", "", ""))
+    print(columns % ("TRV", "rssi", "wake s", "sim h", "wakes", "awake ms", "p95 ms", "frames", "air ms", "lost",
+                     "unackd", "searches", "states", "mAh", "room"))
+    print(columns % ("", "", "", "", "/day", "mean", "", "/day", "/day", "/day", "/day", "/day", "/day", "/day", "C"))
+    rows = []
+    failed = 0
+    for trv in trvs:
+        wakes = trv.wakes()
+        rows += [[mac_str(trv.mac), trv.rssi] + ["%g" % v for v in w] for w in wakes]
+        if len(wakes) < 2 or not medium.states[trv.mac]:
+            print("%-17s %d wakes, %d states (see %s)" % (mac_str(trv.mac), len(wakes), medium.states[trv.mac], trv.log))
+            failed += 1
+            continue
+        # After the first wake, which calibrates the valve and asks for settings
+        steady = wakes[1:]
+        days = (steady[-1][1] - wakes[0][1]) / 86400
+        awake = [w[2] for w in steady]
+        awake_secs = sum(awake) / 1000
+        charge = (c["awake_ma"] * awake_secs + c["motor_ma"] * sum(w[3] for w in steady) / 1000
+                  + c["tx_mas"] * medium.sent[trv.mac] + c["sleep_ma"] * max(0, days * 86400 - awake_secs)) / 3600
+        print("%-17s %5d %7.1f %6.1f %6.0f %8.0f %6.0f %7.0f %7.0f %6.0f %6.0f %8.0f %6.0f %6.2f %6.1f" % (
+            mac_str(trv.mac), trv.rssi, wakes[0][2] / 1000, wakes[-1][1] / 3600, len(steady) / days,
+            sum(awake) / len(awake), sim.percentile(awake, 95), medium.sent[trv.mac] / days,
+            medium.airtime[trv.mac] / 1000 / days, medium.collided[trv.mac] / days, medium.unacked[trv.mac] / days,
+            medium.broadcast_joins[trv.mac] / c["channels"] / days, medium.states[trv.mac] / days, charge / days,
+            wakes[-1][5]))
+
+    print("\nchannel  busy   lost")
+    for channel in sorted(medium.busy):
+        print("%7d %5.2f%% %6d" % (channel, medium.busy[channel] / 1e4 / elapsed, medium.lost[channel]))
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            out = csv.writer(f)
+            out.writerow(["mac", "rssi", "boot", "sim_secs", "awake_ms", "motor_ms", "sleep_secs", "room", "valve"])
+            out.writerows(rows)
+    if failed:
+        print("%d TRVs didn't get past their first wake" % failed)
+    return 1 if failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trv_host")
+    parser.add_argument("--trvs", type=int, default=6)
+    parser.add_argument("--hubs", type=int, default=1)
+    parser.add_argument("--duration", type=float, default=120, help="seconds to run for, on the TRVs' clock")
+    parser.add_argument("--sleep-scale", type=float, default=0.02, help="as trv-host's")
+    parser.add_argument("--slowdown", type=float, default=1, help="as trv-host's: more for more TRVs")
+    parser.add_argument("--loss", type=int, default=0, help="percentage of the frames each TRV hears that are lost")
+    parser.add_argument("--setpoint", type=float, default=21)
+    parser.add_argument("--outage", action="append", default=[], metavar="AT:SECS",
+                        help="turn the hubs off AT seconds in, for SECS (repeatable)")
+    parser.add_argument("--port", type=int, default=5620, help="of the medium (and the next, the relay's), apart from any other hub's")
+    parser.add_argument("--dir", help="for the TRVs' state and the logs (kept)")
+    parser.add_argument("--csv", help="write every wake of every TRV here")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    if not 1 <= args.trvs <= 254:
+        sys.exit("--trvs must be 1-254")
+    if args.slowdown <= 0:
+        sys.exit("--slowdown must be more than 0")
+    random.seed(args.seed)
+    root = args.dir or tempfile.mkdtemp(prefix="fleet-")
+    os.makedirs(root, exist_ok=True)
+    try:
+        sys.exit(run(args, root))
+    finally:
+        if not args.dir:
+            shutil.rmtree(root, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
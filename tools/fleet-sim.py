@@ -0,0 +1,815 @@
+#!/usr/bin/env python3
+"""Simulate a fleet of TRVs and hubs sharing the 2.4GHz band, to see how ESP-NOW contention and
+re-pairing scale as sites grow.
+
+    tools/fleet-sim.py [--sites 4] [--trvs 12] [--hubs 1] [--hours 24] [--sleep 20]
+                       [--outage <hour>:<minutes> ...] [--csv trvs.csv] [--timeline] [--seed 1]
+
+Each TRV wakes, does what main.cpp and EspNet do, and deep sleeps, on a virtual clock:
+  - The radio task pings its hub with a unicast JOIN, or if it isn't paired, scans every channel
+    with a broadcast JOIN (EspNet::pair_with_hub). It takes the PACK with the best RSSI, and NACKs
+    the other hubs. A failed send to the hub unpairs it, so the next wake scans again.
+  - The state is sent to the hub at the end of the wake, and every 1234ms while the motor runs.
+  - In AUTO mode, the valve opens below setpoint - 0.5C and closes above it (Trv::checkAutoState).
+    The setpoint comes from the hub as a deferred message on a daily schedule.
+  Only what the firmware keeps in RTC memory (the hub, its channel, the valve position) carries
+  over from one wake to the next.
+
+Each room is a first order thermal model: it heats towards outside + gain * valve opening, with
+its own time constant. The radio medium is 802.11b at 1Mbps (ESP-NOW's default rate), with:
+  - carrier sense and random backoff
+  - MAC-level ACKs and retries
+  - collisions at each receiver, unless one frame is CAPTURE_DB stronger
+  - half duplex, and frames lost when a radio changes channel
+  - RSSI from log-distance path loss, with per-link shadowing, per-frame fading, and a wall loss
+    between sites
+Sites are laid out on a grid, each with its hubs in the middle on channels 1, 6 and 11 in turn.
+
+The wake timings, channels and charge model come from the firmware sources (see firmware_constants()),
+so the energy figures match what BatteryMonitor estimates on the device. --outage turns every hub
+off for a while, to see the re-pairing storm when they come back.
+
+This is a model of the firmware, separate from it: none of the firmware's code runs, so it can
+drift from what the firmware does. tools/fleet-host.py runs the firmware itself, as a fleet of
+trv-host processes on a medium with the same airtime, carrier sense and collisions, but with no
+path loss, and at most 254 TRVs on one site, each a process (with --slowdown, for the machine to
+keep up). This is for many sites, bigger fleets, and the radio effects that it doesn't model.
+"""
+
+import argparse
+import collections
+import csv
+import heapq
+import math
+import os
+import random
+import re
+import sys
+import time
+
+MAIN = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "main")
+
+# 802.11b DSSS at 1Mbps, long preamble. Times in microseconds.
+PREAMBLE_US = 192
+US_PER_BYTE = 8
+FRAME_OVERHEAD = 43     # MAC header, ESP-NOW's action frame & vendor element, FCS
+ACK_US = PREAMBLE_US + 14 * US_PER_BYTE
+SIFS_US = 10
+SLOT_US = 20
+DIFS_US = SIFS_US + 2 * SLOT_US
+ACK_TIMEOUT_US = SIFS_US + ACK_US + SLOT_US
+CW_MIN, CW_MAX = 31, 1023
+RETRY_LIMIT = 7         # Transmissions of a unicast frame before the send fails
+
+# Radio propagation
+TX_DBM = 10             # Radiated, after a small PCB antenna
+PATH_LOSS_1M = 40       # dB at 1m, 2.4GHz
+PATH_EXPONENT = 3.5     # Indoors
+SHADOW_DB = 4           # Per link, fixed
+FADE_DB = 2             # Per frame
+WALL_DB = 12            # Between sites
+SENSITIVITY_DBM = -97   # At 1Mbps
+CCA_DBM = -85           # Carrier sense
+CAPTURE_DB = 10         # A frame survives a collision if it's this much stronger
+
+# Frame sizes (payload bytes)
+JOIN_BYTES = 308        # "JOIN" + IV + the encrypted pairing JSON
+STATE_BYTES = 360       # Trv::asJson
+MESSAGE_BYTES = 40      # {"current_heating_setpoint":21.5}
+PACK_BYTES = 4
+NACK_BYTES = 5
+
+# Time the firmware spends on things other than the radio, in milliseconds
+BOOT_MS = 30            # From the wake stub to app_main, and loading the Trv state
+RADIO_START_MS = 35     # dev_wifi_init(), esp_wifi_start() and esp_now_init()
+CHANNEL_SWITCH_MS = 3   # Until the channel change event
+HUB_REPLY_MS = 2        # For the hub to answer a JOIN
+SEND_WAIT_MS = 100      # sendStateToHub() waits this long for the send callback
+STATE_LOOP_MS = 1234    # main.cpp's waitForAllTasks() period, which resends the state
+MOTOR_TRAVEL_MS = 9000  # Fully closed to fully open
+MODE_CHECK_SECS = 60    # main.cpp re-applies the system mode this often
+PAIR_RETRIES = 2        # EspNet::task()
+HYSTERESIS = 0.5        # Trv::checkAutoState()
+
+DAY_SETPOINT, NIGHT_SETPOINT = 21.0, 17.0
+DAY_START_H, DAY_END_H = 6.5, 22.5
+
+
+def read_source(path):
+    with open(os.path.join(MAIN, path)) as f:
+        return f.read()
+
+
+def define(path, name):
+    m = re.search(r"^\s*#define\s+%s\s+\(?([-\d.]+)" % name, read_source(path), re.M)
+    if not m:
+        sys.exit("%s isn't defined in main/%s" % (name, path))
+    return float(m.group(1))
+
+
+def default(path, field):
+    m = re.search(r"\.%s\s*=\s*([-\d.]+)" % field, read_source(path))
+    if not m:
+        sys.exit("No default %s in main/%s" % (field, path))
+    return float(m.group(1))
+
+
+def firmware_constants():
+    return {
+        "response_ms": define("net/esp-now.cpp", "NOW_RESPONSE_TIME"),
+        "first_channel": int(define("net/now-transport.hpp", "NOW_FIRST_CHANNEL")),
+        "channels": int(define("net/now-transport.hpp", "NOW_CHANNELS")),
+        "sleep_ma": define("src/BatteryMonitor.cpp", "SLEEP_MA"),
+        "awake_ma": define("src/BatteryMonitor.cpp", "AWAKE_MA"),
+        "motor_ma": define("src/BatteryMonitor.cpp", "MOTOR_MA"),
+        "tx_mas": define("src/BatteryMonitor.cpp", "TX_MAS"),
+        "capacity_mah": define("src/BatteryMonitor.cpp", "BATTERY_CAPACITY_MAH"),
+        "max_motor_ms": define("src/MotorController.cpp", "maxMotorTime"),
+        "sleep_time": default("src/trv-state.cpp", "sleep_time"),
+        "resolution": int(default("src/trv-state.cpp", "resolution")),
+    }
+
+
+def ms(value):
+    return int(value * 1000)
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100 * len(values)))]
+
+
+class Sim:
+    """A virtual clock (in microseconds) and the events scheduled on it. Processes are generators
+    that yield a delay, or an (Event, timeout) pair to wait for."""
+
+    def __init__(self):
+        self.now = 0
+        self.queue = []
+        self.seq = 0
+
+    def at(self, t, fn, *args):
+        heapq.heappush(self.queue, (t, self.seq, fn, args))
+        self.seq += 1
+
+    def after(self, delay, fn, *args):
+        self.at(self.now + delay, fn, *args)
+
+    def spawn(self, process):
+        self.resume(process, None)
+
+    def resume(self, process, value):
+        try:
+            step = process.send(value)
+        except StopIteration:
+            return
+        if isinstance(step, tuple):
+            event, timeout = step
+            event.wait(process, timeout)
+        else:
+            self.after(step, self.resume, process, None)
+
+    def run(self, until):
+        while self.queue and self.queue[0][0] <= until:
+            self.now, _, fn, args = heapq.heappop(self.queue)
+            fn(*args)
+        self.now = until
+
+
+class Event:
+    """Set once. A process waiting on it resumes with the value, or None if the wait timed out."""
+
+    def __init__(self, sim):
+        self.sim = sim
+        self.fired = False
+        self.value = None
+        self.waiter = None
+
+    def set(self, value=True):
+        if self.fired:
+            return
+        self.fired, self.value = True, value
+        if self.waiter:
+            process, self.waiter = self.waiter, None
+            self.sim.after(0, self.sim.resume, process, value)
+
+    def wait(self, process, timeout):
+        if self.fired:
+            self.sim.after(0, self.sim.resume, process, self.value)
+            return
+        self.waiter = process
+        self.sim.after(timeout, self.timeout, process)
+
+    def timeout(self, process):
+        if self.waiter is process:
+            self.waiter = None
+            self.sim.resume(process, None)
+
+
+class Frame:
+    __slots__ = ("src", "dst", "kind", "size", "value", "acks")
+
+    def __init__(self, src, dst, kind, size, value=None, acks=None):
+        self.src, self.dst, self.kind, self.size, self.value, self.acks = src, dst, kind, size, value, acks
+
+    def airtime(self):
+        return ACK_US if self.kind == "ACK" else PREAMBLE_US + (FRAME_OVERHEAD + self.size) * US_PER_BYTE
+
+
+class Reception:
+    __slots__ = ("frame", "rssi", "ok", "epoch")
+
+    def __init__(self, frame, rssi, epoch):
+        self.frame, self.rssi, self.ok, self.epoch = frame, rssi, True, epoch
+
+
+class Medium:
+    """Who hears each transmission, and which receptions collide."""
+
+    def __init__(self, sim, site_spacing, site_size):
+        self.sim = sim
+        self.site_spacing = site_spacing
+        self.listening = collections.defaultdict(set)   # (site, channel) -> radios that are on
+        self.links = {}
+        reach = 10 ** ((TX_DBM - PATH_LOSS_1M - SENSITIVITY_DBM + 2 * SHADOW_DB) / (10 * PATH_EXPONENT))
+        self.site_reach = reach + site_size * 1.5       # Sites further apart than this can't hear each other
+        self.radios = []
+
+    def near_sites(self, site, sites):
+        x, y = site
+        return [s for s in sites if math.hypot(s[0] - x, s[1] - y) * self.site_spacing <= self.site_reach]
+
+    def rssi(self, a, b):
+        key = (a.id, b.id) if a.id < b.id else (b.id, a.id)
+        mean = self.links.get(key)
+        if mean is None:
+            d = max(1.0, math.hypot(a.x - b.x, a.y - b.y))
+            mean = TX_DBM - PATH_LOSS_1M - 10 * PATH_EXPONENT * math.log10(d) + random.gauss(0, SHADOW_DB)
+            if a.site != b.site:
+                mean -= WALL_DB
+            self.links[key] = mean
+        return mean
+
+    def transmit(self, sender, frame):
+        now = self.sim.now
+        end = now + frame.airtime()
+        channel = sender.channel
+        sender.tx_until = end
+        sender.airtime += end - now
+        for rec in sender.receiving:    # Half duplex
+            rec.ok = False
+        heard = []
+        for site in sender.near:
+            for r in self.listening[(site, channel)]:
+                if r is sender:
+                    continue
+                rssi = self.rssi(sender, r) + random.gauss(0, FADE_DB)
+                if rssi >= CCA_DBM:
+                    r.carrier(now, end)
+                if rssi < SENSITIVITY_DBM or r.tx_until > now:
+                    continue
+                rec = Reception(frame, rssi, r.epoch)
+                for other in r.receiving:
+                    if rssi < other.rssi + CAPTURE_DB:
+                        rec.ok = False
+                    if other.rssi < rssi + CAPTURE_DB:
+                        other.ok = False
+                r.receiving.append(rec)
+                heard.append((r, rec))
+        self.sim.at(end, self.finished, heard)
+
+    def finished(self, heard):
+        for r, rec in heard:
+            if r.epoch != rec.epoch:
+                continue    # The radio changed channel, or was turned off, while it was arriving
+            r.receiving.remove(rec)
+            frame = rec.frame
+            if frame.dst is not None and frame.dst is not r:
+                continue
+            if not rec.ok:
+                r.collisions += 1
+            else:
+                r.deliver(frame, rec.rssi)
+
+
+class Radio:
+    """ESP-NOW on one device: a send queue with CSMA, ACKs and retries, and a receiver."""
+
+    def __init__(self, medium, node, site, x, y, near):
+        self.id = len(medium.radios)
+        medium.radios.append(self)
+        self.sim = medium.sim
+        self.medium = medium
+        self.node = node
+        self.site, self.x, self.y, self.near = site, x, y, near
+        self.on = False
+        self.power_epoch = 0
+        self.epoch = 0          # Changes with the channel, or power. Receptions from before are lost.
+        self.channel = 0
+        self.queue = collections.deque()
+        self.sending = None
+        self.attempts = 0
+        self.cw = CW_MIN
+        self.tx_until = 0
+        self.busy_until = 0
+        self.receiving = []
+        # Counters
+        self.airtime = 0
+        self.transmissions = 0
+        self.collisions = 0
+        self.busy = 0
+
+    def power(self, on):
+        if on == self.on:
+            return
+        if self.channel:
+            (self.medium.listening[(self.site, self.channel)].add if on else
+             self.medium.listening[(self.site, self.channel)].discard)(self)
+        self.on = on
+        self.power_epoch += 1
+        self.epoch += 1
+        self.receiving = []
+        if not on:
+            self.queue.clear()
+            self.sending = None
+
+    def set_channel(self, channel):
+        if channel == self.channel:
+            return False
+        if self.on and self.channel:
+            self.medium.listening[(self.site, self.channel)].discard(self)
+        self.channel = channel
+        if self.on:
+            self.medium.listening[(self.site, channel)].add(self)
+        self.epoch += 1
+        self.receiving = []
+        self.busy_until = 0
+        return True
+
+    def carrier(self, start, end):
+        self.busy += max(0, end - max(start, self.busy_until))
+        self.busy_until = max(self.busy_until, end)
+
+    def send(self, frame):
+        self.queue.append(frame)
+        if self.sending is None:
+            self.next()
+
+    def next(self):
+        if not self.queue:
+            self.sending = None
+            return
+        self.sending = self.queue.popleft()
+        self.attempts = 0
+        self.cw = CW_MIN
+        self.backoff()
+
+    def backoff(self):
+        self.sim.after(DIFS_US + random.randint(0, self.cw) * SLOT_US, self.attempt, self.power_epoch)
+
+    def attempt(self, power_epoch):
+        if power_epoch != self.power_epoch:
+            return
+        if self.sim.now < max(self.busy_until, self.tx_until):
+            self.sim.at(max(self.busy_until, self.tx_until), self.backoff)
+            return
+        frame = self.sending
+        self.attempts += 1
+        self.transmissions += 1
+        self.medium.transmit(self, frame)
+        if frame.dst is None:
+            self.sim.at(self.tx_until, self.done, power_epoch, True)
+        else:
+            self.sim.at(self.tx_until + ACK_TIMEOUT_US, self.ack_timeout, power_epoch, frame, self.attempts)
+
+    def ack_timeout(self, power_epoch, frame, attempts):
+        if power_epoch != self.power_epoch or self.sending is not frame or self.attempts != attempts:
+            return
+        if self.attempts >= RETRY_LIMIT:
+            self.done(power_epoch, False)
+        else:
+            self.cw = min(2 * self.cw + 1, CW_MAX)
+            self.backoff()
+
+    def done(self, power_epoch, acked):
+        if power_epoch != self.power_epoch:
+            return
+        frame = self.sending
+        self.sending = None
+        self.node.sent(frame, acked)
+        self.next()
+
+    def deliver(self, frame, rssi):
+        if frame.kind == "ACK":
+            if self.sending is frame.acks:   # Otherwise it's late, and the frame was resent
+                self.done(self.power_epoch, True)
+            return
+        if frame.dst is self:
+            ack = Frame(self, frame.src, "ACK", 0, acks=frame)
+            self.sim.after(SIFS_US, self.send_ack, ack)
+        self.node.received(frame, rssi)
+
+    def send_ack(self, ack):
+        if self.on and self.tx_until <= self.sim.now:
+            self.transmissions += 1
+            self.medium.transmit(self, ack)
+
+
+class Room:
+    def __init__(self):
+        self.temperature = random.uniform(15.5, 18.5)
+        self.tau = random.uniform(4, 10) * 3600e6     # Microseconds
+        self.gain = random.uniform(15, 25)            # Degrees above outside with the valve open
+        self.valve = 0.5
+        self.updated = 0
+
+    @staticmethod
+    def outside(t):
+        hours = t / 3600e6
+        return 6 + 4 * math.sin(2 * math.pi * (hours - 9) / 24)
+
+    def advance(self, now):
+        if now <= self.updated:
+            return self.temperature
+        target = self.outside((now + self.updated) / 2) + self.gain * self.valve
+        self.temperature = target + (self.temperature - target) * math.exp(-(now - self.updated) / self.tau)
+        self.updated = now
+        return self.temperature
+
+
+def setpoint_at(t):
+    hours = (t / 3600e6) % 24
+    return DAY_SETPOINT if DAY_START_H <= hours < DAY_END_H else NIGHT_SETPOINT
+
+
+class Hub:
+    def __init__(self, fleet, site, x, y, channel):
+        self.fleet = fleet
+        self.site = site
+        self.radio = Radio(fleet.medium, self, site, x, y, fleet.near[site])
+        self.radio.set_channel(channel)
+        self.radio.power(True)
+        self.registered = set()
+        self.states = 0
+
+    def received(self, frame, rssi):
+        trv = frame.src.node
+        if trv.site != self.site:
+            return  # It's another site's: the JOIN is encrypted with their pass key
+        if frame.kind == "JOIN":
+            self.registered.add(trv)
+            if frame.dst is None:
+                self.reply(trv, "PACK", PACK_BYTES)
+            setpoint = self.fleet.pending.pop(trv, None)
+            if setpoint is not None:
+                self.reply(trv, "MESSAGE", MESSAGE_BYTES, setpoint)
+        elif frame.kind == "NACK":
+            self.registered.discard(trv)
+        elif frame.kind == "STATE":
+            self.states += 1
+
+    def reply(self, trv, kind, size, value=None):
+        self.fleet.sim.after(ms(HUB_REPLY_MS), self.radio.send, Frame(self.radio, trv.radio, kind, size, value))
+
+    def sent(self, frame, acked):
+        pass
+
+
+class Trv:
+    def __init__(self, fleet, site, x, y):
+        self.fleet = fleet
+        self.sim = fleet.sim
+        self.fw = fleet.fw
+        self.site = site
+        self.radio = Radio(fleet.medium, self, site, x, y, fleet.near[site])
+        self.room = Room()
+        self.drift = random.uniform(0.98, 1.02)       # Of the RTC's slow clock
+        # In RTC memory
+        self.hub = None
+        self.wifi_channel = 0
+        self.position = 50
+        self.setpoint = setpoint_at(0)
+        self.check_count = 0
+        # This wake
+        self.collecting = None
+        self.state_sent = None
+        self.message = None
+        # Counters
+        self.wakes = 0
+        self.awake = []
+        self.motor_us = 0
+        self.scans = 0
+        self.pair_times = []
+        self.pair_failures = 0
+        self.states = 0
+        self.states_acked = 0
+        self.send_failures = 0
+        self.error_sum = 0.0
+        self.error_samples = 0
+
+    def start(self, offset):
+        self.sim.at(offset, self.wake)
+
+    def wake(self):
+        self.sim.spawn(self.run())
+
+    def send(self, dst, kind, size):
+        self.radio.send(Frame(self.radio, dst.radio if dst else None, kind, size))
+
+    def unpair(self):
+        self.hub = None
+        self.wifi_channel = 0
+
+    def received(self, frame, rssi):
+        if frame.kind == "PACK" and self.collecting is not None:
+            hub = frame.src.node
+            best = self.collecting.get(hub)
+            if not best or best[1] < rssi:
+                self.collecting[hub] = (self.radio.channel, rssi)
+        elif frame.kind == "NACK" and self.wifi_channel == self.radio.channel:
+            self.unpair()
+        elif frame.kind == "MESSAGE":
+            self.message = frame.value
+
+    def sent(self, frame, acked):
+        if not acked and self.hub and frame.dst is self.hub.radio:
+            self.send_failures += 1
+            self.unpair()
+        if frame.kind == "STATE" and self.state_sent:
+            self.state_sent.set(acked)
+
+    def set_channel(self, channel):
+        if self.radio.set_channel(channel):
+            yield ms(CHANNEL_SWITCH_MS)
+
+    def pair_with_hub(self):
+        fw = self.fw
+        self.scans += 1
+        started = self.sim.now
+        self.collecting = {}
+        for channel in range(fw["first_channel"], fw["first_channel"] + fw["channels"]):
+            yield from self.set_channel(channel)
+            self.send(None, "JOIN", JOIN_BYTES)
+            yield ms(fw["response_ms"])
+        replies, self.collecting = self.collecting, None
+        if not replies:
+            self.pair_failures += 1
+            return
+        best = max(replies, key=lambda hub: replies[hub][1])
+        for hub, (channel, _) in replies.items():
+            if hub is not best:
+                yield from self.set_channel(channel)
+                self.send(hub, "NACK", NACK_BYTES)
+        self.hub = best
+        yield from self.set_channel(replies[best][0])
+        self.wifi_channel = replies[best][0]
+        self.pair_times.append(self.sim.now - started)
+
+    def send_state(self):
+        if not self.wifi_channel or not self.hub:
+            return
+        self.state_sent = Event(self.sim)
+        self.send(self.hub, "STATE", STATE_BYTES)
+        acked = yield (self.state_sent, ms(SEND_WAIT_MS))
+        self.state_sent = None
+        self.states += 1
+        self.states_acked += bool(acked)
+
+    def check_auto(self, temperature):
+        target = self.position
+        if temperature > self.setpoint:
+            target = 0
+        elif temperature < self.setpoint - HYSTERESIS:
+            target = 100
+        if target == self.position:
+            return 0
+        motor = min(self.fw["max_motor_ms"], MOTOR_TRAVEL_MS * abs(target - self.position) / 100)
+        self.position = target
+        return ms(motor)
+
+    def run(self):
+        sim, fw = self.sim, self.fw
+        started = sim.now
+        self.wakes += 1
+        self.message = None
+        yield ms(BOOT_MS)
+        sensors_done = sim.now + ms(93.75 * (1 << fw["resolution"]))  # DS18B20 conversion
+
+        # EspNet::task()
+        self.radio.power(True)
+        yield ms(RADIO_START_MS)
+        for _ in range(PAIR_RETRIES):
+            if self.hub is None:
+                self.wifi_channel = 0
+            if self.wifi_channel == 0:
+                yield from self.pair_with_hub()
+            else:
+                yield from self.set_channel(self.wifi_channel)
+                self.send(self.hub, "JOIN", JOIN_BYTES)  # Elicits any deferred messages
+            yield ms(fw["response_ms"])
+            if self.wifi_channel:
+                break
+
+        # checkMessages(), then the Trv task's sensor reading
+        if sim.now < sensors_done:
+            yield sensors_done - sim.now
+        temperature = self.room.advance(sim.now)
+        if self.message is not None:
+            self.setpoint = self.message
+        motor = 0
+        if self.message is not None or self.check_count == 0:
+            motor = self.check_auto(round(temperature * 4) / 4)
+        self.check_count = (self.check_count + 1) % max(1, int(MODE_CHECK_SECS // fw["sleep_time"]))
+
+        # waitForAllTasks(), sending the state while the motor runs
+        motor_done = sim.now + motor
+        while sim.now + ms(STATE_LOOP_MS) < motor_done:
+            yield ms(STATE_LOOP_MS)
+            yield from self.send_state()
+        if sim.now < motor_done:
+            yield motor_done - sim.now
+        self.room.valve = self.position / 100
+        yield from self.send_state()
+
+        self.radio.power(False)
+        self.awake.append(sim.now - started)
+        self.motor_us += motor
+        if DAY_START_H <= (sim.now / 3600e6) % 24 < DAY_END_H:
+            self.error_sum += abs(temperature - self.setpoint)
+            self.error_samples += 1
+        sim.after(int(fw["sleep_time"] * 1e6 * self.drift), self.wake)
+
+    def charge_mah(self, hours):
+        fw = self.fw
+        awake_s = sum(self.awake) / 1e6
+        asleep_s = hours * 3600 - awake_s
+        mas = (awake_s * fw["awake_ma"] + asleep_s * fw["sleep_ma"] + self.motor_us / 1e6 * fw["motor_ma"]
+               + self.radio.transmissions * fw["tx_mas"])
+        return mas / 3600
+
+
+class Fleet:
+    def __init__(self, args, fw):
+        self.args = args
+        self.fw = fw
+        self.sim = Sim()
+        self.medium = Medium(self.sim, args.site_spacing, args.site_size)
+        side = math.ceil(math.sqrt(args.sites))
+        sites = [(i % side, i // side) for i in range(args.sites)]
+        self.near = {s: self.medium.near_sites(s, sites) for s in sites}
+        self.pending = {}   # Trv -> setpoint the hub has yet to deliver
+        self.hubs = []
+        self.trvs = []
+        channels = args.channels
+        for n, site in enumerate(sites):
+            cx, cy = (site[0] + 0.5) * args.site_spacing, (site[1] + 0.5) * args.site_spacing
+            for h in range(args.hubs):
+                channel = channels[(n * args.hubs + h) % len(channels)]
+                self.hubs.append(Hub(self, site, cx + random.uniform(-2, 2), cy + random.uniform(-2, 2), channel))
+            half = args.site_size / 2
+            for _ in range(args.trvs):
+                trv = Trv(self, site, cx + random.uniform(-half, half), cy + random.uniform(-half, half))
+                trv.start(random.randint(0, int(fw["sleep_time"] * 1e6)))
+                self.trvs.append(trv)
+
+    def schedule(self, until):
+        day = 0
+        while day * 86400e6 < until:
+            for hour in (DAY_START_H, DAY_END_H):
+                t = int((day * 24 + hour) * 3600e6)
+                if 0 < t < until:
+                    self.sim.at(t, self.change_setpoint, setpoint_at(t))
+            day += 1
+        for start_h, minutes in self.args.outage:
+            self.sim.at(int(start_h * 3600e6), self.hubs_power, False)
+            self.sim.at(int((start_h * 60 + minutes) * 60e6), self.hubs_power, True)
+
+    def change_setpoint(self, setpoint):
+        for trv in self.trvs:
+            self.pending[trv] = setpoint
+
+    def hubs_power(self, on):
+        for hub in self.hubs:
+            hub.radio.power(on)
+            if not on:
+                hub.registered.clear()
+
+    def run(self):
+        until = int(self.args.hours * 3600e6)
+        self.schedule(until)
+        if not self.args.timeline:
+            self.sim.run(until)
+            return
+        print("%5s %8s %8s %7s %8s %10s %8s" % ("hour", "wakes", "scans", "paired", "failed", "frames", "states"))
+        previous = self.totals()
+        hour = 0
+        while hour * 3600e6 < until:
+            hour += 1
+            self.sim.run(min(until, int(hour * 3600e6)))
+            now = self.totals()
+            delta = [a - b for a, b in zip(now, previous)]
+            print("%5d %8d %8d %7d %8d %10d %7.1f%%" % (hour, delta[0], delta[1], delta[2], delta[3], delta[4],
+                                                       100 * delta[6] / delta[5] if delta[5] else 0))
+            previous = now
+        print()
+
+    def totals(self):
+        return [sum(t.wakes for t in self.trvs), sum(t.scans for t in self.trvs),
+                sum(len(t.pair_times) for t in self.trvs), sum(t.send_failures for t in self.trvs),
+                sum(t.radio.transmissions for t in self.trvs), sum(t.states for t in self.trvs),
+                sum(t.states_acked for t in self.trvs)]
+
+    def report(self, elapsed):
+        args, fw = self.args, self.fw
+        days = args.hours / 24
+        print("%d sites x %d TRVs, %d hub%s each on channels %s; %.1fh simulated in %.0fs" % (
+            args.sites, args.trvs, args.hubs, "" if args.hubs == 1 else "s",
+            ",".join(map(str, args.channels)), args.hours, elapsed))
+        rows = [
+            ("wakes", [t.wakes / days for t in self.trvs], "%.0f"),
+            ("awake ms per wake", [sum(t.awake) / len(t.awake) / 1000 if t.awake else 0 for t in self.trvs], "%.0f"),
+            ("p95 awake ms", [percentile(t.awake, 95) / 1000 for t in self.trvs], "%.0f"),
+            ("airtime ms", [t.radio.airtime / 1000 / days for t in self.trvs], "%.0f"),
+            ("transmissions", [t.radio.transmissions / days for t in self.trvs], "%.0f"),
+            ("failed sends to hub", [t.send_failures / days for t in self.trvs], "%.1f"),
+            ("channel scans", [t.scans / days for t in self.trvs], "%.1f"),
+            ("charge mAh", [t.charge_mah(args.hours) / days for t in self.trvs], "%.2f"),
+            ("battery days", [fw["capacity_mah"] * days / max(1e-9, t.charge_mah(args.hours)) for t in self.trvs], "%.0f"),
+        ]
+        print("\n%-24s %9s %9s %9s %9s" % ("Per TRV per day", "mean", "p50", "p95", "max"))
+        for name, values, fmt in rows:
+            cells = [sum(values) / len(values), percentile(values, 50), percentile(values, 95), max(values)]
+            print("%-24s %s" % (name, " ".join("%9s" % (fmt % v) for v in cells)))
+
+        pairs = [p / 1000 for t in self.trvs for p in t.pair_times]
+        failures = sum(t.pair_failures for t in self.trvs)
+        print("\nPairing, scan to paired: %d times, %d with no hub; mean %.0fms, p95 %.0fms, max %.0fms" % (
+            len(pairs), failures, sum(pairs) / len(pairs) if pairs else 0, percentile(pairs, 95), max(pairs or [0])))
+        states = sum(t.states for t in self.trvs)
+        acked = sum(t.states_acked for t in self.trvs)
+        print("States acked by the hub: %d of %d (%.2f%%)" % (acked, states, 100 * acked / states if states else 0))
+        busy = [h.radio.busy / (args.hours * 3600e6) * 100 for h in self.hubs]
+        print("Hub channel busy: mean %.2f%%, max %.2f%%; collisions heard by hubs: %d" % (
+            sum(busy) / len(busy), max(busy), sum(h.radio.collisions for h in self.hubs)))
+        errors = [t.error_sum / t.error_samples for t in self.trvs if t.error_samples]
+        if errors:
+            print("Room temperature, daytime |T - setpoint|: mean %.2fC, p95 %.2fC" % (
+                sum(errors) / len(errors), percentile(errors, 95)))
+
+    def write_csv(self, path):
+        hours = self.args.hours
+        days = hours / 24
+        with open(path, "w", newline="") as f:
+            out = csv.writer(f)
+            out.writerow(["site", "x", "y", "hub_channel", "wakes", "awake_ms_mean", "airtime_ms", "transmissions",
+                          "collisions", "failed_sends", "scans", "pairings", "states", "states_acked",
+                          "motor_ms", "charge_mah_per_day", "battery_days", "room_c"])
+            for t in self.trvs:
+                charge = t.charge_mah(hours) / days
+                out.writerow(["%d,%d" % t.site, "%.1f" % t.radio.x, "%.1f" % t.radio.y, t.wifi_channel, t.wakes,
+                              "%.0f" % (sum(t.awake) / len(t.awake) / 1000 if t.awake else 0),
+                              "%.1f" % (t.radio.airtime / 1000), t.radio.transmissions, t.radio.collisions,
+                              t.send_failures, t.scans, len(t.pair_times), t.states, t.states_acked,
+                              t.motor_us // 1000, "%.3f" % charge, "%.0f" % (self.fw["capacity_mah"] / charge),
+                              "%.2f" % t.room.temperature])
+
+
+def outage(text):
+    hour, _, minutes = text.partition(":")
+    return float(hour), float(minutes or 10)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sites", type=int, default=4)
+    parser.add_argument("--trvs", type=int, default=12, help="per site")
+    parser.add_argument("--hubs", type=int, default=1, help="per site")
+    parser.add_argument("--channels", type=lambda s: [int(c) for c in s.split(",")], default=[1, 6, 11],
+                        help="for the hubs, in turn")
+    parser.add_argument("--hours", type=float, default=24)
+    parser.add_argument("--sleep", type=float, help="sleep_time in seconds (default: the firmware's)")
+    parser.add_argument("--site-spacing", type=float, default=25, help="metres between site centres")
+    parser.add_argument("--site-size", type=float, default=12, help="metres across a site")
+    parser.add_argument("--outage", type=outage, action="append", default=[],
+                        help="<hour>:<minutes> all hubs are off (repeatable)")
+    parser.add_argument("--csv", help="write per-TRV results here")
+    parser.add_argument("--timeline", action="store_true", help="print hourly totals as it runs")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    random.seed(args.seed)
+
+    fw = firmware_constants()
+    if args.sleep:
+        fw["sleep_time"] = args.sleep
+    started = time.time()
+    fleet = Fleet(args, fw)
+    fleet.run()
+    fleet.report(time.time() - started)
+    if args.csv:
+        fleet.write_csv(args.csv)
+
+
+if __name__ == "__main__":
+    main()
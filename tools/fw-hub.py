@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+"""A stand-in for the hub's side of the ESP-NOW firmware transfer, over UDP.
+
+    tools/fw-hub.py serve <image.bin> [--port 5555] [--loss 0.1]
+    tools/fw-hub.py fetch [--host 127.0.0.1] [--port 5555] -o <out.bin> [--loss 0.1]
+
+`serve` answers a JOIN (or any JSON) datagram with the firmware offer, then serves FWAK requests with
+FWDT fragments, exactly as the hub does over ESP-NOW. `fetch` is a reference TRV: it pulls and
+verifies an image the same way main/net/fw-transfer.cpp does, so the protocol (including lost
+fragments, with --loss) can be exercised without hardware. See fw-transfer.hpp for the frame layouts.
+"""
+
+import argparse
+import hashlib
+import json
+import random
+import socket
+import struct
+import sys
+import time
+
+FRAGMENT = 200
+BLOCK = 4096
+FRAGMENTS = (BLOCK + FRAGMENT - 1) // FRAGMENT
+ACK = struct.Struct("<4sIII")         # tag, session, block, received
+DATA = struct.Struct("<4sIIBBH")      # tag, session, block, fragment, reserved, length
+WINDOW = 0.08
+RETRIES = 8
+
+
+def session_of(sha: bytes) -> int:
+    return struct.unpack_from("<I", sha)[0]
+
+
+def lossy_send(sock, loss, data, addr):
+    if random.random() >= loss:
+        sock.sendto(data, addr)
+
+
+def serve(args):
+    with open(args.image, "rb") as f:
+        image = f.read()
+    sha = hashlib.sha256(image).digest()
+    session = session_of(sha)
+    blocks = (len(image) + BLOCK - 1) // BLOCK
+    offer = json.dumps({"ota": {"size": len(image), "sha256": sha.hex()}}).encode()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("0.0.0.0", args.port))
+    print("Serving %s: %d bytes, %d blocks, session %08x on udp/%d" % (args.image, len(image), blocks, session, args.port))
+    while True:
+        frame, addr = sock.recvfrom(2048)
+        if frame[:4] == b"JOIN" or frame[:1] == b"{":
+            sock.sendto(offer, addr)
+            continue
+        if frame[:4] != b"FWAK" or len(frame) < ACK.size:
+            continue
+        _, s, block, received = ACK.unpack_from(frame)
+        if s != session:
+            sock.sendto(b"FWNO" + struct.pack("<I", s), addr)
+            continue
+        if block >= blocks:
+            print("%s:%d complete" % addr)
+            continue
+        data = image[block * BLOCK:(block + 1) * BLOCK]
+        for fragment in range((len(data) + FRAGMENT - 1) // FRAGMENT):
+            if received & (1 << fragment):
+                continue
+            chunk = data[fragment * FRAGMENT:(fragment + 1) * FRAGMENT]
+            lossy_send(sock, args.loss, DATA.pack(b"FWDT", session, block, fragment, 0, len(chunk)) + chunk, addr)
+
+
+def fetch(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    hub = (args.host, args.port)
+    sock.settimeout(1.0)
+    sock.sendto(b"JOIN", hub)
+    offer = json.loads(sock.recvfrom(2048)[0])["ota"]
+    size, sha = offer["size"], bytes.fromhex(offer["sha256"])
+    session = session_of(sha)
+    blocks = (size + BLOCK - 1) // BLOCK
+    print("Offered %d bytes, %d blocks, session %08x" % (size, blocks, session))
+
+    image = bytearray()
+    acks = 0
+    started = time.time()
+    for block in range(blocks):
+        length = min(BLOCK, size - block * BLOCK)
+        fragments = (length + FRAGMENT - 1) // FRAGMENT
+        everything = (1 << fragments) - 1
+        received = 0
+        data = bytearray(length)
+        retries = 0
+        while received != everything:
+            if retries >= RETRIES:
+                sys.exit("block %d: no progress after %d retries" % (block, retries))
+            before = received
+            lossy_send(sock, args.loss, ACK.pack(b"FWAK", session, block, received), hub)
+            acks += 1
+            sock.settimeout(WINDOW)
+            while received != everything:
+                try:
+                    frame = sock.recv(2048)
+                except socket.timeout:
+                    break
+                if frame[:4] == b"FWNO":
+                    sys.exit("refused by hub")
+                tag, s, b, fragment, _, n = DATA.unpack_from(frame)
+                if tag != b"FWDT" or s != session or b != block or fragment >= fragments:
+                    continue
+                data[fragment * FRAGMENT:fragment * FRAGMENT + n] = frame[DATA.size:DATA.size + n]
+                received |= 1 << fragment
+            retries = retries + 1 if received == before else 0
+        image += data
+    sock.sendto(ACK.pack(b"FWAK", session, blocks, 0), hub)
+
+    if hashlib.sha256(image).digest() != sha:
+        sys.exit("SHA-256 mismatch")
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("Received %d bytes in %.1fs with %d acks (%.1f per block)" % (size, time.time() - started, acks, acks / blocks))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    s = sub.add_parser("serve")
+    s.add_argument("image")
+    s.add_argument("--port", type=int, default=5555)
+    s.add_argument("--loss", type=float, default=0.0, help="fraction of fragments to drop")
+    f = sub.add_parser("fetch")
+    f.add_argument("--host", default="127.0.0.1")
+    f.add_argument("--port", type=int, default=5555)
+    f.add_argument("--loss", type=float, default=0.0, help="fraction of acks to drop")
+    f.add_argument("-o", "--output", required=True)
+    args = parser.parse_args()
+    serve(args) if args.command == "serve" else fetch(args)
+
+
+if __name__ == "__main__":
+    main()
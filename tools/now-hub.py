@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+"""A stand-in hub on the simulated ESP-NOW medium of main/net/udp-transport.hpp.
+
+    tools/now-hub.py [--mac 02:00:00:00:00:01] [--channel 6] [--rssi -50] [--loss 0.0]
+                     [--passphrase <phrase>] [--provision <name>] [--send '<json>' ...] [--send-during-scan]
+                     [--nack] [--duration <s>] [--port 5557] [--medium <port>] [--slowdown 1]
+
+It answers broadcast JOINs with a PACK (or a NACK, with --nack), acknowledges the frames sent to it,
+and prints the state each TRV sends. Each --send is a JSON message for every TRV, sent after its
+next JOIN, as the hub does with deferred messages. With --passphrase, JOINs are decrypted to show
+the device name and details. With --provision as well, its pairing window is open: an unnamed TRV's
+PRRQ is answered with that name and the passphrase, as tools/prov-hub.py does over plain UDP. A
+{mac} in the name is the TRV's MAC address, so each TRV of a fleet gets its own. --send-during-scan
+sends the messages ahead of the answer too, while the TRV is still scanning the channels for hubs.
+
+On exit (Ctrl-C, or after --duration) it prints for each TRV: the JOINs and states it heard, the
+time from the first JOIN to the first state (the pairing latency, as seen from here), and how many
+of the frames it sent to the TRV weren't acknowledged. --loss drops that share of what the hub
+hears, ACKs included, as UdpTransport's lossPercent does.
+
+--medium and --slowdown are trv-host's: frames are sent to the relay on that port (tools/fleet-host.py)
+rather than to the group, and the hub's clock (its ACK wait, --duration and the latency it reports)
+runs that many times slower than real time, to keep pace with TRVs run that way.
+"""
+
+import argparse
+import hashlib
+import importlib.util
+import os
+import random
+import select
+import socket
+import struct
+import sys
+import time
+
+GROUP = "239.255.70.72"
+HEADER = struct.Struct("<4sBBbB6s6s")   # tag, type, channel, rssi, seq, src, dst
+DATA, ACK = 1, 2
+ACK_WAIT = 0.02                         # UDP_NOW_ACK_MS
+BROADCAST = b"\xff" * 6
+PAIR_DELIM = b"\x1d"
+
+
+def mac_str(mac):
+    return ":".join("%02X" % b for b in mac)
+
+
+# The device name and details from a JOIN, or None
+def open_join(key, frame):
+    from cryptography.hazmat.primitives import padding
+    from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+    sealed = frame[4:]
+    try:
+        decryptor = Cipher(algorithms.AES(key), modes.CBC(sealed[:16])).decryptor()
+        unpadder = padding.PKCS7(128).unpadder()
+        plain = unpadder.update(decryptor.update(sealed[16:]) + decryptor.finalize()) + unpadder.finalize()
+    except ValueError:
+        return None
+    parts = plain.rstrip(b"\0").split(PAIR_DELIM)
+    if len(parts) != 3 or parts[1] != b"FreeHouse":
+        return None
+    return parts[0].decode(errors="replace"), parts[2].decode(errors="replace")
+
+
+def load_prov_hub():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "prov-hub.py")
+    spec = importlib.util.spec_from_file_location("prov_hub", path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+class Trv:
+    def __init__(self, now):
+        self.first_join = now
+        self.first_state = None
+        self.joins = 0
+        self.states = 0
+        self.sent = 0
+        self.unacked = 0
+        self.rssi = 0
+
+
+class Hub:
+    def __init__(self, args):
+        self.args = args
+        self.mac = bytes(int(b, 16) for b in args.mac.split(":"))
+        self.key = hashlib.sha256(args.passphrase.encode()).digest() if args.passphrase else None
+        self.prov = load_prov_hub() if args.provision else None
+        self.provisioning = {}  # TRV -> the session key we expect a PRDN for
+        self.seq = 0
+        self.pending = {}   # (mac, seq) -> deadline
+        self.ack_wait = ACK_WAIT * args.slowdown
+        self.trvs = {}
+        self.lost = 0
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        if hasattr(socket, "SO_REUSEPORT"):
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        self.sock.bind(("", args.port))
+        loopback = socket.inet_aton("127.0.0.1")
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, socket.inet_aton(GROUP) + loopback)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, loopback)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 0)
+
+    def transmit(self, kind, dst, seq, data=b""):
+        header = HEADER.pack(b"SNOW", kind, self.args.channel, self.args.rssi, seq, self.mac, dst)
+        self.sock.sendto(header + data, (GROUP, self.args.medium or self.args.port))
+
+    def send(self, trv_mac, data):
+        seq = self.seq
+        self.seq = (self.seq + 1) & 0xFF
+        self.pending[(trv_mac, seq)] = time.time() + self.ack_wait
+        self.trvs[trv_mac].sent += 1
+        self.transmit(DATA, trv_mac, seq, data)
+
+    def expire(self):
+        now = time.time()
+        for (mac, seq), deadline in list(self.pending.items()):
+            if deadline <= now:
+                del self.pending[(mac, seq)]
+                self.trvs[mac].unacked += 1
+
+    def receive(self, packet):
+        if len(packet) < HEADER.size:
+            return
+        tag, kind, channel, rssi, seq, src, dst = HEADER.unpack_from(packet)
+        if tag != b"SNOW" or src == self.mac or channel != self.args.channel or dst not in (self.mac, BROADCAST):
+            return
+        if random.random() < self.args.loss:
+            self.lost += 1
+            return
+        if kind == ACK:
+            self.pending.pop((src, seq), None)
+            return
+        if kind != DATA:
+            return
+        if dst == self.mac:
+            self.transmit(ACK, src, seq)
+        frame = packet[HEADER.size:]
+        now = time.time()
+        trv = self.trvs.setdefault(src, Trv(now))
+        trv.rssi = rssi
+        stamp = "%8.3f %s" % (now - self.started, mac_str(src))
+
+        if frame[:4] == b"JOIN":
+            trv.joins += 1
+            joined = open_join(self.key, frame) if self.key else None
+            print("%s JOIN%s, rssi %d%s" % (stamp, "" if dst == self.mac else " (broadcast)", rssi,
+                                            ": %s %s" % joined if joined else ""))
+            if dst == BROADCAST:
+                self.send(src, b"NACK\0" if self.args.nack else b"PACK")
+            for message in self.args.send:
+                self.send(src, message.encode())
+        elif self.prov and frame[:4] == b"PRRQ" and len(frame) == self.prov.REQUEST.size:
+            self.offer(src, frame, stamp)
+        elif self.prov and frame[:4] == b"PRDN" and len(frame) == self.prov.DONE.size and src in self.provisioning:
+            _, confirm = self.prov.DONE.unpack(frame)
+            ok = confirm == self.prov.confirmation(self.provisioning.pop(src))
+            print("%s %s" % (stamp, "provisioned" if ok else "sent a bad confirmation"))
+        elif frame[:1] == b"{":
+            trv.states += 1
+            if trv.first_state is None:
+                trv.first_state = now
+            print("%s %s" % (stamp, frame.rstrip(b"\0").decode(errors="replace")))
+        else:
+            print("%s %r" % (stamp, frame[:16]))
+
+    def offer(self, trv_mac, frame, stamp):
+        prov = self.prov
+        _, version, trv_key, model = prov.REQUEST.unpack(frame)
+        if version != prov.VERSION:
+            return
+        private_key = prov.X25519PrivateKey.generate()
+        hub_key = prov.raw(private_key.public_key())
+        key = prov.session_key(private_key, trv_key, trv_key, hub_key)
+        name = self.args.provision.replace("{mac}", trv_mac.hex())
+        settings = prov.CONFIG.pack(prov.MAGIC, name.encode()[:31], self.key, 0, -1, 0, -1)
+        self.provisioning[trv_mac] = key
+        if self.args.send_during_scan:
+            for message in self.args.send:
+                self.send(trv_mac, message.encode())
+        self.send(trv_mac, prov.OFFER.pack(b"PRCF", prov.VERSION, hub_key, prov.seal(key, settings)))
+        print("%s %s asked for settings" % (stamp, model.rstrip(b"\0").decode(errors="replace")))
+
+    def run(self):
+        self.started = time.time()
+        until = self.started + self.args.duration * self.args.slowdown if self.args.duration else None
+        print("Hub %s on channel %d, udp/%d" % (mac_str(self.mac), self.args.channel, self.args.port))
+        try:
+            while until is None or time.time() < until:
+                wait = self.ack_wait if self.pending else 0.25
+                if until is not None:
+                    wait = max(0, min(wait, until - time.time()))
+                if select.select([self.sock], [], [], wait)[0]:
+                    self.receive(self.sock.recv(2048))
+                self.expire()
+        except KeyboardInterrupt:
+            pass
+        self.report()
+
+    def report(self):
+        print("\n%-17s %5s %6s %9s %6s %8s %5s" % ("TRV", "JOINs", "states", "paired", "sent", "unacked", "rssi"))
+        for mac, trv in sorted(self.trvs.items()):
+            paired = "        -"
+            if trv.first_state:
+                paired = "%7.0fms" % ((trv.first_state - trv.first_join) / self.args.slowdown * 1000)
+            print("%-17s %5d %6d %9s %6d %8d %5d" % (mac_str(mac), trv.joins, trv.states, paired, trv.sent, trv.unacked, trv.rssi))
+        if self.lost:
+            print("%d frames lost on the way in" % self.lost)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--mac", default="02:00:00:00:00:01")
+    parser.add_argument("--channel", type=int, default=6, choices=range(1, 14))
+    parser.add_argument("--rssi", type=int, default=-50, help="how strongly the TRVs hear the hub")
+    parser.add_argument("--loss", type=float, default=0.0, help="share of incoming frames to drop, 0-1")
+    parser.add_argument("--passphrase", help="to decrypt JOINs")
+    parser.add_argument("--provision", metavar="NAME", help="name an unnamed TRV that asks (needs --passphrase)")
+    parser.add_argument("--send", action="append", default=[], help="JSON for each TRV after its JOIN (repeatable)")
+    parser.add_argument("--send-during-scan", action="store_true", help="send them ahead of a PRCF too")
+    parser.add_argument("--nack", action="store_true", help="refuse pairing, as a hub the TRV isn't paired with")
+    parser.add_argument("--duration", type=float, default=0, help="seconds, 0 to run until Ctrl-C")
+    parser.add_argument("--port", type=int, default=5557)
+    parser.add_argument("--medium", type=int, default=0, help="send to a relay on this port, rather than the group")
+    parser.add_argument("--slowdown", type=float, default=1.0, help="run this many times slower than real time")
+    args = parser.parse_args()
+    if args.slowdown <= 0:
+        sys.exit("--slowdown must be more than 0")
+    if args.provision and not args.passphrase:
+        sys.exit("--provision needs --passphrase")
+    if args.passphrase:
+        try:
+            import cryptography  # noqa: F401
+        except ImportError:
+            sys.exit("--passphrase needs the `cryptography` package")
+    Hub(args).run()
+
+
+if __name__ == "__main__":
+    main()
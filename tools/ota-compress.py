@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""Compress a TRV firmware image (or a delta patch from ota-delta.py) for OTA.
+
+    tools/ota-compress.py <trv-1.bin> -o <trv-1.bin.lz>
+
+The device decompresses it on the fly as it's downloaded (or uploaded in the portal, or sent by the
+hub), in main/common/ota/ota-stream.c. It's LZSS in the style of heatshrink, with a window small
+enough for the device to keep in RAM. See ota-stream.h for the format.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"LZSS"
+VERSION = 1
+MIN_MATCH = 2
+MAX_WINDOW_BITS = 12
+HEADER = struct.Struct("<4sBBBxI")   # magic, version, window_bits, length_bits, size
+
+CHAIN = 64      # Candidates to try at each position: more is slower, and a little smaller
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.bits = 0
+        self.count = 0
+
+    def write(self, value, n):
+        self.bits = (self.bits << n) | value
+        self.count += n
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append((self.bits >> self.count) & 0xFF)
+        self.bits &= (1 << self.count) - 1
+
+    def finish(self):
+        if self.count:
+            self.out.append((self.bits << (8 - self.count)) & 0xFF)
+        return bytes(self.out)
+
+
+def compress(data: bytes, window_bits: int, length_bits: int) -> bytes:
+    window = 1 << window_bits
+    max_len = (1 << length_bits) - 1 + MIN_MATCH
+    literal_bits = 9
+    match_bits = 1 + window_bits + length_bits
+    out = BitWriter()
+    heads = {}      # 3 byte prefix -> recent positions, newest last
+
+    def remember(pos):
+        key = data[pos:pos + 3]
+        chain = heads.setdefault(key, [])
+        chain.append(pos)
+        if len(chain) > CHAIN:
+            del chain[0]
+
+    i = 0
+    while i < len(data):
+        best_len, best_dist = 0, 0
+        limit = min(max_len, len(data) - i)
+        if limit >= 3:
+            for pos in reversed(heads.get(data[i:i + 3], ())):
+                dist = i - pos
+                if dist > window:
+                    break
+                n = 3
+                while n < limit and data[pos + n] == data[i + n]:
+                    n += 1
+                if n > best_len:
+                    best_len, best_dist = n, dist
+                    if n == limit:
+                        break
+        if best_len < 3 and limit >= MIN_MATCH and i >= 1:
+            # A short match (such as a run) is still cheaper than two literals
+            for dist in (1, 2):
+                if dist <= i and data[i - dist:i - dist + MIN_MATCH] == data[i:i + MIN_MATCH]:
+                    best_len, best_dist = MIN_MATCH, dist
+                    break
+        if best_len >= MIN_MATCH and match_bits < best_len * literal_bits:
+            out.write(0, 1)
+            out.write(best_dist - 1, window_bits)
+            out.write(best_len - MIN_MATCH, length_bits)
+            step = best_len
+        else:
+            out.write(1, 1)
+            out.write(data[i], 8)
+            step = 1
+        for pos in range(i, min(i + step, len(data) - 2)):
+            remember(pos)
+        i += step
+    return HEADER.pack(MAGIC, VERSION, window_bits, length_bits, len(data)) + out.finish()
+
+
+def decompress(packed: bytes) -> bytes:
+    """The same as the device does, to check the output before it's published."""
+    magic, version, window_bits, length_bits, size = HEADER.unpack_from(packed)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a compressed image")
+    pos = HEADER.size
+    bits = count = 0
+
+    def read(n):
+        nonlocal pos, bits, count
+        while count < n:
+            if pos >= len(packed):
+                raise ValueError("truncated")
+            bits = (bits << 8) | packed[pos]
+            pos += 1
+            count += 8
+        count -= n
+        value = bits >> count
+        bits &= (1 << count) - 1
+        return value
+
+    out = bytearray()
+    while len(out) < size:
+        if read(1):
+            out.append(read(8))
+        else:
+            dist = read(window_bits) + 1
+            n = read(length_bits) + MIN_MATCH
+            if dist > len(out):
+                raise ValueError("back reference before the start")
+            for _ in range(n):
+                out.append(out[-dist])
+    if len(out) != size:
+        raise ValueError("decompressed size doesn't match")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="the image or delta patch to compress")
+    parser.add_argument("-o", "--output", required=True, help="the compressed file to write")
+    parser.add_argument("--window-bits", type=int, default=MAX_WINDOW_BITS, help="log2 of the window, up to %d" % MAX_WINDOW_BITS)
+    parser.add_argument("--length-bits", type=int, default=4, help="bits for a match length")
+    args = parser.parse_args()
+    if not 4 <= args.window_bits <= MAX_WINDOW_BITS or not 1 <= args.length_bits <= 8:
+        sys.exit("window bits must be 4-%d, and length bits 1-8" % MAX_WINDOW_BITS)
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+    packed = compress(data, args.window_bits, args.length_bits)
+    if decompress(packed) != data:
+        sys.exit("compression failed to round trip")
+    with open(args.output, "wb") as f:
+        f.write(packed)
+    print("%s: %d bytes (%.1f%% of %d)" % (args.output, len(packed), 100.0 * len(packed) / len(data), len(data)))
+
+
+if __name__ == "__main__":
+    main()
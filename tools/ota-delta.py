@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""Generate a delta OTA patch between two TRV firmware images.
+
+    tools/ota-delta.py <running.bin> <new.bin> -o <patch.bin>
+
+The patch is applied on the device by main/common/ota/ota-stream.c, reading the running partition
+and writing the next one. It can be served from the OTA URL, or uploaded in the portal, in place
+of the full image. See ota-stream.h for the format.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"TRVD"
+VERSION = 1
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+BLOCK = 16      # Bytes hashed to find candidate matches
+MIN_COPY = 24   # A COPY op (1-9 bytes) must save more than it costs
+
+
+def image_sha256(image: bytes) -> bytes:
+    """What esp_partition_get_sha256() reports for an app image: the appended SHA-256 if it has one."""
+    if len(image) < 24 or image[0] != 0xE9:
+        sys.exit("source is not an ESP app image")
+    hash_appended = image[23]
+    if hash_appended and len(image) >= 32:
+        return image[-32:]
+    return hashlib.sha256(image).digest()
+
+
+def varint(n: int) -> bytes:
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def diff(old: bytes, new: bytes):
+    """Greedy block matching: yields ('copy', offset, length) and ('insert', bytes)."""
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, 4):
+        index.setdefault(old[i:i + BLOCK], i)
+
+    literal_start = 0
+    i = 0
+    while i <= len(new) - BLOCK:
+        src = index.get(new[i:i + BLOCK])
+        if src is None:
+            i += 1
+            continue
+        # Extend the match forwards, and backwards into any pending literal
+        end = BLOCK
+        while i + end < len(new) and src + end < len(old) and new[i + end] == old[src + end]:
+            end += 1
+        start = 0
+        while i - start > literal_start and src - start > 0 and new[i - start - 1] == old[src - start - 1]:
+            start += 1
+        if start + end < MIN_COPY:
+            i += 1
+            continue
+        if i - start > literal_start:
+            yield ("insert", new[literal_start:i - start])
+        yield ("copy", src - start, start + end)
+        i += end
+        literal_start = i
+    if literal_start < len(new):
+        yield ("insert", new[literal_start:])
+
+
+def make_patch(old: bytes, new: bytes) -> bytes:
+    header = struct.pack("<4sB3xI32sI32s", MAGIC, VERSION,
+                         len(old), image_sha256(old),
+                         len(new), hashlib.sha256(new).digest())
+    body = bytearray()
+    for op in diff(old, new):
+        if op[0] == "copy":
+            body += bytes([OP_COPY]) + varint(op[1]) + varint(op[2])
+        else:
+            body += bytes([OP_INSERT]) + varint(len(op[1])) + op[1]
+    body.append(OP_END)
+    return header + bytes(body)
+
+
+def apply_patch(old: bytes, patch: bytes) -> bytes:
+    """The same as the device does, to check the patch before it's published."""
+    magic, version, source_size, _, target_size, target_sha = struct.unpack_from("<4sB3xI32sI32s", patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a delta patch")
+    pos = struct.calcsize("<4sB3xI32sI32s")
+
+    def read_varint():
+        nonlocal pos
+        n = shift = 0
+        while True:
+            b = patch[pos]
+            pos += 1
+            n |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                return n
+
+    out = bytearray()
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            src = read_varint()
+            n = read_varint()
+            if src + n > source_size:
+                raise ValueError("copy outside source")
+            out += old[src:src + n]
+        elif op == OP_INSERT:
+            n = read_varint()
+            out += patch[pos:pos + n]
+            pos += n
+        else:
+            raise ValueError("bad op %d" % op)
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_sha:
+        raise ValueError("patched image doesn't match")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("running", help="the image the devices are running now")
+    parser.add_argument("new", help="the image to update them to")
+    parser.add_argument("-o", "--output", required=True, help="the patch file to write")
+    args = parser.parse_args()
+
+    with open(args.running, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    patch = make_patch(old, new)
+    apply_patch(old, patch)
+    with open(args.output, "wb") as f:
+        f.write(patch)
+    print("%s: %d bytes (%.1f%% of %d)" % (args.output, len(patch), 100.0 * len(patch) / len(new), len(new)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""A stand-in for the hub's side of ESP-NOW provisioning, over UDP.
+
+    tools/prov-hub.py serve --name <device> --passphrase <phrase> [--sleep 30] [--backoff-ms 50]
+                            [--stall-ms 400] [--reversed 0|1] [--window 120] [--port 5556]
+    tools/prov-hub.py request [--hub 127.0.0.1:5556 ...]
+    tools/prov-hub.py vectors [--check host/test/prov-vectors.h]
+
+`serve` is a hub whose pairing button has been pressed: for --window seconds it answers PRRQ
+requests with the settings in a PRCF, and checks the TRV's PRDN. `request` is a reference TRV, doing
+what EspNet::provision() does. Give it more than one --hub to see it refuse when several reply.
+`vectors` prints one exchange with fixed keys and IV as a C header, the known answers for the
+firmware's side (host/test/provision.cpp); --check compares it with the header checked in.
+See main/net/provision.hpp for the frame layouts. Needs the `cryptography` package (which is in the
+ESP-IDF Python environment).
+"""
+
+import argparse
+import hashlib
+import os
+import socket
+import struct
+import sys
+import time
+
+from cryptography.hazmat.primitives import padding
+from cryptography.hazmat.primitives.asymmetric.x25519 import X25519PrivateKey, X25519PublicKey
+from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+from cryptography.hazmat.primitives.serialization import Encoding, PublicFormat
+
+VERSION = 1
+MAGIC = 0x56504846
+REQUEST = struct.Struct("<4sB3x32s16s")          # tag, version, key, model
+CONFIG = struct.Struct("<I32s32sHhhb")           # magic, device_name, pass_key, sleep_time, backoff_ms, stall_ms, motor_reversed
+SEALED = 16 + (CONFIG.size // 16 + 1) * 16
+OFFER = struct.Struct("<4sB3x32s%ds" % SEALED)   # tag, version, key, sealed
+DONE = struct.Struct("<4s16s")                   # tag, confirm
+REPLY_WAIT = 0.3
+
+
+def raw(public_key):
+    return public_key.public_bytes(Encoding.Raw, PublicFormat.Raw)
+
+
+def session_key(private_key, theirs, trv_key, hub_key):
+    shared = private_key.exchange(X25519PublicKey.from_public_bytes(theirs))
+    return hashlib.sha256(shared + trv_key + hub_key).digest()
+
+
+def confirmation(key):
+    return hashlib.sha256(key + b"PRDN").digest()[:16]
+
+
+# As encryption.c: [16 byte IV][AES-256-CBC with PKCS#7 padding]
+def seal(key, plain, iv=None):
+    iv = iv or os.urandom(16)
+    padder = padding.PKCS7(128).padder()
+    encryptor = Cipher(algorithms.AES(key), modes.CBC(iv)).encryptor()
+    return iv + encryptor.update(padder.update(plain) + padder.finalize()) + encryptor.finalize()
+
+
+def unseal(key, sealed):
+    decryptor = Cipher(algorithms.AES(key), modes.CBC(sealed[:16])).decryptor()
+    unpadder = padding.PKCS7(128).unpadder()
+    return unpadder.update(decryptor.update(sealed[16:]) + decryptor.finalize()) + unpadder.finalize()
+
+
+def serve(args):
+    pass_key = hashlib.sha256(args.passphrase.encode()).digest()  # As get_key_for_passphrase()
+    settings = CONFIG.pack(MAGIC, args.name.encode()[:31], pass_key, args.sleep, args.backoff_ms, args.stall_ms, args.reversed)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("0.0.0.0", args.port))
+    closes = time.time() + args.window
+    pending = {}  # Address -> the session key we expect a PRDN for
+    print("Provisioning '%s' for %ds on udp/%d" % (args.name, args.window, args.port))
+    while time.time() < closes:
+        sock.settimeout(max(0.01, closes - time.time()))
+        try:
+            frame, addr = sock.recvfrom(2048)
+        except socket.timeout:
+            break
+        if frame[:4] == b"PRRQ" and len(frame) == REQUEST.size:
+            _, version, trv_key, model = REQUEST.unpack(frame)
+            if version != VERSION:
+                continue
+            private_key = X25519PrivateKey.generate()
+            hub_key = raw(private_key.public_key())
+            key = session_key(private_key, trv_key, trv_key, hub_key)
+            pending[addr] = key
+            sock.sendto(OFFER.pack(b"PRCF", VERSION, hub_key, seal(key, settings)), addr)
+            print("%s:%d %s asked for settings" % (addr[0], addr[1], model.rstrip(b"\0").decode(errors="replace")))
+        elif frame[:4] == b"PRDN" and len(frame) == DONE.size and addr in pending:
+            _, confirm = DONE.unpack(frame)
+            ok = confirm == confirmation(pending.pop(addr))
+            print("%s:%d %s" % (addr[0], addr[1], "provisioned" if ok else "sent a bad confirmation"))
+            if ok:
+                return
+    sys.exit("Window closed")
+
+
+def request(args):
+    private_key = X25519PrivateKey.generate()
+    trv_key = raw(private_key.public_key())
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    hubs = []
+    for hub in args.hub:
+        host, _, port = hub.rpartition(":")
+        hubs.append((socket.gethostbyname(host), int(port)))
+        sock.sendto(REQUEST.pack(b"PRRQ", VERSION, trv_key, b"stand-in"), hubs[-1])
+
+    replies = {}
+    started = time.time()
+    sock.settimeout(REPLY_WAIT)
+    while True:
+        try:
+            frame, addr = sock.recvfrom(2048)
+        except socket.timeout:
+            break
+        if frame[:4] == b"PRCF" and len(frame) == OFFER.size and addr not in replies:
+            replies[addr] = OFFER.unpack(frame)
+    if len(replies) != 1:
+        sys.exit("%d hubs replied, ignoring them all" % len(replies))
+
+    addr, (_, version, hub_key, sealed) = next(iter(replies.items()))
+    key = session_key(private_key, hub_key, trv_key, hub_key)
+    magic, name, pass_key, sleep, backoff, stall, reversed_ = CONFIG.unpack(unseal(key, sealed))
+    if magic != MAGIC:
+        sys.exit("Settings don't decrypt")
+    sock.sendto(DONE.pack(b"PRDN", confirmation(key)), addr)
+    print("Provisioned by %s:%d in %.0fms" % (addr[0], addr[1], (time.time() - started - REPLY_WAIT) * 1000))
+    print("  device_name %s\n  pass_key %s\n  sleep_time %d\n  backoff_ms %d\n  stall_ms %d\n  motor_reversed %d"
+          % (name.rstrip(b"\0").decode(), pass_key.hex(), sleep, backoff, stall, reversed_))
+
+
+# An X25519 secret as mbedtls requires one (cryptography clamps any 32 bytes itself)
+def clamped(seed):
+    secret = bytearray(hashlib.sha256(seed).digest())
+    secret[0] &= 248
+    secret[31] = (secret[31] & 127) | 64
+    return bytes(secret)
+
+
+def c_bytes(name, data):
+    rows = [", ".join("0x%02x" % b for b in data[i:i + 12]) for i in range(0, len(data), 12)]
+    return "static const uint8_t %s[%d] = {\n  %s,\n};\n" % (name, len(data), ",\n  ".join(rows))
+
+
+def vectors(args):
+    name, passphrase, sleep, backoff, stall, reversed_ = "lounge", "vectors", 30, 50, 400, 0
+    trv_private = X25519PrivateKey.from_private_bytes(clamped(b"prov-hub.py vectors: trv"))
+    hub_private = X25519PrivateKey.from_private_bytes(clamped(b"prov-hub.py vectors: hub"))
+    trv_key, hub_key = raw(trv_private.public_key()), raw(hub_private.public_key())
+    key = session_key(hub_private, trv_key, trv_key, hub_key)
+    assert key == session_key(trv_private, hub_key, trv_key, hub_key)
+    pass_key = hashlib.sha256(passphrase.encode()).digest()
+    settings = CONFIG.pack(MAGIC, name.encode(), pass_key, sleep, backoff, stall, reversed_)
+    sealed = seal(key, settings, bytes(range(16)))
+    assert unseal(key, sealed) == settings
+
+    out = ("// Generated by `tools/prov-hub.py vectors > host/test/prov-vectors.h`: one provisioning exchange,\n"
+           "// with fixed keys and IV, as the hub's side computes it\n"
+           "#ifndef PROV_VECTORS_H\n#define PROV_VECTORS_H\n\n#include <stdint.h>\n\n"
+           "#define PROV_VECTOR_NAME \"%s\"\n#define PROV_VECTOR_SLEEP_TIME %d\n#define PROV_VECTOR_BACKOFF_MS %d\n"
+           "#define PROV_VECTOR_STALL_MS %d\n#define PROV_VECTOR_MOTOR_REVERSED %d\n\n"
+           % (name, sleep, backoff, stall, reversed_))
+    out += c_bytes("provTrvSecret", trv_private.private_bytes_raw())
+    out += c_bytes("provTrvPublic", trv_key)
+    out += c_bytes("provPassKey", pass_key)
+    out += c_bytes("provSessionKey", key)
+    out += "// The hub's PRCF\n" + c_bytes("provOffer", OFFER.pack(b"PRCF", VERSION, hub_key, sealed))
+    out += "// The TRV's PRDN\n" + c_bytes("provDone", DONE.pack(b"PRDN", confirmation(key)))
+    out += "\n#endif\n"
+    if not args.check:
+        sys.stdout.write(out)
+    elif open(args.check).read() != out:
+        sys.exit("%s doesn't match; regenerate it with `tools/prov-hub.py vectors`" % args.check)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    s = sub.add_parser("serve")
+    s.add_argument("--name", required=True)
+    s.add_argument("--passphrase", required=True)
+    s.add_argument("--sleep", type=int, default=0, help="seconds, 0 to leave unchanged")
+    s.add_argument("--backoff-ms", type=int, default=-1, help="-1 to leave unchanged")
+    s.add_argument("--stall-ms", type=int, default=0, help="0 to leave unchanged")
+    s.add_argument("--reversed", type=int, default=-1, choices=[-1, 0, 1], help="-1 to leave unchanged")
+    s.add_argument("--window", type=int, default=120, help="seconds the pairing window stays open")
+    s.add_argument("--port", type=int, default=5556)
+    r = sub.add_parser("request")
+    r.add_argument("--hub", action="append", help="host:port (repeatable)")
+    v = sub.add_parser("vectors")
+    v.add_argument("--check", metavar="HEADER", help="fail if HEADER isn't what would be printed")
+    args = parser.parse_args()
+    if args.command == "request" and not args.hub:
+        args.hub = ["127.0.0.1:5556"]
+    {"serve": serve, "request": request, "vectors": vectors}[args.command](args)
+
+
+if __name__ == "__main__":
+    main()